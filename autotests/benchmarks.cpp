@@ -0,0 +1,486 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+/*
+ * Read and write benchmarks of the plugins.
+ *
+ * The images are the files of autotests/read/<format> and some large images generated by
+ * the benchmark (KIMAGEFORMATS_BENCHMARK_SIZE pixels wide and high, 4096 by default)
+ * encoded with each writer. All images are read from and written to memory.
+ *
+ * For each image, the benchmark measures:
+ * - read / write: the time of a full decode (all frames) / encode (QBENCHMARK);
+ * - readSequential: the time of a full decode from a sequential device;
+ * - readFirstFrame: the time to the first decoded frame (time-to-first-pixel);
+ * - readBytes / writeBytes: the encoded bytes per second (MB/s);
+ * - readPixels / writePixels: the pixels per second (MP/s), reported as events;
+ * - readPeakMemory / writePeakMemory: the peak memory used by a decode / encode (Linux only).
+ *
+ * Use the QTest output options for machine-readable results, e.g.:
+ *   kimageformats_benchmarks -o results.csv,csv
+ *   kimageformats_benchmarks -o results.xml,xml read readBytes qoi/generated-photo
+ *
+ * NOTE: Some code paths are chosen at build time (e.g. XCF_DISABLE_ROW_MERGE): compare
+ *       them by running the benchmarks on both builds.
+ */
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QRandomGenerator>
+#include <QTest>
+
+#include <functional>
+
+/*!
+ * \brief The SequentialBuffer class
+ * A buffer seen by the plugins as a sequential access device.
+ */
+class SequentialBuffer : public QBuffer
+{
+public:
+    explicit SequentialBuffer(QByteArray *data)
+        : QBuffer(data)
+    {
+    }
+
+    bool isSequential() const override
+    {
+        return true;
+    }
+};
+
+/*!
+ * \brief readImages
+ * Reads the frames of \a device (only the first one if \a firstOnly is true).
+ * \return The number of pixels read or 0 on error.
+ */
+static qint64 readImages(QIODevice *device, const QByteArray &format, bool firstOnly = false)
+{
+    QImageReader reader(device, format);
+    qint64 pixels = 0;
+    for (int frames = 0; frames < 10000; ++frames) {
+        QImage image;
+        if (!reader.read(&image)) {
+            break;
+        }
+        pixels += qint64(image.width()) * image.height();
+        if (firstOnly || !reader.supportsAnimation() || !reader.canRead()) {
+            break;
+        }
+    }
+    return pixels;
+}
+
+/*!
+ * \brief writeImage
+ * Writes \a image to \a data (the buffer is truncated).
+ * \return True on success.
+ */
+static bool writeImage(const QImage &image, const QByteArray &format, QByteArray *data)
+{
+    QBuffer buffer(data);
+    if (!buffer.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QImageWriter writer(&buffer, format);
+    return writer.write(image);
+}
+
+/*!
+ * \brief secondsPerRun
+ * Runs \a func for at least 250ms (at least once).
+ * \return The mean time of a run in seconds.
+ */
+static double secondsPerRun(const std::function<void()> &func)
+{
+    QElapsedTimer timer;
+    timer.start();
+    qint64 runs = 0;
+    do {
+        func();
+        ++runs;
+    } while (timer.elapsed() < 250);
+    return double(timer.nsecsElapsed()) / 1e9 / runs;
+}
+
+#ifdef Q_OS_LINUX
+/*!
+ * \brief procStatus
+ * \return The value of \a key in /proc/self/status in bytes, or -1 on error.
+ */
+static qint64 procStatus(const QByteArray &key)
+{
+    QFile f(QStringLiteral("/proc/self/status"));
+    if (!f.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    const auto lines = f.readAll().split('\n');
+    for (auto &&line : lines) {
+        if (line.startsWith(key + ':')) {
+            auto value = line.mid(key.size() + 1).trimmed();
+            if (value.endsWith(" kB")) {
+                return value.chopped(3).trimmed().toLongLong() * 1024;
+            }
+        }
+    }
+    return -1;
+}
+#endif
+
+/*!
+ * \brief peakMemory
+ * Runs \a func once.
+ * \return The memory used at the peak of the run in bytes, or -1 if it is not available.
+ */
+static qint64 peakMemory(const std::function<void()> &func)
+{
+#ifdef Q_OS_LINUX
+    // writing 5 resets the peak resident set size (VmHWM) to the current one
+    QFile clearRefs(QStringLiteral("/proc/self/clear_refs"));
+    if (!clearRefs.open(QIODevice::WriteOnly) || clearRefs.write("5") != 1) {
+        return -1;
+    }
+    clearRefs.close();
+    const auto rss = procStatus("VmRSS");
+    func();
+    const auto hwm = procStatus("VmHWM");
+    if (rss < 0 || hwm < 0) {
+        return -1;
+    }
+    return std::max(qint64(0), hwm - rss);
+#else
+    Q_UNUSED(func)
+    return -1;
+#endif
+}
+
+/*!
+ * \brief generatedImage
+ * \return A photo-like (smooth gradients and noise) or a screenshot-like (flat areas, with alpha) image.
+ */
+static QImage generatedImage(int size, bool photo)
+{
+    QImage image(size, size, photo ? QImage::Format_RGB32 : QImage::Format_ARGB32);
+    if (image.isNull()) {
+        return image;
+    }
+    QRandomGenerator rng(1);
+    for (int y = 0; y < size; ++y) {
+        auto line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size; ++x) {
+            if (photo) {
+                const int noise = int(rng.bounded(16));
+                line[x] = qRgb((x * 255 / size + noise) & 0xFF, (y * 255 / size + noise) & 0xFF, ((x + y) * 127 / size + noise) & 0xFF);
+            } else {
+                const int bx = x / 64;
+                const int by = y / 64;
+                const int alpha = (bx + by) % 4 == 0 ? 128 : 255;
+                line[x] = qRgba((bx * 37) & 0xFF, (by * 59) & 0xFF, ((bx ^ by) * 23) & 0xFF, alpha);
+            }
+        }
+    }
+    return image;
+}
+
+class Benchmarks : public QObject
+{
+    Q_OBJECT
+
+private:
+    struct EncodedImage {
+        QByteArray format;
+        QByteArray data;
+    };
+
+    struct SourceImage {
+        QByteArray format;
+        QImage image;
+    };
+
+    void readRows()
+    {
+        QTest::addColumn<int>("index");
+        for (int i = 0; i < m_encoded.size(); ++i) {
+            QTest::newRow(m_names.at(i).constData()) << i;
+        }
+    }
+
+    void writeRows()
+    {
+        QTest::addColumn<int>("index");
+        for (int i = 0; i < m_sources.size(); ++i) {
+            QTest::newRow(m_sourceNames.at(i).constData()) << i;
+        }
+    }
+
+    const EncodedImage &encoded()
+    {
+        QFETCH(int, index);
+        return m_encoded.at(index);
+    }
+
+    const SourceImage &source()
+    {
+        QFETCH(int, index);
+        return m_sources.at(index);
+    }
+
+    QList<EncodedImage> m_encoded;
+    QList<QByteArray> m_names;
+    QList<SourceImage> m_sources;
+    QList<QByteArray> m_sourceNames;
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::removeLibraryPath(QStringLiteral(PLUGIN_DIR));
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+
+        // corpus of the read tests
+        const auto readable = QImageReader::supportedImageFormats();
+        QDir readDir(QStringLiteral(IMAGEDIR));
+        const auto formats = readDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+        for (auto &&format : formats) {
+            const auto fmt = format.toLatin1();
+            if (!readable.contains(fmt)) {
+                continue;
+            }
+            const auto files = QDir(readDir.filePath(format)).entryInfoList(QDir::Files, QDir::Name);
+            for (auto &&fi : files) {
+                QFile f(fi.filePath());
+                if (!f.open(QIODevice::ReadOnly)) {
+                    continue;
+                }
+                // the comparison images and the templates are not readable with the format of the folder
+                QImageReader reader(&f, fmt);
+                if (!reader.canRead()) {
+                    continue;
+                }
+                f.seek(0);
+                m_encoded.append(EncodedImage{fmt, f.readAll()});
+                m_names.append(fmt + '/' + fi.fileName().toLatin1());
+            }
+        }
+
+        // large generated images encoded with each writer
+        auto ok = false;
+        auto size = qEnvironmentVariableIntValue("KIMAGEFORMATS_BENCHMARK_SIZE", &ok);
+        if (!ok || size < 1) {
+            size = 4096;
+        }
+        const auto writable = QImageWriter::supportedImageFormats();
+        const QList<QByteArray> writers = {"avif", "eps", "exr", "hdr", "heif", "jxl", "jxr", "pcx", "pic", "qoi", "rgb", "tga"};
+        for (int photo = 1; photo >= 0; --photo) {
+            const auto image = generatedImage(size, photo);
+            QVERIFY(!image.isNull());
+            const auto name = QByteArray(photo ? "generated-photo-" : "generated-flat-") + QByteArray::number(size);
+            for (auto &&fmt : writers) {
+                if (!writable.contains(fmt)) {
+                    continue;
+                }
+                m_sources.append(SourceImage{fmt, image});
+                m_sourceNames.append(fmt + '/' + name);
+
+                QByteArray data;
+                if (readable.contains(fmt) && writeImage(image, fmt, &data)) {
+                    m_encoded.append(EncodedImage{fmt, data});
+                    m_names.append(fmt + '/' + name);
+                }
+            }
+        }
+    }
+
+    void read_data()
+    {
+        readRows();
+    }
+
+    void read()
+    {
+        auto &&img = encoded();
+        auto data = img.data;
+        QBuffer probe(&data);
+        QVERIFY(readImages(&probe, img.format) > 0);
+        QBENCHMARK {
+            QBuffer buffer(&data);
+            readImages(&buffer, img.format);
+        }
+    }
+
+    void readSequential_data()
+    {
+        readRows();
+    }
+
+    void readSequential()
+    {
+        auto &&img = encoded();
+        auto data = img.data;
+        SequentialBuffer probe(&data);
+        if (readImages(&probe, img.format) <= 0) {
+            QSKIP("The plugin cannot read from a sequential device");
+        }
+        QBENCHMARK {
+            SequentialBuffer buffer(&data);
+            readImages(&buffer, img.format);
+        }
+    }
+
+    void readFirstFrame_data()
+    {
+        readRows();
+    }
+
+    void readFirstFrame()
+    {
+        auto &&img = encoded();
+        auto data = img.data;
+        QBENCHMARK {
+            QBuffer buffer(&data);
+            readImages(&buffer, img.format, true);
+        }
+    }
+
+    void readBytes_data()
+    {
+        readRows();
+    }
+
+    void readBytes()
+    {
+        auto &&img = encoded();
+        auto data = img.data;
+        const auto seconds = secondsPerRun([&]() {
+            QBuffer buffer(&data);
+            readImages(&buffer, img.format);
+        });
+        QTest::setBenchmarkResult(data.size() / seconds, QTest::BytesPerSecond);
+    }
+
+    void readPixels_data()
+    {
+        readRows();
+    }
+
+    void readPixels()
+    {
+        auto &&img = encoded();
+        auto data = img.data;
+        qint64 pixels = 0;
+        const auto seconds = secondsPerRun([&]() {
+            QBuffer buffer(&data);
+            pixels = readImages(&buffer, img.format);
+        });
+        QVERIFY(pixels > 0);
+        QTest::setBenchmarkResult(pixels / seconds, QTest::Events);
+    }
+
+    void readPeakMemory_data()
+    {
+        readRows();
+    }
+
+    void readPeakMemory()
+    {
+        auto &&img = encoded();
+        auto data = img.data;
+        const auto peak = peakMemory([&]() {
+            QBuffer buffer(&data);
+            readImages(&buffer, img.format);
+        });
+        if (peak < 0) {
+            QSKIP("The peak memory is not available on this system");
+        }
+        QTest::setBenchmarkResult(peak, QTest::BytesAllocated);
+    }
+
+    void write_data()
+    {
+        writeRows();
+    }
+
+    void write()
+    {
+        auto &&src = source();
+        QByteArray data;
+        if (!writeImage(src.image, src.format, &data)) {
+            QSKIP("The plugin cannot write the image");
+        }
+        QBENCHMARK {
+            writeImage(src.image, src.format, &data);
+        }
+    }
+
+    void writeBytes_data()
+    {
+        writeRows();
+    }
+
+    void writeBytes()
+    {
+        auto &&src = source();
+        QByteArray data;
+        auto ok = true;
+        const auto seconds = secondsPerRun([&]() {
+            ok = ok && writeImage(src.image, src.format, &data);
+        });
+        if (!ok) {
+            QSKIP("The plugin cannot write the image");
+        }
+        QTest::setBenchmarkResult(data.size() / seconds, QTest::BytesPerSecond);
+    }
+
+    void writePixels_data()
+    {
+        writeRows();
+    }
+
+    void writePixels()
+    {
+        auto &&src = source();
+        QByteArray data;
+        auto ok = true;
+        const auto seconds = secondsPerRun([&]() {
+            ok = ok && writeImage(src.image, src.format, &data);
+        });
+        if (!ok) {
+            QSKIP("The plugin cannot write the image");
+        }
+        QTest::setBenchmarkResult(qint64(src.image.width()) * src.image.height() / seconds, QTest::Events);
+    }
+
+    void writePeakMemory_data()
+    {
+        writeRows();
+    }
+
+    void writePeakMemory()
+    {
+        auto &&src = source();
+        QByteArray data;
+        auto ok = false;
+        const auto peak = peakMemory([&]() {
+            ok = writeImage(src.image, src.format, &data);
+        });
+        if (!ok) {
+            QSKIP("The plugin cannot write the image");
+        }
+        if (peak < 0) {
+            QSKIP("The peak memory is not available on this system");
+        }
+        QTest::setBenchmarkResult(peak, QTest::BytesAllocated);
+    }
+};
+
+QTEST_MAIN(Benchmarks)
+
+#include "benchmarks.moc"
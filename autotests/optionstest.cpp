@@ -0,0 +1,172 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QColorSpace>
+#include <QImage>
+#include <QImageReader>
+#include <QTest>
+
+#include <algorithm>
+#include <cstdlib>
+
+/*!
+ * Reads the images of autotests/read with the ScaledSize and ClipRect options and compares them
+ * with the full decode. Scaled images can be decoded from other sources (thumbnails, previews,
+ * mip levels, half size raw images, etc...), so they are compared with a tolerance on the average
+ * difference of the samples.
+ */
+class OptionsTests : public QObject
+{
+    Q_OBJECT
+
+private:
+    static QImage readImage(const QString &fileName, const QByteArray &format, const QSize &scaledSize = QSize(), const QRect &clipRect = QRect())
+    {
+        QImageReader reader(fileName, format);
+        if (clipRect.isValid()) {
+            reader.setClipRect(clipRect);
+        }
+        if (scaledSize.isValid()) {
+            reader.setScaledSize(scaledSize);
+        }
+        return reader.read();
+    }
+
+    // sRGB premultiplied pixels: the color of the transparent pixels does not matter
+    static QImage normalized(QImage image)
+    {
+        if (image.colorSpace().isValid() && image.colorSpace() != QColorSpace(QColorSpace::SRgb)) {
+            image.convertToColorSpace(QColorSpace(QColorSpace::SRgb));
+        }
+        return image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+
+    static void differences(const QImage &im1, const QImage &im2, double *mean, int *max)
+    {
+        qint64 sum = 0;
+        *max = 0;
+        for (int y = 0; y < im1.height(); ++y) {
+            auto line1 = im1.constScanLine(y);
+            auto line2 = im2.constScanLine(y);
+            for (int x = 0, n = im1.width() * 4; x < n; ++x) {
+                const int diff = std::abs(int(line1[x]) - int(line2[x]));
+                sum += diff;
+                *max = std::max(*max, diff);
+            }
+        }
+        *mean = double(sum) / std::max(qint64(1), qint64(im1.width()) * im1.height() * 4);
+    }
+
+    static void skipUnsupported(const QByteArray &format)
+    {
+        if (!QImageReader::supportedImageFormats().contains(format)) {
+            QSKIP("The plugin of this format is not available");
+        }
+    }
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void testScaledSize_data()
+    {
+        QTest::addColumn<QString>("fileName");
+        QTest::addColumn<QByteArray>("format");
+        // the maximum average difference of the samples from the scaled full image
+        QTest::addColumn<double>("tolerance");
+
+        QTest::newRow("xcf") << QFINDTESTDATA("read/xcf/birthday.xcf") << QByteArray("xcf") << 6.0;
+        QTest::newRow("xcf 16-bit") << QFINDTESTDATA("read/xcf/birthday16.xcf") << QByteArray("xcf") << 6.0;
+        QTest::newRow("exr") << QFINDTESTDATA("read/exr/rgb-gimp.exr") << QByteArray("exr") << 4.0;
+        QTest::newRow("exr gray") << QFINDTESTDATA("read/exr/gray.exr") << QByteArray("exr") << 4.0;
+        // the embedded thumbnail is processed by the camera
+        QTest::newRow("raw") << QFINDTESTDATA("read/raw/RAW_KODAK_C330_FORMAT_NONE_YRGB.raw") << QByteArray("raw") << 48.0;
+        QTest::newRow("heif") << QFINDTESTDATA("read/heif/rgb.heif") << QByteArray("heif") << 8.0;
+        QTest::newRow("heif alpha") << QFINDTESTDATA("read/heif/rgba.heif") << QByteArray("heif") << 8.0;
+        QTest::newRow("jxl") << QFINDTESTDATA("read/jxl/rgb.jxl") << QByteArray("jxl") << 8.0;
+        QTest::newRow("jxl alpha") << QFINDTESTDATA("read/jxl/rgba.jxl") << QByteArray("jxl") << 8.0;
+        QTest::newRow("jxl rotated") << QFINDTESTDATA("read/jxl/orientation6.jxl") << QByteArray("jxl") << 8.0;
+        QTest::newRow("kra") << QFINDTESTDATA("read/kra/src.kra") << QByteArray("kra") << 8.0;
+        QTest::newRow("ora") << QFINDTESTDATA("read/ora/src.ora") << QByteArray("ora") << 8.0;
+        QTest::newRow("psb") << QFINDTESTDATA("read/psd/8bit-photoshop.psb") << QByteArray("psb") << 8.0;
+        QTest::newRow("psd") << QFINDTESTDATA("read/psd/53alphas.psd") << QByteArray("psd") << 8.0;
+    }
+
+    void testScaledSize()
+    {
+        QFETCH(QString, fileName);
+        QFETCH(QByteArray, format);
+        QFETCH(double, tolerance);
+
+        skipUnsupported(format);
+
+        const QImage full = normalized(readImage(fileName, format));
+        QVERIFY2(!full.isNull(), qPrintable(fileName));
+
+        // half and quarter sizes (thumbnails, previews and mip levels are used when big enough)
+        for (int divisor : {2, 4}) {
+            const QSize size(std::max(1, full.width() / divisor), std::max(1, full.height() / divisor));
+            const QImage scaled = readImage(fileName, format, size);
+            QVERIFY(!scaled.isNull());
+            QCOMPARE(scaled.size(), size);
+
+            double mean;
+            int max;
+            differences(normalized(scaled), full.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation), &mean, &max);
+            QVERIFY2(mean <= tolerance, qPrintable(QStringLiteral("1/%1 size: average difference %2").arg(divisor).arg(mean)));
+        }
+    }
+
+    void testClipRect_data()
+    {
+        QTest::addColumn<QString>("fileName");
+        QTest::addColumn<QByteArray>("format");
+        // the maximum difference of the samples from the full image
+        QTest::addColumn<int>("fuzziness");
+
+        // the tiles of grid images are converted to RGB one by one
+        QTest::newRow("heif") << QFINDTESTDATA("read/heif/rgb.heif") << QByteArray("heif") << 2;
+        QTest::newRow("heif alpha") << QFINDTESTDATA("read/heif/rgba.heif") << QByteArray("heif") << 2;
+        QTest::newRow("psb") << QFINDTESTDATA("read/psd/8bit-photoshop.psb") << QByteArray("psb") << 0;
+        QTest::newRow("psd") << QFINDTESTDATA("read/psd/53alphas.psd") << QByteArray("psd") << 0;
+    }
+
+    void testClipRect()
+    {
+        QFETCH(QString, fileName);
+        QFETCH(QByteArray, format);
+        QFETCH(int, fuzziness);
+
+        skipUnsupported(format);
+
+        const QImage full = normalized(readImage(fileName, format));
+        QVERIFY2(!full.isNull(), qPrintable(fileName));
+
+        const QRect rect(full.width() / 4, full.height() / 5, std::max(1, full.width() / 2), std::max(1, full.height() / 2));
+        const QImage clipped = readImage(fileName, format, QSize(), rect);
+        QVERIFY(!clipped.isNull());
+        QCOMPARE(clipped.size(), rect.size());
+
+        double mean;
+        int max;
+        differences(normalized(clipped), full.copy(rect), &mean, &max);
+        QVERIFY2(max <= fuzziness, qPrintable(QStringLiteral("maximum difference %1").arg(max)));
+
+        // both options: the clip rect is scaled (a thumbnail can be used)
+        const QSize size(std::max(1, rect.width() / 2), std::max(1, rect.height() / 2));
+        const QImage scaled = readImage(fileName, format, size, rect);
+        QVERIFY(!scaled.isNull());
+        QCOMPARE(scaled.size(), size);
+        differences(normalized(scaled), full.copy(rect).scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation), &mean, &max);
+        QVERIFY2(mean <= 8.0, qPrintable(QStringLiteral("average difference %1").arg(mean)));
+    }
+};
+
+QTEST_MAIN(OptionsTests)
+
+#include "optionstest.moc"
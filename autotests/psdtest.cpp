@@ -0,0 +1,146 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QImage>
+#include <QImageReader>
+#include <QTest>
+
+class PsdTests : public QObject
+{
+    Q_OBJECT
+
+private:
+    static QImage readImage(const QString &fileName, int imageNumber = 0, const QRect &clipRect = QRect())
+    {
+        QImageReader reader(fileName, "psd");
+        if (imageNumber > 0 && !reader.jumpToImage(imageNumber)) {
+            return QImage();
+        }
+        if (clipRect.isValid()) {
+            reader.setClipRect(clipRect);
+        }
+        return reader.read();
+    }
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void cleanup()
+    {
+        qunsetenv("KIMAGEFORMATS_PSD_LAYERS");
+    }
+
+    void testLayerSequenceIsOptIn()
+    {
+        QImageReader reader(QFINDTESTDATA("read/psd/53alphas.psd"), "psd");
+        QCOMPARE(reader.imageCount(), 1);
+        QVERIFY(!reader.jumpToImage(1));
+        QVERIFY(!reader.read().isNull());
+    }
+
+    void testLayers_data()
+    {
+        QTest::addColumn<QString>("psdfile");
+        QTest::addColumn<int>("imageCount");
+        QTest::addColumn<QRect>("layerRect");
+        QTest::addColumn<QString>("layerName");
+
+        QTest::newRow("53alphas") << QFINDTESTDATA("read/psd/53alphas.psd") << 2 << QRect(36, 46, 160, 131) << QStringLiteral("Layer 1");
+        QTest::newRow("rgb-gimp") << QFINDTESTDATA("read/psd/rgb-gimp-2.8.10.psd") << 2 << QRect(0, 0, 32, 32) << QStringLiteral("Background");
+        QTest::newRow("16bit-rle") << QFINDTESTDATA("read/psd/16bit-rle.psd") << 2 << QRect(0, 0, 485, 484)
+                                   << QStringLiteral("Screenshot_20170131_091453.png");
+    }
+
+    void testLayers()
+    {
+        QFETCH(QString, psdfile);
+        QFETCH(int, imageCount);
+        QFETCH(QRect, layerRect);
+        QFETCH(QString, layerName);
+
+        qputenv("KIMAGEFORMATS_PSD_LAYERS", "1");
+
+        QImageReader reader(psdfile, "psd");
+        QCOMPARE(reader.imageCount(), imageCount);
+
+        const QImage merged = reader.read();
+        QVERIFY(!merged.isNull());
+        QCOMPARE(reader.currentImageNumber(), 1);
+
+        QCOMPARE(reader.size(), layerRect.size());
+        const QImage layer = reader.read();
+        QVERIFY(!layer.isNull());
+        QCOMPARE(layer.size(), layerRect.size());
+        QCOMPARE(layer.offset(), layerRect.topLeft());
+        QCOMPARE(layer.text(QStringLiteral("PSDLayerName")), layerName);
+
+        // end of the sequence
+        QVERIFY(reader.read().isNull());
+
+        // the merged image can be read again
+        QVERIFY(reader.jumpToImage(0));
+        QCOMPARE(reader.read(), merged);
+    }
+
+    void testOpaqueLayer()
+    {
+        // a single opaque layer with normal blending: the layer is the merged image
+        qputenv("KIMAGEFORMATS_PSD_LAYERS", "1");
+        const auto fileName = QFINDTESTDATA("read/psd/rgb-gimp-2.8.10.psd");
+        const QImage merged = readImage(fileName);
+        const QImage layer = readImage(fileName, 1);
+        QVERIFY(!merged.isNull());
+        QVERIFY(!layer.isNull());
+        QCOMPARE(layer.convertToFormat(QImage::Format_RGB32), merged.convertToFormat(QImage::Format_RGB32));
+    }
+
+    void testClipRect_data()
+    {
+        QTest::addColumn<QString>("psdfile");
+        QTest::addColumn<QRect>("clipRect");
+
+        QTest::newRow("rgb") << QFINDTESTDATA("read/psd/rgb-gimp-2.8.10.psd") << QRect(5, 7, 20, 11);
+        QTest::newRow("alpha channels") << QFINDTESTDATA("read/psd/53alphas.psd") << QRect(30, 40, 100, 90);
+        QTest::newRow("16-bit rle") << QFINDTESTDATA("read/psd/16bit-rle.psd") << QRect(100, 200, 250, 100);
+        QTest::newRow("cmyk") << QFINDTESTDATA("read/psd/cmyk8_testcard.psd") << QRect(64, 32, 128, 160);
+        QTest::newRow("indexed") << QFINDTESTDATA("read/psd/indexed.psd") << QRect(0, 150, 300, 150);
+    }
+
+    void testClipRect()
+    {
+        QFETCH(QString, psdfile);
+        QFETCH(QRect, clipRect);
+
+        const QImage full = readImage(psdfile);
+        QVERIFY(!full.isNull());
+        const QImage clipped = readImage(psdfile, 0, clipRect);
+        QVERIFY(!clipped.isNull());
+        QCOMPARE(clipped.size(), clipRect.size());
+        QCOMPARE(clipped.convertToFormat(full.format()), full.copy(clipRect));
+    }
+
+    void testLayerClipRect()
+    {
+        // the clip rect of a layer is relative to the layer
+        qputenv("KIMAGEFORMATS_PSD_LAYERS", "1");
+        const auto fileName = QFINDTESTDATA("read/psd/53alphas.psd");
+        const QImage layer = readImage(fileName, 1);
+        QVERIFY(!layer.isNull());
+        const QRect clipRect(10, 20, 50, 40);
+        const QImage clipped = readImage(fileName, 1, clipRect);
+        QVERIFY(!clipped.isNull());
+        QCOMPARE(clipped.size(), clipRect.size());
+        QCOMPARE(clipped.offset(), layer.offset() + clipRect.topLeft());
+        QCOMPARE(clipped.convertToFormat(layer.format()), layer.copy(clipRect));
+    }
+};
+
+QTEST_MAIN(PsdTests)
+
+#include "psdtest.moc"
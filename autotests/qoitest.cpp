@@ -0,0 +1,95 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QBuffer>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QRandomGenerator>
+#include <QTest>
+
+class QoiTests : public QObject
+{
+    Q_OBJECT
+
+private:
+    static QByteArray writeQoi(const QImage &image, const QByteArray &maxThreads)
+    {
+        qputenv("KIMAGEFORMATS_MAX_THREADS", maxThreads);
+        QByteArray data;
+        QBuffer buffer(&data);
+        QImageWriter writer(&buffer, "qoi");
+        const bool ok = writer.write(image);
+        qunsetenv("KIMAGEFORMATS_MAX_THREADS");
+        return ok ? data : QByteArray();
+    }
+
+    /*!
+     * \brief testImage
+     * An image large enough to be encoded in bands by the threads (see QOI_BAND_PIXELS) with
+     * all the QOI operations: noise, gradients, and runs of one color crossing the lines.
+     */
+    static QImage testImage(QImage::Format format)
+    {
+        QImage image(1021, 769, format);
+        const QRgb opaque = format == QImage::Format_RGB32 ? 0xff000000 : 0;
+        QRandomGenerator rng(769);
+        for (int y = 0; y < image.height(); ++y) {
+            auto line = reinterpret_cast<QRgb *>(image.scanLine(y));
+            for (int x = 0; x < image.width(); ++x) {
+                const int area = (x / 128 + y / 96) % 4;
+                if (area == 0) { // noise: RGB(A) and index operations
+                    line[x] = rng.generate() | opaque;
+                } else if (area == 1) { // gradient: diff and luma operations
+                    line[x] = qRgba(x & 0xff, (x + y) & 0xff, y & 0xff, 0xff - (y & 0x3f)) | opaque;
+                } else { // flat: runs, also across the lines and the bands
+                    line[x] = qRgba(area * 40, 200, 10, 0xff);
+                }
+            }
+        }
+        return image;
+    }
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void testConcurrentWrite_data()
+    {
+        QTest::addColumn<int>("format");
+
+        QTest::newRow("rgb") << int(QImage::Format_RGB32);
+        QTest::newRow("rgba") << int(QImage::Format_ARGB32);
+    }
+
+    void testConcurrentWrite()
+    {
+        QFETCH(int, format);
+
+        const QImage image = testImage(QImage::Format(format));
+
+        // the stream written by the threads is the same written by the calling thread
+        const auto serial = writeQoi(image, "0");
+        QVERIFY(!serial.isEmpty());
+        const auto concurrent = writeQoi(image, "4");
+        QVERIFY(!concurrent.isEmpty());
+        QCOMPARE(concurrent.size(), serial.size());
+        QVERIFY(concurrent == serial);
+
+        QBuffer buffer;
+        buffer.setData(concurrent);
+        QImageReader reader(&buffer, "qoi");
+        const QImage reread = reader.read();
+        QVERIFY(!reread.isNull());
+        QCOMPARE(reread.convertToFormat(image.format()), image);
+    }
+};
+
+QTEST_MAIN(QoiTests)
+
+#include "qoitest.moc"
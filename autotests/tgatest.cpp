@@ -0,0 +1,87 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QBuffer>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QTest>
+
+class TgaTests : public QObject
+{
+    Q_OBJECT
+
+private:
+    static QByteArray writeTga(const QImage &image, int compression)
+    {
+        QByteArray data;
+        QBuffer buffer(&data);
+        QImageWriter writer(&buffer, "tga");
+        if (compression != -1) {
+            writer.setCompression(compression);
+        }
+        if (!writer.write(image)) {
+            return QByteArray();
+        }
+        return data;
+    }
+
+    static QImage readTga(QByteArray data)
+    {
+        QBuffer buffer(&data);
+        QImageReader reader(&buffer, "tga");
+        return reader.read();
+    }
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void testWriteRle_data()
+    {
+        QTest::addColumn<QString>("pngfile");
+        // the TGA image type written with RLE compression
+        QTest::addColumn<int>("rleType");
+
+        QTest::newRow("grey") << QFINDTESTDATA("write/bw.png") << 11;
+        QTest::newRow("grey with alpha") << QFINDTESTDATA("write/bwa.png") << 10;
+        QTest::newRow("rgb") << QFINDTESTDATA("write/rgb.png") << 10;
+        QTest::newRow("rgb with alpha") << QFINDTESTDATA("write/rgba.png") << 10;
+    }
+
+    void testWriteRle()
+    {
+        QFETCH(QString, pngfile);
+        QFETCH(int, rleType);
+
+        QImage image(pngfile);
+        QVERIFY2(!image.isNull(), qPrintable(pngfile));
+
+        // the default (-1) and 0 write uncompressed images (type 2)
+        const auto raw = writeTga(image, -1);
+        QVERIFY(raw.size() > 2);
+        QCOMPARE(int(raw.at(2)), 2);
+        QCOMPARE(writeTga(image, 0), raw);
+
+        const auto rle = writeTga(image, 1);
+        QVERIFY(rle.size() > 2);
+        QCOMPARE(int(rle.at(2)), rleType);
+
+        // the RLE image reads back as the uncompressed one
+        auto rawImage = readTga(raw);
+        auto rleImage = readTga(rle);
+        QVERIFY(!rawImage.isNull());
+        QVERIFY(!rleImage.isNull());
+        QCOMPARE(rleImage.size(), image.size());
+        QCOMPARE(rleImage.convertToFormat(QImage::Format_ARGB32), rawImage.convertToFormat(QImage::Format_ARGB32));
+    }
+};
+
+QTEST_MAIN(TgaTests)
+
+#include "tgatest.moc"
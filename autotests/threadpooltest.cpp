@@ -0,0 +1,79 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QAtomicInt>
+#include <QTest>
+
+#include "threadpool_p.h"
+
+class ThreadPoolTests : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        // the shared pool is sized on its first use
+        qputenv("KIMAGEFORMATS_MAX_THREADS", "3");
+    }
+
+    void cleanupTestCase()
+    {
+        qunsetenv("KIMAGEFORMATS_MAX_THREADS");
+    }
+
+    void testPoolSize()
+    {
+        QCOMPARE(maxThreadCount(), 3);
+        QCOMPARE(sharedThreadPool()->maxThreadCount(), 3);
+    }
+
+    void testRunConcurrently()
+    {
+        // no more workers than the budget
+        QAtomicInt calls = 0;
+        QAtomicInt outOfRange = 0;
+        runConcurrently(8, [&](int thread) {
+            calls.fetchAndAddRelaxed(1);
+            if (thread < 0 || thread >= 3) {
+                outOfRange.storeRelaxed(1);
+            }
+        });
+        QVERIFY(calls.loadRelaxed() >= 1);
+        QVERIFY(calls.loadRelaxed() <= 3);
+        QCOMPARE(outOfRange.loadRelaxed(), 0);
+
+        // only the calling thread
+        qputenv("KIMAGEFORMATS_MAX_THREADS", "0");
+        calls = 0;
+        runConcurrently(8, [&](int thread) {
+            QCOMPARE(thread, 0);
+            calls.fetchAndAddRelaxed(1);
+        });
+        qputenv("KIMAGEFORMATS_MAX_THREADS", "3");
+        QCOMPARE(calls.loadRelaxed(), 1);
+    }
+
+    void testThreadReservation()
+    {
+        // a reader alone gets the whole budget
+        ThreadReservation first;
+        QCOMPARE(first.reserve(8), 3);
+
+        // the others get what is left (at least the calling thread)
+        ThreadReservation second;
+        QCOMPARE(second.reserve(8), 1);
+        first.release();
+        QCOMPARE(second.reserve(8), 3);
+        QCOMPARE(first.reserve(2), 1);
+        second.release();
+        QCOMPARE(first.reserve(2), 2);
+    }
+};
+
+QTEST_MAIN(ThreadPoolTests)
+
+#include "threadpooltest.moc"
@@ -12,8 +12,19 @@
 #include <QVariant>
 #include <QtEndian>
 
+#include <algorithm>
 #include <cstring>
 
+/*
+Maximum size (in KiB) of the decoded frames kept in memory.
+Cursor themes show the same few frames many times (see the "seq " chunk): cached frames
+are returned without decoding them again.
+0 disables the cache.
+*/
+#ifndef KIMG_ANI_FRAME_CACHE_SIZE
+#define KIMG_ANI_FRAME_CACHE_SIZE 8192
+#endif
+
 namespace
 {
 struct ChunkHeader {
@@ -52,7 +63,10 @@ struct CursorDirEntry {
 
 } // namespace
 
-ANIHandler::ANIHandler() = default;
+ANIHandler::ANIHandler()
+    : m_frameCache(KIMG_ANI_FRAME_CACHE_SIZE)
+{
+}
 
 bool ANIHandler::canRead() const
 {
@@ -84,6 +98,7 @@ bool ANIHandler::read(QImage *outImage)
         device()->seek(m_firstFrameOffset);
     }
 
+    const auto framePos = device()->pos();
     const QByteArray frameType = device()->read(4);
     if (frameType != "icon") {
         return false;
@@ -99,9 +114,21 @@ bool ANIHandler::read(QImage *outImage)
         return false;
     }
 
-    const QByteArray frameData = device()->read(frameSize);
-
-    const bool ok = outImage->loadFromData(frameData, "cur");
+    bool ok = false;
+    if (const QImage *cached = m_frameCache.object(framePos)) {
+        *outImage = *cached;
+        ok = device()->seek(device()->pos() + frameSize);
+    } else {
+        const QByteArray frameData = device()->read(frameSize);
+        if (auto decoded = m_decodeAhead.take(framePos, outImage)) {
+            ok = *decoded;
+        } else {
+            ok = outImage->loadFromData(frameData, "cur");
+        }
+        if (ok && m_frameCache.maxCost() > 0) {
+            m_frameCache.insert(framePos, new QImage(*outImage), std::max(qsizetype(1), outImage->sizeInBytes() / 1024));
+        }
+    }
 
     ++m_currentImageNumber;
 
@@ -122,9 +149,37 @@ bool ANIHandler::read(QImage *outImage)
         }
     }
 
+    if (ok && m_currentImageNumber < m_imageCount && DecodeAhead::isEnabled()) {
+        decodeAhead();
+    }
+
     return ok;
 }
 
+void ANIHandler::decodeAhead()
+{
+    // the next frame is peeked: the device position does not change
+    const auto nextPos = device()->pos();
+    if (m_frameCache.contains(nextPos)) {
+        return;
+    }
+    const QByteArray nextFrame = device()->peek(sizeof(ChunkHeader));
+    if (nextFrame.size() != sizeof(ChunkHeader)) {
+        return;
+    }
+    const auto *header = reinterpret_cast<const ChunkHeader *>(nextFrame.data());
+    if (qstrncmp(header->magic, "icon", sizeof(header->magic)) != 0 || header->size == 0) {
+        return;
+    }
+    const QByteArray frameData = device()->peek(sizeof(ChunkHeader) + header->size).mid(sizeof(ChunkHeader));
+    if (frameData.size() != qsizetype(header->size)) {
+        return;
+    }
+    m_decodeAhead.start(nextPos, [frameData](QImage *image) {
+        return image->loadFromData(frameData, "cur");
+    });
+}
+
 int ANIHandler::currentImageNumber() const
 {
     if (!ensureScanned()) {
@@ -177,6 +232,15 @@ bool ANIHandler::jumpToImage(int imageNumber)
         return false;
     }
 
+    // the frames are indexed by ensureScanned()
+    if (m_frameOffsets.count() == m_frameCount + 1) {
+        if (device()->seek(m_frameOffsets.at(imageNumber))) {
+            m_currentImageNumber = imageNumber;
+            return true;
+        }
+        return false;
+    }
+
     // otherwise we need to jump from frame to frame
     const auto oldPos = device()->pos();
 
@@ -461,11 +525,6 @@ bool ANIHandler::ensureScanned() const
 
                             device()->seek(oldPos);
                         }
-
-                        // If we don't have a custom image sequence we can stop scanning right here
-                        if (m_imageSequence.isEmpty()) {
-                            break;
-                        }
                     }
 
                     mutableThis->m_frameOffsets.append(device()->pos() - 4);
@@ -478,7 +537,7 @@ bool ANIHandler::ensureScanned() const
                     const auto frameSize = *(reinterpret_cast<const quint32_le *>(frameSizeData.data()));
                     device()->seek(device()->pos() + frameSize);
 
-                    read += frameSize;
+                    read += sizeof(quint32_le) + frameSize;
 
                     if (m_frameOffsets.count() == m_frameCount) {
                         // Also record the end of frame data
@@ -507,8 +566,12 @@ bool ANIHandler::ensureScanned() const
     }
 
     if (!m_frameOffsets.isEmpty() && m_frameOffsets.count() - 1 != m_frameCount) {
-        qWarning("ANIHandler: number of actual frames does not match 'nFrames' in anih");
-        return false;
+        if (!m_imageSequence.isEmpty()) {
+            qWarning("ANIHandler: number of actual frames does not match 'nFrames' in anih");
+            return false;
+        }
+        // without a custom sequence the frames can be read one after the other
+        mutableThis->m_frameOffsets.clear();
     }
 
     mutableThis->m_scanned = true;
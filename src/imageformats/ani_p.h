@@ -7,9 +7,12 @@
 #ifndef KIMG_ANI_P_H
 #define KIMG_ANI_P_H
 
+#include <QCache>
 #include <QImageIOPlugin>
 #include <QSize>
 
+#include "decodeahead_p.h"
+
 class ANIHandler : public QImageIOHandler
 {
 public:
@@ -33,6 +36,7 @@ public:
 
 private:
     bool ensureScanned() const;
+    void decodeAhead();
 
     bool m_scanned = false;
 
@@ -42,8 +46,9 @@ private:
     int m_imageCount = 0; // logical images
     // Stores a custom sequence of images
     QList<int> m_imageSequence;
-    // and the corresponding offsets where they are
-    // since we can't read the image data sequentally in this case then
+    // The offsets of the frames (and of the end of the frame data) to jump
+    // to any of them directly, also used by the custom sequence since we
+    // can't read the image data sequentally in this case then
     QList<qint64> m_frameOffsets;
     qint64 m_firstFrameOffset = 0;
 
@@ -53,6 +58,18 @@ private:
     QString m_name;
     QString m_artist;
     QSize m_size;
+
+    /*!
+     * \brief m_decodeAhead
+     * The next frame decoded in background (see DecodeAhead): the key is the position of the frame.
+     */
+    DecodeAhead m_decodeAhead;
+
+    /*!
+     * \brief m_frameCache
+     * The decoded frames, by position (the cost is in KiB).
+     */
+    QCache<qint64, QImage> m_frameCache;
 };
 
 class ANIPlugin : public QImageIOPlugin
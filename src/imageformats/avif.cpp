@@ -14,6 +14,7 @@
 #include "avif_p.h"
 #include "util_p.h"
 
+#include <algorithm>
 #include <cfloat>
 
 /*
@@ -41,19 +42,54 @@ Quality range - compression/subsampling
 #define KIMG_AVIF_QUALITY_LOW 51
 #endif
 
+/*
+Encoder speed: from AVIF_SPEED_SLOWEST (0, smallest files) to AVIF_SPEED_FASTEST (10).
+It can be changed with the CompressionRatio option, independently of the quality: the higher
+the ratio, the slower the encode and the smaller the file. A ratio in [0, 10] sets
+encoder->speed = AVIF_SPEED_FASTEST - ratio (larger ratios are clamped to 10, the slowest speed);
+a negative ratio (the QImageWriter default) uses the default speed.
+*/
+#ifndef KIMG_AVIF_DEFAULT_SPEED
+#define KIMG_AVIF_DEFAULT_SPEED 6
+#endif
+
+/*
+Minimum width and height (in pixels) of the tiles of encoded images.
+AV1 encoders use several threads on a frame only when it is split in tiles: large images
+are split in up to one tile per thread of the budget. 0 disables the tiling.
+*/
+#ifndef KIMG_AVIF_MIN_TILE_SIZE
+#define KIMG_AVIF_MIN_TILE_SIZE 512
+#endif
+
+/*
+Maximum size (in KiB) of the decoded frames of an animation kept in memory.
+Cached frames are returned by jumpToImage() and when looping without decoding them again.
+The cache keeps its own reference to each frame, so the memory of the previous frames cannot
+be reused to decode the next ones. 0 (default) disables the cache.
+*/
+#ifndef KIMG_AVIF_FRAME_CACHE_SIZE
+#define KIMG_AVIF_FRAME_CACHE_SIZE 0
+#endif
+
 QAVIFHandler::QAVIFHandler()
     : m_parseState(ParseAvifNotParsed)
     , m_quality(KIMG_AVIF_DEFAULT_QUALITY)
+    , m_speed(KIMG_AVIF_DEFAULT_SPEED)
     , m_container_width(0)
     , m_container_height(0)
     , m_rawAvifData(AVIF_DATA_EMPTY)
     , m_decoder(nullptr)
+    , m_current_image_number(-1)
+    , m_frame_cache(KIMG_AVIF_FRAME_CACHE_SIZE)
     , m_must_jump_to_next_image(false)
 {
 }
 
 QAVIFHandler::~QAVIFHandler()
 {
+    // the frame decoded ahead uses the decoder
+    m_decodeAhead.clear();
     if (m_decoder) {
         avifDecoderDestroy(m_decoder);
     }
@@ -61,6 +97,7 @@ QAVIFHandler::~QAVIFHandler()
 
 bool QAVIFHandler::canRead() const
 {
+    m_decodeAhead.wait();
     if (m_parseState == ParseAvifNotParsed && !canRead(device())) {
         return false;
     }
@@ -139,9 +176,9 @@ bool QAVIFHandler::ensureDecoder()
         return true;
     }
 
-    m_rawData = device()->readAll();
+    m_rawData.load(device());
 
-    m_rawAvifData.data = reinterpret_cast<const uint8_t *>(m_rawData.constData());
+    m_rawAvifData.data = reinterpret_cast<const uint8_t *>(m_rawData.data());
     m_rawAvifData.size = m_rawData.size();
 
     if (avifPeekCompatibleFileType(&m_rawAvifData) == AVIF_FALSE) {
@@ -154,10 +191,6 @@ bool QAVIFHandler::ensureDecoder()
     m_decoder->ignoreExif = AVIF_TRUE;
     m_decoder->ignoreXMP = AVIF_TRUE;
 
-#if AVIF_VERSION >= 80400
-    m_decoder->maxThreads = qBound(1, QThread::idealThreadCount(), 64);
-#endif
-
 #if AVIF_VERSION >= 90100
     m_decoder->strictFlags = AVIF_STRICT_DISABLED;
 #endif
@@ -272,12 +305,6 @@ bool QAVIFHandler::decode_one_frame()
         }
     }
 
-    QImage result = imageAlloc(m_decoder->image->width, m_decoder->image->height, resultformat);
-    if (result.isNull()) {
-        qWarning("Memory cannot be allocated");
-        return false;
-    }
-
     QColorSpace colorspace;
     if (m_decoder->image->icc.data && (m_decoder->image->icc.size > 0)) {
         const QByteArray icc_data(reinterpret_cast<const char *>(m_decoder->image->icc.data), m_decoder->image->icc.size);
@@ -350,10 +377,78 @@ bool QAVIFHandler::decode_one_frame()
         }
     }
 
+    // clean aperture (crop) rectangle
+    const QRect imageRect(0, 0, m_decoder->image->width, m_decoder->image->height);
+    QRect cropRect = imageRect;
+    if (m_decoder->image->transformFlags & AVIF_TRANSFORM_CLAP) {
+        if ((m_decoder->image->clap.widthD > 0) && (m_decoder->image->clap.heightD > 0) && (m_decoder->image->clap.horizOffD > 0)
+            && (m_decoder->image->clap.vertOffD > 0)) {
+            int new_width = (int)((double)(m_decoder->image->clap.widthN) / (m_decoder->image->clap.widthD) + 0.5);
+            if (new_width > imageRect.width()) {
+                new_width = imageRect.width();
+            }
+
+            int new_height = (int)((double)(m_decoder->image->clap.heightN) / (m_decoder->image->clap.heightD) + 0.5);
+            if (new_height > imageRect.height()) {
+                new_height = imageRect.height();
+            }
+
+            if (new_width > 0 && new_height > 0) {
+                int offx =
+                    ((double)((int32_t)m_decoder->image->clap.horizOffN)) / (m_decoder->image->clap.horizOffD) + (imageRect.width() - new_width) / 2.0 + 0.5;
+                if (offx < 0) {
+                    offx = 0;
+                } else if (offx > (imageRect.width() - new_width)) {
+                    offx = imageRect.width() - new_width;
+                }
+
+                int offy =
+                    ((double)((int32_t)m_decoder->image->clap.vertOffN)) / (m_decoder->image->clap.vertOffD) + (imageRect.height() - new_height) / 2.0 + 0.5;
+                if (offy < 0) {
+                    offy = 0;
+                } else if (offy > (imageRect.height() - new_height)) {
+                    offy = imageRect.height() - new_height;
+                }
+
+                cropRect = QRect(offx, offy, new_width, new_height);
+            }
+        }
+
+        else { // Zero values, we need to avoid 0 divide.
+            qWarning("ERROR: Wrong values in avifCleanApertureBox");
+        }
+    }
+
+    // the YUV planes are converted straight into the QImage: when the crop is aligned to the
+    // chroma subsampling, only the visible area is converted
+    const avifImage *source = m_decoder->image;
+#if AVIF_VERSION >= 1000000
+    avifImage *view = nullptr;
+    if (cropRect != imageRect) {
+        const avifCropRect rect = {uint32_t(cropRect.x()), uint32_t(cropRect.y()), uint32_t(cropRect.width()), uint32_t(cropRect.height())};
+        view = avifImageCreateEmpty();
+        if (view && avifImageSetViewRect(view, m_decoder->image, &rect) == AVIF_RESULT_OK) {
+            source = view;
+        }
+    }
+#endif
+
+    // the memory of a previous frame is reused when the caller no longer uses it
+    QImage result = imageReuse(m_recycled_image, source->width, source->height, resultformat);
+    if (result.isNull()) {
+#if AVIF_VERSION >= 1000000
+        if (view) {
+            avifImageDestroy(view);
+        }
+#endif
+        qWarning("Memory cannot be allocated");
+        return false;
+    }
+
     result.setColorSpace(colorspace);
 
     avifRGBImage rgb;
-    avifRGBImageSetDefaults(&rgb, m_decoder->image);
+    avifRGBImageSetDefaults(&rgb, source);
 
 #if AVIF_VERSION >= 1000000
     rgb.maxThreads = m_decoder->maxThreads;
@@ -389,51 +484,24 @@ bool QAVIFHandler::decode_one_frame()
     rgb.rowBytes = result.bytesPerLine();
     rgb.pixels = result.bits();
 
-    avifResult res = avifImageYUVToRGB(m_decoder->image, &rgb);
+    avifResult res = avifImageYUVToRGB(source, &rgb);
+#if AVIF_VERSION >= 1000000
+    if (view) {
+        avifImageDestroy(view);
+    }
+#endif
     if (res != AVIF_RESULT_OK) {
         qWarning("ERROR in avifImageYUVToRGB: %s", avifResultToString(res));
         return false;
     }
 
-    if (m_decoder->image->transformFlags & AVIF_TRANSFORM_CLAP) {
-        if ((m_decoder->image->clap.widthD > 0) && (m_decoder->image->clap.heightD > 0) && (m_decoder->image->clap.horizOffD > 0)
-            && (m_decoder->image->clap.vertOffD > 0)) {
-            int new_width = (int)((double)(m_decoder->image->clap.widthN) / (m_decoder->image->clap.widthD) + 0.5);
-            if (new_width > result.width()) {
-                new_width = result.width();
-            }
-
-            int new_height = (int)((double)(m_decoder->image->clap.heightN) / (m_decoder->image->clap.heightD) + 0.5);
-            if (new_height > result.height()) {
-                new_height = result.height();
-            }
-
-            if (new_width > 0 && new_height > 0) {
-                int offx =
-                    ((double)((int32_t)m_decoder->image->clap.horizOffN)) / (m_decoder->image->clap.horizOffD) + (result.width() - new_width) / 2.0 + 0.5;
-                if (offx < 0) {
-                    offx = 0;
-                } else if (offx > (result.width() - new_width)) {
-                    offx = result.width() - new_width;
-                }
-
-                int offy =
-                    ((double)((int32_t)m_decoder->image->clap.vertOffN)) / (m_decoder->image->clap.vertOffD) + (result.height() - new_height) / 2.0 + 0.5;
-                if (offy < 0) {
-                    offy = 0;
-                } else if (offy > (result.height() - new_height)) {
-                    offy = result.height() - new_height;
-                }
-
-                result = result.copy(offx, offy, new_width, new_height);
-            }
-        }
-
-        else { // Zero values, we need to avoid 0 divide.
-            qWarning("ERROR: Wrong values in avifCleanApertureBox");
-        }
+    if (result.size() != cropRect.size()) {
+        result = result.copy(cropRect);
     }
 
+    // 180° rotation and mirroring are done in place (and merged into a single pass)
+    bool mirrorH = false;
+    bool mirrorV = false;
     if (m_decoder->image->transformFlags & AVIF_TRANSFORM_IROT) {
         QTransform transform;
         switch (m_decoder->image->irot.angle) {
@@ -442,8 +510,8 @@ bool QAVIFHandler::decode_one_frame()
             result = result.transformed(transform);
             break;
         case 2:
-            transform.rotate(180);
-            result = result.transformed(transform);
+            mirrorH = true;
+            mirrorV = true;
             break;
         case 3:
             transform.rotate(90);
@@ -459,28 +527,101 @@ bool QAVIFHandler::decode_one_frame()
         switch (m_decoder->image->imir.axis) {
 #endif
         case 0: // top-to-bottom
-            result = result.mirrored(false, true);
+            mirrorV = !mirrorV;
             break;
         case 1: // left-to-right
-            result = result.mirrored(true, false);
+            mirrorH = !mirrorH;
             break;
         }
     }
 
-    if (resultformat == result.format()) {
-        m_current_image = result;
-    } else {
-        m_current_image = result.convertToFormat(resultformat);
+    if (mirrorH || mirrorV) {
+        result.mirror(mirrorH, mirrorV);
     }
 
+    if (resultformat != result.format()) {
+        result.convertTo(resultformat);
+    }
+    setCurrentImage(result);
+
     m_estimated_dimensions = m_current_image.size();
+    m_current_image_number = m_decoder->imageIndex;
+
+    if (m_decoder->imageCount >= 2 && m_frame_cache.maxCost() > 0) {
+        m_frame_cache.insert(m_current_image_number, new QImage(m_current_image), std::max(qsizetype(1), m_current_image.sizeInBytes() / 1024));
+    }
 
     m_must_jump_to_next_image = false;
     return true;
 }
 
+void QAVIFHandler::setCurrentImage(const QImage &image)
+{
+    // the current frame is recycled by the decode of the frame after the next one: the caller has
+    // released it by then (frames shared with the cache are never recycled)
+    m_recycled_image = m_frame_cache.maxCost() > 0 ? QImage() : m_current_image;
+    m_current_image = image;
+}
+
+bool QAVIFHandler::decode_frame(int imageNumber)
+{
+    if (const QImage *cached = m_frame_cache.object(imageNumber)) {
+        m_decodeAhead.clear();
+        m_current_image = *cached;
+        m_current_image_number = imageNumber;
+        m_must_jump_to_next_image = false;
+        return true;
+    }
+
+    QImage image;
+    if (auto decoded = m_decodeAhead.take(imageNumber, &image)) {
+        if (!*decoded) {
+            return false;
+        }
+        setCurrentImage(image);
+        m_estimated_dimensions = image.size();
+        m_current_image_number = imageNumber;
+        m_must_jump_to_next_image = false;
+        return true;
+    }
+
+    return decode_nth_frame(imageNumber);
+}
+
+bool QAVIFHandler::decode_nth_frame(int imageNumber)
+{
+    // the AV1 codecs create their own threads: they are taken from the thread budget left by the
+    // other readers, and given back after the decode (NOTE: libavif creates the codec on the first decode)
+    ThreadReservation threads;
+#if AVIF_VERSION >= 80400
+    m_decoder->maxThreads = threads.reserve(maxThreadCount());
+#endif
+
+    if (imageNumber != m_decoder->imageIndex) {
+        // NOTE: avifDecoderNthImage() decodes the next frame directly, otherwise it restarts from the nearest keyframe
+        avifResult decodeResult = avifDecoderNthImage(m_decoder, imageNumber);
+
+        if (decodeResult != AVIF_RESULT_OK) {
+            qWarning("ERROR: Failed to decode %d th Image in sequence: %s", imageNumber, avifResultToString(decodeResult));
+            return false;
+        }
+
+        if ((m_container_width != m_decoder->image->width) || (m_container_height != m_decoder->image->height)) {
+            qWarning("Decoded image sequence size (%dx%d) do not match declared container size (%dx%d)!",
+                     m_decoder->image->width,
+                     m_decoder->image->height,
+                     m_container_width,
+                     m_container_height);
+            return false;
+        }
+    }
+
+    return decode_one_frame();
+}
+
 bool QAVIFHandler::read(QImage *image)
 {
+    m_decodeAhead.wait();
     if (!ensureOpened()) {
         return false;
     }
@@ -492,7 +633,7 @@ bool QAVIFHandler::read(QImage *image)
     *image = m_current_image;
     if (imageCount() >= 2) {
         m_must_jump_to_next_image = true;
-        if (m_decoder->imageIndex >= m_decoder->imageCount - 1) {
+        if (m_current_image_number >= m_decoder->imageCount - 1) {
             // all frames in animation have been read
             m_parseState = ParseAvifFinished;
         }
@@ -500,9 +641,39 @@ bool QAVIFHandler::read(QImage *image)
         // the static image has been read
         m_parseState = ParseAvifFinished;
     }
+
+    if (imageCount() >= 2 && DecodeAhead::isEnabled()) {
+        decodeAhead((m_current_image_number + 1) % m_decoder->imageCount);
+    }
     return true;
 }
 
+void QAVIFHandler::decodeAhead(int imageNumber)
+{
+    if (m_frame_cache.contains(imageNumber)) {
+        return;
+    }
+    // the frame is decoded with the decoder of the handler: its visible state is restored
+    // (the public functions wait for the end of the decode)
+    m_decodeAhead.start(imageNumber, [this, imageNumber](QImage *image) {
+        const auto current_image = m_current_image;
+        const auto current_image_number = m_current_image_number;
+        const auto must_jump_to_next_image = m_must_jump_to_next_image;
+        const auto estimated_dimensions = m_estimated_dimensions;
+
+        const auto ok = decode_nth_frame(imageNumber);
+        if (ok) {
+            *image = m_current_image;
+        }
+
+        m_current_image = current_image;
+        m_current_image_number = current_image_number;
+        m_must_jump_to_next_image = must_jump_to_next_image;
+        m_estimated_dimensions = estimated_dimensions;
+        return ok;
+    });
+}
+
 bool QAVIFHandler::write(const QImage &image)
 {
     if (image.format() == QImage::Format_Invalid) {
@@ -841,7 +1012,8 @@ bool QAVIFHandler::write(const QImage &image)
 
     avifRWData raw = AVIF_DATA_EMPTY;
     avifEncoder *encoder = avifEncoderCreate();
-    encoder->maxThreads = qBound(1, QThread::idealThreadCount(), 64);
+    ThreadReservation threads;
+    encoder->maxThreads = threads.reserve(maxThreadCount());
 
 #if AVIF_VERSION < 1000000
     encoder->minQuantizer = minQuantizer;
@@ -863,7 +1035,8 @@ bool QAVIFHandler::write(const QImage &image)
     }
 #endif
 
-    encoder->speed = 6;
+    encoder->speed = m_speed;
+    setTiling(encoder, avif->width, avif->height);
 
     res = avifEncoderWrite(encoder, avif, &raw);
     avifEncoderDestroy(encoder);
@@ -886,11 +1059,40 @@ bool QAVIFHandler::write(const QImage &image)
     return false;
 }
 
+void QAVIFHandler::setTiling(avifEncoder *encoder, quint32 width, quint32 height)
+{
+    int colsLog2 = 0;
+    int rowsLog2 = 0;
+    const quint32 minSize = KIMG_AVIF_MIN_TILE_SIZE;
+    auto canSplit = [minSize](quint32 size, int log2) {
+        return minSize > 0 && log2 < 6 && (size >> (log2 + 1)) >= minSize;
+    };
+    // the largest side of the tiles is split first
+    while ((1 << (colsLog2 + rowsLog2)) < encoder->maxThreads) {
+        const bool cols = canSplit(width, colsLog2);
+        const bool rows = canSplit(height, rowsLog2);
+        if (cols && (!rows || (width >> colsLog2) >= (height >> rowsLog2))) {
+            ++colsLog2;
+        } else if (rows) {
+            ++rowsLog2;
+        } else {
+            break;
+        }
+    }
+    encoder->tileColsLog2 = colsLog2;
+    encoder->tileRowsLog2 = rowsLog2;
+}
+
 QVariant QAVIFHandler::option(ImageOption option) const
 {
+    m_decodeAhead.wait();
     if (option == Quality) {
         return m_quality;
     }
+    if (option == CompressionRatio) {
+        // the inverse of the speed (see KIMG_AVIF_DEFAULT_SPEED)
+        return AVIF_SPEED_FASTEST - m_speed;
+    }
 
     if (!supportsOption(option) || !ensureParsed()) {
         return QVariant();
@@ -899,6 +1101,18 @@ QVariant QAVIFHandler::option(ImageOption option) const
     switch (option) {
     case Size:
         return m_estimated_dimensions;
+    case ImageFormat:
+        // known after avifDecoderParse(): nothing is decoded
+        if (m_decoder->image->depth > 8) {
+            if (m_decoder->alphaPresent) {
+                return QImage::Format_RGBA64;
+            }
+            return m_decoder->image->yuvFormat == AVIF_PIXEL_FORMAT_YUV400 ? QImage::Format_Grayscale16 : QImage::Format_RGBX64;
+        }
+        if (m_decoder->alphaPresent) {
+            return QImage::Format_ARGB32;
+        }
+        return m_decoder->image->yuvFormat == AVIF_PIXEL_FORMAT_YUV400 ? QImage::Format_Grayscale8 : QImage::Format_RGB32;
     case Animation:
         if (imageCount() >= 2) {
             return true;
@@ -921,6 +1135,17 @@ void QAVIFHandler::setOption(ImageOption option, const QVariant &value)
             m_quality = KIMG_AVIF_DEFAULT_QUALITY;
         }
         return;
+    case CompressionRatio: {
+        // encoder->speed = AVIF_SPEED_FASTEST - ratio: a higher ratio is slower and makes smaller files
+        bool ok = false;
+        const int ratio = value.toInt(&ok);
+        if (!ok || ratio < 0) {
+            m_speed = KIMG_AVIF_DEFAULT_SPEED;
+        } else {
+            m_speed = AVIF_SPEED_FASTEST - std::min(ratio, AVIF_SPEED_FASTEST - AVIF_SPEED_SLOWEST);
+        }
+        return;
+    }
     default:
         break;
     }
@@ -929,11 +1154,12 @@ void QAVIFHandler::setOption(ImageOption option, const QVariant &value)
 
 bool QAVIFHandler::supportsOption(ImageOption option) const
 {
-    return option == Quality || option == Size || option == Animation;
+    return option == Quality || option == CompressionRatio || option == Size || option == ImageFormat || option == Animation;
 }
 
 int QAVIFHandler::imageCount() const
 {
+    m_decodeAhead.wait();
     if (!ensureParsed()) {
         return 0;
     }
@@ -946,6 +1172,7 @@ int QAVIFHandler::imageCount() const
 
 int QAVIFHandler::currentImageNumber() const
 {
+    m_decodeAhead.wait();
     if (m_parseState == ParseAvifNotParsed) {
         return -1;
     }
@@ -962,46 +1189,27 @@ int QAVIFHandler::currentImageNumber() const
         }
     }
 
-    return m_decoder->imageIndex;
+    return m_current_image_number;
 }
 
 bool QAVIFHandler::jumpToNextImage()
 {
+    m_decodeAhead.wait();
     if (!ensureParsed()) {
         return false;
     }
 
-    if (m_decoder->imageIndex >= 0) {
-        if (m_decoder->imageCount < 2) {
-            m_parseState = ParseAvifSuccess;
-            return true;
-        }
-
-        if (m_decoder->imageIndex >= m_decoder->imageCount - 1) { // start from beginning
-            avifDecoderReset(m_decoder);
-        }
-    }
-
-    avifResult decodeResult = avifDecoderNextImage(m_decoder);
-
-    if (decodeResult != AVIF_RESULT_OK) {
-        qWarning("ERROR: Failed to decode Next image in sequence: %s", avifResultToString(decodeResult));
-        m_parseState = ParseAvifError;
-        return false;
+    if (m_decoder->imageIndex >= 0 && m_decoder->imageCount < 2) {
+        m_parseState = ParseAvifSuccess;
+        return true;
     }
 
-    if ((m_container_width != m_decoder->image->width) || (m_container_height != m_decoder->image->height)) {
-        qWarning("Decoded image sequence size (%dx%d) do not match first image size (%dx%d)!",
-                 m_decoder->image->width,
-                 m_decoder->image->height,
-                 m_container_width,
-                 m_container_height);
-
-        m_parseState = ParseAvifError;
-        return false;
+    int imageNumber = m_current_image_number + 1;
+    if (imageNumber >= m_decoder->imageCount) { // start from beginning
+        imageNumber = 0;
     }
 
-    if (decode_one_frame()) {
+    if (decode_frame(imageNumber)) {
         m_parseState = ParseAvifSuccess;
         return true;
     } else {
@@ -1012,6 +1220,7 @@ bool QAVIFHandler::jumpToNextImage()
 
 bool QAVIFHandler::jumpToImage(int imageNumber)
 {
+    m_decodeAhead.wait();
     if (!ensureParsed()) {
         return false;
     }
@@ -1030,32 +1239,13 @@ bool QAVIFHandler::jumpToImage(int imageNumber)
         return false;
     }
 
-    if (imageNumber == m_decoder->imageIndex) { // we are here already
+    if (imageNumber == m_current_image_number) { // we are here already
         m_must_jump_to_next_image = false;
         m_parseState = ParseAvifSuccess;
         return true;
     }
 
-    avifResult decodeResult = avifDecoderNthImage(m_decoder, imageNumber);
-
-    if (decodeResult != AVIF_RESULT_OK) {
-        qWarning("ERROR: Failed to decode %d th Image in sequence: %s", imageNumber, avifResultToString(decodeResult));
-        m_parseState = ParseAvifError;
-        return false;
-    }
-
-    if ((m_container_width != m_decoder->image->width) || (m_container_height != m_decoder->image->height)) {
-        qWarning("Decoded image sequence size (%dx%d) do not match declared container size (%dx%d)!",
-                 m_decoder->image->width,
-                 m_decoder->image->height,
-                 m_container_width,
-                 m_container_height);
-
-        m_parseState = ParseAvifError;
-        return false;
-    }
-
-    if (decode_one_frame()) {
+    if (decode_frame(imageNumber)) {
         m_parseState = ParseAvifSuccess;
         return true;
     } else {
@@ -1066,6 +1256,7 @@ bool QAVIFHandler::jumpToImage(int imageNumber)
 
 int QAVIFHandler::nextImageDelay() const
 {
+    m_decodeAhead.wait();
     if (!ensureOpened()) {
         return 0;
     }
@@ -1074,7 +1265,13 @@ int QAVIFHandler::nextImageDelay() const
         return 0;
     }
 
-    int delay_ms = 1000.0 * m_decoder->imageTiming.duration;
+    // the current frame can come from the cache: the decoder may be elsewhere
+    avifImageTiming timing = m_decoder->imageTiming;
+    if (m_current_image_number >= 0 && m_current_image_number != m_decoder->imageIndex) {
+        avifDecoderNthImageTiming(m_decoder, m_current_image_number, &timing);
+    }
+
+    int delay_ms = 1000.0 * timing.duration;
     if (delay_ms < 1) {
         delay_ms = 1;
     }
@@ -1083,6 +1280,7 @@ int QAVIFHandler::nextImageDelay() const
 
 int QAVIFHandler::loopCount() const
 {
+    m_decodeAhead.wait();
     if (!ensureParsed()) {
         return 0;
     }
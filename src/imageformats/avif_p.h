@@ -10,6 +10,7 @@
 #define KIMG_AVIF_P_H
 
 #include <QByteArray>
+#include <QCache>
 #include <QImage>
 #include <QImageIOPlugin>
 #include <QPointF>
@@ -18,6 +19,10 @@
 #include <avif/avif.h>
 #include <qimageiohandler.h>
 
+#include "decodeahead_p.h"
+#include "devicedata_p.h"
+#include "threadpool_p.h"
+
 class QAVIFHandler : public QImageIOHandler
 {
 public:
@@ -49,6 +54,11 @@ private:
     bool ensureOpened() const;
     bool ensureDecoder();
     bool decode_one_frame();
+    bool decode_frame(int imageNumber);
+    bool decode_nth_frame(int imageNumber);
+    void setCurrentImage(const QImage &image);
+    void decodeAhead(int imageNumber);
+    static void setTiling(avifEncoder *encoder, quint32 width, quint32 height);
 
     enum ParseAvifState {
         ParseAvifError = -1,
@@ -60,18 +70,42 @@ private:
 
     ParseAvifState m_parseState;
     int m_quality;
+    int m_speed; // encoder speed (CompressionRatio option)
 
     uint32_t m_container_width;
     uint32_t m_container_height;
     QSize m_estimated_dimensions;
 
-    QByteArray m_rawData;
+    /*!
+     * \brief m_rawData
+     * The content of the device: mapped or shared when possible (see DeviceData).
+     */
+    DeviceData m_rawData;
     avifROData m_rawAvifData;
 
     avifDecoder *m_decoder;
     QImage m_current_image;
+    int m_current_image_number;
+
+    /*!
+     * \brief m_recycled_image
+     * The frame before the current one: its memory is reused by the next decode (see imageReuse()).
+     */
+    QImage m_recycled_image;
+
+    /*!
+     * \brief m_frame_cache
+     * Decoded frames of animations (the cost is in KiB, see KIMG_AVIF_FRAME_CACHE_SIZE).
+     */
+    QCache<int, QImage> m_frame_cache;
 
     bool m_must_jump_to_next_image;
+
+    /*!
+     * \brief m_decodeAhead
+     * The next frame decoded in background (see DecodeAhead): the key is the frame number.
+     */
+    mutable DecodeAhead m_decodeAhead;
 };
 
 class QAVIFPlugin : public QImageIOPlugin
@@ -0,0 +1,136 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#ifndef DECODEAHEAD_P_H
+#define DECODEAHEAD_P_H
+
+#include "threadpool_p.h"
+
+#include <QImage>
+
+#include <functional>
+#include <memory>
+#include <optional>
+
+/*!
+ * \brief The DecodeAhead class
+ * Decodes the next frame of an animation in background while the caller uses the current one.
+ *
+ * The mode is opt-in: it is enabled by setting the KIMAGEFORMATS_DECODE_AHEAD environment
+ * variable to 1 (and it is disabled when KIMAGEFORMATS_MAX_THREADS is 0).
+ *
+ * After returning a frame, the handler starts the decode of the next one, identified by a
+ * key of its choice (e.g. the frame number or its offset in the file). When that frame is
+ * requested, the handler takes it instead of decoding it.
+ * \note The decode function runs on a thread of the shared thread pool: the handler must call
+ *       wait() before using the state that the function changes (or the function must only use
+ *       its own data). When no thread is available, nothing is decoded ahead.
+ */
+class DecodeAhead
+{
+public:
+    DecodeAhead() = default;
+    DecodeAhead(const DecodeAhead &other) = delete;
+    DecodeAhead &operator=(const DecodeAhead &other) = delete;
+
+    ~DecodeAhead()
+    {
+        wait();
+    }
+
+    /*!
+     * \brief isEnabled
+     * \return True if the frames should be decoded ahead.
+     */
+    static bool isEnabled()
+    {
+        static const bool enabled = qEnvironmentVariableIntValue("KIMAGEFORMATS_DECODE_AHEAD") > 0 && maxThreadCount() > 0;
+        return enabled;
+    }
+
+    /*!
+     * \brief start
+     * Starts the decode of the frame \a key with \a decode, which returns true on success.
+     * A previous result not taken is discarded.
+     */
+    void start(qint64 key, const std::function<bool(QImage *)> &decode)
+    {
+        clear();
+        m_key = key;
+        m_task = std::make_unique<BackgroundTask>([this, decode]() {
+            m_decoded = decode(&m_image);
+        });
+        if (!m_task->isStarted()) {
+            // no free thread: the frame will be decoded when requested
+            m_task.reset();
+            return;
+        }
+        m_pending = true;
+    }
+
+    /*!
+     * \brief wait
+     * Waits for the end of the decode in progress (if any). The result is kept.
+     */
+    void wait()
+    {
+        if (m_task) {
+            m_task->wait();
+            m_task.reset();
+        }
+    }
+
+    /*!
+     * \brief isPending
+     * \return True if a frame is decoded, or was decoded and not taken yet.
+     */
+    bool isPending() const
+    {
+        return m_pending;
+    }
+
+    /*!
+     * \brief take
+     * Takes the frame \a key.
+     * \return Nothing if the frame \a key was not decoded ahead, otherwise the result of the decode
+     *         function (\a image is set only on success). Any other result is discarded.
+     */
+    std::optional<bool> take(qint64 key, QImage *image)
+    {
+        wait();
+        if (!m_pending || m_key != key) {
+            clear();
+            return std::nullopt;
+        }
+        const auto decoded = m_decoded;
+        if (decoded) {
+            *image = std::move(m_image);
+        }
+        clear();
+        return decoded;
+    }
+
+    /*!
+     * \brief clear
+     * Waits for the decode in progress and discards the result.
+     */
+    void clear()
+    {
+        wait();
+        m_pending = false;
+        m_decoded = false;
+        m_image = QImage();
+    }
+
+private:
+    std::unique_ptr<BackgroundTask> m_task;
+    bool m_pending = false;
+    qint64 m_key = -1;
+    bool m_decoded = false;
+    QImage m_image;
+};
+
+#endif // DECODEAHEAD_P_H
@@ -0,0 +1,139 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#ifndef DEVICEDATA_P_H
+#define DEVICEDATA_P_H
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QPointer>
+
+#include <algorithm>
+
+/*!
+ * \brief The DeviceData class
+ * Gives access to the content of a device, from the current position to the end, for the
+ * codecs that work on memory.
+ *
+ * The content is not copied when possible:
+ * - QFile: the file is mapped in memory (only the pages used by the codec are read);
+ * - QBuffer: the data of the buffer is shared;
+ * - other devices: the content is read with QIODevice::readAll().
+ *
+ * As with readAll(), the device position is moved to the end.
+ * \note The data of a mapped file is valid until the file is closed.
+ */
+class DeviceData
+{
+public:
+    DeviceData() = default;
+    DeviceData(const DeviceData &other) = delete;
+    DeviceData &operator=(const DeviceData &other) = delete;
+
+    ~DeviceData()
+    {
+        clear();
+    }
+
+    /*!
+     * \brief load
+     * Gives access to the content of \a device.
+     * \return True if some data is available.
+     */
+    bool load(QIODevice *device)
+    {
+        clear();
+        if (device == nullptr) {
+            return false;
+        }
+
+        const auto pos = device->pos();
+        if (!device->isSequential()) {
+            // QFile: memory map
+            if (auto file = qobject_cast<QFile *>(device)) {
+                const auto size = file->size() - pos;
+                if (size > 0) {
+                    if (auto map = file->map(pos, size)) {
+                        m_file = file;
+                        m_map = map;
+                        m_data = reinterpret_cast<const char *>(map);
+                        m_size = size;
+                        device->seek(pos + size);
+                        return true;
+                    }
+                }
+            }
+
+            // QBuffer: shallow copy
+            if (auto buffer = qobject_cast<QBuffer *>(device)) {
+                m_buffer = buffer->data();
+                if (pos >= 0 && pos < m_buffer.size()) {
+                    m_data = m_buffer.constData() + pos;
+                    m_size = m_buffer.size() - pos;
+                    device->seek(m_buffer.size());
+                    return true;
+                }
+                m_buffer.clear();
+            }
+        }
+
+        m_buffer = device->readAll();
+        m_data = m_buffer.constData();
+        m_size = m_buffer.size();
+        return m_size > 0;
+    }
+
+    /*!
+     * \brief clear
+     * Releases the data.
+     */
+    void clear()
+    {
+        if (m_map && m_file) {
+            m_file->unmap(m_map);
+        }
+        m_file.clear();
+        m_map = nullptr;
+        m_buffer.clear();
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const char *data() const
+    {
+        return m_data;
+    }
+
+    qint64 size() const
+    {
+        return m_size;
+    }
+
+    bool isEmpty() const
+    {
+        return m_size <= 0;
+    }
+
+    /*!
+     * \brief header
+     * \return The first \a size bytes (not copied).
+     */
+    QByteArray header(qint64 size) const
+    {
+        return QByteArray::fromRawData(m_data, qsizetype(std::min(size, m_size)));
+    }
+
+private:
+    QPointer<QFile> m_file;
+    uchar *m_map = nullptr;
+    QByteArray m_buffer;
+    const char *m_data = nullptr;
+    qint64 m_size = 0;
+};
+
+#endif // DEVICEDATA_P_H
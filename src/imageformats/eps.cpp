@@ -8,15 +8,17 @@
     SPDX-License-Identifier: LGPL-2.0-or-later
 */
 #include "eps_p.h"
+#include "threadpool_p.h"
+#include "util_p.h"
 
 #include <QCoreApplication>
 #include <QImage>
-#include <QImageReader>
+#include <QList>
 #include <QPainter>
-#include <QPrinter>
 #include <QProcess>
 #include <QStandardPaths>
-#include <QTemporaryFile>
+
+#include <algorithm>
 
 // logging category for this framework, default: log stuff >= warning
 Q_LOGGING_CATEGORY(EPSPLUGIN, "kf.imageformats.plugins.eps", QtWarningMsg)
@@ -114,6 +116,83 @@ static bool bbox(QIODevice *io, int *x1, int *y1, int *x2, int *y2)
     return ret;
 }
 
+static QString ghostscriptExecutable()
+{
+    // the PATH is searched once: it is expensive when many small files are read
+    static const QString gsExec = QStandardPaths::findExecutable(QStringLiteral("gs"));
+    return gsExec;
+}
+
+static bool waitForData(QProcess &process, qint64 size)
+{
+    while (process.bytesAvailable() < size) {
+        if (!process.waitForReadyRead(-1)) {
+            return process.bytesAvailable() >= size;
+        }
+    }
+    return true;
+}
+
+static bool readHeaderToken(QProcess &process, QByteArray &token)
+{
+    token.clear();
+    char c;
+    for (auto comment = false;;) {
+        if (!waitForData(process, 1) || !process.getChar(&c)) {
+            return false;
+        }
+        if (c == '#') {
+            comment = true;
+        } else if (c == '\n' || c == '\r') {
+            comment = false;
+        } else if (!comment && !isspace(uchar(c))) {
+            break;
+        }
+    }
+    // NOTE: the single whitespace after the token is consumed as required by the PPM header
+    while (token.size() < 16) {
+        token.append(c);
+        if (!waitForData(process, 1) || !process.getChar(&c)) {
+            return false;
+        }
+        if (isspace(uchar(c))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief readRaster
+ * Reads the raw PPM written by gs on its standard output into \a image (allocated with
+ * the expected size and format RGB888).
+ */
+static bool readRaster(QProcess &process, QImage &image)
+{
+    QByteArray magic;
+    QByteArray width;
+    QByteArray height;
+    QByteArray maxval;
+    if (!readHeaderToken(process, magic) || !readHeaderToken(process, width) || !readHeaderToken(process, height) || !readHeaderToken(process, maxval)) {
+        return false;
+    }
+    if (magic != "P6" || width.toInt() != image.width() || height.toInt() != image.height() || maxval.toInt() != 255) {
+        qCDebug(EPSPLUGIN) << "unexpected raster:" << magic << width << height << maxval;
+        return false;
+    }
+
+    const qint64 lineSize = qint64(image.width()) * 3;
+    for (auto y = 0, h = image.height(); y < h; ++y) {
+        if (!waitForData(process, lineSize)) {
+            return false;
+        }
+        if (process.read(reinterpret_cast<char *>(image.scanLine(y)), lineSize) != lineSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
 EPSHandler::EPSHandler()
 {
 }
@@ -157,35 +236,50 @@ bool EPSHandler::read(QImage *image)
         return false;
     }
 
-    QTemporaryFile tmpFile;
-    if (!tmpFile.open()) {
-        qCWarning(EPSPLUGIN) << "Could not create the temporary file" << tmpFile.fileName();
-        return false;
-    }
-    qCDebug(EPSPLUGIN) << "temporary file:" << tmpFile.fileName();
-
     // x1, y1 -> translation
     // x2, y2 -> new size
 
     x2 -= x1;
     y2 -= y1;
     qCDebug(EPSPLUGIN) << "origin point: " << x1 << "," << y1 << "  size:" << x2 << "," << y2;
-    double xScale = 1.0;
-    double yScale = 1.0;
+    if (x2 <= 0 || y2 <= 0) {
+        qCDebug(EPSPLUGIN) << "invalid bounding box!";
+        return false;
+    }
+
+    // PostScript units are points (1/72 inch): the scaled size is obtained with the resolution,
+    // so that small previews are rendered at small resolution (and not scaled afterwards)
     int wantedWidth = x2;
     int wantedHeight = y2;
+    double xResolution = 72.0;
+    double yResolution = 72.0;
+    if (m_scaledSize.isValid() && !m_scaledSize.isEmpty()) {
+        wantedWidth = m_scaledSize.width();
+        wantedHeight = m_scaledSize.height();
+        xResolution = 72.0 * wantedWidth / x2;
+        yResolution = 72.0 * wantedHeight / y2;
+    }
+
+    // the raster is read from the standard output, in an image allocated in advance
+    auto img = imageAlloc(wantedWidth, wantedHeight, QImage::Format_RGB888);
+    if (img.isNull()) {
+        qCWarning(EPSPLUGIN) << "Failed to allocate image, invalid size:" << wantedWidth << "x" << wantedHeight;
+        return false;
+    }
 
     // create GS command line
 
-    const QString gsExec = QStandardPaths::findExecutable(QStringLiteral("gs"));
+    const QString gsExec = ghostscriptExecutable();
     if (gsExec.isEmpty()) {
         qCWarning(EPSPLUGIN) << "Couldn't find gs exectuable (from GhostScript) in PATH.";
         return false;
     }
 
+    // NOTE: the output of the PostScript code (e.g. print) is sent to stderr to not corrupt the raster
     QStringList gsArgs;
-    gsArgs << QLatin1String("-sOutputFile=") + tmpFile.fileName() << QStringLiteral("-q") << QStringLiteral("-g%1x%2").arg(wantedWidth).arg(wantedHeight)
-           << QStringLiteral("-dSAFER") << QStringLiteral("-dPARANOIDSAFER") << QStringLiteral("-dNOPAUSE") << QStringLiteral("-sDEVICE=ppm")
+    gsArgs << QStringLiteral("-sOutputFile=-") << QStringLiteral("-sstdout=%stderr") << QStringLiteral("-q")
+           << QStringLiteral("-g%1x%2").arg(wantedWidth).arg(wantedHeight) << QStringLiteral("-r%1x%2").arg(xResolution).arg(yResolution)
+           << QStringLiteral("-dSAFER") << QStringLiteral("-dPARANOIDSAFER") << QStringLiteral("-dNOPAUSE") << QStringLiteral("-sDEVICE=ppmraw")
            << QStringLiteral("-c")
            << QStringLiteral(
                   "0 0 moveto "
@@ -199,6 +293,7 @@ bool EPSHandler::read(QImage *image)
 
     QProcess converter;
     converter.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    converter.setReadChannel(QProcess::StandardOutput);
     converter.start(gsExec, gsArgs);
     if (!converter.waitForStarted(3000)) {
         qCWarning(EPSPLUGIN) << "Reading EPS files requires gs (from GhostScript)";
@@ -206,9 +301,9 @@ bool EPSHandler::read(QImage *image)
     }
 
     QByteArray intro = "\n";
-    intro += QByteArray::number(-qRound(x1 * xScale));
+    intro += QByteArray::number(-x1);
     intro += " ";
-    intro += QByteArray::number(-qRound(y1 * yScale));
+    intro += QByteArray::number(-y1);
     intro += " translate\n";
     converter.write(intro);
 
@@ -236,73 +331,205 @@ bool EPSHandler::read(QImage *image)
     }
 
     converter.closeWriteChannel();
+
+    const bool ok = readRaster(converter, img);
     converter.waitForFinished(-1);
+    if (!ok) {
+        qCDebug(EPSPLUGIN) << "Reading failed: invalid raster from gs";
+        return false;
+    }
 
-    QImageReader ppmReader(tmpFile.fileName(), "ppm");
-    if (ppmReader.read(image)) {
-        qCDebug(EPSPLUGIN) << "success!";
+    *image = img;
+    qCDebug(EPSPLUGIN) << "success!";
 #ifdef EPS_PERFORMANCE_DEBUG
-        qCDebug(EPSPLUGIN) << "Loading EPS took " << (float)(dt.elapsed()) / 1000 << " seconds";
+    qCDebug(EPSPLUGIN) << "Loading EPS took " << (float)(dt.elapsed()) / 1000 << " seconds";
 #endif
-        return true;
-    } else {
-        qCDebug(EPSPLUGIN) << "Reading failed:" << ppmReader.errorString();
-        return false;
+    return true;
+}
+
+/*!
+ * \brief ascii85
+ * Encodes \a data with the PostScript ASCII85 encoding (without the EOD marker).
+ */
+static QByteArray ascii85(const QByteArray &data)
+{
+    QByteArray text;
+    text.reserve(data.size() / 4 * 5 + data.size() / 60 + 8);
+    auto src = reinterpret_cast<const uchar *>(data.constData());
+    qsizetype column = 0;
+    for (qsizetype i = 0, n = data.size(); i < n; i += 4) {
+        const auto count = std::min(qsizetype(4), n - i);
+        quint32 tuple = 0;
+        for (qsizetype j = 0; j < 4; ++j) {
+            tuple = (tuple << 8) | (j < count ? src[i + j] : 0);
+        }
+        if (tuple == 0 && count == 4) {
+            text.append('z');
+            ++column;
+        } else {
+            char group[5];
+            for (auto j = 4; j >= 0; --j) {
+                group[j] = char('!' + tuple % 85);
+                tuple /= 85;
+            }
+            text.append(group, count + 1);
+            column += count + 1;
+        }
+        // DSC lines are limited to 255 characters
+        if (column >= 75) {
+            text.append('\n');
+            column = 0;
+        }
+    }
+    return text;
+}
+
+/*!
+ * \brief encodeBand
+ * Compresses the \a height lines of \a image starting at \a y (Flate + ASCII85).
+ */
+static QByteArray encodeBand(const QImage &image, int y, int height)
+{
+    const qsizetype lineSize = qsizetype(image.width()) * (image.format() == QImage::Format_Grayscale8 ? 1 : 3);
+    QByteArray raw;
+    raw.reserve(lineSize * height);
+    for (auto i = 0; i < height; ++i) {
+        raw.append(reinterpret_cast<const char *>(image.constScanLine(y + i)), lineSize);
     }
+
+    // qCompress() prepends the uncompressed size to the zlib stream
+    auto zlib = qCompress(raw);
+    zlib.remove(0, 4);
+    return ascii85(zlib) + "~>\n";
 }
 
 bool EPSHandler::write(const QImage &image)
 {
-    QPrinter psOut(QPrinter::PrinterResolution);
-    QPainter p;
+    auto d = device();
+    if (d == nullptr || image.isNull()) {
+        return false;
+    }
 
-    QTemporaryFile tmpFile(QStringLiteral("XXXXXXXX.pdf"));
-    if (!tmpFile.open()) {
+    // EPS images have no transparency: the image is drawn on a white page
+    QImage img;
+    const auto gray = image.isGrayscale() && !image.hasAlphaChannel();
+    if (gray) {
+        img = image.convertToFormat(QImage::Format_Grayscale8);
+    } else if (image.hasAlphaChannel()) {
+        img = imageAlloc(image.size(), QImage::Format_RGB888);
+        if (img.isNull()) {
+            return false;
+        }
+        img.fill(Qt::white);
+        QPainter p(&img);
+        p.drawImage(QPoint(0, 0), image);
+    } else {
+        img = image.convertToFormat(QImage::Format_RGB888);
+    }
+    if (img.isNull()) {
         return false;
     }
 
-    psOut.setCreator(QStringLiteral("KDE EPS image plugin"));
-    psOut.setOutputFileName(tmpFile.fileName());
-    psOut.setOutputFormat(QPrinter::PdfFormat);
-    psOut.setFullPage(true);
-    const double multiplier = psOut.resolution() <= 0 ? 1.0 : 72.0 / psOut.resolution();
-    psOut.setPageSize(QPageSize(image.size() * multiplier, QPageSize::Point));
+    const auto width = QByteArray::number(img.width());
+    const auto height = QByteArray::number(img.height());
+
+    // one point per pixel, as the reader
+    QByteArray header;
+    header += "%!PS-Adobe-3.0 EPSF-3.0\n";
+    header += "%%Creator: KDE EPS image plugin\n";
+    header += "%%LanguageLevel: 3\n";
+    header += "%%BoundingBox: 0 0 " + width + " " + height + "\n";
+    header += "%%HiResBoundingBox: 0 0 " + width + " " + height + "\n";
+    header += "%%Pages: 1\n";
+    header += "%%EndComments\n";
+    header += "%%Page: 1 1\n";
+    header += "save\n";
+    header += "10 dict begin\n";
+    header += gray ? "/DeviceGray setcolorspace\n" : "/DeviceRGB setcolorspace\n";
+    if (d->write(header) != header.size()) {
+        return false;
+    }
 
-    // painting the pixmap to the "printer" which is a file
-    p.begin(&psOut);
-    p.drawImage(QPoint(0, 0), image);
-    p.end();
+    // The image is written in bands compressed concurrently. Each band is drawn with its own
+    // image operator: the remaining data of the filters (up to the EOD) is consumed by flushfile
+    // before the interpreter parses the next band.
+    const auto decode = gray ? QByteArrayLiteral("[0 1]") : QByteArrayLiteral("[0 1 0 1 0 1]");
+    const int bandHeight = 64;
+    const int bands = (img.height() + bandHeight - 1) / bandHeight;
+    const int threads = std::max(1, maxThreadCount());
+    QList<QByteArray> encoded(std::min(bands, threads * 2));
+    for (auto first = 0; first < bands; first += encoded.size()) {
+        const auto count = std::min(qsizetype(bands - first), encoded.size());
+        QAtomicInt next = 0;
+        auto data = encoded.data();
+        runConcurrently(std::min(qsizetype(threads), count), [&](int) {
+            for (int i; (i = next.fetchAndAddRelaxed(1)) < count;) {
+                const auto y = (first + i) * bandHeight;
+                data[i] = encodeBand(img, y, std::min(bandHeight, img.height() - y));
+            }
+        });
+
+        for (qsizetype i = 0; i < count; ++i) {
+            const auto y = (first + i) * bandHeight;
+            const auto h = QByteArray::number(std::min(bandHeight, img.height() - y));
+            QByteArray band;
+            band += "gsave\n";
+            band += "0 " + QByteArray::number(img.height() - y - h.toInt()) + " translate " + width + " " + h + " scale\n";
+            band += "/A currentfile /ASCII85Decode filter def\n";
+            band += "{ << /ImageType 1 /Width " + width + " /Height " + h + " /BitsPerComponent 8 /Decode " + decode;
+            band += " /ImageMatrix [" + width + " 0 0 -" + h + " 0 " + h + "] /DataSource A /FlateDecode filter >> image A flushfile } exec\n";
+            band += encoded.at(i);
+            band += "grestore\n";
+            if (d->write(band) != band.size()) {
+                return false;
+            }
+            encoded[i].clear();
+        }
+    }
 
-    QProcess converter;
-    converter.setProcessChannelMode(QProcess::ForwardedErrorChannel);
-    converter.setReadChannel(QProcess::StandardOutput);
+    const QByteArray trailer = "end\nrestore\nshowpage\n%%Trailer\n%%EOF\n";
+    return d->write(trailer) == trailer.size();
+}
 
-    // pdftops comes with Poppler and produces much smaller EPS files than GhostScript
-    QStringList pdftopsArgs;
-    pdftopsArgs << QStringLiteral("-eps") << tmpFile.fileName() << QStringLiteral("-");
-    qCDebug(EPSPLUGIN) << "Running pdftops with args" << pdftopsArgs;
-    converter.start(QStringLiteral("pdftops"), pdftopsArgs);
-
-    if (!converter.waitForStarted()) {
-        // GhostScript produces huge files, and takes a long time doing so
-        QStringList gsArgs;
-        gsArgs << QStringLiteral("-q") << QStringLiteral("-P-") << QStringLiteral("-dNOPAUSE") << QStringLiteral("-dBATCH") << QStringLiteral("-dSAFER")
-               << QStringLiteral("-sDEVICE=epswrite") << QStringLiteral("-sOutputFile=-") << QStringLiteral("-c") << QStringLiteral("save")
-               << QStringLiteral("pop") << QStringLiteral("-f") << tmpFile.fileName();
-        qCDebug(EPSPLUGIN) << "Failed to start pdftops; trying gs with args" << gsArgs;
-        converter.start(QStringLiteral("gs"), gsArgs);
-
-        if (!converter.waitForStarted(3000)) {
-            qCWarning(EPSPLUGIN) << "Creating EPS files requires pdftops (from Poppler) or gs (from GhostScript)";
-            return false;
+QVariant EPSHandler::option(ImageOption option) const
+{
+    if (option == ScaledSize) {
+        return m_scaledSize;
+    }
+    if (option == Size) {
+        // the bounding box is read without moving the device position
+        auto d = device();
+        if (d && !d->isSequential()) {
+            const auto pos = d->pos();
+            qint64 ps_offset;
+            qint64 ps_size;
+            int x1;
+            int y1;
+            int x2;
+            int y2;
+            QSize size;
+            if (seekToCodeStart(d, ps_offset, ps_size) && bbox(d, &x1, &y1, &x2, &y2) && x2 > x1 && y2 > y1) {
+                size = QSize(x2 - x1, y2 - y1);
+            }
+            d->seek(pos);
+            if (size.isValid()) {
+                return size;
+            }
         }
     }
+    return QVariant();
+}
 
-    while (converter.bytesAvailable() || (converter.state() == QProcess::Running && converter.waitForReadyRead(2000))) {
-        device()->write(converter.readAll());
+void EPSHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == ScaledSize) {
+        m_scaledSize = value.toSize();
     }
+}
 
-    return true;
+bool EPSHandler::supportsOption(ImageOption option) const
+{
+    return option == Size || option == ScaledSize;
 }
 
 bool EPSHandler::canRead(QIODevice *device)
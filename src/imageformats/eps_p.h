@@ -9,6 +9,7 @@
 
 #include <QImageIOPlugin>
 #include <QLoggingCategory>
+#include <QSize>
 
 class EPSHandler : public QImageIOHandler
 {
@@ -19,7 +20,14 @@ public:
     bool read(QImage *image) override;
     bool write(const QImage &image) override;
 
+    QVariant option(ImageOption option) const override;
+    void setOption(ImageOption option, const QVariant &value) override;
+    bool supportsOption(ImageOption option) const override;
+
     static bool canRead(QIODevice *device);
+
+private:
+    QSize m_scaledSize;
 };
 
 class EPSPlugin : public QImageIOPlugin
@@ -46,7 +46,7 @@
 /* *** EXR_LINES_PER_BLOCK ***
  * Allows certain compression schemes to work in multithreading
  * Requires up to "LINES_PER_BLOCK * MAX_IMAGE_WIDTH * 8"
- * additional RAM (e.g. if 128, up to 307MiB of RAM).
+ * additional RAM (e.g. if 128, up to 293MiB of RAM).
  * There is a performance gain with the following parameters (based on empirical tests):
  * - PIZ compression needs 64+ lines
  * - ZIPS compression needs 8+ lines
@@ -54,23 +54,57 @@
  * - Others not tested
  *
  * NOTE: The OpenEXR documentation states that the higher the better :)
+ *
+ * NOTE: The lines read or written at a time are chosen at runtime from the file
+ *       compression, the number of threads and QImageReader::allocationLimit()
+ *       (see linesPerBlock()). This is their maximum, except when a chunk of the
+ *       compression is larger: a block holds at least one chunk, so DWAB files
+ *       (256 lines per chunk) use up to 256 lines (586MiB of RAM at the maximum width).
  */
 #ifndef EXR_LINES_PER_BLOCK
 #define EXR_LINES_PER_BLOCK 128
 #endif
 
+/* *** EXR_DISABLE_CLAMPING ***
+ * If defined, the pixel values are not clamped to [0, 1] on read. When the file has RGB(A) channels
+ * with the same sampling of the image, the channels are read by Imf::InputFile directly into the
+ * QImage scanlines: half into RGBX/RGBA16FPx4 and float into RGBX/RGBA32FPx4 images.
+ * Otherwise, the image is read without clamping through Imf::RgbaInputFile as usual.
+ * NOTE: Only random access devices are read directly. If EXR_USE_LEGACY_CONVERSIONS is active, this is ignored.
+ */
+//#define EXR_DISABLE_CLAMPING // default commented -> you should define it in your cmake file
+
+/* *** EXR_DISABLE_PARALLEL_CONVERSION ***
+ * On write, the lines of each block are converted to Imf::Rgba by the threads of the shared
+ * thread pool (see threadpool_p.h), and the next block is converted while OpenEXR compresses and writes the current one.
+ * If you encounter problems you can convert them on the calling thread only by defining
+ * EXR_DISABLE_PARALLEL_CONVERSION.
+ */
+//#define EXR_DISABLE_PARALLEL_CONVERSION // default commented
+
+/* *** EXR_CONVERSION_BLOCK ***
+ * On write, the lines are converted by the ScanLineConverter in blocks of EXR_CONVERSION_BLOCK lines:
+ * the color transform is set up once per block instead of once per line.
+ */
+#ifndef EXR_CONVERSION_BLOCK
+#define EXR_CONVERSION_BLOCK 16
+#endif
+
 #include "exr_p.h"
 #include "scanlineconverter_p.h"
+#include "threadpool_p.h"
 #include "util_p.h"
 
 #include <IexThrowErrnoExc.h>
 #include <ImathBox.h>
 #include <ImfArray.h>
 #include <ImfBoxAttribute.h>
+#include <ImfChannelList.h>
 #include <ImfChannelListAttribute.h>
 #include <ImfCompressionAttribute.h>
 #include <ImfConvert.h>
 #include <ImfFloatAttribute.h>
+#include <ImfFrameBuffer.h>
 #include <ImfInputFile.h>
 #include <ImfInt64.h>
 #include <ImfIntAttribute.h>
@@ -78,9 +112,14 @@
 #include <ImfPreviewImage.h>
 #include <ImfRgbaFile.h>
 #include <ImfStandardAttributes.h>
+#include <ImfThreading.h>
+#include <ImfTiledRgbaFile.h>
 #include <ImfVersion.h>
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <memory>
 
 #include <QColorSpace>
 #include <QDataStream>
@@ -88,9 +127,12 @@
 #include <QFloat16>
 #include <QImage>
 #include <QImageIOPlugin>
+#include <QImageReader>
 #include <QLocale>
+#include <QSemaphore>
 #include <QThread>
 #include <QTimeZone>
+#include <QtEndian>
 
 // Allow the code to works on all QT versions supported by KDE
 // project (Qt 5.15 and Qt 6.x) to easy backports fixes.
@@ -104,6 +146,26 @@
 #define EXR_GRAY_SUPPORT_ENABLED
 #endif
 
+#if defined(EXR_DISABLE_CLAMPING) && !defined(EXR_USE_LEGACY_CONVERSIONS)
+#define EXR_NATIVE_READ_ENABLED
+#endif
+
+#ifdef EXR_NATIVE_READ_ENABLED
+/*!
+ * \brief clamp
+ * Clamps the values to [0, 1] only when EXR_DISABLE_CLAMPING is not defined.
+ */
+inline float clamp(float v)
+{
+    return v;
+}
+#else
+inline float clamp(float v)
+{
+    return qBound(0.f, v, 1.f);
+}
+#endif
+
 class K_IStream : public Imf::IStream
 {
 public:
@@ -221,7 +283,7 @@ inline unsigned char gamma(float x)
     x = std::pow(5.5555f * std::max(0.f, x), 0.4545f) * 84.66f;
     return (unsigned char)qBound(0.f, x, 255.f);
 }
-inline QRgb RgbaToQrgba(struct Imf::Rgba &imagePixel)
+inline QRgb RgbaToQrgba(const struct Imf::Rgba &imagePixel)
 {
     return qRgba(gamma(float(imagePixel.r)),
                  gamma(float(imagePixel.g)),
@@ -237,8 +299,10 @@ EXRHandler::EXRHandler()
     , m_imageCount(0)
     , m_startPos(-1)
 {
-    // Set the number of threads to use (0 is allowed)
-    Imf::setGlobalThreadCount(QThread::idealThreadCount() / 2);
+}
+
+EXRHandler::~EXRHandler()
+{
 }
 
 bool EXRHandler::canRead() const
@@ -250,8 +314,61 @@ bool EXRHandler::canRead() const
     return false;
 }
 
-static QImage::Format imageFormat(const Imf::RgbaInputFile &file)
+/*!
+ * \brief nativeFormat
+ * \param header The header of the file.
+ * \param layerName The name of the layer (view) to read.
+ * \return The format of the image that can be read directly from the file channels or
+ * QImage::Format_Invalid if the RGB(A) channels of the layer cannot be read directly.
+ */
+static QImage::Format nativeFormat(const Imf::Header &header, const std::string &layerName)
+{
+#ifdef EXR_NATIVE_READ_ENABLED
+    auto prefix = layerName.empty() ? std::string() : layerName + ".";
+    auto &&channels = header.channels();
+    auto r = channels.findChannel(prefix + "R");
+    auto g = channels.findChannel(prefix + "G");
+    auto b = channels.findChannel(prefix + "B");
+    auto a = channels.findChannel(prefix + "A");
+    if (r == nullptr || g == nullptr || b == nullptr) {
+        return QImage::Format_Invalid;
+    }
+
+    auto half = true;
+    for (auto &&c : {r, g, b, a}) {
+        if (c == nullptr) {
+            continue;
+        }
+        if (c->xSampling != 1 || c->ySampling != 1 || c->type == Imf::PixelType::UINT) {
+            return QImage::Format_Invalid;
+        }
+        half = half && c->type == Imf::PixelType::HALF;
+    }
+    if (half) {
+        return a ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBX16FPx4;
+    }
+    return a ? QImage::Format_RGBA32FPx4 : QImage::Format_RGBX32FPx4;
+#else
+    Q_UNUSED(header)
+    Q_UNUSED(layerName)
+    return QImage::Format_Invalid;
+#endif
+}
+
+/*!
+ * \brief layerName
+ * \return The name of the view \a imageNumber or an empty string if the file is not a multiview one.
+ */
+static std::string layerName(const Imf::Header &header, qint32 imageNumber);
+
+template<class T> // T is Imf::RgbaInputFile or Imf::TiledRgbaInputFile
+static QImage::Format imageFormat(const T &file, qint32 imageNumber = -1)
 {
+    auto native = nativeFormat(file.header(), layerName(file.header(), imageNumber));
+    if (native != QImage::Format_Invalid) {
+        return native;
+    }
+
     auto isRgba = file.channels() & Imf::RgbaChannels::WRITE_A;
 #ifdef EXR_GRAY_SUPPORT_ENABLED
     auto isGray = file.channels() & Imf::RgbaChannels::WRITE_Y;
@@ -283,6 +400,125 @@ static QStringList viewList(const Imf::Header &h)
     return l;
 }
 
+static std::string layerName(const Imf::Header &header, qint32 imageNumber)
+{
+    if (imageNumber > -1) {
+        auto views = viewList(header);
+        if (imageNumber < views.count()) {
+            return views.at(imageNumber).toStdString();
+        }
+    }
+    return {};
+}
+
+/*!
+ * \brief threadCount
+ * \return The number of threads to use for a file (0 means the caller thread only).
+ *
+ * The file tasks run on the OpenEXR global thread pool: the pool is only enlarged when
+ * needed so that the value set by the application is not overwritten.
+ */
+static int threadCount()
+{
+    auto count = maxThreadCount(QThread::idealThreadCount() / 2);
+    if (count > Imf::globalThreadCount()) {
+        Imf::setGlobalThreadCount(count);
+    }
+    return count;
+}
+
+/*!
+ * \brief linesPerBlock
+ * \param header The header of the file.
+ * \param threads The number of threads used by the file.
+ * \return The number of lines to read or write at a time.
+ *
+ * Each thread works on one chunk of lines: the block holds a chunk per thread, so compression
+ * schemes with big chunks (PIZ, DWAB, etc...) can decode in parallel. The block is limited to
+ * EXR_LINES_PER_BLOCK lines, or to one chunk when it is larger (DWAB), so that no chunk is decoded
+ * twice. Uncompressed and RLE files are I/O bound and are streamed with a small buffer.
+ */
+static qint32 linesPerBlock(const Imf::Header &header, qint32 threads)
+{
+    qint32 chunkLines = 32;
+    switch (header.compression()) {
+    case Imf::Compression::NO_COMPRESSION:
+    case Imf::Compression::RLE_COMPRESSION:
+        return std::min(16, EXR_LINES_PER_BLOCK);
+    case Imf::Compression::ZIPS_COMPRESSION:
+        chunkLines = 8; // single line chunks: 8+ lines per thread are faster (see EXR_LINES_PER_BLOCK)
+        break;
+    case Imf::Compression::ZIP_COMPRESSION:
+    case Imf::Compression::PXR24_COMPRESSION:
+        chunkLines = 16;
+        break;
+    case Imf::Compression::DWAB_COMPRESSION:
+        chunkLines = 256;
+        break;
+    default: // PIZ, B44(A), DWAA, etc...
+        break;
+    }
+
+    auto &&dw = header.dataWindow();
+    auto width = qint64(dw.max.x) - dw.min.x + 1;
+    qint64 lines = std::min(qint64(chunkLines) * std::max(1, threads), qint64(std::max(EXR_LINES_PER_BLOCK, chunkLines)));
+
+    // the buffer of Imf::Rgba pixels should not use more than a quarter of the allocation limit
+    if (auto limit = QImageReader::allocationLimit()) {
+        auto maxLines = (qint64(limit) * 1024 * 1024 / 4) / std::max(qint64(1), width * qint64(sizeof(Imf::Rgba)));
+        lines = std::min(lines, maxLines);
+    }
+    return qint32(std::max(qint64(1), lines));
+}
+
+/*!
+ * \brief The EXRCachedFile class
+ * The file opened on a random access device: the header (views, data window, channels
+ * and attributes) and the line offset table are parsed only once.
+ */
+class EXRCachedFile
+{
+public:
+    EXRCachedFile(QIODevice *dev, qint64 pos)
+        : device(dev)
+        , startPos(pos)
+        , stream(dev, QByteArray())
+        , file(stream, threadCount())
+        , views(viewList(file.header()))
+    {
+    }
+
+    QIODevice *device;
+    qint64 startPos;
+    K_IStream stream;
+    Imf::RgbaInputFile file;
+    QStringList views;
+};
+
+EXRCachedFile *EXRHandler::cachedFile() const
+{
+    auto d = device();
+    if (d == nullptr || d->isSequential()) {
+        return nullptr;
+    }
+    if (m_cachedFile && m_cachedFile->device == d && (m_startPos < 0 || m_cachedFile->startPos == m_startPos)) {
+        return m_cachedFile.data();
+    }
+
+    m_cachedFile.reset();
+    auto pos = d->pos();
+    auto startPos = m_startPos > -1 ? m_startPos : pos;
+    if (d->seek(startPos)) {
+        try {
+            m_cachedFile.reset(new EXRCachedFile(d, startPos));
+        } catch (const std::exception &) {
+            // broken file or unsupported version
+        }
+    }
+    d->seek(pos);
+    return m_cachedFile.data();
+}
+
 #ifdef QT_DEBUG
 void printAttributes(const Imf::Header &h)
 {
@@ -403,6 +639,181 @@ static void readColorSpace(const Imf::Header &header, QImage &image)
 #endif // !EXR_USE_LEGACY_CONVERSIONS
 }
 
+/*!
+ * \brief copyPixels
+ * Converts the first \a lines rows of \a pixels into the image starting from the line \a y.
+ */
+static void copyPixels(const Imf::Array2D<Imf::Rgba> &pixels, qint32 lines, qint32 y, QImage &image)
+{
+    auto width = image.width();
+    auto isRgba = image.hasAlphaChannel();
+    for (qint32 n = 0; n < lines; ++n) {
+        if (image.format() == QImage::Format_Grayscale16) { // grayscale image
+            auto scanLine = reinterpret_cast<quint16 *>(image.scanLine(y + n));
+            for (int x = 0; x < width; ++x) {
+                *(scanLine + x) = quint16(qBound(0.f, float(pixels[n][x].r) * 65535.f + 0.5f, 65535.f));
+            }
+            continue;
+        }
+#if defined(EXR_NATIVE_READ_ENABLED)
+        if (image.format() == QImage::Format_RGBA32FPx4 || image.format() == QImage::Format_RGBX32FPx4) { // see nativeFormat()
+            auto scanLine = reinterpret_cast<float *>(image.scanLine(y + n));
+            for (int x = 0; x < width; ++x) {
+                auto xcs = x * 4;
+                *(scanLine + xcs) = float(pixels[n][x].r);
+                *(scanLine + xcs + 1) = float(pixels[n][x].g);
+                *(scanLine + xcs + 2) = float(pixels[n][x].b);
+                *(scanLine + xcs + 3) = isRgba ? float(pixels[n][x].a) : 1.f;
+            }
+            continue;
+        }
+#endif
+#if defined(EXR_USE_LEGACY_CONVERSIONS)
+        Q_UNUSED(isRgba)
+        auto scanLine = reinterpret_cast<QRgb *>(image.scanLine(y + n));
+        for (int x = 0; x < width; ++x) {
+            *(scanLine + x) = RgbaToQrgba(pixels[n][x]);
+        }
+#elif defined(EXR_USE_QT6_FLOAT_IMAGE)
+        auto scanLine = reinterpret_cast<qfloat16 *>(image.scanLine(y + n));
+        for (int x = 0; x < width; ++x) {
+            auto xcs = x * 4;
+            *(scanLine + xcs) = qfloat16(clamp(float(pixels[n][x].r)));
+            *(scanLine + xcs + 1) = qfloat16(clamp(float(pixels[n][x].g)));
+            *(scanLine + xcs + 2) = qfloat16(clamp(float(pixels[n][x].b)));
+            *(scanLine + xcs + 3) = qfloat16(isRgba ? clamp(float(pixels[n][x].a)) : 1.f);
+        }
+#else
+        auto scanLine = reinterpret_cast<QRgba64 *>(image.scanLine(y + n));
+        for (int x = 0; x < width; ++x) {
+            *(scanLine + x) = QRgba64::fromRgba64(quint16(qBound(0.f, float(pixels[n][x].r) * 65535.f + 0.5f, 65535.f)),
+                                                  quint16(qBound(0.f, float(pixels[n][x].g) * 65535.f + 0.5f, 65535.f)),
+                                                  quint16(qBound(0.f, float(pixels[n][x].b) * 65535.f + 0.5f, 65535.f)),
+                                                  isRgba ? quint16(qBound(0.f, float(pixels[n][x].a) * 65535.f + 0.5f, 65535.f)) : quint16(65535));
+        }
+#endif
+    }
+}
+
+/*!
+ * \brief readNative
+ * Reads the RGB(A) channels of \a layerName directly into the image (see EXR_DISABLE_CLAMPING).
+ * \param format The image format returned by nativeFormat().
+ */
+static bool readNative(Imf::InputFile &file, const std::string &layerName, QImage::Format format, QImage &image)
+{
+    auto &&header = file.header();
+    Imath::Box2i dw = header.dataWindow();
+    qint32 width = dw.max.x - dw.min.x + 1;
+    qint32 height = dw.max.y - dw.min.y + 1;
+
+    // limiting the maximum image size on a reasonable size (as done in other plugins)
+    if (width > EXR_MAX_IMAGE_WIDTH || height > EXR_MAX_IMAGE_HEIGHT) {
+        qWarning() << "The maximum image size is limited to" << EXR_MAX_IMAGE_WIDTH << "x" << EXR_MAX_IMAGE_HEIGHT << "px";
+        return false;
+    }
+
+    image = imageAlloc(width, height, format);
+    if (image.isNull()) {
+        qWarning() << "Failed to allocate image, invalid size?" << QSize(width, height);
+        return false;
+    }
+
+    // The slices point to the scanlines: the library converts the channels to the type of the slices
+    // and fills the missing alpha channel with 1
+    auto half = format == QImage::Format_RGBA16FPx4 || format == QImage::Format_RGBX16FPx4;
+    auto type = half ? Imf::PixelType::HALF : Imf::PixelType::FLOAT;
+    size_t xs = half ? sizeof(qfloat16) * 4 : sizeof(float) * 4;
+    size_t ys = image.bytesPerLine();
+    auto base = reinterpret_cast<char *>(image.bits()) - qint64(dw.min.x) * xs - qint64(dw.min.y) * ys;
+    auto prefix = layerName.empty() ? std::string() : layerName + ".";
+    auto cs = xs / 4;
+
+    Imf::FrameBuffer fb;
+    fb.insert(prefix + "R", Imf::Slice(type, base, xs, ys));
+    fb.insert(prefix + "G", Imf::Slice(type, base + cs, xs, ys));
+    fb.insert(prefix + "B", Imf::Slice(type, base + cs * 2, xs, ys));
+    fb.insert(prefix + "A", Imf::Slice(type, base + cs * 3, xs, ys, 1, 1, 1.0));
+    file.setFrameBuffer(fb);
+    file.readPixels(dw.min.y, dw.max.y);
+
+    // set some useful metadata
+    readMetadata(header, image);
+    // final color operations
+    readColorSpace(header, image);
+
+    return true;
+}
+
+/*!
+ * \brief isTiled
+ * \return True if the device contains a single part tiled file.
+ */
+static bool isTiled(QIODevice *d)
+{
+    auto ba = d->peek(8);
+    if (ba.size() < 8) {
+        return false;
+    }
+    return Imf::isTiled(qFromLittleEndian<qint32>(ba.constData() + 4));
+}
+
+/*!
+ * \brief readLevel
+ * Reads the smallest level of a mipmap/ripmap tiled file that is at least \a size.
+ * \return False if only the full resolution level is at least \a size or on error.
+ */
+static bool readLevel(Imf::TiledRgbaInputFile &file, const QSize &size, QImage &image)
+{
+    int lx = 0;
+    int ly = 0;
+    if (file.levelMode() == Imf::LevelMode::MIPMAP_LEVELS) {
+        for (int l = 1; l < file.numLevels() && file.levelWidth(l) >= size.width() && file.levelHeight(l) >= size.height(); ++l) {
+            lx = ly = l;
+        }
+    } else if (file.levelMode() == Imf::LevelMode::RIPMAP_LEVELS) {
+        for (int l = 1; l < file.numXLevels() && file.levelWidth(l) >= size.width(); ++l) {
+            lx = l;
+        }
+        for (int l = 1; l < file.numYLevels() && file.levelHeight(l) >= size.height(); ++l) {
+            ly = l;
+        }
+    }
+    if (lx == 0 && ly == 0) {
+        return false;
+    }
+
+    Imath::Box2i dw = file.dataWindowForLevel(lx, ly);
+    qint32 width = dw.max.x - dw.min.x + 1;
+    qint32 height = dw.max.y - dw.min.y + 1;
+
+    image = imageAlloc(width, height, imageFormat(file));
+    if (image.isNull()) {
+        qWarning() << "Failed to allocate image, invalid size?" << QSize(width, height);
+        return false;
+    }
+
+    Imf::Array2D<Imf::Rgba> pixels;
+    pixels.resizeErase(height, width);
+    file.setFrameBuffer(&pixels[0][0] - dw.min.x - qint64(dw.min.y) * width, 1, width);
+    file.readTiles(0, file.numXTiles(lx) - 1, 0, file.numYTiles(ly) - 1, lx, ly);
+    copyPixels(pixels, height, 0, image);
+
+    return true;
+}
+
+/*!
+ * \brief scaledImage
+ * \return The \a image scaled to \a size if \a size is valid, otherwise \a image.
+ */
+static QImage scaledImage(const QImage &image, const QSize &size)
+{
+    if (!size.isValid() || size.isEmpty() || image.size() == size) {
+        return image;
+    }
+    return image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+}
+
 bool EXRHandler::read(QImage *outImage)
 {
     try {
@@ -417,17 +828,55 @@ bool EXRHandler::read(QImage *outImage)
             }
         }
 
-        K_IStream istr(d, QByteArray());
-        Imf::RgbaInputFile file(istr);
-        auto &&header = file.header();
+        // multi-resolution tiled files: when a scaled image is requested, the smallest level large enough is read
+        if (m_scaledSize.isValid() && !m_scaledSize.isEmpty() && !d->isSequential() && isTiled(d)) {
+            K_IStream istr(d, QByteArray());
+            Imf::TiledRgbaInputFile file(istr, threadCount());
+            auto layer = layerName(file.header(), m_imageNumber);
+            if (!layer.empty()) {
+                file.setLayerName(layer);
+            }
+            QImage image;
+            if (readLevel(file, m_scaledSize, image)) {
+                readMetadata(file.header(), image);
+                readColorSpace(file.header(), image);
+                *outImage = scaledImage(image, m_scaledSize);
+                return !outImage->isNull();
+            }
+            d->seek(m_startPos);
+        }
 
-        // set the image to load
-        if (m_imageNumber > -1) {
-            auto views = viewList(header);
-            if (m_imageNumber < views.count()) {
-                file.setLayerName(views.at(m_imageNumber).toStdString());
+#ifdef EXR_NATIVE_READ_ENABLED
+        if (!d->isSequential()) {
+            K_IStream istr(d, QByteArray());
+            Imf::InputFile file(istr, threadCount());
+            auto layer = layerName(file.header(), m_imageNumber);
+            auto format = nativeFormat(file.header(), layer);
+            if (format != QImage::Format_Invalid) {
+                QImage image;
+                if (!readNative(file, layer, format, image)) {
+                    return false;
+                }
+                *outImage = scaledImage(image, m_scaledSize);
+                return !outImage->isNull();
             }
+            d->seek(m_startPos);
         }
+#endif
+
+        // on random access devices the file is parsed only once: it is reused by all views
+        std::unique_ptr<K_IStream> istr;
+        std::unique_ptr<Imf::RgbaInputFile> tmp;
+        auto cache = cachedFile();
+        if (cache == nullptr) {
+            istr.reset(new K_IStream(d, QByteArray()));
+            tmp.reset(new Imf::RgbaInputFile(*istr, threadCount()));
+        }
+        auto &&file = cache ? cache->file : *tmp;
+        auto &&header = file.header();
+
+        // set the image to load
+        file.setLayerName(layerName(header, m_imageNumber));
 
         // get image info
         Imath::Box2i dw = file.dataWindow();
@@ -441,15 +890,15 @@ bool EXRHandler::read(QImage *outImage)
         }
 
         // creating the image
-        QImage image = imageAlloc(width, height, imageFormat(file));
+        QImage image = imageAlloc(width, height, imageFormat(file, m_imageNumber));
         if (image.isNull()) {
             qWarning() << "Failed to allocate image, invalid size?" << QSize(width, height);
             return false;
         }
 
+        auto blockLines = linesPerBlock(header, threadCount());
         Imf::Array2D<Imf::Rgba> pixels;
-        pixels.resizeErase(EXR_LINES_PER_BLOCK, width);
-        bool isRgba = image.hasAlphaChannel();
+        pixels.resizeErase(blockLines, width);
 
         // somehow copy pixels into image
         for (int y = 0, n = 0; y < height; y += n) {
@@ -459,41 +908,10 @@ bool EXRHandler::read(QImage *outImage)
             }
 
             file.setFrameBuffer(&pixels[0][0] - dw.min.x - qint64(my) * width, 1, width);
-            file.readPixels(my, std::min(my + EXR_LINES_PER_BLOCK - 1, dw.max.y));
+            file.readPixels(my, std::min(my + blockLines - 1, dw.max.y));
 
-            for (n = 0; n < std::min(EXR_LINES_PER_BLOCK, height - y); ++n) {
-                if (image.format() == QImage::Format_Grayscale16) { // grayscale image
-                    auto scanLine = reinterpret_cast<quint16 *>(image.scanLine(y + n));
-                    for (int x = 0; x < width; ++x) {
-                        *(scanLine + x) = quint16(qBound(0.f, float(pixels[n][x].r) * 65535.f + 0.5f, 65535.f));
-                    }
-                    continue;
-                }
-#if defined(EXR_USE_LEGACY_CONVERSIONS)
-                Q_UNUSED(isRgba)
-                auto scanLine = reinterpret_cast<QRgb *>(image.scanLine(y + n));
-                for (int x = 0; x < width; ++x) {
-                    *(scanLine + x) = RgbaToQrgba(pixels[n][x]);
-                }
-#elif defined(EXR_USE_QT6_FLOAT_IMAGE)
-                auto scanLine = reinterpret_cast<qfloat16 *>(image.scanLine(y + n));
-                for (int x = 0; x < width; ++x) {
-                    auto xcs = x * 4;
-                    *(scanLine + xcs) = qfloat16(qBound(0.f, float(pixels[n][x].r), 1.f));
-                    *(scanLine + xcs + 1) = qfloat16(qBound(0.f, float(pixels[n][x].g), 1.f));
-                    *(scanLine + xcs + 2) = qfloat16(qBound(0.f, float(pixels[n][x].b), 1.f));
-                    *(scanLine + xcs + 3) = qfloat16(isRgba ? qBound(0.f, float(pixels[n][x].a), 1.f) : 1.f);
-                }
-#else
-                auto scanLine = reinterpret_cast<QRgba64 *>(image.scanLine(y + n));
-                for (int x = 0; x < width; ++x) {
-                    *(scanLine + x) = QRgba64::fromRgba64(quint16(qBound(0.f, float(pixels[n][x].r) * 65535.f + 0.5f, 65535.f)),
-                                                          quint16(qBound(0.f, float(pixels[n][x].g) * 65535.f + 0.5f, 65535.f)),
-                                                          quint16(qBound(0.f, float(pixels[n][x].b) * 65535.f + 0.5f, 65535.f)),
-                                                          isRgba ? quint16(qBound(0.f, float(pixels[n][x].a) * 65535.f + 0.5f, 65535.f)) : quint16(65535));
-                }
-#endif
-            }
+            n = std::min(blockLines, height - y);
+            copyPixels(pixels, n, y, image);
         }
 
         // set some useful metadata
@@ -501,9 +919,9 @@ bool EXRHandler::read(QImage *outImage)
         // final color operations
         readColorSpace(header, image);
 
-        *outImage = image;
+        *outImage = scaledImage(image, m_scaledSize);
 
-        return true;
+        return !outImage->isNull();
     } catch (const std::exception &) {
         return false;
     }
@@ -608,6 +1026,100 @@ static void setMetadata(const QImage &image, Imf::Header &header)
     // TODO: EXR 3.2 attributes (see readMetadata())
 }
 
+/*!
+ * \brief convertLine
+ * Converts the \a width pixels of \a scanLine (converted by a ScanLineConverter) to \a pixels.
+ */
+static void convertLine(const uchar *scanLine, qint32 width, Imf::Rgba *pixels)
+{
+#if defined(EXR_USE_QT6_FLOAT_IMAGE)
+    auto line = reinterpret_cast<const qfloat16 *>(scanLine);
+    for (int x = 0; x < width; ++x) {
+        auto xcs = x * 4;
+        pixels[x].r = float(*(line + xcs));
+        pixels[x].g = float(*(line + xcs + 1));
+        pixels[x].b = float(*(line + xcs + 2));
+        pixels[x].a = float(*(line + xcs + 3));
+    }
+#else
+    auto line = reinterpret_cast<const QRgba64 *>(scanLine);
+    for (int x = 0; x < width; ++x) {
+        pixels[x].r = float((line + x)->red() / 65535.f);
+        pixels[x].g = float((line + x)->green() / 65535.f);
+        pixels[x].b = float((line + x)->blue() / 65535.f);
+        pixels[x].a = float((line + x)->alpha() / 65535.f);
+    }
+#endif
+}
+
+#ifndef EXR_DISABLE_PARALLEL_CONVERSION
+static constexpr bool parallelConversion = true;
+#else
+static constexpr bool parallelConversion = false;
+#endif
+
+/*!
+ * \brief convertBlocks
+ * Converts the lines [\a first, \a first + \a lines) of \a image, starting from line \a y, to \a pixels.
+ * The lines are converted in blocks of EXR_CONVERSION_BLOCK lines with the block API of \a conv.
+ * \return False on error.
+ */
+static bool convertBlocks(const QImage &image, ScanLineConverter &conv, qint32 y, qint32 first, qint32 lines, Imf::Array2D<Imf::Rgba> &pixels, QByteArray &buffer)
+{
+    const auto width = image.width();
+    const auto bpl = conv.targetBytesPerLine(width);
+    const auto block = std::min(lines, qint32(EXR_CONVERSION_BLOCK));
+    if (buffer.size() < bpl * block) {
+        buffer.resize(bpl * block);
+    }
+    auto data = reinterpret_cast<uchar *>(buffer.data());
+    for (qint32 n = 0; n < lines; n += block) {
+        const auto count = std::min(block, lines - n);
+        if (!conv.convertScanLines(image, y + first + n, count, data, bpl)) {
+            return false;
+        }
+        for (qint32 i = 0; i < count; ++i) {
+            convertLine(data + i * bpl, width, pixels[first + n + i]);
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief convertLines
+ * Converts the \a lines of \a image starting from line \a y to the first lines of \a pixels.
+ * The blocks of lines are converted concurrently (unless EXR_DISABLE_PARALLEL_CONVERSION is defined):
+ * each thread has its own copy of the converter \a slc.
+ * \return False on error.
+ */
+static bool convertLines(const QImage &image, const ScanLineConverter &slc, qint32 y, qint32 lines, Imf::Array2D<Imf::Rgba> &pixels)
+{
+#ifndef EXR_DISABLE_PARALLEL_CONVERSION
+    const auto blocks = (lines + EXR_CONVERSION_BLOCK - 1) / EXR_CONVERSION_BLOCK;
+    const auto threads = std::min(maxThreadCount(), blocks);
+    if (threads > 1) {
+        QAtomicInt nextBlock = 0;
+        QAtomicInt failed = 0;
+        runConcurrently(threads, [&](int) {
+            ScanLineConverter conv(slc);
+            QByteArray buffer;
+            for (auto n = nextBlock.fetchAndAddRelaxed(1); n < blocks && !failed.loadRelaxed(); n = nextBlock.fetchAndAddRelaxed(1)) {
+                const auto first = n * EXR_CONVERSION_BLOCK;
+                if (!convertBlocks(image, conv, y, first, std::min(lines - first, EXR_CONVERSION_BLOCK), pixels, buffer)) {
+                    failed.storeRelaxed(1);
+                    break;
+                }
+            }
+        });
+        return !failed.loadRelaxed();
+    }
+#endif
+
+    ScanLineConverter conv(slc);
+    QByteArray buffer;
+    return convertBlocks(image, conv, y, 0, lines, pixels, buffer);
+}
+
 bool EXRHandler::write(const QImage &image)
 {
     try {
@@ -654,9 +1166,11 @@ bool EXRHandler::write(const QImage &image)
             image.format() == QImage::Format_Grayscale8) {
             channelsType = Imf::RgbaChannels::WRITE_Y;
         }
-        Imf::RgbaOutputFile file(ostr, header, channelsType);
+        auto threads = threadCount();
+        Imf::RgbaOutputFile file(ostr, header, channelsType, threads);
+        auto blockLines = linesPerBlock(header, threads);
         Imf::Array2D<Imf::Rgba> pixels;
-        pixels.resizeErase(EXR_LINES_PER_BLOCK, width);
+        pixels.resizeErase(blockLines, width);
 
         // convert the image and write into the stream
 #if defined(EXR_USE_QT6_FLOAT_IMAGE)
@@ -676,35 +1190,38 @@ bool EXRHandler::write(const QImage &image)
 #endif
 
         slc.setTargetColorSpace(QColorSpace(QColorSpace::SRgbLinear));
-        for (int y = 0, n = 0; y < height; y += n) {
-            for (n = 0; n < std::min(EXR_LINES_PER_BLOCK, height - y); ++n) {
-#if defined(EXR_USE_QT6_FLOAT_IMAGE)
-                auto scanLine = reinterpret_cast<const qfloat16 *>(slc.convertedScanLine(image, y + n));
-                if (scanLine == nullptr) {
-                    return false;
-                }
-                for (int x = 0; x < width; ++x) {
-                    auto xcs = x * 4;
-                    pixels[n][x].r = float(*(scanLine + xcs));
-                    pixels[n][x].g = float(*(scanLine + xcs + 1));
-                    pixels[n][x].b = float(*(scanLine + xcs + 2));
-                    pixels[n][x].a = float(*(scanLine + xcs + 3));
-                }
-#else
-                auto scanLine = reinterpret_cast<const QRgba64 *>(slc.convertedScanLine(image, y + n));
-                if (scanLine == nullptr) {
-                    return false;
-                }
-                for (int x = 0; x < width; ++x) {
-                    pixels[n][x].r = float((scanLine + x)->red() / 65535.f);
-                    pixels[n][x].g = float((scanLine + x)->green() / 65535.f);
-                    pixels[n][x].b = float((scanLine + x)->blue() / 65535.f);
-                    pixels[n][x].a = float((scanLine + x)->alpha() / 65535.f);
-                }
-#endif
-            }
-            file.setFrameBuffer(&pixels[0][0] - qint64(y) * width, 1, width);
+
+        // double buffering: the next block is converted while the current one is written
+        Imf::Array2D<Imf::Rgba> nextPixels;
+        if (blockLines < height) {
+            nextPixels.resizeErase(blockLines, width);
+        }
+        auto current = &pixels;
+        auto next = &nextPixels;
+        auto n = std::min(blockLines, height);
+        if (!convertLines(image, slc, 0, n, *current)) {
+            return false;
+        }
+        for (int y = 0; y < height;) {
+            auto nextY = y + n;
+            auto nextN = std::min(blockLines, height - nextY);
+            auto converted = true;
+            BackgroundTask task(
+                [&]() {
+                    if (nextN > 0) {
+                        converted = convertLines(image, slc, nextY, nextN, *next);
+                    }
+                },
+                parallelConversion);
+            file.setFrameBuffer(&(*current)[0][0] - qint64(y) * width, 1, width);
             file.writePixels(n);
+            task.wait();
+            if (!converted) {
+                return false;
+            }
+            std::swap(current, next);
+            y = nextY;
+            n = nextN;
         }
     } catch (const std::exception &) {
         return false;
@@ -729,6 +1246,9 @@ void EXRHandler::setOption(ImageOption option, const QVariant &value)
             m_quality = q;
         }
     }
+    if (option == QImageIOHandler::ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
 }
 
 bool EXRHandler::supportsOption(ImageOption option) const
@@ -747,6 +1267,9 @@ bool EXRHandler::supportsOption(ImageOption option) const
     if (option == QImageIOHandler::Quality) {
         return true;
     }
+    if (option == QImageIOHandler::ScaledSize) {
+        return true;
+    }
     return false;
 }
 
@@ -757,19 +1280,18 @@ QVariant EXRHandler::option(ImageOption option) const
     if (option == QImageIOHandler::Size) {
         if (auto d = device()) {
             // transactions works on both random and sequential devices
+            if (auto cache = cachedFile()) {
+                Imath::Box2i dw = cache->file.dataWindow();
+                return QVariant(QSize(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1));
+            }
             d->startTransaction();
             if (m_startPos > -1) {
                 d->seek(m_startPos);
             }
             try {
                 K_IStream istr(d, QByteArray());
-                Imf::RgbaInputFile file(istr);
-                if (m_imageNumber > -1) { // set the image to read
-                    auto views = viewList(file.header());
-                    if (m_imageNumber < views.count()) {
-                        file.setLayerName(views.at(m_imageNumber).toStdString());
-                    }
-                }
+                Imf::RgbaInputFile file(istr, threadCount());
+                file.setLayerName(layerName(file.header(), m_imageNumber));
                 Imath::Box2i dw = file.dataWindow();
                 v = QVariant(QSize(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1));
             } catch (const std::exception &) {
@@ -782,14 +1304,19 @@ QVariant EXRHandler::option(ImageOption option) const
     if (option == QImageIOHandler::ImageFormat) {
         if (auto d = device()) {
             // transactions works on both random and sequential devices
+            if (auto cache = cachedFile()) {
+                cache->file.setLayerName(layerName(cache->file.header(), m_imageNumber));
+                return QVariant::fromValue(imageFormat(cache->file, m_imageNumber));
+            }
             d->startTransaction();
             if (m_startPos > -1) {
                 d->seek(m_startPos);
             }
             try {
                 K_IStream istr(d, QByteArray());
-                Imf::RgbaInputFile file(istr);
-                v = QVariant::fromValue(imageFormat(file));
+                Imf::RgbaInputFile file(istr, threadCount());
+                file.setLayerName(layerName(file.header(), m_imageNumber));
+                v = QVariant::fromValue(imageFormat(file, m_imageNumber));
             } catch (const std::exception &) {
                 // broken file or unsupported version
             }
@@ -805,6 +1332,10 @@ QVariant EXRHandler::option(ImageOption option) const
         v = QVariant(m_quality);
     }
 
+    if (option == QImageIOHandler::ScaledSize) {
+        v = QVariant(m_scaledSize);
+    }
+
     return v;
 }
 
@@ -832,12 +1363,19 @@ int EXRHandler::imageCount() const
 
     count = QImageIOHandler::imageCount();
 
+    if (auto cache = cachedFile()) {
+        if (!cache->views.isEmpty()) {
+            count = cache->views.size();
+        }
+        return count;
+    }
+
     auto d = device();
     d->startTransaction();
 
     try {
         K_IStream istr(d, QByteArray());
-        Imf::RgbaInputFile file(istr);
+        Imf::RgbaInputFile file(istr, threadCount());
         auto views = viewList(file.header());
         if (!views.isEmpty()) {
             count = views.size();
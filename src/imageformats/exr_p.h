@@ -11,6 +11,9 @@
 #define KIMG_EXR_P_H
 
 #include <QImageIOPlugin>
+#include <QScopedPointer>
+
+class EXRCachedFile;
 
 /*!
  * \brief The EXRHandler class
@@ -30,6 +33,8 @@
  * - Size: The size of the image.
  * - CompressionRatio: The compression ratio of the image data (see OpenEXR compression schemes).
  * - Quality: The quality level of the image (see OpenEXR compression level of lossy codecs).
+ * - ScaledSize: The size of the image to read. Of the tiled files with mipmap/ripmap levels, the smallest level
+ *               not smaller than the requested size is read.
  *
  * The following metadata are set/get via QImage::setText()/QImage::text() in both read/write (if any):
  * - Latitude, Longitude, Altitude: Geographic coordinates (Float converted to string).
@@ -47,6 +52,8 @@
  *                        The higher the value, the greater the parallelization but the RAM consumption increases (default: 128)
  * - EXR_USE_LEGACY_CONVERSIONS: The result image is an 8-bit RGB(A) converted without icc profiles (read, default: undefined).
  * - EXR_CONVERT_TO_SRGB: The resulting image is convertef in the sRGB color space (read, default: undefined).
+ * - EXR_DISABLE_CLAMPING: The pixel values are not clamped to [0, 1] and, when possible, the RGB(A) channels are read\n
+ *                         directly into a float16/float32 image (read, default: undefined).
  * - EXR_DISABLE_XMP_ATTRIBUTE: Disable the stores of XMP values in a non-standard attribute named "xmp".\n
  *                              The QImage metadata used is "XML:com.adobe.xmp" (write, default: undefined).
  */
@@ -54,6 +61,7 @@ class EXRHandler : public QImageIOHandler
 {
 public:
     EXRHandler();
+    ~EXRHandler() override;
 
     bool canRead() const override;
     bool read(QImage *outImage) override;
@@ -71,6 +79,13 @@ public:
     static bool canRead(QIODevice *device);
 
 private:
+    /*!
+     * \brief cachedFile
+     * Opens the file on the current device once.
+     * \return The opened file or nullptr on sequential devices and on error.
+     */
+    EXRCachedFile *cachedFile() const;
+
     /*!
      * \brief m_compressionRatio
      * Value set by QImageWriter::setCompression().
@@ -116,6 +131,18 @@ private:
      * The initial device position to allow multi image load (cache value).
      */
     qint64 m_startPos;
+
+    /*!
+     * \brief m_scaledSize
+     * Value set by QImageReader::setScaledSize().
+     */
+    QSize m_scaledSize;
+
+    /*!
+     * \brief m_cachedFile
+     * The file parsed on the first access to a random access device (cache value).
+     */
+    mutable QScopedPointer<EXRCachedFile> m_cachedFile;
 };
 
 class EXRPlugin : public QImageIOPlugin
@@ -7,10 +7,11 @@
 */
 
 #include "hdr_p.h"
+#include "scanlineconverter_p.h"
+#include "threadpool_p.h"
 #include "util_p.h"
 
 #include <QColorSpace>
-#include <QDataStream>
 #include <QFloat16>
 #include <QImage>
 #include <QLoggingCategory>
@@ -18,11 +19,22 @@
 
 #include <QDebug>
 
+#include <algorithm>
+#include <cstring>
+
 /* *** HDR_HALF_QUALITY ***
  * If defined, a 16-bits float image is created, otherwise a 32-bits float ones (default).
  */
 //#define HDR_HALF_QUALITY // default commented -> you should define it in your cmake file
 
+/* *** HDR_ENCODING_BAND ***
+ * On write, the rows are converted to float and encoded in bands of HDR_ENCODING_BAND rows:
+ * the rows of a band are encoded by the threads of the shared thread pool (see threadpool_p.h).
+ */
+#ifndef HDR_ENCODING_BAND
+#define HDR_ENCODING_BAND 64
+#endif
+
 typedef unsigned char uchar;
 
 Q_LOGGING_CATEGORY(HDRPLUGIN, "kf.imageformats.plugins.hdr", QtWarningMsg)
@@ -32,24 +44,93 @@ namespace // Private.
 #define MAXLINE 1024
 #define MINELEN 8 // minimum scanline length for encoding
 #define MAXELEN 0x7fff // maximum scanline length for encoding
+#define MINRUN 4 // minimum run length
+
+/*!
+ * \brief The HDRReader class
+ * Reads the device in blocks so that the scanlines are decoded from memory.
+ */
+class HDRReader
+{
+public:
+    HDRReader(QIODevice *device)
+        : m_device(device)
+    {
+    }
+
+    /*!
+     * \brief fill
+     * Makes at least \a n bytes available in the buffer.
+     * \return False if the device has fewer bytes.
+     */
+    bool fill(qsizetype n)
+    {
+        if (m_buffer.size() - m_pos >= n) {
+            return true;
+        }
+        m_buffer.remove(0, m_pos);
+        m_pos = 0;
+        while (m_buffer.size() < n) {
+            auto block = m_device->read(std::max(n - m_buffer.size(), qsizetype(BLOCK_SIZE)));
+            if (block.isEmpty()) {
+                return false;
+            }
+            m_buffer.append(block);
+        }
+        return true;
+    }
+
+    /*!
+     * \brief data
+     * \return The pointer to the available bytes.
+     */
+    const uchar *data() const
+    {
+        return reinterpret_cast<const uchar *>(m_buffer.constData()) + m_pos;
+    }
+
+    /*!
+     * \brief skip
+     * Consumes \a n bytes (they must be available).
+     */
+    void skip(qsizetype n)
+    {
+        m_pos += n;
+    }
+
+    /*!
+     * \brief getChar
+     * \return The next byte or -1 at the end of the device.
+     */
+    int getChar()
+    {
+        if (!fill(1)) {
+            return -1;
+        }
+        return m_buffer.at(m_pos++) & 0xFF;
+    }
+
+private:
+    static constexpr qsizetype BLOCK_SIZE = 64 * 1024;
+
+    QIODevice *m_device;
+    QByteArray m_buffer;
+    qsizetype m_pos = 0;
+};
 
 // read an old style line from the hdr image file
-// if 'first' is true the first byte is already read
-static bool Read_Old_Line(uchar *image, int width, QDataStream &s)
+static bool Read_Old_Line(uchar *image, int width, HDRReader &r)
 {
     int rshift = 0;
     int i;
 
     uchar *start = image;
     while (width > 0) {
-        s >> image[0];
-        s >> image[1];
-        s >> image[2];
-        s >> image[3];
-
-        if (s.atEnd()) {
+        if (!r.fill(4)) {
             return false;
         }
+        std::memcpy(image, r.data(), 4);
+        r.skip(4);
 
         if ((image[0] == 1) && (image[1] == 1) && (image[2] == 1)) {
             // NOTE: we don't have an image sample that cover this code
@@ -75,29 +156,180 @@ static bool Read_Old_Line(uchar *image, int width, QDataStream &s)
     return true;
 }
 
+/*!
+ * \brief The RGBEScale struct
+ * The scale of the RGB components for each exponent (ldexp(1, e - 128) / 255).
+ */
+struct RGBEScale {
+    RGBEScale()
+    {
+        for (int e = 0; e < 256; ++e) {
+            // exponents are limited to [-31, 31] as in previous versions: the powers of two are exact
+            auto exp = qBound(-31, e - 128, 31);
+            auto bits = quint32(exp + 127) << 23;
+            float v;
+            std::memcpy(&v, &bits, sizeof(v));
+            scale[e] = v / 255.0f;
+        }
+    }
+    float scale[256];
+};
+
 template<class float_T>
-void RGBE_To_QRgbLine(uchar *image, float_T *scanline, int width)
+void RGBE_To_QRgbLine(const uchar *image, float_T *scanline, int width)
 {
+    static const RGBEScale rgbe;
+    // branchless loop: it can be vectorized by the compiler
     for (int j = 0; j < width; j++) {
-        // v = ldexp(1.0, int(image[3]) - 128);
-        float v;
-        int e = qBound(-31, int(image[3]) - 128, 31);
-        if (e > 0) {
-            v = float(1 << e);
-        } else {
-            v = 1.0f / float(1 << -e);
+        auto j4 = j * 4;
+        auto vn = rgbe.scale[image[j4 + 3]];
+        scanline[j4] = float_T(std::min(float(image[j4]) * vn, 1.0f));
+        scanline[j4 + 1] = float_T(std::min(float(image[j4 + 1]) * vn, 1.0f));
+        scanline[j4 + 2] = float_T(std::min(float(image[j4 + 2]) * vn, 1.0f));
+        scanline[j4 + 3] = float_T(1.0f);
+    }
+}
+
+/*!
+ * \brief Read_RLE_Line
+ * Decodes the four run length encoded components of a new style line from memory.
+ * \return False if the file is truncated.
+ */
+static bool Read_RLE_Line(uchar *image, int width, HDRReader &r)
+{
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < width;) {
+            // the code and, for runs, the value
+            if (!r.fill(2)) {
+                qCDebug(HDRPLUGIN) << "Truncated HDR file";
+                return false;
+            }
+            auto src = r.data();
+            int code = src[0];
+            if (code > 128) {
+                // run
+                code &= 127;
+                auto val = src[1];
+                r.skip(2);
+                auto end = j + code;
+                for (auto last = std::min(end, width); j < last; j++) {
+                    image[i + j * 4] = val;
+                }
+                j = end;
+            } else {
+                // non-run
+                r.skip(1);
+                if (!r.fill(code)) {
+                    qCDebug(HDRPLUGIN) << "Truncated HDR file";
+                    return false;
+                }
+                src = r.data();
+                for (int k = 0; k < code; ++k, ++j) {
+                    if (j < width) {
+                        image[i + j * 4] = src[k];
+                    }
+                }
+                r.skip(code);
+            }
         }
+    }
+    return true;
+}
 
+/*!
+ * \brief QRgbLine_To_RGBE
+ * Converts the \a width RGBX float pixels of \a scanline to RGBE pixels (the inverse of RGBE_To_QRgbLine).
+ *
+ * The exponent is taken from the bits of the largest component so the loop is branchless
+ * and can be vectorized by the compiler (the result is the same of frexp()).
+ */
+static void QRgbLine_To_RGBE(const float *scanline, uchar *image, int width)
+{
+    // 2^127 is not representable as an exponent: the larger values are clamped
+    constexpr float maxValue = 1.0e38f;
+    constexpr float minValue = 1.0e-32f;
+    for (int j = 0; j < width; j++) {
         auto j4 = j * 4;
-        auto vn = v / 255.0f;
-        scanline[j4] = float_T(std::min(float(image[0]) * vn, 1.0f));
-        scanline[j4 + 1] = float_T(std::min(float(image[1]) * vn, 1.0f));
-        scanline[j4 + 2] = float_T(std::min(float(image[2]) * vn, 1.0f));
-        scanline[j4 + 3] = float_T(1.0f);
-        image += 4;
+        // negative and NaN components are written as 0
+        auto r = std::min(std::max(0.0f, scanline[j4]), maxValue);
+        auto g = std::min(std::max(0.0f, scanline[j4 + 1]), maxValue);
+        auto b = std::min(std::max(0.0f, scanline[j4 + 2]), maxValue);
+        auto v = std::max(r, std::max(g, b));
+        auto zero = v < minValue;
+
+        // v = m * 2^e with m in [0.5, 1)
+        quint32 bits;
+        auto ve = std::max(v, minValue);
+        std::memcpy(&bits, &ve, sizeof(bits));
+        auto e = qint32(bits >> 23) - 126;
+
+        // the components are scaled by 256 / 2^e
+        auto scaleBits = quint32(127 + 8 - e) << 23;
+        float scale;
+        std::memcpy(&scale, &scaleBits, sizeof(scale));
+
+        scale = zero ? 0.0f : scale;
+        e = zero ? -128 : e;
+
+        image[j4] = uchar(qint32(r * scale));
+        image[j4 + 1] = uchar(qint32(g * scale));
+        image[j4 + 2] = uchar(qint32(b * scale));
+        image[j4 + 3] = uchar(e + 128);
     }
 }
 
+/*!
+ * \brief Write_RLE_Line
+ * Encodes the four components of the \a width RGBE pixels of \a image as a new style line.
+ * \param out The output buffer: it must have room for RLELineBound(width) bytes.
+ * \return The end of the encoded data.
+ */
+static uchar *Write_RLE_Line(const uchar *image, int width, uchar *out)
+{
+    *out++ = 2;
+    *out++ = 2;
+    *out++ = uchar(width >> 8);
+    *out++ = uchar(width & 0xFF);
+    for (int i = 0; i < 4; i++) {
+        auto comp = image + i;
+        for (int j = 0; j < width;) {
+            // look for the next run
+            int beg = j;
+            int cnt = 1;
+            for (; beg < width; beg += cnt) {
+                for (cnt = 1; cnt < 127 && beg + cnt < width && comp[(beg + cnt) * 4] == comp[beg * 4]; ++cnt) { }
+                if (cnt >= MINRUN) {
+                    break;
+                }
+            }
+            // non-run bytes before the run
+            while (j < beg) {
+                auto n = std::min(128, beg - j);
+                *out++ = uchar(n);
+                for (auto last = j + n; j < last; ++j) {
+                    *out++ = comp[j * 4];
+                }
+            }
+            // run
+            if (cnt >= MINRUN) {
+                *out++ = uchar(128 + cnt);
+                *out++ = comp[beg * 4];
+                j += cnt;
+            }
+        }
+    }
+    return out;
+}
+
+/*!
+ * \brief RLELineBound
+ * \return The maximum size of a line of \a width pixels encoded by Write_RLE_Line().
+ */
+static qsizetype RLELineBound(int width)
+{
+    return 4 + 4 * (qsizetype(width) + width / 128 + 1);
+}
+
 QImage::Format imageFormat()
 {
 #ifdef HDR_HALF_QUALITY
@@ -108,11 +340,8 @@ QImage::Format imageFormat()
 }
 
 // Load the HDR image.
-static bool LoadHDR(QDataStream &s, const int width, const int height, QImage &img)
+static bool LoadHDR(QIODevice *device, const int width, const int height, QImage &img)
 {
-    uchar val;
-    uchar code;
-
     // Create dst image.
     img = imageAlloc(width, height, imageFormat());
     if (img.isNull()) {
@@ -124,6 +353,7 @@ static bool LoadHDR(QDataStream &s, const int width, const int height, QImage &i
     lineArray.resize(4 * width);
     uchar *image = reinterpret_cast<uchar *>(lineArray.data());
 
+    HDRReader r(device);
     for (int cline = 0; cline < height; cline++) {
 #ifdef HDR_HALF_QUALITY
         auto scanline = reinterpret_cast<qfloat16 *>(img.scanLine(cline));
@@ -133,35 +363,30 @@ static bool LoadHDR(QDataStream &s, const int width, const int height, QImage &i
 
         // determine scanline type
         if ((width < MINELEN) || (MAXELEN < width)) {
-            Read_Old_Line(image, width, s);
+            Read_Old_Line(image, width, r);
             RGBE_To_QRgbLine(image, scanline, width);
             continue;
         }
 
-        s >> val;
-
-        if (s.atEnd()) {
+        if (!r.fill(1)) {
             return true;
         }
 
-        if (val != 2) {
-            s.device()->ungetChar(val);
-            Read_Old_Line(image, width, s);
+        if (r.data()[0] != 2) {
+            Read_Old_Line(image, width, r);
             RGBE_To_QRgbLine(image, scanline, width);
             continue;
         }
 
-        s >> image[1];
-        s >> image[2];
-        s >> image[3];
-
-        if (s.atEnd()) {
+        if (!r.fill(4)) {
             return true;
         }
+        std::memcpy(image, r.data(), 4);
+        r.skip(4);
 
         if ((image[1] != 2) || (image[2] & 128)) {
             image[0] = 2;
-            Read_Old_Line(image + 4, width - 1, s);
+            Read_Old_Line(image + 4, width - 1, r);
             RGBE_To_QRgbLine(image, scanline, width);
             continue;
         }
@@ -172,37 +397,8 @@ static bool LoadHDR(QDataStream &s, const int width, const int height, QImage &i
         }
 
         // read each component
-        for (int i = 0, len = int(lineArray.size()); i < 4; i++) {
-            for (int j = 0; j < width;) {
-                s >> code;
-                if (s.atEnd()) {
-                    qCDebug(HDRPLUGIN) << "Truncated HDR file";
-                    return false;
-                }
-                if (code > 128) {
-                    // run
-                    code &= 127;
-                    s >> val;
-                    while (code != 0) {
-                        auto idx = i + j * 4;
-                        if (idx < len) {
-                            image[idx] = val;
-                        }
-                        j++;
-                        code--;
-                    }
-                } else {
-                    // non-run
-                    while (code != 0) {
-                        auto idx = i + j * 4;
-                        if (idx < len) {
-                            s >> image[idx];
-                        }
-                        j++;
-                        code--;
-                    }
-                }
-            }
+        if (!Read_RLE_Line(image, width, r)) {
+            return false;
         }
 
         RGBE_To_QRgbLine(image, scanline, width);
@@ -211,6 +407,61 @@ static bool LoadHDR(QDataStream &s, const int width, const int height, QImage &i
     return true;
 }
 
+// Save the HDR image.
+static bool SaveHDR(QIODevice *device, const QImage &image)
+{
+    const auto width = image.width();
+    const auto height = image.height();
+    auto header = QByteArray("#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y ") + QByteArray::number(height) + " +X " + QByteArray::number(width) + "\n";
+    if (device->write(header) != header.size()) {
+        return false;
+    }
+
+    // the scanlines are linear floats (the reader sets the SRgbLinear color space)
+    ScanLineConverter slc(QImage::Format_RGBX32FPx4);
+    slc.setDefaultSourceColorSpace(QColorSpace(QColorSpace::SRgb));
+    slc.setTargetColorSpace(QColorSpace(QColorSpace::SRgbLinear));
+
+    // new style lines are used when allowed, otherwise flat RGBE pixels are written
+    const auto rle = width >= MINELEN && width <= MAXELEN;
+    const auto floatBpl = slc.targetBytesPerLine(width);
+    QByteArray floats(floatBpl * std::min(height, HDR_ENCODING_BAND), Qt::Uninitialized);
+    QList<QByteArray> rows(HDR_ENCODING_BAND);
+    for (int y = 0; y < height; y += HDR_ENCODING_BAND) {
+        const int lines = std::min(HDR_ENCODING_BAND, height - y);
+        if (!slc.convertScanLines(image, y, lines, reinterpret_cast<uchar *>(floats.data()), floatBpl)) {
+            return false;
+        }
+
+        // the rows are independent: they are encoded by the threads of the shared pool
+        QAtomicInt next = 0;
+        runConcurrently(lines, [&](int) {
+            QByteArray rgbe;
+            for (int i = next.fetchAndAddRelaxed(1); i < lines; i = next.fetchAndAddRelaxed(1)) {
+                auto scanline = reinterpret_cast<const float *>(floats.constData() + floatBpl * i);
+                auto &&row = rows[i];
+                if (!rle) {
+                    row.resize(qsizetype(width) * 4);
+                    QRgbLine_To_RGBE(scanline, reinterpret_cast<uchar *>(row.data()), width);
+                    continue;
+                }
+                rgbe.resize(qsizetype(width) * 4);
+                QRgbLine_To_RGBE(scanline, reinterpret_cast<uchar *>(rgbe.data()), width);
+                row.resize(RLELineBound(width));
+                auto begin = reinterpret_cast<uchar *>(row.data());
+                row.resize(Write_RLE_Line(reinterpret_cast<const uchar *>(rgbe.constData()), width, begin) - begin);
+            }
+        });
+        for (int i = 0; i < lines; ++i) {
+            if (device->write(rows.at(i)) != rows.at(i).size()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 static QSize readHeaderSize(QIODevice *device)
 {
     int len;
@@ -267,15 +518,13 @@ static QSize readHeaderSize(QIODevice *device)
 
 bool HDRHandler::read(QImage *outImage)
 {
-    QDataStream s(device());
-
-    m_imageSize = readHeaderSize(s.device());
+    m_imageSize = readHeaderSize(device());
     if (!m_imageSize.isValid()) {
         return false;
     }
 
     QImage img;
-    if (!LoadHDR(s, m_imageSize.width(), m_imageSize.height(), img)) {
+    if (!LoadHDR(device(), m_imageSize.width(), m_imageSize.height(), img)) {
         // qDebug() << "Error loading HDR file.";
         return false;
     }
@@ -287,6 +536,18 @@ bool HDRHandler::read(QImage *outImage)
     return true;
 }
 
+bool HDRHandler::write(const QImage &image)
+{
+    if (image.isNull()) {
+        return false;
+    }
+    if (!SaveHDR(device(), image)) {
+        qCDebug(HDRPLUGIN) << "Error writing HDR file.";
+        return false;
+    }
+    return true;
+}
+
 bool HDRHandler::supportsOption(ImageOption option) const
 {
     if (option == QImageIOHandler::Size) {
@@ -362,7 +623,7 @@ bool HDRHandler::canRead(QIODevice *device)
 QImageIOPlugin::Capabilities HDRPlugin::capabilities(QIODevice *device, const QByteArray &format) const
 {
     if (format == "hdr") {
-        return Capabilities(CanRead);
+        return Capabilities(CanRead | CanWrite);
     }
     if (!format.isEmpty()) {
         return {};
@@ -375,6 +636,9 @@ QImageIOPlugin::Capabilities HDRPlugin::capabilities(QIODevice *device, const QB
     if (device->isReadable() && HDRHandler::canRead(device)) {
         cap |= CanRead;
     }
+    if (device->isWritable()) {
+        cap |= CanWrite;
+    }
     return cap;
 }
 
@@ -17,6 +17,7 @@ public:
 
     bool canRead() const override;
     bool read(QImage *outImage) override;
+    bool write(const QImage &image) override;
 
     bool supportsOption(QImageIOHandler::ImageOption option) const override;
     QVariant option(QImageIOHandler::ImageOption option) const override;
@@ -15,8 +15,10 @@
 #include <QDebug>
 #include <QPointF>
 #include <QSysInfo>
+#include <cmath>
 #include <limits>
 #include <string.h>
+#include <vector>
 
 size_t HEIFHandler::m_initialized_count = 0;
 bool HEIFHandler::m_plugins_queried = false;
@@ -55,9 +57,18 @@ static struct heif_error heifhandler_write_callback(struct heif_context * /* ctx
 HEIFHandler::HEIFHandler()
     : m_parseState(ParseHeicNotParsed)
     , m_quality(100)
+    , m_context(nullptr)
+    , m_handle(nullptr)
+    , m_bitDepth(0)
+    , m_hasAlpha(false)
 {
 }
 
+HEIFHandler::~HEIFHandler()
+{
+    releaseContext();
+}
+
 bool HEIFHandler::canRead() const
 {
     if (m_parseState == ParseHeicNotParsed) {
@@ -86,7 +97,7 @@ bool HEIFHandler::canRead() const
 
 bool HEIFHandler::read(QImage *outImage)
 {
-    if (!ensureParsed()) {
+    if (!ensureDecoded()) {
         return false;
     }
 
@@ -183,64 +194,35 @@ bool HEIFHandler::write_helper(const QImage &image)
     size_t rowbytes;
 
     switch (save_depth) {
-    case 10:
-        if (save_alpha) {
-            for (int y = 0; y < tmpimage.height(); y++) {
-                const uint16_t *src_word = reinterpret_cast<const uint16_t *>(tmpimage.constScanLine(y));
-                uint16_t *dest_word = reinterpret_cast<uint16_t *>(dst + (y * stride));
-                for (int x = 0; x < tmpimage.width(); x++) {
-                    int tmp_pixelval;
-                    // R
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
-                    // G
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
-                    // B
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
-                    // A
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
+    case 10: {
+        auto to10Bit = [](uint16_t value) {
+            return uint16_t(qBound(0, (int)(((float)value / 65535.0f) * 1023.0f + 0.5f), 1023));
+        };
+        for (int y = 0; y < tmpimage.height(); y++) {
+            const uint16_t *src_word = reinterpret_cast<const uint16_t *>(tmpimage.constScanLine(y));
+            uint16_t *dest_word = reinterpret_cast<uint16_t *>(dst + (y * stride));
+            if (save_alpha) {
+                // one sample for each sample: the loop is vectorized
+                for (int i = 0, n = tmpimage.width() * 4; i < n; i++) {
+                    dest_word[i] = to10Bit(src_word[i]);
                 }
-            }
-        } else { // no alpha channel
-            for (int y = 0; y < tmpimage.height(); y++) {
-                const uint16_t *src_word = reinterpret_cast<const uint16_t *>(tmpimage.constScanLine(y));
-                uint16_t *dest_word = reinterpret_cast<uint16_t *>(dst + (y * stride));
+            } else { // no alpha channel: X is skipped
                 for (int x = 0; x < tmpimage.width(); x++) {
-                    int tmp_pixelval;
-                    // R
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
-                    // G
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
-                    // B
-                    tmp_pixelval = (int)(((float)(*src_word) / 65535.0f) * 1023.0f + 0.5f);
-                    *dest_word = qBound(0, tmp_pixelval, 1023);
-                    src_word++;
-                    dest_word++;
-                    // X
-                    src_word++;
+                    dest_word[x * 3] = to10Bit(src_word[x * 4]);
+                    dest_word[x * 3 + 1] = to10Bit(src_word[x * 4 + 1]);
+                    dest_word[x * 3 + 2] = to10Bit(src_word[x * 4 + 2]);
                 }
             }
         }
         break;
+    }
     case 8:
         rowbytes = save_alpha ? (tmpimage.width() * 4) : (tmpimage.width() * 3);
+        if (stride == tmpimage.bytesPerLine()) {
+            // same layout: a single copy
+            memcpy(dst, tmpimage.constBits(), size_t(stride) * (tmpimage.height() - 1) + rowbytes);
+            break;
+        }
         for (int y = 0; y < tmpimage.height(); y++) {
             memcpy(dst + (y * stride), tmpimage.constScanLine(y), rowbytes);
         }
@@ -374,6 +356,12 @@ QVariant HEIFHandler::option(ImageOption option) const
     if (option == Quality) {
         return m_quality;
     }
+    if (option == ScaledSize) {
+        return m_scaledSize;
+    }
+    if (option == ClipRect) {
+        return m_clipRect;
+    }
 
     if (!supportsOption(option) || !ensureParsed()) {
         return QVariant();
@@ -381,7 +369,13 @@ QVariant HEIFHandler::option(ImageOption option) const
 
     switch (option) {
     case Size:
-        return m_current_image.size();
+        return m_imageSize;
+        break;
+    case ImageFormat:
+        if (m_bitDepth > 8) {
+            return m_hasAlpha ? QImage::Format_RGBA64 : QImage::Format_RGBX64;
+        }
+        return m_hasAlpha ? QImage::Format_RGBA8888 : QImage::Format_RGB888;
         break;
     default:
         return QVariant();
@@ -400,6 +394,12 @@ void HEIFHandler::setOption(ImageOption option, const QVariant &value)
             m_quality = 100;
         }
         break;
+    case ScaledSize:
+        m_scaledSize = value.toSize();
+        break;
+    case ClipRect:
+        m_clipRect = value.toRect();
+        break;
     default:
         QImageIOHandler::setOption(option, value);
         break;
@@ -408,76 +408,286 @@ void HEIFHandler::setOption(ImageOption option, const QVariant &value)
 
 bool HEIFHandler::supportsOption(ImageOption option) const
 {
-    return option == Quality || option == Size;
+    return option == Quality || option == Size || option == ImageFormat || option == ScaledSize || option == ClipRect;
 }
 
 bool HEIFHandler::ensureParsed() const
 {
-    if (m_parseState == ParseHeicSuccess) {
-        return true;
-    }
-    if (m_parseState == ParseHeicError) {
-        return false;
+    if (m_parseState == ParseHeicNotParsed) {
+        HEIFHandler *that = const_cast<HEIFHandler *>(this);
+        if (!that->parseHeader()) {
+            that->releaseContext();
+        }
     }
-
-    HEIFHandler *that = const_cast<HEIFHandler *>(this);
-
-#if LIBHEIF_HAVE_VERSION(1, 13, 0)
-    startHeifLib();
-#endif
-
-    bool success = that->ensureDecoder();
-
-#if LIBHEIF_HAVE_VERSION(1, 13, 0)
-    finishHeifLib();
-#endif
-    return success;
+    return m_parseState != ParseHeicError;
 }
 
-bool HEIFHandler::ensureDecoder()
+bool HEIFHandler::ensureDecoded()
 {
-    if (m_parseState != ParseHeicNotParsed) {
-        if (m_parseState == ParseHeicSuccess) {
-            return true;
-        }
+    if (!ensureParsed()) {
         return false;
     }
+    if (m_parseState == ParseHeicMetadata) {
+        ensureDecoder();
+        // the context is no longer needed
+        releaseContext();
+    }
+    return m_parseState == ParseHeicSuccess;
+}
 
-    const QByteArray buffer = device()->readAll();
-    if (!HEIFHandler::isSupportedBMFFType(buffer) && !HEIFHandler::isSupportedHEJ2(buffer)) {
+bool HEIFHandler::parseHeader()
+{
+    // NOTE: the buffer must live as long as the context (it is not copied)
+    m_rawData.load(device());
+    const QByteArray header = m_rawData.header(28);
+    if (!HEIFHandler::isSupportedBMFFType(header) && !HEIFHandler::isSupportedHEJ2(header)) {
         m_parseState = ParseHeicError;
         return false;
     }
 
-    struct heif_context *ctx = heif_context_alloc();
-    struct heif_error err = heif_context_read_from_memory(ctx, static_cast<const void *>(buffer.constData()), buffer.size(), nullptr);
-
+    startHeifLib();
+    m_context = heif_context_alloc();
+    struct heif_error err = heif_context_read_from_memory_without_copy(m_context, static_cast<const void *>(m_rawData.data()), m_rawData.size(), nullptr);
     if (err.code) {
         qWarning() << "heif_context_read_from_memory error:" << err.message;
-        heif_context_free(ctx);
         m_parseState = ParseHeicError;
         return false;
     }
 
-    struct heif_image_handle *handle = nullptr;
-    err = heif_context_get_primary_image_handle(ctx, &handle);
+    err = heif_context_get_primary_image_handle(m_context, &m_handle);
     if (err.code) {
         qWarning() << "heif_context_get_primary_image_handle error:" << err.message;
-        heif_context_free(ctx);
+        m_handle = nullptr;
         m_parseState = ParseHeicError;
         return false;
     }
 
-    if ((heif_image_handle_get_width(handle) == 0) || (heif_image_handle_get_height(handle) == 0)) {
+    m_imageSize = QSize(heif_image_handle_get_width(m_handle), heif_image_handle_get_height(m_handle));
+    if (m_imageSize.isEmpty()) {
         m_parseState = ParseHeicError;
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
         qWarning() << "HEIC image has zero dimension";
         return false;
     }
 
-    const bool hasAlphaChannel = heif_image_handle_has_alpha_channel(handle);
-    const int bit_depth = heif_image_handle_get_luma_bits_per_pixel(handle);
+    m_hasAlpha = heif_image_handle_has_alpha_channel(m_handle);
+    m_bitDepth = heif_image_handle_get_luma_bits_per_pixel(m_handle);
+    if (m_bitDepth != 8 && m_bitDepth != 10 && m_bitDepth != 12) {
+        m_parseState = ParseHeicError;
+        if (m_bitDepth > 0) {
+            qWarning() << "Unsupported bit depth:" << m_bitDepth;
+        } else {
+            qWarning() << "Undefined bit depth.";
+        }
+        return false;
+    }
+
+    m_parseState = ParseHeicMetadata;
+    return true;
+}
+
+void HEIFHandler::releaseContext()
+{
+    if (m_handle) {
+        heif_image_handle_release(m_handle);
+        m_handle = nullptr;
+    }
+    if (m_context) {
+        heif_context_free(m_context);
+        m_context = nullptr;
+        finishHeifLib();
+    }
+    m_rawData.clear();
+}
+
+/*!
+ * \brief copyPixels
+ * Converts the interleaved pixels of \a img and writes them in \a target at \a offset.
+ * The pixels falling outside \a target are skipped.
+ * \return False if the pixels of \a img are not valid.
+ */
+static bool copyPixels(const struct heif_image *img, int bit_depth, bool hasAlphaChannel, QImage &target, const QPoint &offset)
+{
+    int stride = 0;
+    const uint8_t *const src = heif_image_get_plane_readonly(img, heif_channel_interleaved, &stride);
+    if (!src || stride <= 0) {
+        return false;
+    }
+
+    const QSize size(heif_image_get_width(img, heif_channel_interleaved), heif_image_get_height(img, heif_channel_interleaved));
+    const QRect rect = QRect(offset, size).intersected(target.rect());
+    const int channels = hasAlphaChannel ? 4 : 3;
+    const int sx = rect.left() - offset.x();
+
+    // 8-bit image with the same stride of the plane: one block copy
+    const qsizetype rowBytes = qsizetype(rect.width()) * channels;
+    if (bit_depth == 8 && !rect.isEmpty() && rect == target.rect() && offset == QPoint() && stride == target.bytesPerLine()) {
+        memcpy(target.bits(), src, size_t(stride) * (rect.height() - 1) + rowBytes);
+        return true;
+    }
+
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        const uint8_t *src_line = src + qsizetype(y - offset.y()) * stride;
+        uchar *dest_line = target.scanLine(y);
+        switch (bit_depth) {
+        case 12:
+        case 10: {
+            const uint16_t mask = bit_depth == 12 ? 0x0fff : 0x03ff;
+            const float maxValue = bit_depth == 12 ? 4095.0f : 1023.0f;
+            auto to16Bit = [mask, maxValue](uint16_t value) {
+                return uint16_t(qBound(0, (int)(((float)(mask & value) / maxValue) * 65535.0f + 0.5f), 65535));
+            };
+            const uint16_t *src_word = reinterpret_cast<const uint16_t *>(src_line) + sx * channels;
+            uint16_t *dest_data = reinterpret_cast<uint16_t *>(dest_line) + rect.left() * 4;
+            if (hasAlphaChannel) {
+                // one sample for each sample: the loop is vectorized
+                for (int i = 0, n = rect.width() * 4; i < n; i++) {
+                    dest_data[i] = to16Bit(src_word[i]);
+                }
+            } else { // no alpha channel: X = 0xffff
+                for (int x = 0; x < rect.width(); x++) {
+                    dest_data[x * 4] = to16Bit(src_word[x * 3]);
+                    dest_data[x * 4 + 1] = to16Bit(src_word[x * 3 + 1]);
+                    dest_data[x * 4 + 2] = to16Bit(src_word[x * 3 + 2]);
+                    dest_data[x * 4 + 3] = 0xffff;
+                }
+            }
+            break;
+        }
+        case 8:
+            // RGBA8888 / RGB888: the samples have the same layout of the plane
+            memcpy(dest_line + rect.left() * channels, src_line + sx * channels, size_t(rect.width()) * channels);
+            break;
+        default:
+            qWarning() << "Unsupported bit depth:" << bit_depth;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief findThumbnail
+ * \return The smallest thumbnail of \a handle of at least \a size and with the same aspect
+ * ratio of the image or nullptr if none. The returned handle must be released.
+ */
+static struct heif_image_handle *findThumbnail(const struct heif_image_handle *handle, const QSize &size)
+{
+    const int count = heif_image_handle_get_number_of_thumbnails(handle);
+    if (count < 1) {
+        return nullptr;
+    }
+    std::vector<heif_item_id> ids(count);
+    const int n = heif_image_handle_get_list_of_thumbnail_IDs(handle, ids.data(), count);
+
+    const double ratio = double(heif_image_handle_get_width(handle)) / heif_image_handle_get_height(handle);
+    struct heif_image_handle *best = nullptr;
+    for (int i = 0; i < n; ++i) {
+        struct heif_image_handle *thumbnail = nullptr;
+        if (heif_image_handle_get_thumbnail(handle, ids.at(i), &thumbnail).code || thumbnail == nullptr) {
+            continue;
+        }
+        const int width = heif_image_handle_get_width(thumbnail);
+        const int height = heif_image_handle_get_height(thumbnail);
+        const bool big = width >= size.width() && height >= size.height();
+        const bool sameRatio = height > 0 && std::abs(double(width) / height - ratio) <= ratio * 0.01;
+        if (big && sameRatio && (best == nullptr || width < heif_image_handle_get_width(best))) {
+            if (best) {
+                heif_image_handle_release(best);
+            }
+            best = thumbnail;
+        } else {
+            heif_image_handle_release(thumbnail);
+        }
+    }
+    return best;
+}
+
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+/*!
+ * \brief decodeTiles
+ * Decodes only the tiles of a tiled (grid) image that intersect \a clipRect.
+ * \return False if the image is not tiled or on error (the caller should decode the whole image).
+ */
+static bool decodeTiles(const struct heif_image_handle *handle,
+                        heif_chroma chroma,
+                        const struct heif_decoding_options *options,
+                        const QRect &clipRect,
+                        int bit_depth,
+                        bool hasAlphaChannel,
+                        QImage::Format format,
+                        QImage &image)
+{
+    struct heif_image_tiling tiling;
+    if (heif_image_handle_get_image_tiling(handle, 1, &tiling).code) {
+        return false;
+    }
+    if (tiling.num_columns * tiling.num_rows < 2 || tiling.tile_width == 0 || tiling.tile_height == 0) {
+        return false;
+    }
+
+    image = imageAlloc(clipRect.size(), format);
+    if (image.isNull()) {
+        return false;
+    }
+
+    const uint32_t tx0 = clipRect.left() / tiling.tile_width;
+    const uint32_t ty0 = clipRect.top() / tiling.tile_height;
+    const uint32_t tx1 = std::min(tiling.num_columns - 1, uint32_t(clipRect.right()) / tiling.tile_width);
+    const uint32_t ty1 = std::min(tiling.num_rows - 1, uint32_t(clipRect.bottom()) / tiling.tile_height);
+    for (uint32_t ty = ty0; ty <= ty1; ++ty) {
+        for (uint32_t tx = tx0; tx <= tx1; ++tx) {
+            struct heif_image *tile = nullptr;
+            auto err = heif_image_handle_decode_image_tile(handle, &tile, heif_colorspace_RGB, chroma, options, tx, ty);
+            if (err.code) {
+                qWarning() << "heif_image_handle_decode_image_tile error:" << err.message;
+                image = QImage();
+                return false;
+            }
+            const QPoint offset(int(tx * tiling.tile_width) - clipRect.left(), int(ty * tiling.tile_height) - clipRect.top());
+            const bool ok = copyPixels(tile, bit_depth, hasAlphaChannel, image, offset);
+            heif_image_release(tile);
+            if (!ok) {
+                image = QImage();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+bool HEIFHandler::ensureDecoder()
+{
+    if (m_parseState != ParseHeicMetadata) {
+        return m_parseState == ParseHeicSuccess;
+    }
+
+    struct heif_image_handle *handle = m_handle;
+    struct heif_error err;
+
+    // region of interest (QImageIOHandler::ClipRect)
+    const QSize fullSize = m_imageSize;
+    QRect clipRect(QPoint(), fullSize);
+    if (m_clipRect.isValid()) {
+        clipRect = clipRect.intersected(m_clipRect);
+        if (clipRect.isEmpty()) {
+            m_parseState = ParseHeicError;
+            qWarning() << "HEIC clip rect outside the image";
+            return false;
+        }
+    }
+
+    // when a scaled image is requested, a big enough thumbnail is decoded instead of the primary image
+    struct heif_image_handle *thumbnail = nullptr;
+    if (m_scaledSize.isValid() && !m_scaledSize.isEmpty()) {
+        const QSize neededSize(int(std::ceil(double(m_scaledSize.width()) * fullSize.width() / clipRect.width())),
+                               int(std::ceil(double(m_scaledSize.height()) * fullSize.height() / clipRect.height())));
+        thumbnail = findThumbnail(handle, neededSize);
+    }
+    struct heif_image_handle *decodeHandle = thumbnail ? thumbnail : handle;
+
+    const bool hasAlphaChannel = heif_image_handle_has_alpha_channel(decodeHandle);
+    const int bit_depth = heif_image_handle_get_luma_bits_per_pixel(decodeHandle);
     heif_chroma chroma;
 
     QImage::Format target_image_format;
@@ -493,15 +703,16 @@ bool HEIFHandler::ensureDecoder()
     } else if (bit_depth == 8) {
         if (hasAlphaChannel) {
             chroma = heif_chroma_interleaved_RGBA;
-            target_image_format = QImage::Format_ARGB32;
+            target_image_format = QImage::Format_RGBA8888;
         } else {
             chroma = heif_chroma_interleaved_RGB;
-            target_image_format = QImage::Format_RGB32;
+            target_image_format = QImage::Format_RGB888;
         }
     } else {
         m_parseState = ParseHeicError;
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
+        if (thumbnail) {
+            heif_image_handle_release(thumbnail);
+        }
         if (bit_depth > 0) {
             qWarning() << "Unsupported bit depth:" << bit_depth;
         } else {
@@ -516,222 +727,88 @@ bool HEIFHandler::ensureDecoder()
     decoder_option->strict_decoding = 1;
 #endif
 
-    struct heif_image *img = nullptr;
-    err = heif_decode_image(handle, &img, heif_colorspace_RGB, chroma, decoder_option);
-
-    if (decoder_option) {
-        heif_decoding_options_free(decoder_option);
+    bool decoded = false;
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+    // grid images (e.g. 512x512 tiles of phone cameras): only the tiles intersecting the clip rect are decoded
+    if (thumbnail == nullptr && clipRect != QRect(QPoint(), fullSize)) {
+        decoded = decodeTiles(handle, chroma, decoder_option, clipRect, bit_depth, hasAlphaChannel, target_image_format, m_current_image);
     }
+#endif
 
-    if (err.code) {
-        qWarning() << "heif_decode_image error:" << err.message;
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        m_parseState = ParseHeicError;
-        return false;
-    }
-
-    const int imageWidth = heif_image_get_width(img, heif_channel_interleaved);
-    const int imageHeight = heif_image_get_height(img, heif_channel_interleaved);
-
-    QSize imageSize(imageWidth, imageHeight);
-
-    if (!imageSize.isValid()) {
-        heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        m_parseState = ParseHeicError;
-        qWarning() << "HEIC image size invalid:" << imageSize;
-        return false;
-    }
+    if (!decoded) {
+        struct heif_image *img = nullptr;
+        err = heif_decode_image(decodeHandle, &img, heif_colorspace_RGB, chroma, decoder_option);
 
-    int stride = 0;
-    const uint8_t *const src = heif_image_get_plane_readonly(img, heif_channel_interleaved, &stride);
+        if (err.code) {
+            qWarning() << "heif_decode_image error:" << err.message;
+            heif_decoding_options_free(decoder_option);
+            if (thumbnail) {
+                heif_image_handle_release(thumbnail);
+            }
+            m_parseState = ParseHeicError;
+            return false;
+        }
 
-    if (!src || stride <= 0) {
-        heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        m_parseState = ParseHeicError;
-        qWarning() << "HEIC data pixels information not valid!";
-        return false;
-    }
+        const int imageWidth = heif_image_get_width(img, heif_channel_interleaved);
+        const int imageHeight = heif_image_get_height(img, heif_channel_interleaved);
 
-    m_current_image = imageAlloc(imageSize, target_image_format);
-    if (m_current_image.isNull()) {
-        heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        m_parseState = ParseHeicError;
-        qWarning() << "Unable to allocate memory!";
-        return false;
-    }
+        QSize imageSize(imageWidth, imageHeight);
 
-    switch (bit_depth) {
-    case 12:
-        if (hasAlphaChannel) {
-            for (int y = 0; y < imageHeight; y++) {
-                const uint16_t *src_word = reinterpret_cast<const uint16_t *>(src + (y * stride));
-                uint16_t *dest_data = reinterpret_cast<uint16_t *>(m_current_image.scanLine(y));
-                for (int x = 0; x < imageWidth; x++) {
-                    int tmpvalue;
-                    // R
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // G
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // B
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // A
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                }
-            }
-        } else { // no alpha channel
-            for (int y = 0; y < imageHeight; y++) {
-                const uint16_t *src_word = reinterpret_cast<const uint16_t *>(src + (y * stride));
-                uint16_t *dest_data = reinterpret_cast<uint16_t *>(m_current_image.scanLine(y));
-                for (int x = 0; x < imageWidth; x++) {
-                    int tmpvalue;
-                    // R
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // G
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // B
-                    tmpvalue = (int)(((float)(0x0fff & (*src_word)) / 4095.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // X = 0xffff
-                    *dest_data = 0xffff;
-                    dest_data++;
-                }
+        if (!imageSize.isValid()) {
+            heif_image_release(img);
+            heif_decoding_options_free(decoder_option);
+            if (thumbnail) {
+                heif_image_handle_release(thumbnail);
             }
+            m_parseState = ParseHeicError;
+            qWarning() << "HEIC image size invalid:" << imageSize;
+            return false;
         }
-        break;
-    case 10:
-        if (hasAlphaChannel) {
-            for (int y = 0; y < imageHeight; y++) {
-                const uint16_t *src_word = reinterpret_cast<const uint16_t *>(src + (y * stride));
-                uint16_t *dest_data = reinterpret_cast<uint16_t *>(m_current_image.scanLine(y));
-                for (int x = 0; x < imageWidth; x++) {
-                    int tmpvalue;
-                    // R
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // G
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // B
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // A
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                }
-            }
-        } else { // no alpha channel
-            for (int y = 0; y < imageHeight; y++) {
-                const uint16_t *src_word = reinterpret_cast<const uint16_t *>(src + (y * stride));
-                uint16_t *dest_data = reinterpret_cast<uint16_t *>(m_current_image.scanLine(y));
-                for (int x = 0; x < imageWidth; x++) {
-                    int tmpvalue;
-                    // R
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // G
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // B
-                    tmpvalue = (int)(((float)(0x03ff & (*src_word)) / 1023.0f) * 65535.0f + 0.5f);
-                    tmpvalue = qBound(0, tmpvalue, 65535);
-                    *dest_data = (uint16_t)tmpvalue;
-                    src_word++;
-                    dest_data++;
-                    // X = 0xffff
-                    *dest_data = 0xffff;
-                    dest_data++;
-                }
+
+        m_current_image = imageAlloc(imageSize, target_image_format);
+        if (m_current_image.isNull()) {
+            heif_image_release(img);
+            heif_decoding_options_free(decoder_option);
+            if (thumbnail) {
+                heif_image_handle_release(thumbnail);
             }
+            m_parseState = ParseHeicError;
+            qWarning() << "Unable to allocate memory!";
+            return false;
         }
-        break;
-    case 8:
-        if (hasAlphaChannel) {
-            for (int y = 0; y < imageHeight; y++) {
-                const uint8_t *src_byte = src + (y * stride);
-                uint32_t *dest_pixel = reinterpret_cast<uint32_t *>(m_current_image.scanLine(y));
-                for (int x = 0; x < imageWidth; x++) {
-                    int red = *src_byte++;
-                    int green = *src_byte++;
-                    int blue = *src_byte++;
-                    int alpha = *src_byte++;
-                    *dest_pixel = qRgba(red, green, blue, alpha);
-                    dest_pixel++;
-                }
-            }
-        } else { // no alpha channel
-            for (int y = 0; y < imageHeight; y++) {
-                const uint8_t *src_byte = src + (y * stride);
-                uint32_t *dest_pixel = reinterpret_cast<uint32_t *>(m_current_image.scanLine(y));
-                for (int x = 0; x < imageWidth; x++) {
-                    int red = *src_byte++;
-                    int green = *src_byte++;
-                    int blue = *src_byte++;
-                    *dest_pixel = qRgb(red, green, blue);
-                    dest_pixel++;
-                }
+
+        if (!copyPixels(img, bit_depth, hasAlphaChannel, m_current_image, QPoint())) {
+            heif_image_release(img);
+            heif_decoding_options_free(decoder_option);
+            if (thumbnail) {
+                heif_image_handle_release(thumbnail);
             }
+            m_parseState = ParseHeicError;
+            qWarning() << "HEIC data pixels information not valid!";
+            return false;
         }
-        break;
-    default:
         heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
+
+        // crop the region of interest (mapped on the thumbnail if any)
+        if (clipRect != QRect(QPoint(), fullSize)) {
+            const qreal sx = qreal(imageWidth) / fullSize.width();
+            const qreal sy = qreal(imageHeight) / fullSize.height();
+            auto rect = QRectF(clipRect.x() * sx, clipRect.y() * sy, clipRect.width() * sx, clipRect.height() * sy).toAlignedRect();
+            m_current_image = m_current_image.copy(rect.intersected(m_current_image.rect()));
+        }
+    }
+    heif_decoding_options_free(decoder_option);
+    if (thumbnail) {
+        heif_image_handle_release(thumbnail);
+    }
+
+    if (m_scaledSize.isValid() && !m_scaledSize.isEmpty() && m_current_image.size() != m_scaledSize) {
+        m_current_image = m_current_image.scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+    if (m_current_image.isNull()) {
         m_parseState = ParseHeicError;
-        qWarning() << "Unsupported bit depth:" << bit_depth;
+        qWarning() << "Unable to allocate memory!";
         return false;
-        break;
     }
 
     heif_color_profile_type profileType = heif_image_handle_get_color_profile_type(handle);
@@ -815,9 +892,6 @@ bool HEIFHandler::ensureDecoder()
         m_current_image.setColorSpace(QColorSpace(QColorSpace::SRgb));
     }
 
-    heif_image_release(img);
-    heif_image_handle_release(handle);
-    heif_context_free(ctx);
     m_parseState = ParseHeicSuccess;
     return true;
 }
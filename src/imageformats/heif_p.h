@@ -10,15 +10,21 @@
 #ifndef KIMG_HEIF_P_H
 #define KIMG_HEIF_P_H
 
+#include "devicedata_p.h"
+
 #include <QByteArray>
 #include <QImage>
 #include <QImageIOPlugin>
 #include <QMutex>
 
+struct heif_context;
+struct heif_image_handle;
+
 class HEIFHandler : public QImageIOHandler
 {
 public:
     HEIFHandler();
+    ~HEIFHandler() override;
 
     bool canRead() const override;
     bool read(QImage *image) override;
@@ -37,18 +43,56 @@ public:
 
 private:
     bool ensureParsed() const;
+    bool ensureDecoded();
     bool ensureDecoder();
+    bool parseHeader();
+    void releaseContext();
 
     enum ParseHeicState {
         ParseHeicError = -1,
         ParseHeicNotParsed = 0,
         ParseHeicSuccess = 1,
+        ParseHeicMetadata = 2,
     };
 
     ParseHeicState m_parseState;
     int m_quality;
     QImage m_current_image;
 
+    /*!
+     * \brief m_imageSize
+     * The size of the primary image.
+     */
+    QSize m_imageSize;
+
+    /*!
+     * \brief m_rawData
+     * The file content: it must live as long as the context (it is not copied by libheif).
+     */
+    DeviceData m_rawData;
+
+    /*!
+     * \brief m_context, m_handle
+     * Context and primary image handle created by parseHeader(): the pixels are only decoded by read().
+     */
+    heif_context *m_context;
+    heif_image_handle *m_handle;
+
+    int m_bitDepth;
+    bool m_hasAlpha;
+
+    /*!
+     * \brief m_scaledSize
+     * Value set by QImageReader::setScaledSize(): a big enough thumbnail is decoded if available.
+     */
+    QSize m_scaledSize;
+
+    /*!
+     * \brief m_clipRect
+     * Value set by QImageReader::setClipRect(): only the intersecting tiles of grid images are decoded.
+     */
+    QRect m_clipRect;
+
     bool write_helper(const QImage &image);
 
     static void startHeifLib();
@@ -0,0 +1,228 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#ifndef INSTRUMENTATION_P_H
+#define INSTRUMENTATION_P_H
+
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QImage>
+#include <QLoggingCategory>
+#include <QString>
+
+#include <algorithm>
+#include <utility>
+
+/*!
+ * \brief instrumentationCategory
+ * The logging category of the decode reports. The reports are disabled by default: enable
+ * them with QT_LOGGING_RULES="kf.imageformats.instrumentation.info=true".
+ */
+inline const QLoggingCategory &instrumentationCategory()
+{
+    static const QLoggingCategory category("kf.imageformats.instrumentation", QtWarningMsg);
+    return category;
+}
+
+/*!
+ * \brief The Instrumentation class
+ * Collects the statistics of a decode and reports them in instrumentationCategory() when
+ * destroyed. Create it in the read() function of the handler:
+ * \code
+ * Instrumentation instrumentation("xcf", device());
+ * ...
+ * {
+ *     InstrumentationPhase phase(Instrumentation::Decode);
+ *     ...
+ * }
+ * \endcode
+ * While it exists, it is the current instrumentation of its thread: the phases and the
+ * images allocated with imageAlloc() on that thread are recorded without passing it around.
+ *
+ * The bytes read are the forward moves of the device position seen at the phase changes
+ * (memory-mapped reads are not counted); the seeks are the backward moves and the calls
+ * of seek().
+ * \note When the category is disabled, nothing is recorded and the overhead is negligible.
+ */
+class Instrumentation
+{
+public:
+    enum Phase {
+        Other = 0,
+        Header,
+        Decode,
+        Convert,
+        Composite,
+        Metadata,
+        PhaseCount
+    };
+
+    Instrumentation(const char *plugin, QIODevice *device)
+        : m_plugin(plugin)
+        , m_device(device)
+        , m_enabled(instrumentationCategory().isInfoEnabled())
+    {
+        if (!m_enabled) {
+            return;
+        }
+        m_previous = current();
+        current() = this;
+        m_lastPos = devicePos();
+        m_total.start();
+        m_timer.start();
+    }
+    Instrumentation(const Instrumentation &other) = delete;
+    Instrumentation &operator=(const Instrumentation &other) = delete;
+
+    ~Instrumentation()
+    {
+        if (!m_enabled) {
+            return;
+        }
+        switchPhase(Other);
+        current() = m_previous;
+
+        static const char *const names[PhaseCount] = {"other", "header", "decode", "convert", "composite", "metadata"};
+        QString phases;
+        for (int i = 0; i < PhaseCount; ++i) {
+            phases += QStringLiteral("%1=%2ms ").arg(QLatin1String(names[i])).arg(m_elapsed[i] / 1e6, 0, 'f', 3);
+        }
+        qCInfo(instrumentationCategory).noquote().nospace() << m_plugin << ": " << phases << "total=" << QString::number(m_total.nsecsElapsed() / 1e6, 'f', 3)
+                                                               << "ms bytes=" << m_bytesRead << " seeks=" << m_seeks << " images=" << m_images
+                                                               << " imageBytes=" << m_imageBytes << " maxImageBytes=" << m_maxImageBytes;
+    }
+
+    /*!
+     * \brief current
+     * \return The instrumentation of the current thread, or nullptr.
+     */
+    static Instrumentation *&current()
+    {
+        static thread_local Instrumentation *instance = nullptr;
+        return instance;
+    }
+
+    /*!
+     * \brief switchPhase
+     * Ends the current phase and starts \a phase.
+     * \return The phase that was ended.
+     */
+    Phase switchPhase(Phase phase)
+    {
+        sample();
+        m_elapsed[m_phase] += m_timer.nsecsElapsed();
+        m_timer.start();
+        return std::exchange(m_phase, phase);
+    }
+
+    /*!
+     * \brief seek
+     * Seeks \a device to \a pos and counts the seek when an instrumentation is active.
+     */
+    static bool seek(QIODevice *device, qint64 pos)
+    {
+        auto instance = current();
+        if (instance && instance->m_device == device) {
+            instance->sample();
+            ++instance->m_seeks;
+            auto ok = device->seek(pos);
+            instance->m_lastPos = instance->devicePos();
+            return ok;
+        }
+        return device->seek(pos);
+    }
+
+    /*!
+     * \brief imageAllocated
+     * Records an image allocated with imageAlloc().
+     */
+    static void imageAllocated(const QImage &image)
+    {
+        if (auto instance = current()) {
+            const auto bytes = image.sizeInBytes();
+            ++instance->m_images;
+            instance->m_imageBytes += bytes;
+            instance->m_maxImageBytes = std::max(instance->m_maxImageBytes, qint64(bytes));
+        }
+    }
+
+private:
+    qint64 devicePos() const
+    {
+        return (m_device && m_device->isOpen()) ? m_device->pos() : 0;
+    }
+
+    void sample()
+    {
+        const auto pos = devicePos();
+        if (pos >= m_lastPos) {
+            m_bytesRead += pos - m_lastPos;
+        } else {
+            ++m_seeks;
+        }
+        m_lastPos = pos;
+    }
+
+    const char *m_plugin;
+    QIODevice *m_device;
+    bool m_enabled;
+    Instrumentation *m_previous = nullptr;
+
+    Phase m_phase = Other;
+    QElapsedTimer m_timer;
+    QElapsedTimer m_total;
+    qint64 m_elapsed[PhaseCount] = {};
+
+    qint64 m_lastPos = 0;
+    qint64 m_bytesRead = 0;
+    qint64 m_seeks = 0;
+
+    qint64 m_images = 0;
+    qint64 m_imageBytes = 0;
+    qint64 m_maxImageBytes = 0;
+};
+
+/*!
+ * \brief The InstrumentationPhase class
+ * Records the time spent in its scope in a phase of the current instrumentation (if any).
+ * The phases can be nested: the time is counted in the innermost phase only.
+ */
+class InstrumentationPhase
+{
+public:
+    explicit InstrumentationPhase(Instrumentation::Phase phase)
+        : m_instance(Instrumentation::current())
+    {
+        if (m_instance) {
+            m_previous = m_instance->switchPhase(phase);
+        }
+    }
+    InstrumentationPhase(const InstrumentationPhase &other) = delete;
+    InstrumentationPhase &operator=(const InstrumentationPhase &other) = delete;
+
+    ~InstrumentationPhase()
+    {
+        end();
+    }
+
+    /*!
+     * \brief end
+     * Ends the phase before the end of the scope.
+     */
+    void end()
+    {
+        if (m_instance) {
+            m_instance->switchPhase(m_previous);
+            m_instance = nullptr;
+        }
+    }
+
+private:
+    Instrumentation *m_instance;
+    Instrumentation::Phase m_previous = Instrumentation::Other;
+};
+
+#endif // INSTRUMENTATION_P_H
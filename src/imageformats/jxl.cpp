@@ -6,35 +6,306 @@
     SPDX-License-Identifier: BSD-2-Clause
 */
 
+#include <QMutex>
 #include <QThread>
 #include <QtGlobal>
 
 #include "jxl_p.h"
+#include "scanlineconverter_p.h"
+#include "threadpool_p.h"
 #include "util_p.h"
 
 #include <jxl/encode.h>
-#include <jxl/thread_parallel_runner.h>
+#include <algorithm>
+#include <list>
+#include <memory>
 #include <string.h>
 
+/* *** JXL_CHUNKED_ENCODING_PIXELS ***
+ * With libjxl 0.10 or later, the images with at least JXL_CHUNKED_ENCODING_PIXELS pixels are
+ * encoded with the chunked frame API: the encoder requests the pixels one band at a time and
+ * they are converted on demand, instead of converting the whole image before encoding it.
+ * 0 disables the chunked encoding.
+ */
+#ifndef JXL_CHUNKED_ENCODING_PIXELS
+#define JXL_CHUNKED_ENCODING_PIXELS (4096 * 4096)
+#endif
+
+/* *** JXL_DISABLE_STREAMING_OUTPUT ***
+ * The chunked encoding writes the compressed data to the device while encoding (with an output
+ * processor) instead of collecting it in memory. If you encounter problems (e.g. with devices
+ * that do not support seeking back) you can collect it in memory by defining
+ * JXL_DISABLE_STREAMING_OUTPUT.
+ */
+//#define JXL_DISABLE_STREAMING_OUTPUT // default commented
+
+/*!
+ * \brief sharedParallelRunner
+ * JxlParallelRunner that runs the tasks of libjxl on the calling thread and on the shared
+ * thread pool: concurrent decoders and encoders share the thread budget of the process.
+ */
+static JxlParallelRetCode sharedParallelRunner(void *runner_opaque,
+                                               void *jpegxl_opaque,
+                                               JxlParallelRunInit init,
+                                               JxlParallelRunFunction func,
+                                               uint32_t start_range,
+                                               uint32_t end_range)
+{
+    Q_UNUSED(runner_opaque)
+    const int threads = int(std::clamp<qint64>(qint64(end_range) - start_range, 1, std::max(1, maxThreadCount())));
+    const auto ret = init(jpegxl_opaque, size_t(threads));
+    if (ret != 0) {
+        return ret;
+    }
+
+    QAtomicInteger<qint64> next = start_range;
+    runConcurrently(threads, [&](int thread) {
+        for (auto i = next.fetchAndAddRelaxed(1); i < end_range; i = next.fetchAndAddRelaxed(1)) {
+            func(jpegxl_opaque, uint32_t(i), size_t(thread));
+        }
+    });
+    return JXL_PARALLEL_RET_SUCCESS;
+}
+
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 10, 0)
+/*!
+ * \brief The ChunkedInput class
+ * JxlChunkedFrameInputSource of the chunked encoding: the lines covered by the rectangles
+ * requested by the encoder are converted with a ScanLineConverter, one band at a time (the
+ * band is kept until the encoder has requested all its rectangles).
+ */
+class ChunkedInput
+{
+public:
+    ChunkedInput(const QImage &image, const ScanLineConverter &converter, const JxlPixelFormat &format)
+        : m_image(image)
+        , m_converter(converter)
+        , m_format(format)
+    {
+        m_pixelSize = qsizetype(format.num_channels) * (format.data_type == JXL_TYPE_UINT16 ? 2 : 1);
+        m_bytesPerLine = m_converter.targetBytesPerLine(image.width());
+        // RGBX64 lines are packed to 3 channels
+        m_pack = format.data_type == JXL_TYPE_UINT16 && format.num_channels == 3;
+    }
+    ChunkedInput(const ChunkedInput &other) = delete;
+    ChunkedInput &operator=(const ChunkedInput &other) = delete;
+
+    JxlChunkedFrameInputSource source()
+    {
+        JxlChunkedFrameInputSource source;
+        source.opaque = this;
+        source.get_color_channels_pixel_format = [](void *opaque, JxlPixelFormat *pixel_format) {
+            *pixel_format = static_cast<ChunkedInput *>(opaque)->m_format;
+        };
+        source.get_color_channel_data_at = [](void *opaque, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t *row_offset) -> const void * {
+            Q_UNUSED(xsize)
+            return static_cast<ChunkedInput *>(opaque)->data(xpos, ypos, ysize, row_offset);
+        };
+        // the alpha channel is interleaved with the color channels
+        source.get_extra_channel_pixel_format = [](void *opaque, size_t ec_index, JxlPixelFormat *pixel_format) {
+            Q_UNUSED(ec_index)
+            *pixel_format = static_cast<ChunkedInput *>(opaque)->m_format;
+        };
+        source.get_extra_channel_data_at =
+            [](void *opaque, size_t ec_index, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t *row_offset) -> const void * {
+            Q_UNUSED(ec_index)
+            Q_UNUSED(xsize)
+            return static_cast<ChunkedInput *>(opaque)->data(xpos, ypos, ysize, row_offset);
+        };
+        source.release_buffer = [](void *opaque, const void *buf) {
+            static_cast<ChunkedInput *>(opaque)->release(buf);
+        };
+        return source;
+    }
+
+private:
+    struct Band {
+        size_t y = 0;
+        size_t lines = 0;
+        QByteArray data;
+        int refs = 0;
+    };
+
+    const void *data(size_t xpos, size_t ypos, size_t ysize, size_t *row_offset)
+    {
+        QMutexLocker locker(&m_mutex);
+        auto band = std::find_if(m_bands.begin(), m_bands.end(), [ypos, ysize](const Band &b) {
+            return ypos >= b.y && ypos + ysize <= b.y + b.lines;
+        });
+        if (band == m_bands.end()) {
+            m_bands.remove_if([](const Band &b) {
+                return b.refs == 0;
+            });
+            Band b;
+            b.y = ypos;
+            b.lines = ysize;
+            b.data.resize(m_bytesPerLine * qsizetype(ysize));
+            if (b.data.size() != m_bytesPerLine * qsizetype(ysize)) {
+                return nullptr;
+            }
+            auto dest = reinterpret_cast<uchar *>(b.data.data());
+            if (!m_converter.convertScanLines(m_image, qint32(ypos), qint32(ysize), dest, m_bytesPerLine)) {
+                return nullptr;
+            }
+            if (m_pack) {
+                for (size_t y = 0; y < ysize; ++y) {
+                    auto line = reinterpret_cast<quint16 *>(dest + m_bytesPerLine * qsizetype(y));
+                    for (qint32 x = 0, w = m_image.width(); x < w; ++x) {
+                        line[x * 3] = line[x * 4];
+                        line[x * 3 + 1] = line[x * 4 + 1];
+                        line[x * 3 + 2] = line[x * 4 + 2];
+                    }
+                }
+            }
+            band = m_bands.insert(m_bands.end(), std::move(b));
+        }
+        ++band->refs;
+        *row_offset = size_t(m_bytesPerLine);
+        return band->data.constData() + m_bytesPerLine * qsizetype(ypos - band->y) + m_pixelSize * qsizetype(xpos);
+    }
+
+    void release(const void *buf)
+    {
+        QMutexLocker locker(&m_mutex);
+        auto p = static_cast<const char *>(buf);
+        for (auto &&band : m_bands) {
+            if (p >= band.data.constData() && p < band.data.constData() + band.data.size()) {
+                --band.refs;
+                break;
+            }
+        }
+    }
+
+    const QImage &m_image;
+    ScanLineConverter m_converter;
+    JxlPixelFormat m_format;
+    qsizetype m_pixelSize = 0;
+    qsizetype m_bytesPerLine = 0;
+    bool m_pack = false;
+    QMutex m_mutex;
+    std::list<Band> m_bands;
+};
+
+#ifndef JXL_DISABLE_STREAMING_OUTPUT
+/*!
+ * \brief The StreamingOutput class
+ * JxlEncoderOutputProcessor that writes the compressed data to the device while encoding. The
+ * encoder seeks back to fill in the sizes it did not know yet (only on random access devices).
+ */
+class StreamingOutput
+{
+public:
+    explicit StreamingOutput(QIODevice *device)
+        : m_device(device)
+        , m_start(device->isSequential() ? 0 : device->pos())
+        , m_end(m_start)
+    {
+    }
+    StreamingOutput(const StreamingOutput &other) = delete;
+    StreamingOutput &operator=(const StreamingOutput &other) = delete;
+
+    JxlEncoderOutputProcessor processor()
+    {
+        JxlEncoderOutputProcessor processor;
+        processor.opaque = this;
+        processor.get_buffer = [](void *opaque, size_t *size) -> void * {
+            return static_cast<StreamingOutput *>(opaque)->buffer(size);
+        };
+        processor.release_buffer = [](void *opaque, size_t written_bytes) {
+            static_cast<StreamingOutput *>(opaque)->write(written_bytes);
+        };
+        processor.seek = nullptr;
+        if (!m_device->isSequential()) {
+            processor.seek = [](void *opaque, uint64_t position) {
+                static_cast<StreamingOutput *>(opaque)->seek(position);
+            };
+        }
+        processor.set_finalized_position = [](void *opaque, uint64_t finalized_position) {
+            Q_UNUSED(opaque)
+            Q_UNUSED(finalized_position)
+        };
+        return processor;
+    }
+
+    /*!
+     * \brief finish
+     * Moves the device after the compressed data.
+     * \return True if all the data was written.
+     */
+    bool finish()
+    {
+        if (!m_device->isSequential() && m_device->pos() != m_end && !m_device->seek(m_end)) {
+            m_error = true;
+        }
+        return !m_error && m_written > 0;
+    }
+
+private:
+    void *buffer(size_t *size)
+    {
+        // the encoder uses its own buffer when this one is smaller than the data to write
+        m_buffer.resize(qsizetype(std::clamp(*size, size_t(4096), size_t(1024 * 1024))));
+        *size = size_t(m_buffer.size());
+        return m_buffer.data();
+    }
+
+    void write(size_t written_bytes)
+    {
+        if (written_bytes == 0) {
+            return;
+        }
+        if (m_device->write(m_buffer.constData(), qint64(written_bytes)) != qint64(written_bytes)) {
+            qWarning("Write error: %s\n", qUtf8Printable(m_device->errorString()));
+            m_error = true;
+        }
+        m_written += qint64(written_bytes);
+        if (!m_device->isSequential()) {
+            m_end = std::max(m_end, m_device->pos());
+        }
+    }
+
+    void seek(uint64_t position)
+    {
+        if (!m_device->seek(m_start + qint64(position))) {
+            m_error = true;
+        }
+    }
+
+    QIODevice *m_device;
+    qint64 m_start;
+    qint64 m_end;
+    qint64 m_written = 0;
+    bool m_error = false;
+    QByteArray m_buffer;
+};
+#endif // JXL_DISABLE_STREAMING_OUTPUT
+#endif // JPEGXL_NUMERIC_VERSION >= 0.10
+
+static int frameDelay(const JxlBasicInfo &basicinfo, const JxlFrameHeader &frame_header)
+{
+    if (basicinfo.animation.tps_denominator > 0 && basicinfo.animation.tps_numerator > 0) {
+        return (int)(0.5 + 1000.0 * frame_header.duration * basicinfo.animation.tps_denominator / basicinfo.animation.tps_numerator);
+    }
+    return 0;
+}
+
 QJpegXLHandler::QJpegXLHandler()
     : m_parseState(ParseJpegXLNotParsed)
     , m_quality(90)
     , m_currentimage_index(0)
     , m_previousimage_index(-1)
     , m_decoder(nullptr)
-    , m_runner(nullptr)
     , m_next_image_delay(0)
     , m_input_image_format(QImage::Format_Invalid)
-    , m_target_image_format(QImage::Format_Invalid)
     , m_buffer_size(0)
+    , m_progressive(false)
 {
 }
 
 QJpegXLHandler::~QJpegXLHandler()
 {
-    if (m_runner) {
-        JxlThreadParallelRunnerDestroy(m_runner);
-    }
+    // the frame decoded ahead uses the decoder
+    m_decodeAhead.clear();
     if (m_decoder) {
         JxlDecoderDestroy(m_decoder);
     }
@@ -42,6 +313,7 @@ QJpegXLHandler::~QJpegXLHandler()
 
 bool QJpegXLHandler::canRead() const
 {
+    m_decodeAhead.wait();
     if (m_parseState == ParseJpegXLNotParsed && !canRead(device())) {
         return false;
     }
@@ -89,7 +361,7 @@ bool QJpegXLHandler::ensureParsed() const
     return that->ensureDecoder();
 }
 
-bool QJpegXLHandler::ensureALLCounted() const
+bool QJpegXLHandler::ensureReady() const
 {
     if (!ensureParsed()) {
         return false;
@@ -101,6 +373,21 @@ bool QJpegXLHandler::ensureALLCounted() const
 
     QJpegXLHandler *that = const_cast<QJpegXLHandler *>(this);
 
+    return that->parseColorEncoding();
+}
+
+bool QJpegXLHandler::ensureALLCounted() const
+{
+    if (!ensureParsed()) {
+        return false;
+    }
+
+    if (!m_framedelays.isEmpty()) {
+        return true;
+    }
+
+    QJpegXLHandler *that = const_cast<QJpegXLHandler *>(this);
+
     return that->countALLFrames();
 }
 
@@ -110,13 +397,11 @@ bool QJpegXLHandler::ensureDecoder()
         return true;
     }
 
-    m_rawData = device()->readAll();
-
-    if (m_rawData.isEmpty()) {
+    if (!m_rawData.load(device())) {
         return false;
     }
 
-    JxlSignature signature = JxlSignatureCheck(reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size());
+    JxlSignature signature = JxlSignatureCheck(reinterpret_cast<const uint8_t *>(m_rawData.data()), m_rawData.size());
     if (signature != JXL_SIG_CODESTREAM && signature != JXL_SIG_CONTAINER) {
         m_parseState = ParseJpegXLError;
         return false;
@@ -129,22 +414,13 @@ bool QJpegXLHandler::ensureDecoder()
         return false;
     }
 
-    int num_worker_threads = QThread::idealThreadCount();
-    if (!m_runner && num_worker_threads >= 4) {
-        /* use half of the threads because plug-in is usually used in environment
-         * where application performs another tasks in backround (pre-load other images) */
-        num_worker_threads = num_worker_threads / 2;
-        num_worker_threads = qBound(2, num_worker_threads, 64);
-        m_runner = JxlThreadParallelRunnerCreate(nullptr, num_worker_threads);
-
-        if (JxlDecoderSetParallelRunner(m_decoder, JxlThreadParallelRunner, m_runner) != JXL_DEC_SUCCESS) {
-            qWarning("ERROR: JxlDecoderSetParallelRunner failed");
-            m_parseState = ParseJpegXLError;
-            return false;
-        }
+    if (JxlDecoderSetParallelRunner(m_decoder, sharedParallelRunner, nullptr) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSetParallelRunner failed");
+        m_parseState = ParseJpegXLError;
+        return false;
     }
 
-    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size()) != JXL_DEC_SUCCESS) {
+    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.data()), m_rawData.size()) != JXL_DEC_SUCCESS) {
         qWarning("ERROR: JxlDecoderSetInput failed");
         m_parseState = ParseJpegXLError;
         return false;
@@ -214,7 +490,7 @@ bool QJpegXLHandler::ensureDecoder()
     return true;
 }
 
-bool QJpegXLHandler::countALLFrames()
+bool QJpegXLHandler::parseColorEncoding()
 {
     if (m_parseState != ParseJpegXLBasicInfoParsed) {
         return false;
@@ -245,25 +521,25 @@ bool QJpegXLHandler::countALLFrames()
     m_input_pixel_format.align = 0;
     m_input_pixel_format.num_channels = 4;
 
+    // NOTE: the QImage formats match the layout of the output of libjxl, so the pixels are written
+    //       directly into the image (libjxl sets the alpha to opaque when the image has no alpha)
     if (m_basicinfo.bits_per_sample > 8) { // high bit depth
         m_input_pixel_format.data_type = JXL_TYPE_UINT16;
         m_buffer_size = 8 * (size_t)m_basicinfo.xsize * (size_t)m_basicinfo.ysize;
-        m_input_image_format = QImage::Format_RGBA64;
 
         if (loadalpha) {
-            m_target_image_format = QImage::Format_RGBA64;
+            m_input_image_format = QImage::Format_RGBA64;
         } else {
-            m_target_image_format = QImage::Format_RGBX64;
+            m_input_image_format = QImage::Format_RGBX64;
         }
     } else { // 8bit depth
         m_input_pixel_format.data_type = JXL_TYPE_UINT8;
         m_buffer_size = 4 * (size_t)m_basicinfo.xsize * (size_t)m_basicinfo.ysize;
-        m_input_image_format = QImage::Format_RGBA8888;
 
         if (loadalpha) {
-            m_target_image_format = QImage::Format_ARGB32;
+            m_input_image_format = QImage::Format_RGBA8888;
         } else {
-            m_target_image_format = QImage::Format_RGB32;
+            m_input_image_format = QImage::Format_RGBX8888;
         }
     }
 
@@ -312,11 +588,39 @@ bool QJpegXLHandler::countALLFrames()
         }
     }
 
-    if (m_basicinfo.have_animation) { // count all frames
-        JxlFrameHeader frame_header;
-        int delay;
+    if (!rewind()) {
+        return false;
+    }
+
+    m_next_image_delay = 0;
+    m_parseState = ParseJpegXLSuccess;
+    return true;
+}
+
+bool QJpegXLHandler::countALLFrames()
+{
+    m_framedelays.clear();
+    if (!m_basicinfo.have_animation) { // static picture
+        m_framedelays.append(0);
+        return true;
+    }
 
-        for (status = JxlDecoderProcessInput(m_decoder); status != JXL_DEC_SUCCESS; status = JxlDecoderProcessInput(m_decoder)) {
+    // the frame headers are read by a separate decoder, so counting does not move m_decoder
+    // and it is only done when the number of frames is actually needed
+    JxlDecoder *decoder = JxlDecoderCreate(nullptr);
+    if (!decoder) {
+        qWarning("ERROR: JxlDecoderCreate failed");
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    bool ok = JxlDecoderSetInput(decoder, reinterpret_cast<const uint8_t *>(m_rawData.data()), m_rawData.size()) == JXL_DEC_SUCCESS
+        && JxlDecoderSubscribeEvents(decoder, JXL_DEC_FRAME) == JXL_DEC_SUCCESS;
+    if (ok) {
+        JxlDecoderCloseInput(decoder);
+
+        JxlFrameHeader frame_header;
+        for (JxlDecoderStatus status = JxlDecoderProcessInput(decoder); status != JXL_DEC_SUCCESS; status = JxlDecoderProcessInput(decoder)) {
             if (status != JXL_DEC_FRAME) {
                 switch (status) {
                 case JXL_DEC_ERROR:
@@ -329,91 +633,115 @@ bool QJpegXLHandler::countALLFrames()
                     qWarning("Unexpected event %d instead of JXL_DEC_FRAME", status);
                     break;
                 }
-                m_parseState = ParseJpegXLError;
-                return false;
+                ok = false;
+                break;
             }
 
-            if (JxlDecoderGetFrameHeader(m_decoder, &frame_header) != JXL_DEC_SUCCESS) {
+            if (JxlDecoderGetFrameHeader(decoder, &frame_header) != JXL_DEC_SUCCESS) {
                 qWarning("ERROR: JxlDecoderGetFrameHeader failed");
-                m_parseState = ParseJpegXLError;
-                return false;
+                ok = false;
+                break;
             }
 
-            if (m_basicinfo.animation.tps_denominator > 0 && m_basicinfo.animation.tps_numerator > 0) {
-                delay = (int)(0.5 + 1000.0 * frame_header.duration * m_basicinfo.animation.tps_denominator / m_basicinfo.animation.tps_numerator);
-            } else {
-                delay = 0;
-            }
-
-            m_framedelays.append(delay);
-        }
-
-        if (m_framedelays.isEmpty()) {
-            qWarning("no frames loaded by the JXL plug-in");
-            m_parseState = ParseJpegXLError;
-            return false;
+            m_framedelays.append(frameDelay(m_basicinfo, frame_header));
         }
+    } else {
+        qWarning("ERROR: JxlDecoderSetInput failed");
+    }
+    JxlDecoderDestroy(decoder);
 
-        if (m_framedelays.count() == 1) {
-            qWarning("JXL file was marked as animation but it has only one frame.");
-            m_basicinfo.have_animation = JXL_FALSE;
-        }
-    } else { // static picture
-        m_framedelays.resize(1);
-        m_framedelays[0] = 0;
+    if (!ok) {
+        m_framedelays.clear();
+        m_parseState = ParseJpegXLError;
+        return false;
     }
 
-    if (!rewind()) {
+    if (m_framedelays.isEmpty()) {
+        qWarning("no frames loaded by the JXL plug-in");
+        m_parseState = ParseJpegXLError;
         return false;
     }
 
-    m_next_image_delay = m_framedelays[0];
-    m_parseState = ParseJpegXLSuccess;
+    if (m_framedelays.count() == 1) {
+        qWarning("JXL file was marked as animation but it has only one frame.");
+        m_basicinfo.have_animation = JXL_FALSE;
+    }
+
     return true;
 }
 
 bool QJpegXLHandler::decode_one_frame()
 {
     JxlDecoderStatus status = JxlDecoderProcessInput(m_decoder);
+    if (status != JXL_DEC_FRAME) {
+        qWarning("Unexpected event %d instead of JXL_DEC_FRAME", status);
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    JxlFrameHeader frame_header;
+    if (JxlDecoderGetFrameHeader(m_decoder, &frame_header) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderGetFrameHeader failed");
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    status = JxlDecoderProcessInput(m_decoder);
     if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
         qWarning("Unexpected event %d instead of JXL_DEC_NEED_IMAGE_OUT_BUFFER", status);
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    m_current_image = imageAlloc(m_basicinfo.xsize, m_basicinfo.ysize, m_input_image_format);
-    if (m_current_image.isNull()) {
+    // the memory of a previous frame is reused when the caller no longer uses it
+    QImage frame = imageReuse(m_recycled_image, m_basicinfo.xsize, m_basicinfo.ysize, m_input_image_format);
+    if (frame.isNull()) {
         qWarning("Memory cannot be allocated");
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    m_current_image.setColorSpace(m_colorspace);
+    frame.setColorSpace(m_colorspace);
 
-    if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, m_current_image.bits(), m_buffer_size) != JXL_DEC_SUCCESS) {
+    if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, frame.bits(), m_buffer_size) != JXL_DEC_SUCCESS) {
         qWarning("ERROR: JxlDecoderSetImageOutBuffer failed");
         m_parseState = ParseJpegXLError;
         return false;
     }
 
     status = JxlDecoderProcessInput(m_decoder);
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+    if (status == JXL_DEC_FRAME_PROGRESSION) {
+        // the 1:8 pass (upsampled by libjxl) is enough for the requested scaled size
+        if (JxlDecoderFlushImage(m_decoder) == JXL_DEC_SUCCESS) {
+            status = JXL_DEC_FULL_IMAGE;
+        } else {
+            status = JxlDecoderProcessInput(m_decoder);
+        }
+    }
+#endif
     if (status != JXL_DEC_FULL_IMAGE) {
         qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    if (m_target_image_format != m_input_image_format) {
-        m_current_image.convertTo(m_target_image_format);
+    if (m_scaledSize.isValid() && !m_scaledSize.isEmpty() && m_scaledSize != frame.size()) {
+        // the full size frame is not returned: its memory is reused by the next decode
+        m_current_image = frame.scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        m_recycled_image = frame;
+    } else {
+        // the current frame is reused by the decode after the next one: the caller has released it by then
+        m_recycled_image = std::exchange(m_current_image, frame);
     }
 
-    m_next_image_delay = m_framedelays[m_currentimage_index];
+    m_next_image_delay = frameDelay(m_basicinfo, frame_header);
     m_previousimage_index = m_currentimage_index;
 
-    if (m_framedelays.count() > 1) {
+    if (m_basicinfo.have_animation) {
         m_currentimage_index++;
 
-        if (m_currentimage_index >= m_framedelays.count()) {
+        if (frame_header.is_last) {
             if (!rewind()) {
                 return false;
             }
@@ -433,7 +761,8 @@ bool QJpegXLHandler::decode_one_frame()
 
 bool QJpegXLHandler::read(QImage *image)
 {
-    if (!ensureALLCounted()) {
+    m_decodeAhead.wait();
+    if (!ensureReady()) {
         return false;
     }
 
@@ -442,14 +771,91 @@ bool QJpegXLHandler::read(QImage *image)
         return jumpToNextImage();
     }
 
+    if (m_decodeAhead.isPending()) {
+        QImage frame;
+        auto decoded = m_decodeAhead.take(m_currentimage_index, &frame);
+        if (!decoded) {
+            if (!resyncDecoder()) {
+                return false;
+            }
+        } else {
+            setFrameState(m_ahead_state);
+            m_ahead_state = FrameState();
+            if (!*decoded) {
+                return false;
+            }
+            *image = m_current_image;
+            decodeAhead();
+            return true;
+        }
+    }
+
     if (decode_one_frame()) {
         *image = m_current_image;
+        decodeAhead();
         return true;
     } else {
         return false;
     }
 }
 
+QJpegXLHandler::FrameState QJpegXLHandler::frameState() const
+{
+    return FrameState{m_current_image, m_next_image_delay, m_previousimage_index, m_currentimage_index, m_parseState};
+}
+
+void QJpegXLHandler::setFrameState(const FrameState &state)
+{
+    m_current_image = state.image;
+    m_next_image_delay = state.next_image_delay;
+    m_previousimage_index = state.previousimage_index;
+    m_currentimage_index = state.currentimage_index;
+    m_parseState = state.parseState;
+}
+
+void QJpegXLHandler::decodeAhead()
+{
+    if (!m_basicinfo.have_animation || m_parseState != ParseJpegXLSuccess || !DecodeAhead::isEnabled()) {
+        return;
+    }
+    // the next frame is decoded by the decoder of the handler: the visible state is restored
+    // and the state after the frame is kept in m_ahead_state (the public functions wait for the
+    // end of the decode, and move the decoder back when they do not use the frame)
+    m_decodeAhead.start(m_currentimage_index, [this](QImage *image) {
+        const auto state = frameState();
+        const auto ok = decode_one_frame();
+        m_ahead_state = frameState();
+        setFrameState(state);
+        if (ok) {
+            *image = m_ahead_state.image;
+        }
+        return ok;
+    });
+}
+
+void QJpegXLHandler::dropDecodeAhead()
+{
+    if (m_decodeAhead.isPending()) {
+        m_decodeAhead.clear();
+        m_ahead_state = FrameState();
+        resyncDecoder();
+    }
+}
+
+bool QJpegXLHandler::resyncDecoder()
+{
+    // the decoder is after the frame decoded ahead: it is moved back to the current frame
+    const auto index = m_currentimage_index;
+    if (!rewind()) {
+        return false;
+    }
+    if (index > 0) {
+        JxlDecoderSkipFrames(m_decoder, index);
+    }
+    m_currentimage_index = index;
+    return true;
+}
+
 bool QJpegXLHandler::write(const QImage &image)
 {
     if (image.format() == QImage::Format_Invalid) {
@@ -548,17 +954,10 @@ bool QJpegXLHandler::write(const QImage &image)
         JxlEncoderSetCodestreamLevel(encoder, 10);
     }
 
-    void *runner = nullptr;
-    int num_worker_threads = qBound(1, QThread::idealThreadCount(), 64);
-
-    if (num_worker_threads > 1) {
-        runner = JxlThreadParallelRunnerCreate(nullptr, num_worker_threads);
-        if (JxlEncoderSetParallelRunner(encoder, JxlThreadParallelRunner, runner) != JXL_ENC_SUCCESS) {
-            qWarning("JxlEncoderSetParallelRunner failed");
-            JxlThreadParallelRunnerDestroy(runner);
-            JxlEncoderDestroy(encoder);
-            return false;
-        }
+    if (JxlEncoderSetParallelRunner(encoder, sharedParallelRunner, nullptr) != JXL_ENC_SUCCESS) {
+        qWarning("JxlEncoderSetParallelRunner failed");
+        JxlEncoderDestroy(encoder);
+        return false;
     }
 
     JxlPixelFormat pixel_format;
@@ -605,31 +1004,35 @@ bool QJpegXLHandler::write(const QImage &image)
         }
     }
 
-    const QImage tmpimage =
-        convert_color_profile ? image.convertToFormat(tmpformat).convertedToColorSpace(QColorSpace(QColorSpace::SRgb)) : image.convertToFormat(tmpformat);
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 10, 0)
+    // large images are converted on demand (see ChunkedInput)
+    const bool chunked = JXL_CHUNKED_ENCODING_PIXELS > 0 && qint64(image.width()) * image.height() >= qint64(JXL_CHUNKED_ENCODING_PIXELS);
+#else
+    const bool chunked = false;
+#endif
+
+    QImage tmpimage;
+    if (!chunked) {
+        tmpimage = convert_color_profile ? image.convertToFormat(tmpformat).convertedToColorSpace(QColorSpace(QColorSpace::SRgb))
+                                         : image.convertToFormat(tmpformat);
+    }
 
-    const size_t xsize = tmpimage.width();
-    const size_t ysize = tmpimage.height();
+    const size_t xsize = image.width();
+    const size_t ysize = image.height();
     const size_t buffer_size = (save_depth > 8) ? (2 * pixel_format.num_channels * xsize * ysize) : (pixel_format.num_channels * xsize * ysize);
 
-    if (xsize == 0 || ysize == 0 || tmpimage.isNull()) {
+    if (xsize == 0 || ysize == 0 || (!chunked && tmpimage.isNull())) {
         qWarning("Unable to allocate memory for output image");
-        if (runner) {
-            JxlThreadParallelRunnerDestroy(runner);
-        }
         JxlEncoderDestroy(encoder);
         return false;
     }
 
-    output_info.xsize = tmpimage.width();
-    output_info.ysize = tmpimage.height();
+    output_info.xsize = xsize;
+    output_info.ysize = ysize;
 
     status = JxlEncoderSetBasicInfo(encoder, &output_info);
     if (status != JXL_ENC_SUCCESS) {
         qWarning("JxlEncoderSetBasicInfo failed!");
-        if (runner) {
-            JxlThreadParallelRunnerDestroy(runner);
-        }
         JxlEncoderDestroy(encoder);
         return false;
     }
@@ -638,9 +1041,6 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderSetICCProfile(encoder, reinterpret_cast<const uint8_t *>(iccprofile.constData()), iccprofile.size());
         if (status != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetICCProfile failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -651,9 +1051,6 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderSetColorEncoding(encoder, &color_profile);
         if (status != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetColorEncoding failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -665,6 +1062,36 @@ bool QJpegXLHandler::write(const QImage &image)
 
     JxlEncoderSetFrameLossless(encoder_options, (m_quality == 100) ? JXL_TRUE : JXL_FALSE);
 
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 10, 0)
+    std::unique_ptr<ChunkedInput> chunked_input;
+    if (chunked) {
+        ScanLineConverter converter(tmpformat);
+        if (convert_color_profile) {
+            converter.setTargetColorSpace(QColorSpace(QColorSpace::SRgb));
+        }
+        chunked_input = std::make_unique<ChunkedInput>(image, converter, pixel_format);
+#ifndef JXL_DISABLE_STREAMING_OUTPUT
+        StreamingOutput output(device());
+        if (JxlEncoderSetOutputProcessor(encoder, output.processor()) != JXL_ENC_SUCCESS) {
+            qWarning("JxlEncoderSetOutputProcessor failed!");
+            JxlEncoderDestroy(encoder);
+            return false;
+        }
+        status = JxlEncoderAddChunkedFrame(encoder_options, JXL_TRUE, chunked_input->source());
+        if (status == JXL_ENC_SUCCESS) {
+            status = JxlEncoderFlushInput(encoder);
+        }
+        JxlEncoderDestroy(encoder);
+        if (status != JXL_ENC_SUCCESS) {
+            qWarning("JxlEncoderAddChunkedFrame failed!");
+            return false;
+        }
+        return output.finish();
+#else
+        status = JxlEncoderAddChunkedFrame(encoder_options, JXL_TRUE, chunked_input->source());
+#endif
+    } else
+#endif
     if (image.hasAlphaChannel() || ((save_depth == 8) && (xsize % 4 == 0))) {
         status = JxlEncoderAddImageFrame(encoder_options, &pixel_format, static_cast<const void *>(tmpimage.constBits()), buffer_size);
     } else {
@@ -672,9 +1099,6 @@ bool QJpegXLHandler::write(const QImage &image)
             uint16_t *tmp_buffer = new (std::nothrow) uint16_t[3 * xsize * ysize];
             if (!tmp_buffer) {
                 qWarning("Memory allocation error");
-                if (runner) {
-                    JxlThreadParallelRunnerDestroy(runner);
-                }
                 JxlEncoderDestroy(encoder);
                 return false;
             }
@@ -703,9 +1127,6 @@ bool QJpegXLHandler::write(const QImage &image)
             uchar *tmp_buffer8 = new (std::nothrow) uchar[3 * xsize * ysize];
             if (!tmp_buffer8) {
                 qWarning("Memory allocation error");
-                if (runner) {
-                    JxlThreadParallelRunnerDestroy(runner);
-                }
                 JxlEncoderDestroy(encoder);
                 return false;
             }
@@ -723,9 +1144,6 @@ bool QJpegXLHandler::write(const QImage &image)
 
     if (status == JXL_ENC_ERROR) {
         qWarning("JxlEncoderAddImageFrame failed!");
-        if (runner) {
-            JxlThreadParallelRunnerDestroy(runner);
-        }
         JxlEncoderDestroy(encoder);
         return false;
     }
@@ -747,17 +1165,11 @@ bool QJpegXLHandler::write(const QImage &image)
             compressed.resize(compressed.size() * 2);
         } else if (status == JXL_ENC_ERROR) {
             qWarning("JxlEncoderProcessOutput failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
     } while (status != JXL_ENC_SUCCESS);
 
-    if (runner) {
-        JxlThreadParallelRunnerDestroy(runner);
-    }
     JxlEncoderDestroy(encoder);
 
     compressed.resize(next_out - compressed.data());
@@ -777,9 +1189,13 @@ bool QJpegXLHandler::write(const QImage &image)
 
 QVariant QJpegXLHandler::option(ImageOption option) const
 {
+    m_decodeAhead.wait();
     if (option == Quality) {
         return m_quality;
     }
+    if (option == ScaledSize) {
+        return m_scaledSize;
+    }
 
     if (!supportsOption(option) || !ensureParsed()) {
         return QVariant();
@@ -788,6 +1204,12 @@ QVariant QJpegXLHandler::option(ImageOption option) const
     switch (option) {
     case Size:
         return QSize(m_basicinfo.xsize, m_basicinfo.ysize);
+    case ImageFormat:
+        // known after JXL_DEC_BASIC_INFO: nothing is decoded
+        if (m_basicinfo.bits_per_sample > 8) {
+            return m_basicinfo.alpha_bits > 0 ? QImage::Format_RGBA64 : QImage::Format_RGBX64;
+        }
+        return m_basicinfo.alpha_bits > 0 ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888;
     case Animation:
         if (m_basicinfo.have_animation) {
             return true;
@@ -801,6 +1223,7 @@ QVariant QJpegXLHandler::option(ImageOption option) const
 
 void QJpegXLHandler::setOption(ImageOption option, const QVariant &value)
 {
+    dropDecodeAhead();
     switch (option) {
     case Quality:
         m_quality = value.toInt();
@@ -810,6 +1233,9 @@ void QJpegXLHandler::setOption(ImageOption option, const QVariant &value)
             m_quality = 90;
         }
         return;
+    case ScaledSize:
+        m_scaledSize = value.toSize();
+        return;
     default:
         break;
     }
@@ -818,23 +1244,22 @@ void QJpegXLHandler::setOption(ImageOption option, const QVariant &value)
 
 bool QJpegXLHandler::supportsOption(ImageOption option) const
 {
-    return option == Quality || option == Size || option == Animation;
+    return option == Quality || option == Size || option == ImageFormat || option == ScaledSize || option == Animation;
 }
 
 int QJpegXLHandler::imageCount() const
 {
+    m_decodeAhead.wait();
     if (!ensureParsed()) {
         return 0;
     }
 
-    if (m_parseState == ParseJpegXLBasicInfoParsed) {
-        if (!m_basicinfo.have_animation) {
-            return 1;
-        }
+    if (!m_basicinfo.have_animation) {
+        return 1;
+    }
 
-        if (!ensureALLCounted()) {
-            return 0;
-        }
+    if (!ensureALLCounted()) {
+        return 0;
     }
 
     if (!m_framedelays.isEmpty()) {
@@ -845,6 +1270,7 @@ int QJpegXLHandler::imageCount() const
 
 int QJpegXLHandler::currentImageNumber() const
 {
+    m_decodeAhead.wait();
     if (m_parseState == ParseJpegXLNotParsed) {
         return -1;
     }
@@ -858,7 +1284,8 @@ int QJpegXLHandler::currentImageNumber() const
 
 bool QJpegXLHandler::jumpToNextImage()
 {
-    if (!ensureALLCounted()) {
+    dropDecodeAhead();
+    if (!ensureReady() || !ensureALLCounted()) {
         return false;
     }
 
@@ -880,7 +1307,8 @@ bool QJpegXLHandler::jumpToNextImage()
 
 bool QJpegXLHandler::jumpToImage(int imageNumber)
 {
-    if (!ensureALLCounted()) {
+    dropDecodeAhead();
+    if (!ensureReady() || !ensureALLCounted()) {
         return false;
     }
 
@@ -914,11 +1342,12 @@ bool QJpegXLHandler::jumpToImage(int imageNumber)
 
 int QJpegXLHandler::nextImageDelay() const
 {
-    if (!ensureALLCounted()) {
+    m_decodeAhead.wait();
+    if (!ensureReady()) {
         return 0;
     }
 
-    if (m_framedelays.count() < 2) {
+    if (!m_basicinfo.have_animation) {
         return 0;
     }
 
@@ -927,6 +1356,7 @@ int QJpegXLHandler::nextImageDelay() const
 
 int QJpegXLHandler::loopCount() const
 {
+    m_decodeAhead.wait();
     if (!ensureParsed()) {
         return 0;
     }
@@ -944,15 +1374,13 @@ bool QJpegXLHandler::rewind()
 
     JxlDecoderReleaseInput(m_decoder);
     JxlDecoderRewind(m_decoder);
-    if (m_runner) {
-        if (JxlDecoderSetParallelRunner(m_decoder, JxlThreadParallelRunner, m_runner) != JXL_DEC_SUCCESS) {
-            qWarning("ERROR: JxlDecoderSetParallelRunner failed");
-            m_parseState = ParseJpegXLError;
-            return false;
-        }
+    if (JxlDecoderSetParallelRunner(m_decoder, sharedParallelRunner, nullptr) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSetParallelRunner failed");
+        m_parseState = ParseJpegXLError;
+        return false;
     }
 
-    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size()) != JXL_DEC_SUCCESS) {
+    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.data()), m_rawData.size()) != JXL_DEC_SUCCESS) {
         qWarning("ERROR: JxlDecoderSetInput failed");
         m_parseState = ParseJpegXLError;
         return false;
@@ -960,19 +1388,35 @@ bool QJpegXLHandler::rewind()
 
     JxlDecoderCloseInput(m_decoder);
 
-    if (m_basicinfo.uses_original_profile) {
-        if (JxlDecoderSubscribeEvents(m_decoder, JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
-            qWarning("ERROR: JxlDecoderSubscribeEvents failed");
-            m_parseState = ParseJpegXLError;
-            return false;
-        }
-    } else {
-        if (JxlDecoderSubscribeEvents(m_decoder, JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
-            qWarning("ERROR: JxlDecoderSubscribeEvents failed");
-            m_parseState = ParseJpegXLError;
-            return false;
-        }
+    int events = JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE;
+    if (!m_basicinfo.uses_original_profile) {
+        events |= JXL_DEC_COLOR_ENCODING;
+    }
+
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+    // a still image scaled down by 8 or more: the progressive DC pass is enough
+    m_progressive = !m_basicinfo.have_animation && m_scaledSize.isValid() && !m_scaledSize.isEmpty()
+        && quint64(m_scaledSize.width()) * 8 <= m_basicinfo.xsize && quint64(m_scaledSize.height()) * 8 <= m_basicinfo.ysize;
+    if (m_progressive) {
+        events |= JXL_DEC_FRAME_PROGRESSION;
+    }
+#endif
+
+    if (JxlDecoderSubscribeEvents(m_decoder, events) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSubscribeEvents failed");
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+    if (m_progressive && JxlDecoderSetProgressiveDetail(m_decoder, kDC) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSetProgressiveDetail failed");
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+#endif
 
+    if (!m_basicinfo.uses_original_profile) {
         JxlDecoderStatus status = JxlDecoderProcessInput(m_decoder);
         if (status != JXL_DEC_COLOR_ENCODING) {
             qWarning("Unexpected event %d instead of JXL_DEC_COLOR_ENCODING", status);
@@ -19,6 +19,9 @@
 
 #include <jxl/decode.h>
 
+#include "decodeahead_p.h"
+#include "devicedata_p.h"
+
 class QJpegXLHandler : public QImageIOHandler
 {
 public:
@@ -46,8 +49,10 @@ public:
 
 private:
     bool ensureParsed() const;
+    bool ensureReady() const;
     bool ensureALLCounted() const;
     bool ensureDecoder();
+    bool parseColorEncoding();
     bool countALLFrames();
     bool decode_one_frame();
     bool rewind();
@@ -60,28 +65,69 @@ private:
         ParseJpegXLFinished = 3,
     };
 
+    /*!
+     * \brief The FrameState struct
+     * The state changed by decode_one_frame().
+     */
+    struct FrameState {
+        QImage image;
+        int next_image_delay = 0;
+        int previousimage_index = -1;
+        int currentimage_index = 0;
+        ParseJpegXLState parseState = ParseJpegXLNotParsed;
+    };
+    FrameState frameState() const;
+    void setFrameState(const FrameState &state);
+
+    void decodeAhead();
+    void dropDecodeAhead();
+    bool resyncDecoder();
+
     ParseJpegXLState m_parseState;
     int m_quality;
     int m_currentimage_index;
     int m_previousimage_index;
 
-    QByteArray m_rawData;
+    /*!
+     * \brief m_rawData
+     * The content of the device: mapped or shared when possible (see DeviceData).
+     */
+    DeviceData m_rawData;
 
     JxlDecoder *m_decoder;
-    void *m_runner;
     JxlBasicInfo m_basicinfo;
 
     QList<int> m_framedelays;
     int m_next_image_delay;
 
     QImage m_current_image;
+    QImage m_recycled_image; // the memory is reused by the next decode (see imageReuse())
     QColorSpace m_colorspace;
 
     QImage::Format m_input_image_format;
-    QImage::Format m_target_image_format;
 
     JxlPixelFormat m_input_pixel_format;
     size_t m_buffer_size;
+
+    /*!
+     * \brief m_scaledSize
+     * Value set by QImageReader::setScaledSize().
+     */
+    QSize m_scaledSize;
+
+    /*!
+     * \brief m_progressive
+     * True when only the progressive DC pass (1:8) is decoded (see m_scaledSize).
+     */
+    bool m_progressive;
+
+    /*!
+     * \brief m_decodeAhead
+     * The next frame decoded in background (see DecodeAhead): the key is the frame index and
+     * m_ahead_state is the state of the handler after the frame.
+     */
+    mutable DecodeAhead m_decodeAhead;
+    FrameState m_ahead_state;
 };
 
 class QJpegXLPlugin : public QImageIOPlugin
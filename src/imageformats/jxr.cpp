@@ -14,13 +14,14 @@
  * - https://github.com/bvibber/hdrfix/tree/main/samples
  */
 
+#include "devicedata_p.h"
 #include "jxr_p.h"
 #include "util_p.h"
 
+#include <QBuffer>
 #include <QColorSpace>
 #include <QCoreApplication>
 #include <QDataStream>
-#include <QFile>
 #include <QFloat16>
 #include <QHash>
 #include <QImage>
@@ -28,10 +29,10 @@
 #include <QLoggingCategory>
 #include <QSet>
 #include <QSharedData>
-#include <QTemporaryDir>
 
 #include <JXRGlue.h>
 #include <cstring>
+#include <new>
 
 Q_DECLARE_LOGGING_CATEGORY(LOG_JXRPLUGIN)
 Q_LOGGING_CATEGORY(LOG_JXRPLUGIN, "kf.imageformats.plugins.jxr", QtWarningMsg)
@@ -76,8 +77,10 @@ Q_LOGGING_CATEGORY(LOG_JXRPLUGIN, "kf.imageformats.plugins.jxr", QtWarningMsg)
 class JXRHandlerPrivate : public QSharedData
 {
 private:
-    QSharedPointer<QTemporaryDir> tempDir;
-    mutable QSharedPointer<QFile> jxrFile;
+    // read: the content of the device, the stream of the decoder works on it (no temporary files)
+    QSharedPointer<DeviceData> rawData;
+    // write: the memory buffer used when the target device is sequential
+    QSharedPointer<QBuffer> writeBuffer;
     mutable QHash<QString, QString> txtMeta;
 
 public:
@@ -88,7 +91,6 @@ public:
 
     JXRHandlerPrivate()
     {
-        tempDir = QSharedPointer<QTemporaryDir>(new QTemporaryDir);
         if (PKCreateFactory(&pFactory, PK_SDK_VERSION) == WMP_errSuccess) {
             PKCreateCodecFactory(&pCodecFactory, WMP_SDK_VERSION);
         }
@@ -114,11 +116,6 @@ public:
         }
     }
 
-    QString fileName() const
-    {
-        return jxrFile->fileName();
-    }
-
     /* *** READ *** */
 
     /*!
@@ -388,15 +385,33 @@ public:
     /*!
      * \brief initForWriting
      * Initialize the stream for writing.
+     * \param device The target device.
+     * \param ppStream The created stream: it is closed by the encoder (see finalizeWriting()).
      * \return True on success, otherwise false.
      */
-    bool initForWriting()
+    bool initForWriting(QIODevice *device, struct WMPStream **ppStream)
     {
-        // I have to use QFile because, on Windows, the QTemporary file is locked (even if I close it)
-        auto fileName = QStringLiteral("%1.jxr").arg(tempDir->filePath(QUuid::createUuid().toString(QUuid::WithoutBraces).left(8)));
-        QSharedPointer<QFile> file(new QFile(fileName));
-        jxrFile = file;
-        return initEncoder();
+        if (device == nullptr) {
+            return false;
+        }
+        // the encoder seeks back to complete the header: sequential devices are written through a buffer
+        QIODevice *target = device;
+        if (device->isSequential()) {
+            writeBuffer = QSharedPointer<QBuffer>(new QBuffer);
+            if (!writeBuffer->open(QBuffer::ReadWrite)) {
+                return false;
+            }
+            target = writeBuffer.data();
+        }
+        if (!createDeviceStream(ppStream, target)) {
+            qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::initForWriting() unable to create stream";
+            return false;
+        }
+        if (!initEncoder()) {
+            (*ppStream)->Close(ppStream);
+            return false;
+        }
+        return true;
     }
 
     /*!
@@ -415,9 +430,13 @@ public:
             return false;
         }
 
-        if (!deviceCopy(device, jxrFile.data())) {
-            qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::finalizeWriting() error while writing in the target device";
-            return false;
+        if (!writeBuffer.isNull()) {
+            const auto &&data = writeBuffer->data();
+            if (device->write(data) != data.size()) {
+                qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::finalizeWriting() error while writing in the target device";
+                return false;
+            }
+            writeBuffer.reset();
         }
         return true;
     }
@@ -638,35 +657,60 @@ private:
         return list;
     }
 
-    bool deviceCopy(QIODevice *target, QIODevice *source)
+    /*!
+     * \brief The DeviceStream struct
+     * jxrlib stream on a QIODevice: the positions are relative to the device position at creation.
+     */
+    struct DeviceStream {
+        struct WMPStream stream; // must be the first member
+        QIODevice *device;
+        qint64 offset;
+    };
+
+    /*!
+     * \brief createDeviceStream
+     * Creates a jxrlib stream that reads and writes \a device directly (\a device must be random access).
+     * \return True on success, otherwise false.
+     */
+    static bool createDeviceStream(struct WMPStream **ppWS, QIODevice *device)
     {
-        if (target == nullptr || source == nullptr) {
-            return false;
-        }
-        auto isTargetOpen = target->isOpen();
-        if (!isTargetOpen && !target->open(QIODevice::WriteOnly)) {
+        auto ds = new (std::nothrow) DeviceStream{};
+        if (ds == nullptr || ppWS == nullptr || device == nullptr) {
+            delete ds;
             return false;
         }
-        auto isSourceOpen = source->isOpen();
-        if (!isSourceOpen && !source->open(QIODevice::ReadOnly)) {
-            return false;
-        }
-        QByteArray buff(32768 * 4, char());
-        for (; !source->atEnd();) {
-            auto read = source->read(buff.data(), buff.size());
-            if (read < 1) {
-                return false;
-            }
-            if (target->write(buff.data(), read) != read) {
-                return false;
+        ds->device = device;
+        ds->offset = device->pos();
+
+        auto ws = &ds->stream;
+        ws->Close = [](struct WMPStream **pme) -> ERR {
+            if (pme && *pme) {
+                delete reinterpret_cast<DeviceStream *>(*pme);
+                *pme = nullptr;
             }
-        }
-        if (!isSourceOpen) {
-            source->close();
-        }
-        if (!isTargetOpen) {
-            target->close();
-        }
+            return WMP_errSuccess;
+        };
+        ws->EOS = [](struct WMPStream *me) -> Bool {
+            return reinterpret_cast<DeviceStream *>(me)->device->atEnd();
+        };
+        ws->Read = [](struct WMPStream *me, void *pv, size_t cb) -> ERR {
+            auto dev = reinterpret_cast<DeviceStream *>(me)->device;
+            return dev->read(static_cast<char *>(pv), qint64(cb)) == qint64(cb) ? WMP_errSuccess : WMP_errFileIO;
+        };
+        ws->Write = [](struct WMPStream *me, const void *pv, size_t cb) -> ERR {
+            auto dev = reinterpret_cast<DeviceStream *>(me)->device;
+            return dev->write(static_cast<const char *>(pv), qint64(cb)) == qint64(cb) ? WMP_errSuccess : WMP_errFileIO;
+        };
+        ws->SetPos = [](struct WMPStream *me, size_t offPos) -> ERR {
+            auto ds = reinterpret_cast<DeviceStream *>(me);
+            return ds->device->seek(ds->offset + qint64(offPos)) ? WMP_errSuccess : WMP_errFileIO;
+        };
+        ws->GetPos = [](struct WMPStream *me, size_t *poffPos) -> ERR {
+            auto ds = reinterpret_cast<DeviceStream *>(me);
+            *poffPos = size_t(ds->device->pos() - ds->offset);
+            return WMP_errSuccess;
+        };
+        *ppWS = ws;
         return true;
     }
 
@@ -675,21 +719,14 @@ private:
         if (device == nullptr) {
             return false;
         }
-        if (!jxrFile.isNull()) {
+        if (!rawData.isNull()) {
             return true;
         }
-        // I have to use QFile because, on Windows, the QTemporary file is locked (even if I close it)
-        auto fileName = QStringLiteral("%1.jxr").arg(tempDir->filePath(QUuid::createUuid().toString(QUuid::WithoutBraces).left(8)));
-        QSharedPointer<QFile> file(new QFile(fileName));
-        if (!file->open(QFile::WriteOnly)) {
-            return false;
-        }
-        if (!deviceCopy(file.data(), device)) {
-            qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::readDevice() error while writing in the target device";
+        QSharedPointer<DeviceData> data(new DeviceData);
+        if (!data->load(device)) {
             return false;
         }
-        file->close();
-        jxrFile = file;
+        rawData = data;
         return true;
     }
 
@@ -698,13 +735,27 @@ private:
         if (pDecoder) {
             return true;
         }
-        if (pCodecFactory == nullptr) {
+        if (pFactory == nullptr || pCodecFactory == nullptr || rawData.isNull()) {
+            return false;
+        }
+        // NOTE: the decoder only reads the stream, so the (possibly mapped) data is not modified
+        struct WMPStream *pStream = nullptr;
+        if (auto err = pFactory->CreateStreamFromMemory(&pStream, const_cast<char *>(rawData->data()), size_t(rawData->size()))) {
+            qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::initDecoder() unable to create stream:" << err;
             return false;
         }
-        if (auto err = pCodecFactory->CreateDecoderFromFile(qUtf8Printable(fileName()), &pDecoder)) {
+        if (auto err = pCodecFactory->CreateCodec(&IID_PKImageWmpDecode, (void **)&pDecoder)) {
             qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::initDecoder() unable to create decoder:" << err;
+            pStream->Close(&pStream);
+            return false;
+        }
+        if (auto err = pDecoder->Initialize(pDecoder, pStream)) {
+            qCWarning(LOG_JXRPLUGIN) << "JXRHandlerPrivate::initDecoder() unable to initialize decoder:" << err;
+            PKImageDecode_Release(&pDecoder);
+            pStream->Close(&pStream);
             return false;
         }
+        pDecoder->fStreamOwner = !0;
         return true;
     }
 
@@ -903,12 +954,8 @@ bool JXRHandler::read(QImage *outImage)
 
 bool JXRHandler::write(const QImage &image)
 {
-    if (!d->initForWriting()) {
-        return false;
-    }
     struct WMPStream *pEncodeStream = nullptr;
-    if (auto err = d->pFactory->CreateStreamFromFilename(&pEncodeStream, qUtf8Printable(d->fileName()), "wb")) {
-        qCWarning(LOG_JXRPLUGIN) << "JXRHandler::write() unable to create stream:" << err;
+    if (!d->initForWriting(device(), &pEncodeStream)) {
         return false;
     }
 
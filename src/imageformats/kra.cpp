@@ -10,16 +10,13 @@
 
 #include "kra.h"
 
-#include <kzip.h>
-
-#include <QFile>
 #include <QIODevice>
-#include <QImage>
 
 static constexpr char s_magic[] = "application/x-krita";
 static constexpr int s_magic_size = sizeof(s_magic) - 1; // -1 to remove the last \0
 
 KraHandler::KraHandler()
+    : ZipImageHandler(QStringLiteral("mergedimage.png"), QStringLiteral("preview.png"))
 {
 }
 
@@ -32,25 +29,6 @@ bool KraHandler::canRead() const
     return false;
 }
 
-bool KraHandler::read(QImage *image)
-{
-    KZip zip(device());
-    if (!zip.open(QIODevice::ReadOnly)) {
-        return false;
-    }
-
-    const KArchiveEntry *entry = zip.directory()->entry(QStringLiteral("mergedimage.png"));
-    if (!entry || !entry->isFile()) {
-        return false;
-    }
-
-    const KZipFileEntry *fileZipEntry = static_cast<const KZipFileEntry *>(entry);
-
-    image->loadFromData(fileZipEntry->data(), "PNG");
-
-    return true;
-}
-
 bool KraHandler::canRead(QIODevice *device)
 {
     if (!device) {
@@ -8,15 +8,16 @@
 #ifndef KIMG_KRA_H
 #define KIMG_KRA_H
 
+#include "zipimagehandler_p.h"
+
 #include <QImageIOPlugin>
 
-class KraHandler : public QImageIOHandler
+class KraHandler : public ZipImageHandler
 {
 public:
     KraHandler();
 
     bool canRead() const override;
-    bool read(QImage *image) override;
 
     static bool canRead(QIODevice *device);
 };
@@ -10,15 +10,13 @@
 
 #include "ora.h"
 
-#include <QImage>
-#include <QScopedPointer>
-
-#include <kzip.h>
+#include <QIODevice>
 
 static constexpr char s_magic[] = "image/openraster";
 static constexpr int s_magic_size = sizeof(s_magic) - 1; // -1 to remove the last \0
 
 OraHandler::OraHandler()
+    : ZipImageHandler(QStringLiteral("mergedimage.png"), QStringLiteral("Thumbnails/thumbnail.png"))
 {
 }
 
@@ -31,25 +29,6 @@ bool OraHandler::canRead() const
     return false;
 }
 
-bool OraHandler::read(QImage *image)
-{
-    KZip zip(device());
-    if (!zip.open(QIODevice::ReadOnly)) {
-        return false;
-    }
-
-    const KArchiveEntry *entry = zip.directory()->entry(QStringLiteral("mergedimage.png"));
-    if (!entry || !entry->isFile()) {
-        return false;
-    }
-
-    const KZipFileEntry *fileZipEntry = static_cast<const KZipFileEntry *>(entry);
-
-    image->loadFromData(fileZipEntry->data(), "PNG");
-
-    return true;
-}
-
 bool OraHandler::canRead(QIODevice *device)
 {
     if (!device) {
@@ -8,15 +8,16 @@
 #ifndef KIMG_ORA_H
 #define KIMG_ORA_H
 
+#include "zipimagehandler_p.h"
+
 #include <QImageIOPlugin>
 
-class OraHandler : public QImageIOHandler
+class OraHandler : public ZipImageHandler
 {
 public:
     OraHandler();
 
     bool canRead() const override;
-    bool read(QImage *image) override;
 
     static bool canRead(QIODevice *device);
 };
@@ -13,6 +13,9 @@
 #include <QDebug>
 #include <QImage>
 
+#include <algorithm>
+#include <cstring>
+
 #pragma pack(push, 1)
 class RGB
 {
@@ -230,40 +233,123 @@ PCXHEADER::PCXHEADER()
     s >> *this;
 }
 
-static bool readLine(QDataStream &s, QByteArray &buf, const PCXHEADER &header)
+/*!
+ * \brief The LineReader class
+ * Decodes the lines reading the device by chunks.
+ *
+ * The data read in advance is given back to the device by release() (or by the destructor) so that
+ * the data following the image (e.g. the palette of 8-bit images) can be read from the stream.
+ */
+class LineReader
 {
-    quint32 i = 0;
-    quint32 size = buf.size();
-    quint8 byte;
-    quint8 count;
+public:
+    explicit LineReader(QDataStream &s)
+        : m_device(s.device())
+    {
+    }
+    LineReader(const LineReader &other) = delete;
+    LineReader &operator=(const LineReader &other) = delete;
+
+    ~LineReader()
+    {
+        release();
+    }
+
+    bool atEnd() const
+    {
+        return m_pos >= m_size && (m_device == nullptr || m_device->atEnd());
+    }
+
+    /*!
+     * \brief readLine
+     * Decodes \a size bytes in \a buf.
+     */
+    bool readLine(uchar *buf, quint32 size, const PCXHEADER &header)
+    {
+        quint32 i = 0;
 
-    if (header.isCompressed()) {
-        // Uncompress the image data
-        while (i < size) {
-            count = 1;
-            s >> byte;
-            if (byte > 0xc0) {
-                count = byte - 0xc0;
-                s >> byte;
+        if (header.isCompressed()) {
+            // Uncompress the image data
+            while (i < size) {
+                if (!fill()) {
+                    return false;
+                }
+                quint32 count = 1;
+                quint8 byte = m_buffer[m_pos++];
+                if (byte > 0xc0) {
+                    count = byte - 0xc0;
+                    if (!fill()) {
+                        return false;
+                    }
+                    byte = m_buffer[m_pos++];
+                }
+                count = std::min(count, size - i);
+                memset(buf + i, byte, count);
+                i += count;
             }
-            while (count-- && i < size) {
-                buf[i++] = byte;
+        } else {
+            // Image is not compressed (possible?)
+            while (i < size) {
+                if (!fill()) {
+                    return false;
+                }
+                const quint32 count = std::min(quint32(m_size - m_pos), size - i);
+                memcpy(buf + i, m_buffer + m_pos, count);
+                m_pos += count;
+                i += count;
             }
         }
-    } else {
-        // Image is not compressed (possible?)
-        while (i < size) {
-            s >> byte;
-            buf[i++] = byte;
+
+        return true;
+    }
+
+    /*!
+     * \brief release
+     * Gives back to the device the data read but not decoded.
+     */
+    void release()
+    {
+        if (m_device && m_pos < m_size) {
+            if (m_device->isSequential()) {
+                for (auto i = m_size; i > m_pos; --i) {
+                    m_device->ungetChar(char(m_buffer[i - 1]));
+                }
+            } else {
+                m_device->seek(m_device->pos() - (m_size - m_pos));
+            }
         }
+        m_pos = m_size = 0;
     }
 
-    return (s.status() == QDataStream::Ok);
-}
+private:
+    bool fill()
+    {
+        if (m_pos < m_size) {
+            return true;
+        }
+        m_pos = m_size = 0;
+        if (m_device == nullptr) {
+            return false;
+        }
+        const auto read = m_device->read(reinterpret_cast<char *>(m_buffer), sizeof(m_buffer));
+        if (read <= 0) {
+            return false;
+        }
+        m_size = read;
+        return true;
+    }
+
+    QIODevice *m_device;
+    qint64 m_pos = 0;
+    qint64 m_size = 0;
+    uchar m_buffer[4096];
+};
 
 static bool readImage1(QImage &img, QDataStream &s, const PCXHEADER &header)
 {
     QByteArray buf(header.BytesPerLine, 0);
+    auto line = reinterpret_cast<uchar *>(buf.data());
+    LineReader reader(s);
 
     img = imageAlloc(header.width(), header.height(), QImage::Format_Mono);
     img.setColorCount(2);
@@ -273,20 +359,17 @@ static bool readImage1(QImage &img, QDataStream &s, const PCXHEADER &header)
         return false;
     }
 
+    const unsigned int bpl = qMin((quint16)((header.width() + 7) / 8), header.BytesPerLine);
     for (int y = 0; y < header.height(); ++y) {
-        if (s.atEnd()) {
+        if (reader.atEnd()) {
             return false;
         }
 
-        if (!readLine(s, buf, header)) {
+        if (!reader.readLine(line, header.BytesPerLine, header)) {
             return false;
         }
 
-        uchar *p = img.scanLine(y);
-        unsigned int bpl = qMin((quint16)((header.width() + 7) / 8), header.BytesPerLine);
-        for (unsigned int x = 0; x < bpl; ++x) {
-            p[x] = buf[x];
-        }
+        memcpy(img.scanLine(y), line, bpl);
     }
 
     // Set the color palette
@@ -298,8 +381,11 @@ static bool readImage1(QImage &img, QDataStream &s, const PCXHEADER &header)
 
 static bool readImage4(QImage &img, QDataStream &s, const PCXHEADER &header)
 {
-    QByteArray buf(header.BytesPerLine * 4, 0);
-    QByteArray pixbuf(header.width(), 0);
+    // NOTE: the extra bytes keep the pixel reads in the buffer even when BytesPerLine is too small
+    const quint32 planeSize = header.BytesPerLine;
+    QByteArray buf(planeSize * 4 + (header.width() + 7) / 8, 0);
+    auto planes = reinterpret_cast<uchar *>(buf.data());
+    LineReader reader(s);
 
     img = imageAlloc(header.width(), header.height(), QImage::Format_Indexed8);
     img.setColorCount(16);
@@ -309,30 +395,26 @@ static bool readImage4(QImage &img, QDataStream &s, const PCXHEADER &header)
     }
 
     for (int y = 0; y < header.height(); ++y) {
-        if (s.atEnd()) {
+        if (reader.atEnd()) {
             return false;
         }
 
-        pixbuf.fill(0);
-        if (!readLine(s, buf, header)) {
+        // the 4 planes are consecutive: a run can continue on the next plane
+        if (!reader.readLine(planes, planeSize * 4, header)) {
             return false;
         }
 
-        for (int i = 0; i < 4; i++) {
-            quint32 offset = i * header.BytesPerLine;
-            for (int x = 0; x < header.width(); ++x) {
-                if (buf[offset + (x / 8)] & (128 >> (x % 8))) {
-                    pixbuf[x] = (int)(pixbuf[x]) + (1 << i);
-                }
-            }
-        }
-
         uchar *p = img.scanLine(y);
-        if (!p) {
-            qWarning() << "Failed to get scanline for" << y << "might be out of bounds";
-        }
         for (int x = 0; x < header.width(); ++x) {
-            p[x] = pixbuf[x];
+            const auto offset = x / 8;
+            const auto mask = 128 >> (x % 8);
+            quint8 pixel = 0;
+            for (int i = 0; i < 4; i++) {
+                if (planes[i * planeSize + offset] & mask) {
+                    pixel |= (1 << i);
+                }
+            }
+            p[x] = pixel;
         }
     }
 
@@ -347,6 +429,8 @@ static bool readImage4(QImage &img, QDataStream &s, const PCXHEADER &header)
 static bool readImage8(QImage &img, QDataStream &s, const PCXHEADER &header)
 {
     QByteArray buf(header.BytesPerLine, 0);
+    auto line = reinterpret_cast<uchar *>(buf.data());
+    LineReader reader(s);
 
     img = imageAlloc(header.width(), header.height(), QImage::Format_Indexed8);
     img.setColorCount(256);
@@ -356,12 +440,13 @@ static bool readImage8(QImage &img, QDataStream &s, const PCXHEADER &header)
         return false;
     }
 
+    const unsigned int bpl = qMin(header.BytesPerLine, (quint16)header.width());
     for (int y = 0; y < header.height(); ++y) {
-        if (s.atEnd()) {
+        if (reader.atEnd()) {
             return false;
         }
 
-        if (!readLine(s, buf, header)) {
+        if (!reader.readLine(line, header.BytesPerLine, header)) {
             return false;
         }
 
@@ -370,12 +455,12 @@ static bool readImage8(QImage &img, QDataStream &s, const PCXHEADER &header)
             return false;
         }
 
-        unsigned int bpl = qMin(header.BytesPerLine, (quint16)header.width());
-        for (unsigned int x = 0; x < bpl; ++x) {
-            p[x] = buf[x];
-        }
+        memcpy(p, line, bpl);
     }
 
+    // the palette is read from the stream
+    reader.release();
+
     // by specification, the extended palette starts at file.size() - 769
     quint8 flag = 0;
     if (auto device = s.device()) {
@@ -407,9 +492,13 @@ static bool readImage8(QImage &img, QDataStream &s, const PCXHEADER &header)
 
 static bool readImage24(QImage &img, QDataStream &s, const PCXHEADER &header)
 {
-    QByteArray r_buf(header.BytesPerLine, 0);
-    QByteArray g_buf(header.BytesPerLine, 0);
-    QByteArray b_buf(header.BytesPerLine, 0);
+    // NOTE: the buffer is large enough for the pixels even when BytesPerLine is too small
+    const quint32 planeSize = std::max(quint32(header.BytesPerLine), quint32(header.width()));
+    QByteArray buf(planeSize * 3, 0);
+    auto r_buf = reinterpret_cast<uchar *>(buf.data());
+    auto g_buf = r_buf + planeSize;
+    auto b_buf = g_buf + planeSize;
+    LineReader reader(s);
 
     img = imageAlloc(header.width(), header.height(), QImage::Format_RGB32);
 
@@ -419,17 +508,17 @@ static bool readImage24(QImage &img, QDataStream &s, const PCXHEADER &header)
     }
 
     for (int y = 0; y < header.height(); ++y) {
-        if (s.atEnd()) {
+        if (reader.atEnd()) {
             return false;
         }
 
-        if (!readLine(s, r_buf, header)) {
+        if (!reader.readLine(r_buf, header.BytesPerLine, header)) {
             return false;
         }
-        if (!readLine(s, g_buf, header)) {
+        if (!reader.readLine(g_buf, header.BytesPerLine, header)) {
             return false;
         }
-        if (!readLine(s, b_buf, header)) {
+        if (!reader.readLine(b_buf, header.BytesPerLine, header)) {
             return false;
         }
 
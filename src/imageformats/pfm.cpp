@@ -17,6 +17,12 @@
 #include <QIODevice>
 #include <QImage>
 #include <QLoggingCategory>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 Q_DECLARE_LOGGING_CATEGORY(LOG_PFMPLUGIN)
 Q_LOGGING_CATEGORY(LOG_PFMPLUGIN, "kf.imageformats.plugins.pfm", QtWarningMsg)
@@ -157,6 +163,95 @@ public:
     }
 } ;
 
+/*!
+ * \brief encodeGray
+ * \return The 16-bit sRGB encoded value of the linear value \a f.
+ */
+static quint16 encodeGray(float f)
+{
+    f = f < 0.0031308f ? (f * 12.92f) : (1.055 * std::pow(f, 1.0 / 2.4) - 0.055);
+    return quint16(std::clamp(f, float(0), float(1)) * std::numeric_limits<quint16>::max() + float(0.5));
+}
+
+/*!
+ * \brief The PFMGrayTable class
+ * Tables to get the same results of encodeGray() without calling std::pow() for each pixel.
+ */
+class PFMGrayTable
+{
+public:
+    PFMGrayTable()
+        : m_threshold(65536)
+        , m_approx((ONE_BITS >> SHIFT) + 2)
+    {
+        // m_threshold[k] is the smallest value encoded as k (or more): the encoding is monotonic
+        m_threshold[0] = 0;
+        for (qint32 k = 1; k < 65536; ++k) {
+            auto v = (k - 0.5) / 65535.0;
+            auto guess = float(v < 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4));
+            auto bits = std::min(toBits(guess), ONE_BITS);
+            while (bits > 0 && encodeGray(fromBits(bits)) >= k) {
+                --bits;
+            }
+            while (encodeGray(fromBits(bits)) < k) {
+                ++bits;
+            }
+            m_threshold[k] = fromBits(bits);
+        }
+        // m_approx is the encoded value at the start of each interval of (1 << SHIFT) float values
+        for (quint32 i = 0, n = m_approx.size(); i < n; ++i) {
+            m_approx[i] = encodeGray(fromBits(std::min(i << SHIFT, ONE_BITS)));
+        }
+    }
+
+    quint16 encode(float f) const
+    {
+        if (!(f > 0)) {
+            return 0; // negative, zero and NaN
+        }
+        if (f >= 1) {
+            return std::numeric_limits<quint16>::max();
+        }
+        // linear interpolation of the approximation table followed by an exact correction
+        auto bits = toBits(f);
+        auto i = bits >> SHIFT;
+        qint32 k = m_approx[i] + ((qint32(m_approx[i + 1] - m_approx[i]) * qint32(bits & ((1 << SHIFT) - 1))) >> SHIFT);
+        while (k < 65535 && f >= m_threshold[k + 1]) {
+            ++k;
+        }
+        while (k > 0 && f < m_threshold[k]) {
+            --k;
+        }
+        return quint16(k);
+    }
+
+private:
+    static constexpr quint32 ONE_BITS = 0x3F800000; // 1.0f
+    static constexpr quint32 SHIFT = 15;
+
+    static quint32 toBits(float f)
+    {
+        quint32 bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+    static float fromBits(quint32 bits)
+    {
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    std::vector<float> m_threshold;
+    std::vector<quint16> m_approx;
+};
+
+static const PFMGrayTable &grayTable()
+{
+    static const PFMGrayTable table;
+    return table;
+}
+
 class PFMHandlerPrivate
 {
 public:
@@ -204,46 +299,52 @@ bool PFMHandler::read(QImage *image)
         return false;
     }
 
-    QDataStream s(device());
-    s.setFloatingPointPrecision(QDataStream::SinglePrecision);
-    s.setByteOrder(header.byteOrder());
-
     auto img = imageAlloc(header.size(), header.format());
     if (img.isNull()) {
         qCWarning(LOG_PFMPLUGIN) << "PFMHandler::read() error while allocating the image";
         return false;
     }
 
+    const auto bw = header.isBlackAndWhite();
+    const auto w = img.width();
+    const auto rowSize = qint64(w) * (bw ? 1 : 3) * sizeof(float);
+    QByteArray row;
+    if (bw) {
+        row.resize(rowSize);
+    }
+
     for (auto y = 0, h = img.height(); y < h; ++y) {
-        float f;
-        if (header.isBlackAndWhite()) {
-            auto line = reinterpret_cast<quint16*>(img.scanLine(header.isPhotoshop() ? y : h - y - 1));
-            for (auto x = 0, w = img.width(); x < w; ++x) {
-                s >> f;
-                // QColorSpace does not handle gray linear profile, so I have to convert to non-linear
-                f = f < 0.0031308f ? (f * 12.92f) : (1.055 * std::pow(f, 1.0 / 2.4) - 0.055);
-                line[x] = quint16(std::clamp(f, float(0), float(1)) * std::numeric_limits<quint16>::max() + float(0.5));
+        auto scanLine = img.scanLine(header.isPhotoshop() ? y : h - y - 1);
+        // RGB rows are read at the end of the RGBA scanline and expanded in place
+        auto data = bw ? row.data() : reinterpret_cast<char *>(scanLine) + qint64(w) * sizeof(float);
+        if (device()->read(data, rowSize) != rowSize) {
+            qCWarning(LOG_PFMPLUGIN) << "PFMHandler::read() detected corrupted data";
+            return false;
+        }
+        if (header.byteOrder() == QDataStream::BigEndian) {
+            qFromBigEndian<float>(data, rowSize / sizeof(float), data);
+        } else {
+            qFromLittleEndian<float>(data, rowSize / sizeof(float), data);
+        }
 
-                if (s.status() != QDataStream::Ok) {
-                    qCWarning(LOG_PFMPLUGIN) << "PFMHandler::read() detected corrupted data";
-                    return false;
-                }
+        auto src = reinterpret_cast<const float *>(data);
+        if (bw) {
+            auto line = reinterpret_cast<quint16 *>(scanLine);
+            for (auto x = 0; x < w; ++x) {
+                // QColorSpace does not handle gray linear profile, so I have to convert to non-linear
+                line[x] = grayTable().encode(src[x]);
             }
         } else {
-            auto line = reinterpret_cast<float*>(img.scanLine(header.isPhotoshop() ? y : h - y - 1));
-            for (auto x = 0, n = img.width() * 4; x < n; x += 4) {
-                s >> f;
-                line[x] = std::clamp(f, float(0), float(1));
-                s >> f;
-                line[x + 1] = std::clamp(f, float(0), float(1));
-                s >> f;
-                line[x + 2] = std::clamp(f, float(0), float(1));
-                line[x + 3] = float(1);
-
-                if (s.status() != QDataStream::Ok) {
-                    qCWarning(LOG_PFMPLUGIN) << "PFMHandler::read() detected corrupted data";
-                    return false;
-                }
+            // the source is always ahead of the destination: each pixel is read before it is overwritten
+            auto line = reinterpret_cast<float *>(scanLine);
+            for (auto x = 0; x < w; ++x) {
+                auto r = src[x * 3];
+                auto g = src[x * 3 + 1];
+                auto b = src[x * 3 + 2];
+                line[x * 4] = std::clamp(r, float(0), float(1));
+                line[x * 4 + 1] = std::clamp(g, float(0), float(1));
+                line[x * 4 + 2] = std::clamp(b, float(0), float(1));
+                line[x * 4 + 3] = float(1);
             }
         }
     }
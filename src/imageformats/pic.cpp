@@ -14,7 +14,9 @@
  */
 
 #include "pic_p.h"
+#include "devicedata_p.h"
 #include "rle_p.h"
+#include "threadpool_p.h"
 #include "util_p.h"
 
 #include <QDataStream>
@@ -26,6 +28,14 @@
 #include <qendian.h>
 #include <utility>
 
+/* *** PIC_ENCODING_BAND ***
+ * On write, the rows are encoded in bands of PIC_ENCODING_BAND rows by the threads of the
+ * shared thread pool (see threadpool_p.h): a band is kept in memory until it is written.
+ */
+#ifndef PIC_ENCODING_BAND
+#define PIC_ENCODING_BAND 64
+#endif
+
 /**
  * Reads a PIC file header from a data stream.
  *
@@ -159,25 +169,32 @@ static QDataStream &operator<<(QDataStream &s, const QList<PicChannel> &channels
     return s;
 }
 
-static bool readRow(QDataStream &stream, QRgb *row, quint16 width, const QList<PicChannel> &channels)
+/*!
+ * \brief readRow
+ * Decodes a row from the memory buffer \a input of \a ilen bytes.
+ * \return The number of bytes of \a input used, or -1 on error.
+ */
+static qint64 readRow(const uchar *input, qint64 ilen, QRgb *row, quint16 width, const QList<PicChannel> &channels)
 {
+    qint64 ip = 0;
     for (const PicChannel &channel : channels) {
-        auto readPixel = [&](QDataStream &str) -> QRgb {
+        const qint64 pixelSize = ((channel.code & RED) ? 1 : 0) + ((channel.code & GREEN) ? 1 : 0) + ((channel.code & BLUE) ? 1 : 0) + ((channel.code & ALPHA) ? 1 : 0);
+        auto readPixel = [&](const uchar *p) -> QRgb {
             quint8 red = 0;
             if (channel.code & RED) {
-                str >> red;
+                red = *p++;
             }
             quint8 green = 0;
             if (channel.code & GREEN) {
-                str >> green;
+                green = *p++;
             }
             quint8 blue = 0;
             if (channel.code & BLUE) {
-                str >> blue;
+                blue = *p++;
             }
             quint8 alpha = 0;
             if (channel.code & ALPHA) {
-                str >> alpha;
+                alpha = *p++;
             }
             return qRgba(red, green, blue, alpha);
         };
@@ -188,26 +205,27 @@ static bool readRow(QDataStream &stream, QRgb *row, quint16 width, const QList<P
                          qAlpha((channel.code & ALPHA) ? newPixel : oldPixel));
         };
         if (channel.encoding == MixedRLE) {
-            bool success = decodeRLEData(RLEVariant::PIC, stream, row, width, readPixel, updatePixel);
-            if (!success) {
+            const qint64 used = decodeRLEData(RLEVariant::PIC, input + ip, ilen - ip, pixelSize, row, width, readPixel, updatePixel);
+            if (used < 0) {
                 qDebug() << "decodeRLEData failed";
-                return false;
+                return -1;
             }
+            ip += used;
         } else if (channel.encoding == Uncompressed) {
-            for (quint16 i = 0; i < width; ++i) {
-                QRgb pixel = readPixel(stream);
-                row[i] = updatePixel(row[i], pixel);
+            if (ip + pixelSize * width > ilen) {
+                qDebug() << "Unexpected end of data";
+                return -1;
+            }
+            for (quint16 i = 0; i < width; ++i, ip += pixelSize) {
+                row[i] = updatePixel(row[i], readPixel(input + ip));
             }
         } else {
             // unknown encoding
             qDebug() << "Unknown encoding";
-            return false;
+            return -1;
         }
     }
-    if (stream.status() != QDataStream::Ok) {
-        qDebug() << "DataStream status was" << stream.status();
-    }
-    return stream.status() == QDataStream::Ok;
+    return ip;
 }
 
 bool SoftimagePICHandler::canRead() const
@@ -246,13 +264,20 @@ bool SoftimagePICHandler::read(QImage *image)
 
     img.fill(qRgb(0, 0, 0));
 
+    // the rows are decoded from memory (the file is mapped when possible)
+    DeviceData data;
+    data.load(m_dataStream.device());
+    auto input = reinterpret_cast<const uchar *>(data.data());
+    qint64 ip = 0;
     for (int y = 0; y < m_header.height; y++) {
         QRgb *row = reinterpret_cast<QRgb *>(img.scanLine(y));
-        if (!readRow(m_dataStream, row, m_header.width, m_channels)) {
+        const qint64 used = readRow(input + ip, data.size() - ip, row, m_header.width, m_channels);
+        if (used < 0) {
             qDebug() << "readRow failed";
             m_state = Error;
             return false;
         }
+        ip += used;
     }
 
     *image = img;
@@ -288,21 +313,29 @@ bool SoftimagePICHandler::write(const QImage &_image)
     }
     stream << channels;
 
-    for (int r = 0; r < image.height(); r++) {
-        const QRgb *row = reinterpret_cast<const QRgb *>(image.scanLine(r));
+    const int width = image.width();
+    const qint64 rowSize = encodeRLEBound(width, 3) + (alpha ? encodeRLEBound(width, 1) : 0);
+    auto encodeRow = [&image, width, rowSize, alpha, this](int r, QByteArray &buffer) {
+        buffer.resize(rowSize);
+        const QRgb *row = reinterpret_cast<const QRgb *>(image.constScanLine(r));
+        uchar *const begin = reinterpret_cast<uchar *>(buffer.data());
+        uchar *out = begin;
 
         /* Write the RGB part of the scanline */
         auto rgbEqual = [](QRgb p1, QRgb p2) -> bool {
             return qRed(p1) == qRed(p2) && qGreen(p1) == qGreen(p2) && qBlue(p1) == qBlue(p2);
         };
-        auto writeRgb = [](QDataStream &str, QRgb pixel) -> void {
-            str << quint8(qRed(pixel)) << quint8(qGreen(pixel)) << quint8(qBlue(pixel));
+        auto writeRgb = [](uchar *o, QRgb pixel) -> uchar * {
+            *o++ = quint8(qRed(pixel));
+            *o++ = quint8(qGreen(pixel));
+            *o++ = quint8(qBlue(pixel));
+            return o;
         };
         if (m_compression) {
-            encodeRLEData(RLEVariant::PIC, stream, row, image.width(), rgbEqual, writeRgb);
+            out = encodeRLEData(RLEVariant::PIC, out, row, width, rgbEqual, writeRgb);
         } else {
-            for (int i = 0; i < image.width(); ++i) {
-                writeRgb(stream, row[i]);
+            for (int i = 0; i < width; ++i) {
+                out = writeRgb(out, row[i]);
             }
         }
 
@@ -311,17 +344,35 @@ bool SoftimagePICHandler::write(const QImage &_image)
             auto alphaEqual = [](QRgb p1, QRgb p2) -> bool {
                 return qAlpha(p1) == qAlpha(p2);
             };
-            auto writeAlpha = [](QDataStream &str, QRgb pixel) -> void {
-                str << quint8(qAlpha(pixel));
+            auto writeAlpha = [](uchar *o, QRgb pixel) -> uchar * {
+                *o++ = quint8(qAlpha(pixel));
+                return o;
             };
             if (m_compression) {
-                encodeRLEData(RLEVariant::PIC, stream, row, image.width(), alphaEqual, writeAlpha);
+                out = encodeRLEData(RLEVariant::PIC, out, row, width, alphaEqual, writeAlpha);
             } else {
-                for (int i = 0; i < image.width(); ++i) {
-                    writeAlpha(stream, row[i]);
+                for (int i = 0; i < width; ++i) {
+                    out = writeAlpha(out, row[i]);
                 }
             }
         }
+        buffer.resize(out - begin);
+    };
+
+    // the rows are independent: a band of rows is encoded in memory by the threads of the
+    // shared pool, then the rows are written in order (one write per row)
+    QList<QByteArray> rows(PIC_ENCODING_BAND);
+    for (int y = 0; y < image.height(); y += PIC_ENCODING_BAND) {
+        const int lines = std::min(PIC_ENCODING_BAND, image.height() - y);
+        QAtomicInt next = 0;
+        runConcurrently(lines, [&](int) {
+            for (int i = next.fetchAndAddRelaxed(1); i < lines; i = next.fetchAndAddRelaxed(1)) {
+                encodeRow(y + i, rows[i]);
+            }
+        });
+        for (int i = 0; i < lines; ++i) {
+            stream.writeRawData(rows.at(i).constData(), rows.at(i).size());
+        }
     }
     return stream.status() == QDataStream::Ok;
 }
@@ -34,6 +34,7 @@
 
 #include "fastmath_p.h"
 #include "psd_p.h"
+#include "rle_p.h"
 #include "scanlineconverter_p.h"
 #include "util_p.h"
 
@@ -42,8 +43,15 @@
 #include <QImage>
 #include <QColorSpace>
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
+#include <functional>
+
+#ifndef PSD_DISABLE_PARALLEL_DECODING
+#include "threadpool_p.h"
+#include <QAtomicInt>
+#endif
 
 typedef quint32 uint;
 typedef quint16 ushort;
@@ -68,6 +76,27 @@ typedef quint8 uchar;
  */
 //#define PSD_NATIVE_CMYK_SUPPORT_DISABLED
 
+/* *** PSD_DISABLE_PARALLEL_DECODING ***
+ * The lines of the channels of images that do not need a color conversion are decoded using
+ * the threads of the shared thread pool (see processLines() and KIMAGEFORMATS_MAX_THREADS). If
+ * you encounter problems you can decode them on the calling thread only by defining
+ * PSD_DISABLE_PARALLEL_DECODING.
+ */
+//#define PSD_DISABLE_PARALLEL_DECODING // default commented
+
+/* *** PSD_LAYER_SEQUENCE ***
+ * The layers can be read as an image sequence: the merged image (image 0) followed by the layers
+ * with pixels (see PSDHandler::imageCount()). The sequence changes what the handler returns, so
+ * it is opt-in: it is enabled by setting the KIMAGEFORMATS_PSD_LAYERS environment variable to 1,
+ * or always by defining PSD_LAYER_SEQUENCE.
+ */
+//#define PSD_LAYER_SEQUENCE // default commented
+
+/*
+ * The maximum size of the compressed data read at once while decoding a channel.
+ */
+#define PSD_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
 namespace // Private.
 {
 
@@ -99,6 +128,8 @@ enum ColorMode : quint16 {
 
 enum ImageResourceId : quint16 {
     IRI_RESOLUTIONINFO = 0x03ED,
+    IRI_THUMBNAIL_PS4 = 0x0409, // Photoshop 4.0: JPEG data in BGR order
+    IRI_THUMBNAIL = 0x040C,
     IRI_ICCPROFILE = 0x040F,
     IRI_TRANSPARENCYINDEX = 0x0417,
     IRI_VERSIONINFO = 0x0421,
@@ -108,7 +139,9 @@ enum ImageResourceId : quint16 {
 enum LayerId : quint32 {
     LI_MT16 = 0x4D743136,   // 'Mt16',
     LI_MT32 = 0x4D743332,   // 'Mt32',
-    LI_MTRN = 0x4D74726E    // 'Mtrn'
+    LI_MTRN = 0x4D74726E,   // 'Mtrn'
+    LI_LR16 = 0x4C723136,   // 'Lr16'
+    LI_LR32 = 0x4C723332    // 'Lr32'
 };
 
 struct PSDHeader {
@@ -154,6 +187,39 @@ using PSDImageResourceSection = QHash<quint16, PSDImageResourceBlock>;
 struct PSDLayerInfo {
     qint64 size = -1;
     qint16 layerCount = 0;
+    qint64 offset = -1; // position of the layer count
+};
+
+/*!
+ * \brief The PSDLayerChannel struct
+ * A channel of a layer record: the id is the color component (0, 1, ...),
+ * -1 for the transparency mask and less than -1 for the user masks.
+ */
+struct PSDLayerChannel {
+    qint16 id = 0;
+    qint64 size = 0;    // size of the channel data (compression included)
+    qint64 offset = -1; // position of the channel data (compression included)
+};
+
+/*!
+ * \brief The PSDLayerRecord struct
+ * The information needed to decode a layer.
+ */
+struct PSDLayerRecord {
+    QRect rect;
+    QString name;
+    QList<PSDLayerChannel> channels;
+};
+
+/*!
+ * \brief The PSDChannelData struct
+ * Compression, size and absolute position of the lines of the planar channels of an image
+ * (the merged one or a layer). The line y of the channel c is at index c * height + y.
+ */
+struct PSDChannelData {
+    QList<quint16> compression;
+    QList<quint32> strides;
+    QList<quint64> stridePositions;
 };
 
 struct PSDGlobalLayerMaskInfo {
@@ -164,6 +230,7 @@ struct PSDAdditionalLayerInfo {
     Signature signature = Signature();
     LayerId id = LayerId();
     qint64 size = -1;
+    qint64 offset = -1; // position of the data
 };
 
 struct PSDLayerAndMaskSection {
@@ -398,6 +465,9 @@ PSDAdditionalLayerInfo readAdditionalLayer(QDataStream &s, bool *ok = nullptr)
     if (!*ok)
         return li;
 
+    if (auto dev = s.device())
+        li.offset = dev->pos();
+
     *ok = skip_data(s, li.size);
 
     return li;
@@ -421,6 +491,7 @@ PSDLayerAndMaskSection readLayerAndMaskSection(QDataStream &s, bool isPsb, bool
     if (s.status() == QDataStream::Ok && !lms.atEnd(isPsb)) {
         lms.layerInfo.size = readSize(s, isPsb);
         if (lms.layerInfo.size > 0) {
+            lms.layerInfo.offset = device->pos();
             s >> lms.layerInfo.layerCount;
             skip_data(s, lms.layerInfo.size - sizeof(lms.layerInfo.layerCount));
         }
@@ -448,6 +519,97 @@ PSDLayerAndMaskSection readLayerAndMaskSection(QDataStream &s, bool isPsb, bool
     return lms;
 }
 
+/*!
+ * \brief readLayerRecords
+ * Reads the layer records and calculates the positions of the channel data of each layer.
+ * \param s The stream positioned on the layer count of the layer info.
+ * \param isPsb True if the file is a PSB.
+ * \param ok Pointer to the operation result variable.
+ * \return The layer records in file order (from the bottom layer to the top one).
+ */
+static QList<PSDLayerRecord> readLayerRecords(QDataStream &s, bool isPsb, bool *ok = nullptr)
+{
+    QList<PSDLayerRecord> layers;
+
+    bool tmp = true;
+    if (ok == nullptr)
+        ok = &tmp;
+    *ok = false;
+
+    auto device = s.device();
+    if (device == nullptr)
+        return layers;
+
+    // If the count is negative, its absolute value is the number of layers and the first
+    // alpha channel contains the transparency data for the merged result.
+    qint16 count;
+    s >> count;
+    for (qint32 i = 0, n = std::abs(qint32(count)); i < n && s.status() == QDataStream::Ok; ++i) {
+        PSDLayerRecord lr;
+        qint32 top, left, bottom, right;
+        s >> top >> left >> bottom >> right;
+        if (bottom < top || right < left) {
+            qDebug() << "Invalid layer" << i << "bounds";
+            return {};
+        }
+        lr.rect = QRect(left, top, right - left, bottom - top);
+
+        quint16 channelCount;
+        s >> channelCount;
+        for (quint16 c = 0; c < channelCount; ++c) {
+            PSDLayerChannel ch;
+            s >> ch.id;
+            ch.size = readSize(s, isPsb);
+            if (ch.size < 0) {
+                qDebug() << "Invalid layer" << i << "channel" << c << "size";
+                return {};
+            }
+            lr.channels.append(ch);
+        }
+
+        quint32 signature;
+        quint32 blendMode;
+        s >> signature >> blendMode;
+        if (signature != S_8BIM) {
+            qDebug() << "Invalid layer" << i << "blend mode signature";
+            return {};
+        }
+
+        // opacity, clipping, flags and filler (not used)
+        s.skipRawData(4);
+
+        // Extra data: layer mask data, blending ranges, name and additional layer information
+        quint32 extraSize;
+        s >> extraSize;
+        auto extraPos = device->pos();
+        if (!skip_section(s) || !skip_section(s)) {
+            qDebug() << "Error while skipping the mask data of the layer" << i;
+            return {};
+        }
+        lr.name = readPascalString(s, 4);
+        if (!device->seek(extraPos + extraSize)) {
+            qDebug() << "Error while skipping the extra data of the layer" << i;
+            return {};
+        }
+
+        layers.append(lr);
+    }
+    if (s.status() != QDataStream::Ok)
+        return {};
+
+    // The channel image data follows the records: layers and channels are in the same order of the records
+    auto offset = device->pos();
+    for (auto &&lr : layers) {
+        for (auto &&ch : lr.channels) {
+            ch.offset = offset;
+            offset += ch.size;
+        }
+    }
+
+    *ok = true;
+    return layers;
+}
+
 /*!
  * \brief readColorModeDataSection
  * Read the color mode section
@@ -579,6 +741,49 @@ static bool setResolution(QImage& img, const PSDImageResourceSection& irs)
     return true;
 }
 
+/*!
+ * \brief loadThumbnail
+ * Decodes the JPEG thumbnail stored in the image resources when it is large enough for \a scaledSize.
+ * \param img The thumbnail scaled to \a scaledSize.
+ * \param irs The image resource section.
+ * \param scaledSize The requested size.
+ * \return True on success, otherwise false.
+ */
+static bool loadThumbnail(QImage &img, const PSDImageResourceSection &irs, const QSize &scaledSize)
+{
+    auto id = IRI_THUMBNAIL;
+    if (!irs.contains(id))
+        id = IRI_THUMBNAIL_PS4;
+    if (!irs.contains(id) || !scaledSize.isValid() || scaledSize.isEmpty())
+        return false;
+    auto irb = irs.value(id);
+
+    QDataStream s(irb.data);
+    s.setByteOrder(QDataStream::BigEndian);
+
+    quint32 format;
+    quint32 width;
+    quint32 height;
+    s >> format >> width >> height;
+    s.skipRawData(16);                      // Width bytes, total size, compressed size, bits per pixel and planes
+    if (s.status() != QDataStream::Ok || format != 1) // 1 = kJpegRGB
+        return false;
+    if (quint32(scaledSize.width()) > width || quint32(scaledSize.height()) > height)
+        return false;
+
+    if (irb.data.size() <= 28)
+        return false;
+    auto thumbnail = QImage::fromData(QByteArrayView(irb.data).sliced(28), "JPG");
+    if (thumbnail.isNull())
+        return false;
+    if (id == IRI_THUMBNAIL_PS4)
+        thumbnail.rgbSwap();
+    if (thumbnail.size() != scaledSize)
+        thumbnail = thumbnail.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    img = thumbnail;
+    return true;
+}
+
 /*!
  * \brief setTransparencyIndex
  * Search for transparency index block and, if found, changes the alpha of the value at the given index.
@@ -697,18 +902,40 @@ static bool IsSupported(const PSDHeader &header)
 }
 
 /*!
- * \brief decompress
- * Fast PackBits decompression.
+ * \brief decompressToChunchy
+ * PackBits decompression of a planar line directly into an interleaved (chunchy) line.
+ * It is the same as calling decodePackBits() followed by planarToChunchy<T>() on the range [x, x + width).
  * \param input The compressed input buffer.
  * \param ilen The input buffer size.
- * \param output The uncompressed target buffer.
- * \param olen The target buffer size.
- * \return The number of valid bytes in the target buffer.
+ * \param lineWidth The number of samples of the uncompressed line.
+ * \param target The (interleaved) target line.
+ * \param x The first sample of the line to write.
+ * \param width The number of samples to write.
+ * \param c The channel to write.
+ * \param cn The number of channels of the target.
+ * \return The number of valid bytes decoded or -1 on error.
  */
-qint64 decompress(const char *input, qint64 ilen, char *output, qint64 olen)
+template<class T>
+qint64 decompressToChunchy(const char *input, qint64 ilen, qint32 lineWidth, uchar *target, qint32 x, qint32 width, qint32 c, qint32 cn)
 {
+    constexpr qint64 bps = sizeof(T);
+    const qint64 olen = qint64(lineWidth) * bps;
+    const qint64 first = qint64(x) * bps;
+    const qint64 last = std::min(qint64(x + width) * bps, olen);
+    auto put = [&](qint64 j, char v) {
+        if (j < first || j >= last)
+            return;
+        auto k = j - first;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        auto b = bps - 1 - k % bps; // PSD samples are big endian
+#else
+        auto b = k % bps;
+#endif
+        target[(k / bps * cn + c) * bps + b] = uchar(v);
+    };
+
     qint64  j = 0;
-    for (qint64 ip = 0, rr = 0, available = olen; j < olen && ip < ilen; available = olen - j) {
+    for (qint64 ip = 0, rr = 0, available = olen; j < last && ip < ilen; available = olen - j) {
         signed char n = static_cast<signed char>(input[ip++]);
         if (n == -128)
             continue;
@@ -722,7 +949,8 @@ qint64 decompress(const char *input, qint64 ilen, char *output, qint64 olen)
 
             if (ip + rr > ilen)
                 return -1;
-            memcpy(output + j, input + ip, size_t(rr));
+            for (qint64 i = 0; i < rr; ++i)
+                put(j + i, input[ip + i]);
             ip += rr;
         }
         else if (ip < ilen) {
@@ -731,7 +959,9 @@ qint64 decompress(const char *input, qint64 ilen, char *output, qint64 olen)
                 --ip;
                 break;
             }
-            memset(output + j, input[ip++], size_t(rr));
+            for (qint64 i = 0; i < rr; ++i)
+                put(j + i, input[ip]);
+            ++ip;
         }
 
         j += rr;
@@ -739,6 +969,43 @@ qint64 decompress(const char *input, qint64 ilen, char *output, qint64 olen)
     return j;
 }
 
+/*!
+ * \brief processLines
+ * Calls \a func for each line in [first, last). The lines are processed concurrently by the
+ * threads of the shared pool with runConcurrently() (unless PSD_DISABLE_PARALLEL_DECODING is defined).
+ * \param func The function called for each line: it receives the line number and a buffer
+ * of \a bufferSize bytes that is not shared with the other threads.
+ * \return False if \a func returned false for at least one line.
+ */
+static bool processLines(qint32 first, qint32 last, qsizetype bufferSize, const std::function<bool(qint32, QByteArray &)> &func)
+{
+#ifndef PSD_DISABLE_PARALLEL_DECODING
+    if (last - first > 1 && maxThreadCount() > 1) {
+        QAtomicInt nextLine = first;
+        QAtomicInt failed = 0;
+        runConcurrently(last - first, [&](int) {
+            QByteArray buffer;
+            buffer.resize(bufferSize);
+            for (auto y = nextLine.fetchAndAddRelaxed(1); y < last && !failed.loadRelaxed(); y = nextLine.fetchAndAddRelaxed(1)) {
+                if (!func(y, buffer)) {
+                    failed.storeRelaxed(1);
+                }
+            }
+        });
+        return !failed.loadRelaxed();
+    }
+#endif
+
+    QByteArray buffer;
+    buffer.resize(bufferSize);
+    for (auto y = first; y < last; ++y) {
+        if (!func(y, buffer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /*!
  * \brief imageFormat
  * \param header The PSD header.
@@ -789,6 +1056,25 @@ static QImage::Format imageFormat(const PSDHeader &header, bool alpha)
     return format;
 }
 
+/*!
+ * \brief unpremultipliedFormat
+ * \return The format with unassociated alpha equivalent to \a format.
+ */
+static QImage::Format unpremultipliedFormat(const QImage::Format &format)
+{
+    switch (format) {
+    case QImage::Format_RGBA8888_Premultiplied:
+        return QImage::Format_RGBA8888;
+    case QImage::Format_RGBA64_Premultiplied:
+        return QImage::Format_RGBA64;
+    case QImage::Format_RGBA32FPx4_Premultiplied:
+        return QImage::Format_RGBA32FPx4;
+    default:
+        break;
+    }
+    return format;
+}
+
 /*!
  * \brief imageChannels
  * \param format The Qt image format.
@@ -856,13 +1142,41 @@ inline float xchg(float v)
 #endif
 }
 
-template<class T>
-inline void planarToChunchy(uchar *target, const char *source, qint32 width, qint32 c, qint32 cn)
+template<class T, qint32 cn>
+inline void planarToChunchyN(uchar *target, const char *source, qint32 width, qint32 c)
 {
     auto s = reinterpret_cast<const T*>(source);
-    auto t = reinterpret_cast<T*>(target);
+    auto t = reinterpret_cast<T*>(target) + c;
     for (qint32 x = 0; x < width; ++x) {
-        t[x * cn + c] = xchg(s[x]);
+        t[x * cn] = xchg(s[x]);
+    }
+}
+
+template<class T>
+inline void planarToChunchy(uchar *target, const char *source, qint32 width, qint32 c, qint32 cn)
+{
+    // Known number of channels allow the compiler to vectorize the loops
+    switch (cn) {
+    case 1:
+        planarToChunchyN<T, 1>(target, source, width, c);
+        break;
+    case 2:
+        planarToChunchyN<T, 2>(target, source, width, c);
+        break;
+    case 3:
+        planarToChunchyN<T, 3>(target, source, width, c);
+        break;
+    case 4:
+        planarToChunchyN<T, 4>(target, source, width, c);
+        break;
+    default: {
+        auto s = reinterpret_cast<const T*>(source);
+        auto t = reinterpret_cast<T*>(target);
+        for (qint32 x = 0; x < width; ++x) {
+            t[x * cn + c] = xchg(s[x]);
+        }
+        break;
+    }
     }
 }
 
@@ -986,6 +1300,29 @@ inline void cmykToRgb(uchar *target, qint32 targetChannels, const char *source,
         return;
     }
 
+    if constexpr (std::numeric_limits<T>::is_integer) {
+        // Integer version (auto vectorizable) of the floating point one below that gives the same results:
+        // max - (C * (1 - K) + K) * max = max * (1 - C) * (1 - K) = s[c] * s[k] / max
+        // NOTE: max is odd so the rounding is never a tie.
+        const quint64 imax = std::numeric_limits<T>::max();
+        for (qint32 w = 0; w < width; ++w) {
+            auto ps = s + sourceChannels * w;
+            const quint64 k = sourceChannels > 3 ? *(ps + 3) : imax;
+
+            auto pt = t + targetChannels * w;
+            *(pt + 0) = T((*(ps + 0) * k * 2 + imax) / (imax * 2));
+            *(pt + 1) = T((*(ps + 1) * k * 2 + imax) / (imax * 2));
+            *(pt + 2) = T((*(ps + 2) * k * 2 + imax) / (imax * 2));
+            if (targetChannels == 4) {
+                if (sourceChannels >= 5 && alpha)
+                    *(pt + 3) = *(ps + 4);
+                else
+                    *(pt + 3) = std::numeric_limits<T>::max();
+            }
+        }
+        return;
+    }
+
     for (qint32 w = 0; w < width; ++w) {
         auto ps = s + sourceChannels * w;
         auto C = 1 - *(ps + 0) * invmax;
@@ -1022,6 +1359,38 @@ inline double gammaCorrection(double linear)
 #endif
 }
 
+/*!
+ * \brief The LabTables struct
+ * The terms of the LAB to XYZ conversion that depend on one component only (see labToRgb()):
+ * they are used with 8-bit images where the tables are small.
+ */
+struct LabTables
+{
+    LabTables()
+    {
+        auto invmax = 1.0 / 255.0;
+        for (qint32 v = 0; v < 256; ++v) {
+            auto L = (v * invmax) * 100.0;
+            auto A = (v * invmax) * 255.0 - 128.0;
+            auto B = (v * invmax) * 255.0 - 128.0;
+            y[v] = (L + 16.0) * (1.0 / 116.0);
+            fy[v] = finv(y[v]) * 1.0000;
+            a[v] = A * (1.0 / 500.0);
+            b[v] = B * (1.0 / 200.0);
+        }
+    }
+    double y[256];
+    double fy[256];
+    double a[256];
+    double b[256];
+};
+
+static const LabTables &labTables()
+{
+    static const LabTables tables;
+    return tables;
+}
+
 template<class T>
 inline void labToRgb(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false)
 {
@@ -1035,21 +1404,37 @@ inline void labToRgb(uchar *target, qint32 targetChannels, const char *source, q
         return;
     }
 
+    constexpr bool useTables = std::numeric_limits<T>::is_integer && sizeof(T) == 1;
+    const LabTables *tables = useTables ? &labTables() : nullptr;
+
     for (qint32 w = 0; w < width; ++w) {
         auto ps = s + sourceChannels * w;
-        auto L = (*(ps + 0) * invmax) * 100.0;
-        auto A = (*(ps + 1) * invmax) * 255.0 - 128.0;
-        auto B = (*(ps + 2) * invmax) * 255.0 - 128.0;
-
-        // converting LAB to XYZ (D65 illuminant)
-        auto Y = (L + 16.0) * (1.0 / 116.0);
-        auto X = A * (1.0 / 500.0) + Y;
-        auto Z = Y - B * (1.0 / 200.0);
-
-        // NOTE: use the constants of the illuminant of the target RGB color space
-        X = finv(X) * 0.9504;   // D50: * 0.9642
-        Y = finv(Y) * 1.0000;   // D50: * 1.0000
-        Z = finv(Z) * 1.0888;   // D50: * 0.8251
+        double X, Y, Z;
+        if constexpr (useTables) {
+            // same of the code below: the terms depending on one component are precomputed
+            Y = tables->y[*(ps + 0)];
+            X = tables->a[*(ps + 1)] + Y;
+            Z = Y - tables->b[*(ps + 2)];
+
+            X = finv(X) * 0.9504;
+            Y = tables->fy[*(ps + 0)];
+            Z = finv(Z) * 1.0888;
+        }
+        else {
+            auto L = (*(ps + 0) * invmax) * 100.0;
+            auto A = (*(ps + 1) * invmax) * 255.0 - 128.0;
+            auto B = (*(ps + 2) * invmax) * 255.0 - 128.0;
+
+            // converting LAB to XYZ (D65 illuminant)
+            Y = (L + 16.0) * (1.0 / 116.0);
+            X = A * (1.0 / 500.0) + Y;
+            Z = Y - B * (1.0 / 200.0);
+
+            // NOTE: use the constants of the illuminant of the target RGB color space
+            X = finv(X) * 0.9504;   // D50: * 0.9642
+            Y = finv(Y) * 1.0000;   // D50: * 1.0000
+            Z = finv(Z) * 1.0888;   // D50: * 0.8251
+        }
 
         // converting XYZ to sRGB (sRGB illuminant is D65)
         auto r = gammaCorrection(  3.24071   * X - 1.53726  * Y - 0.498571  * Z);
@@ -1080,7 +1465,7 @@ bool readChannel(QByteArray& target, QDataStream &stream, quint32 compressedSize
         if (stream.readRawData(tmp.data(), tmp.size()) != tmp.size()) {
             return false;
         }
-        if (decompress(tmp.data(), tmp.size(), target.data(), target.size()) < 0) {
+        if (decodePackBits(tmp.data(), tmp.size(), target.data(), target.size()) < 0) {
             return false;
         }
     }
@@ -1091,63 +1476,50 @@ bool readChannel(QByteArray& target, QDataStream &stream, quint32 compressedSize
     return stream.status() == QDataStream::Ok;
 }
 
-// Load the PSD image.
-static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
+/*!
+ * \brief decodeChannels
+ * Decodes the planar channels of the merged image or of a layer.
+ * \param stream The stream.
+ * \param header The header of the image to decode (the size and the channels of a layer differ from the file ones).
+ * \param channels The position and the size of the compressed lines.
+ * \param alpha True if the last channel has to be used as alpha.
+ * \param premultiplied True if the color channels are premultiplied to the alpha as in the merged image.
+ * \param cmds The color mode data section.
+ * \param irs The image resource section.
+ * \param clipRect If valid, only the lines and columns it covers are decoded.
+ * \param img The decoded image.
+ * \return True on success, otherwise false.
+ */
+static bool decodeChannels(QDataStream &stream,
+                           const PSDHeader &header,
+                           const PSDChannelData &channels,
+                           bool alpha,
+                           bool premultiplied,
+                           const PSDColorModeDataSection &cmds,
+                           const PSDImageResourceSection &irs,
+                           const QRect &clipRect,
+                           QImage &img)
 {
-    // Checking for PSB
-    auto isPsb = header.version == 2;
-    bool ok = false;
-
-    // Color Mode Data section
-    auto cmds = readColorModeDataSection(stream, &ok);
-    if (!ok) {
-        qDebug() << "Error while skipping Color Mode Data section";
-        return false;
+    auto format = imageFormat(header, alpha);
+    if (!premultiplied) {
+        format = unpremultipliedFormat(format);
     }
-
-    // Image Resources Section
-    auto irs = readImageResourceSection(stream, &ok);
-    if (!ok) {
-        qDebug() << "Error while reading Image Resources Section";
-        return false;
-    }
-    // Checking for merged image (Photoshop compatibility data)
-    if (!hasMergedData(irs)) {
-        qDebug() << "No merged data found";
-        return false;
-    }
-
-    // Layer and Mask section
-    auto lms = readLayerAndMaskSection(stream, isPsb, &ok);
-    if (!ok) {
-        qDebug() << "Error while skipping Layer and Mask section";
-        return false;
-    }
-
-    // Find out if the data is compressed.
-    // Known values:
-    //   0: no compression
-    //   1: RLE compressed
-    quint16 compression;
-    stream >> compression;
-    if (compression > 1) {
-        qDebug() << "Unknown compression type";
+    if (format == QImage::Format_Invalid) {
+        qWarning() << "Unsupported image format. color_mode:" << header.color_mode << "depth:" << header.depth << "channel_count:" << header.channel_count;
         return false;
     }
 
-    // Try to identify the nature of spots: note that this is just one of many ways to identify the presence
-    // of alpha channels: should work in most cases where colorspaces != RGB/Gray
-    auto alpha = header.color_mode == CM_RGB;
-    if (!lms.isNull())
-        alpha = lms.hasAlpha();
-
-    const QImage::Format format = imageFormat(header, alpha);
-    if (format == QImage::Format_Invalid) {
-        qWarning() << "Unsupported image format. color_mode:" << header.color_mode << "depth:" << header.depth << "channel_count:" << header.channel_count;
+    // Region of interest: columns are cropped during the conversion to chunky, except
+    // for bitmaps (1-bit) that are cropped at the end to avoid bit shifting each line.
+    const auto fullRect = QRect(0, 0, header.width, header.height);
+    const auto clip = clipRect.isValid() ? clipRect.intersected(fullRect) : fullRect;
+    if (clip.isEmpty()) {
+        qWarning() << "decodeChannels() the clip rect is outside the image" << clipRect;
         return false;
     }
+    const auto bitmap = header.depth == 1;
 
-    img = imageAlloc(header.width, header.height, format);
+    img = imageAlloc(bitmap ? header.width : clip.width(), clip.height(), format);
     if (img.isNull()) {
         qWarning() << "Failed to allocate image, invalid dimensions?" << QSize(header.width, header.height);
         return false;
@@ -1163,33 +1535,8 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
     auto raw_count = qsizetype(header.width * header.depth + 7) / 8;
     auto native_cmyk = img.format() == CMYK_FORMAT;
 
-    if (header.height > kMaxQVectorSize / header.channel_count / sizeof(quint32)) {
-        qWarning() << "LoadPSD() header height/channel_count too big" << header.height << header.channel_count;
-        return false;
-    }
-
-    QList<quint32> strides(header.height * header.channel_count, raw_count);
-    // Read the compressed stride sizes
-    if (compression) {
-        for (auto&& v : strides) {
-            if (isPsb) {
-                stream >> v;
-                continue;
-            }
-            quint16 tmp;
-            stream >> tmp;
-            v = tmp;
-        }
-    }
-    // calculate the absolute file positions of each stride (required when a colorspace conversion should be done)
     auto device = stream.device();
-    QList<quint64> stridePositions(strides.size());
-    if (!stridePositions.isEmpty()) {
-        stridePositions[0] = device->pos();
-    }
-    for (qsizetype i = 1, n = stridePositions.size(); i < n; ++i) {
-        stridePositions[i] = stridePositions[i-1] + strides.at(i-1);
-    }
+    auto seekable = !device->isSequential();
 
     // Read the image
     QByteArray rawStride;
@@ -1209,7 +1556,7 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
         ScanLineConverter iccConv(img.format());
 #if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0) && !defined(PSD_NATIVE_CMYK_SUPPORT_DISABLED)
         if (header.color_mode == CM_CMYK && img.format() != QImage::Format_CMYK8888) {
-            auto tmpi = QImage(header.width, 1, QImage::Format_CMYK8888);
+            auto tmpi = QImage(clip.width(), 1, QImage::Format_CMYK8888);
             if (setColorSpace(tmpi, irs))
                 tmpCmyk = tmpi;
             iccConv.setTargetColorSpace(QColorSpace(QColorSpace::SRgb));
@@ -1219,15 +1566,17 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
         // In order to make a colorspace transformation, we need all channels of a scanline
         QByteArray psdScanline;
         psdScanline.resize(qsizetype(header.width * header.depth * header.channel_count + 7) / 8);
-        for (qint32 y = 0, h = header.height; y < h; ++y) {
+        const auto width = clip.width();
+        const auto psdOffset = qsizetype(clip.x()) * header.depth * header.channel_count / 8;
+        for (qint32 y = clip.top(), h = header.height; y <= clip.bottom(); ++y) {
             for (qint32 c = 0; c < header.channel_count; ++c) {
                 auto strideNumber = c * qsizetype(h) + y;
-                if (!device->seek(stridePositions.at(strideNumber))) {
+                if (!device->seek(channels.stridePositions.at(strideNumber))) {
                     qDebug() << "Error while seeking the stream of channel" << c << "line" << y;
                     return false;
                 }
-                auto&& strideSize = strides.at(strideNumber);
-                if (!readChannel(rawStride, stream, strideSize, compression)) {
+                auto&& strideSize = channels.strides.at(strideNumber);
+                if (!readChannel(rawStride, stream, strideSize, channels.compression.at(c))) {
                     qDebug() << "Error while reading the stream of channel" << c << "line" << y;
                     return false;
                 }
@@ -1245,105 +1594,178 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
             }
 
             // Convert premultiplied data to unassociated data
-            if (img.hasAlphaChannel()) {
-                auto scanLine = reinterpret_cast<char*>(psdScanline.data());
+            if (premultiplied && img.hasAlphaChannel()) {
+                auto scanLine = reinterpret_cast<char*>(psdScanline.data()) + psdOffset;
                 if (header.color_mode == CM_CMYK) {
                     if (header.depth == 8)
-                        premulConversion<quint8>(scanLine, header.width, 4, header.channel_count, PremulConversion::PS2A);
+                        premulConversion<quint8>(scanLine, width, 4, header.channel_count, PremulConversion::PS2A);
                     else if (header.depth == 16)
-                        premulConversion<quint16>(scanLine, header.width, 4, header.channel_count, PremulConversion::PS2A);
+                        premulConversion<quint16>(scanLine, width, 4, header.channel_count, PremulConversion::PS2A);
                 }
                 if (header.color_mode == CM_LABCOLOR) {
                     if (header.depth == 8)
-                        premulConversion<quint8>(scanLine, header.width, 3, header.channel_count, PremulConversion::PSLab2A);
+                        premulConversion<quint8>(scanLine, width, 3, header.channel_count, PremulConversion::PSLab2A);
                     else if (header.depth == 16)
-                        premulConversion<quint16>(scanLine, header.width, 3, header.channel_count, PremulConversion::PSLab2A);
+                        premulConversion<quint16>(scanLine, width, 3, header.channel_count, PremulConversion::PSLab2A);
                 }
                 if (header.color_mode == CM_RGB) {
                     if (header.depth == 8)
-                        premulConversion<quint8>(scanLine, header.width, 3, header.channel_count, PremulConversion::PS2P);
+                        premulConversion<quint8>(scanLine, width, 3, header.channel_count, PremulConversion::PS2P);
                     else if (header.depth == 16)
-                        premulConversion<quint16>(scanLine, header.width, 3, header.channel_count, PremulConversion::PS2P);
+                        premulConversion<quint16>(scanLine, width, 3, header.channel_count, PremulConversion::PS2P);
                     else if (header.depth == 32)
-                        premulConversion<float>(scanLine, header.width, 3, header.channel_count, PremulConversion::PS2P);
+                        premulConversion<float>(scanLine, width, 3, header.channel_count, PremulConversion::PS2P);
                 }
             }
 
             // Conversion to RGB
+            InstrumentationPhase convertPhase(Instrumentation::Convert);
             if (header.color_mode == CM_CMYK || header.color_mode == CM_MULTICHANNEL) {
                 if (tmpCmyk.isNull()) {
                     if (header.depth == 8)
-                        cmykToRgb<quint8>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
+                        cmykToRgb<quint8>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width, alpha);
                     else if (header.depth == 16)
-                        cmykToRgb<quint16>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
+                        cmykToRgb<quint16>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width, alpha);
                 }
                 else if (header.depth == 8) {
-                    rawChannelsCopyToCMYK<quint8>(tmpCmyk.bits(), 4, psdScanline.data(), header.channel_count, header.width);
+                    rawChannelsCopyToCMYK<quint8>(tmpCmyk.bits(), 4, psdScanline.data() + psdOffset, header.channel_count, width);
                     if (auto rgbPtr = iccConv.convertedScanLine(tmpCmyk, 0))
-                        std::memcpy(img.scanLine(y), rgbPtr, img.bytesPerLine());
+                        std::memcpy(img.scanLine(y - clip.top()), rgbPtr, img.bytesPerLine());
                     if (imgChannels == 4 && header.channel_count >= 5)
-                        rawChannelCopy<quint8>(img.scanLine(y), imgChannels, 3, psdScanline.data(), header.channel_count, 4, header.width);
+                        rawChannelCopy<quint8>(img.scanLine(y - clip.top()), imgChannels, 3, psdScanline.data() + psdOffset, header.channel_count, 4, width);
                 }
                 else if (header.depth == 16) {
-                    rawChannelsCopyToCMYK<quint16>(tmpCmyk.bits(), 4, psdScanline.data(), header.channel_count, header.width);
+                    rawChannelsCopyToCMYK<quint16>(tmpCmyk.bits(), 4, psdScanline.data() + psdOffset, header.channel_count, width);
                     if (auto rgbPtr = iccConv.convertedScanLine(tmpCmyk, 0))
-                        std::memcpy(img.scanLine(y), rgbPtr, img.bytesPerLine());
+                        std::memcpy(img.scanLine(y - clip.top()), rgbPtr, img.bytesPerLine());
                     if (imgChannels == 4 && header.channel_count >= 5)
-                        rawChannelCopy<quint16>(img.scanLine(y), imgChannels, 3, psdScanline.data(), header.channel_count, 4, header.width);
+                        rawChannelCopy<quint16>(img.scanLine(y - clip.top()), imgChannels, 3, psdScanline.data() + psdOffset, header.channel_count, 4, width);
                 }
             }
             if (header.color_mode == CM_LABCOLOR) {
                 if (header.depth == 8)
-                    labToRgb<quint8>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
+                    labToRgb<quint8>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width, alpha);
                 else if (header.depth == 16)
-                    labToRgb<quint16>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
+                    labToRgb<quint16>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width, alpha);
             }
             if (header.color_mode == CM_RGB) {
                 if (header.depth == 8)
-                    rawChannelsCopy<quint8>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width);
+                    rawChannelsCopy<quint8>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width);
                 else if (header.depth == 16)
-                    rawChannelsCopy<quint16>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width);
+                    rawChannelsCopy<quint16>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width);
                 else if (header.depth == 32)
-                    rawChannelsCopy<float>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width);
+                    rawChannelsCopy<float>(img.scanLine(y - clip.top()), imgChannels, psdScanline.data() + psdOffset, header.channel_count, width);
             }
         }
     }
     else {
         // Linear read (no position jumps): optimized code usable only for the colorspaces supported by QImage
+        // On random access devices, only the lines of each channel needed by the clip rect are read.
+        // The data of a channel is read in chunks of lines and the lines of each chunk are decoded concurrently
+        // straight into the image scanlines.
+        const auto width = bitmap ? header.width : clip.width();
+        const auto rawOffset = bitmap ? 0 : qsizetype(clip.x()) * header.depth / 8;
+        // clang-format off
+        // checks if the PackBits decompression can write directly into the image (see decompressToChunchy())
+        const auto direct = !native_cmyk &&
+                            (header.depth == 8 || header.depth == 16 || (header.depth == 32 && header.color_mode == CM_RGB));
+        // clang-format on
+        // NOTE: QImage is not thread safe (scanLine() may detach): the scanlines are addressed from the bits.
+        const auto bits = img.bits();
+        const auto bpl = qsizetype(img.bytesPerLine());
+
+        QByteArray chunk;
+        QList<qint64> lineOffsets;
         for (qint32 c = 0; c < channel_num; ++c) {
-            for (qint32 y = 0, h = header.height; y < h; ++y) {
-                auto&& strideSize = strides.at(c * qsizetype(h) + y);
-                if (!readChannel(rawStride, stream, strideSize, compression)) {
-                    qDebug() << "Error while reading the stream of channel" << c << "line" << y;
-                    return false;
-                }
-
-                auto scanLine = img.scanLine(y);
-                if (header.depth == 1) { // Bitmap
-                    monoInvert(scanLine, rawStride.data(), std::min(rawStride.size(), img.bytesPerLine()));
-                }
-                else if (header.depth == 8) { // 8-bits images: Indexed, Grayscale, RGB/RGBA, CMYK, MCH4
-                    if (native_cmyk)
-                        planarToChunchyCMYK<quint8>(scanLine, rawStride.data(), header.width, c, imgChannels);
-                    else
-                        planarToChunchy<quint8>(scanLine, rawStride.data(), header.width, c, imgChannels);
+            const auto h = header.height;
+            const auto compression = channels.compression.at(c);
+            if (seekable && !device->seek(channels.stridePositions.at(c * qsizetype(h) + clip.top()))) {
+                qDebug() << "Error while seeking the stream of channel" << c << "line" << clip.top();
+                return false;
+            }
+            for (qint32 y0 = seekable ? clip.top() : 0, last = seekable ? clip.bottom() + 1 : h, y1 = y0; y0 < last; y0 = y1) {
+                // lines of the chunk: at least one
+                qint64 chunkSize = 0;
+                lineOffsets.clear();
+                for (; y1 < last && (y1 == y0 || chunkSize + channels.strides.at(c * qsizetype(h) + y1) <= PSD_MAX_CHUNK_SIZE); ++y1) {
+                    lineOffsets.append(chunkSize);
+                    chunkSize += channels.strides.at(c * qsizetype(h) + y1);
                 }
-                else if (header.depth == 16) { // 16-bits integer images: Grayscale, RGB/RGBA, CMYK, MCH4
-                    if (native_cmyk)
-                        planarToChunchyCMYK<quint16>(scanLine, rawStride.data(), header.width, c, imgChannels);
-                    else
-                        planarToChunchy<quint16>(scanLine, rawStride.data(), header.width, c, imgChannels);
+                if (chunkSize > kMaxQVectorSize) {
+                    qDebug() << "Line too big in channel" << c << "line" << y0;
+                    return false;
                 }
-                else if (header.depth == 32 && header.color_mode == CM_RGB) { // 32-bits float images: RGB/RGBA
-                    planarToChunchy<float>(scanLine, rawStride.data(), header.width, c, imgChannels);
+                chunk.resize(chunkSize);
+                if (stream.readRawData(chunk.data(), chunk.size()) != chunk.size() || stream.status() != QDataStream::Ok) {
+                    qDebug() << "Error while reading the stream of channel" << c << "lines" << y0 << y1 - 1;
+                    return false;
                 }
-                else if (header.depth == 32 && header.color_mode == CM_GRAYSCALE) { // 32-bits float images: Grayscale (coverted to equivalent integer 16-bits)
-                    planarToChunchyFloatToUInt16<float>(scanLine, rawStride.data(), header.width, c, imgChannels);
+
+                auto ok = processLines(std::max(y0, clip.top()), std::min(y1, clip.bottom() + 1), direct ? 0 : raw_count, [&](qint32 y, QByteArray &buffer) -> bool {
+                    auto scanLine = bits + (y - clip.top()) * bpl;
+                    auto input = chunk.constData() + lineOffsets.at(y - y0);
+                    auto inputSize = channels.strides.at(c * qsizetype(h) + y);
+                    if (direct && compression) {
+                        if (header.depth == 8)
+                            return decompressToChunchy<quint8>(input, inputSize, header.width, scanLine, clip.x(), width, c, imgChannels) >= 0;
+                        if (header.depth == 16)
+                            return decompressToChunchy<quint16>(input, inputSize, header.width, scanLine, clip.x(), width, c, imgChannels) >= 0;
+                        return decompressToChunchy<float>(input, inputSize, header.width, scanLine, clip.x(), width, c, imgChannels) >= 0;
+                    }
+
+                    const char *rawData = input;
+                    if (compression) {
+                        if (decodePackBits(input, inputSize, buffer.data(), buffer.size()) < 0)
+                            return false;
+                        rawData = buffer.constData();
+                    }
+
+                    if (header.depth == 1) { // Bitmap
+                        monoInvert(scanLine, rawData, std::min(qsizetype(raw_count), bpl));
+                        return true;
+                    }
+                    rawData += rawOffset;
+                    if (header.depth == 8) { // 8-bits images: Indexed, Grayscale, RGB/RGBA, CMYK, MCH4
+                        if (native_cmyk)
+                            planarToChunchyCMYK<quint8>(scanLine, rawData, width, c, imgChannels);
+                        else
+                            planarToChunchy<quint8>(scanLine, rawData, width, c, imgChannels);
+                    }
+                    else if (header.depth == 16) { // 16-bits integer images: Grayscale, RGB/RGBA, CMYK, MCH4
+                        if (native_cmyk)
+                            planarToChunchyCMYK<quint16>(scanLine, rawData, width, c, imgChannels);
+                        else
+                            planarToChunchy<quint16>(scanLine, rawData, width, c, imgChannels);
+                    }
+                    else if (header.depth == 32 && header.color_mode == CM_RGB) { // 32-bits float images: RGB/RGBA
+                        planarToChunchy<float>(scanLine, rawData, width, c, imgChannels);
+                    }
+                    else if (header.depth == 32 && header.color_mode == CM_GRAYSCALE) { // 32-bits float images: Grayscale (coverted to equivalent integer 16-bits)
+                        planarToChunchyFloatToUInt16<float>(scanLine, rawData, width, c, imgChannels);
+                    }
+                    return true;
+                });
+                if (!ok) {
+                    qDebug() << "Error while decoding the stream of channel" << c << "lines" << y0 << y1 - 1;
+                    return false;
                 }
             }
         }
     }
 
+    if (bitmap && clip.width() != img.width()) {
+        img = img.copy(clip.x(), 0, clip.width(), clip.height());
+    }
+
+    return true;
+}
+
+/*!
+ * \brief setImageMetadata
+ * Sets resolution, color space and metadata to the decoded image.
+ */
+static void setImageMetadata(QImage &img, const PSDHeader &header, const PSDColorModeDataSection &cmds, const PSDImageResourceSection &irs)
+{
     // Resolution info
     if (!setResolution(img, irs)) {
         // qDebug() << "No resolution info found!";
@@ -1373,6 +1795,227 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
     if (!cmds.duotone.data.isEmpty()) {
         img.setText(QStringLiteral("PSDDuotoneOptions"), QString::fromUtf8(cmds.duotone.data.toHex()));
     }
+}
+
+// Load the PSD image.
+// If clipRect is valid, only the rows it covers are read from the file (the per-row byte
+// counts stored by RLE compressed images are used to jump directly to them) and the
+// returned image has the size of the intersection of clipRect with the image.
+// If scaledSize is valid and the embedded thumbnail is large enough, the thumbnail is
+// returned instead (the layers and the image data are not read): check the size of img.
+static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img, const QRect &clipRect = QRect(), const QSize &scaledSize = QSize())
+{
+    // Checking for PSB
+    auto isPsb = header.version == 2;
+    bool ok = false;
+
+    InstrumentationPhase headerPhase(Instrumentation::Header);
+
+    // Color Mode Data section
+    auto cmds = readColorModeDataSection(stream, &ok);
+    if (!ok) {
+        qDebug() << "Error while skipping Color Mode Data section";
+        return false;
+    }
+
+    // Image Resources Section
+    auto irs = readImageResourceSection(stream, &ok);
+    if (!ok) {
+        qDebug() << "Error while reading Image Resources Section";
+        return false;
+    }
+    // Previews (e.g. of a file manager) use the thumbnail
+    if (!clipRect.isValid() && loadThumbnail(img, irs, scaledSize)) {
+        setXmpData(img, irs);
+        return true;
+    }
+    // Checking for merged image (Photoshop compatibility data)
+    if (!hasMergedData(irs)) {
+        qDebug() << "No merged data found";
+        return false;
+    }
+
+    // Layer and Mask section
+    auto lms = readLayerAndMaskSection(stream, isPsb, &ok);
+    if (!ok) {
+        qDebug() << "Error while skipping Layer and Mask section";
+        return false;
+    }
+
+    // Find out if the data is compressed.
+    // Known values:
+    //   0: no compression
+    //   1: RLE compressed
+    quint16 compression;
+    stream >> compression;
+    if (compression > 1) {
+        qDebug() << "Unknown compression type";
+        return false;
+    }
+
+    // Try to identify the nature of spots: note that this is just one of many ways to identify the presence
+    // of alpha channels: should work in most cases where colorspaces != RGB/Gray
+    auto alpha = header.color_mode == CM_RGB;
+    if (!lms.isNull())
+        alpha = lms.hasAlpha();
+
+    if (header.height > kMaxQVectorSize / header.channel_count / sizeof(quint32)) {
+        qWarning() << "LoadPSD() header height/channel_count too big" << header.height << header.channel_count;
+        return false;
+    }
+
+    PSDChannelData channels;
+    auto raw_count = qsizetype(header.width * header.depth + 7) / 8;
+    channels.compression = QList<quint16>(header.channel_count, compression);
+    channels.strides = QList<quint32>(header.height * header.channel_count, raw_count);
+    // Read the compressed stride sizes
+    if (compression) {
+        for (auto&& v : channels.strides) {
+            if (isPsb) {
+                stream >> v;
+                continue;
+            }
+            quint16 tmp;
+            stream >> tmp;
+            v = tmp;
+        }
+    }
+    // calculate the absolute file positions of each stride (required when a colorspace conversion should be done)
+    auto&& strides = channels.strides;
+    auto&& stridePositions = channels.stridePositions;
+    stridePositions.resize(strides.size());
+    if (!stridePositions.isEmpty()) {
+        stridePositions[0] = stream.device()->pos();
+    }
+    for (qsizetype i = 1, n = stridePositions.size(); i < n; ++i) {
+        stridePositions[i] = stridePositions[i-1] + strides.at(i-1);
+    }
+    headerPhase.end();
+
+    InstrumentationPhase decodePhase(Instrumentation::Decode);
+    if (!decodeChannels(stream, header, channels, alpha, true, cmds, irs, clipRect, img)) {
+        return false;
+    }
+    decodePhase.end();
+
+    InstrumentationPhase metadataPhase(Instrumentation::Metadata);
+    setImageMetadata(img, header, cmds, irs);
+
+    return true;
+}
+
+/*!
+ * \brief LoadPSDLayer
+ * Loads a layer as an image: only the channels of the layer are read. The offset of the
+ * returned image is the position of the layer on the canvas.
+ * \param stream The stream.
+ * \param header The file header.
+ * \param layer The layer record.
+ * \param cmds The color mode data section.
+ * \param irs The image resource section.
+ * \param clipRect If valid, the region of the layer to load.
+ * \param img The layer image.
+ * \return True on success, otherwise false.
+ */
+static bool LoadPSDLayer(QDataStream &stream,
+                         const PSDHeader &header,
+                         const PSDLayerRecord &layer,
+                         const PSDColorModeDataSection &cmds,
+                         const PSDImageResourceSection &irs,
+                         const QRect &clipRect,
+                         QImage &img)
+{
+    auto isPsb = header.version == 2;
+
+    // The color channels sorted by component followed by the transparency mask (user masks are ignored)
+    QList<PSDLayerChannel> list;
+    for (qint16 id = 0; id < qint16(layer.channels.size()); ++id) {
+        auto it = std::find_if(layer.channels.cbegin(), layer.channels.cend(), [id](const PSDLayerChannel &ch) {
+            return ch.id == id;
+        });
+        if (it == layer.channels.cend())
+            break;
+        list.append(*it);
+    }
+    auto alpha = false;
+    for (auto &&ch : layer.channels) {
+        if (ch.id == -1) {
+            list.append(ch);
+            alpha = true;
+            break;
+        }
+    }
+
+    auto lh = header;
+    lh.width = layer.rect.width();
+    lh.height = layer.rect.height();
+    lh.channel_count = list.size();
+    if (!IsValid(lh) || lh.width == 0 || lh.height == 0) {
+        qDebug() << "Invalid layer" << layer.name;
+        return false;
+    }
+    if (lh.height > kMaxQVectorSize / lh.channel_count / sizeof(quint32)) {
+        qWarning() << "LoadPSDLayer() layer height/channel_count too big" << lh.height << lh.channel_count;
+        return false;
+    }
+
+    // Each channel has its own compression and, if RLE compressed, its own stride sizes
+    PSDChannelData channels;
+    auto raw_count = qsizetype(lh.width * lh.depth + 7) / 8;
+    auto device = stream.device();
+    for (auto &&ch : list) {
+        if (!device->seek(ch.offset)) {
+            qDebug() << "Error while seeking the channel" << ch.id << "of the layer" << layer.name;
+            return false;
+        }
+        quint16 compression;
+        stream >> compression;
+        if (compression > 1) {
+            qDebug() << "Unsupported compression" << compression << "of the layer" << layer.name;
+            return false;
+        }
+        channels.compression.append(compression);
+
+        auto pos = quint64(ch.offset) + sizeof(compression);
+        auto first = channels.strides.size();
+        if (compression) {
+            for (quint32 y = 0; y < lh.height; ++y) {
+                if (isPsb) {
+                    quint32 v;
+                    stream >> v;
+                    channels.strides.append(v);
+                    continue;
+                }
+                quint16 tmp;
+                stream >> tmp;
+                channels.strides.append(tmp);
+            }
+            pos += quint64(lh.height) * (isPsb ? 4 : 2);
+        }
+        else {
+            channels.strides.append(QList<quint32>(lh.height, raw_count));
+        }
+        for (auto i = first, n = channels.strides.size(); i < n; ++i) {
+            channels.stridePositions.append(pos);
+            pos += channels.strides.at(i);
+        }
+    }
+    if (stream.status() != QDataStream::Ok) {
+        qDebug() << "Error while reading the channels of the layer" << layer.name;
+        return false;
+    }
+
+    if (!decodeChannels(stream, lh, channels, alpha, false, cmds, irs, clipRect, img)) {
+        return false;
+    }
+
+    setImageMetadata(img, lh, cmds, irs);
+
+    auto offset = layer.rect.topLeft();
+    if (clipRect.isValid())
+        offset += clipRect.intersected(QRect(0, 0, lh.width, lh.height)).topLeft();
+    img.setOffset(offset);
+    img.setText(QStringLiteral("PSDLayerName"), layer.name);
 
     return true;
 }
@@ -1382,9 +2025,98 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
 class PSDHandlerPrivate
 {
 public:
-    PSDHandlerPrivate() {}
+    PSDHandlerPrivate()
+#ifdef PSD_LAYER_SEQUENCE
+        : m_layerSequence(true)
+#else
+        : m_layerSequence(qEnvironmentVariableIntValue("KIMAGEFORMATS_PSD_LAYERS") > 0)
+#endif
+    {
+    }
     ~PSDHandlerPrivate() {}
     PSDHeader m_header;
+
+    // The layers are read as an image sequence (see PSD_LAYER_SEQUENCE)
+    const bool m_layerSequence;
+
+    // Region of interest (QImageIOHandler::ClipRect)
+    QRect m_clipRect;
+
+    // Requested size (QImageIOHandler::ScaledSize)
+    QSize m_scaledSize;
+
+    /*!
+     * \brief scale
+     * Scales the image to the requested size (if any): the reader does not scale when the
+     * handler supports QImageIOHandler::ScaledSize.
+     */
+    void scale(QImage &img) const
+    {
+        if (m_scaledSize.isValid() && !m_scaledSize.isEmpty() && !img.isNull() && img.size() != m_scaledSize) {
+            auto offset = img.offset();
+            img = img.scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            img.setOffset(offset);
+        }
+    }
+
+    /*!
+     * \brief scanLayers
+     * Indexes the layers of the file (once): the handler exposes the merged image (image 0)
+     * followed by the layers with pixels. Only random access devices are scanned.
+     */
+    void scanLayers(QIODevice *device)
+    {
+        if (m_scanned || device == nullptr || device->isSequential())
+            return;
+        m_scanned = true;
+
+        auto pos = device->pos();
+        if (m_startPos < 0)
+            m_startPos = pos;
+        if (!device->seek(m_startPos))
+            return;
+
+        QDataStream s(device);
+        s.setByteOrder(QDataStream::BigEndian);
+
+        PSDHeader header;
+        s >> header;
+        auto ok = s.status() == QDataStream::Ok && IsSupported(header);
+        auto isPsb = header.version == 2;
+        if (ok)
+            m_cmds = readColorModeDataSection(s, &ok);
+        if (ok)
+            m_irs = readImageResourceSection(s, &ok);
+        PSDLayerAndMaskSection lms;
+        if (ok)
+            lms = readLayerAndMaskSection(s, isPsb, &ok);
+        if (ok) {
+            // 16 and 32-bit images store the layers in the additional layer information
+            auto offset = lms.layerInfo.offset;
+            if (offset < 0)
+                offset = lms.additionalLayerInfo.value(LI_LR16).offset;
+            if (offset < 0)
+                offset = lms.additionalLayerInfo.value(LI_LR32).offset;
+            if (offset >= 0 && device->seek(offset)) {
+                auto layers = readLayerRecords(s, isPsb, &ok);
+                for (auto &&layer : layers) {
+                    // e.g. group markers have no pixels
+                    if (!layer.rect.isEmpty())
+                        m_layers.append(layer);
+                }
+                m_header = header;
+            }
+        }
+
+        device->seek(pos);
+    }
+
+    bool m_scanned = false;
+    qint64 m_startPos = -1;
+    qint32 m_currentImage = 0;
+    QList<PSDLayerRecord> m_layers;
+    PSDColorModeDataSection m_cmds;
+    PSDImageResourceSection m_irs;
 };
 
 PSDHandler::PSDHandler()
@@ -1404,7 +2136,37 @@ bool PSDHandler::canRead() const
 
 bool PSDHandler::read(QImage *image)
 {
-    QDataStream s(device());
+    auto dev = device();
+    Instrumentation instrumentation("psd", dev);
+    if (d->m_layerSequence && d->m_currentImage > 0) {
+        d->scanLayers(dev);
+        if (d->m_currentImage > d->m_layers.size()) {
+            return false;
+        }
+
+        QDataStream s(dev);
+        s.setByteOrder(QDataStream::BigEndian);
+
+        QImage img;
+        if (!LoadPSDLayer(s, d->m_header, d->m_layers.at(d->m_currentImage - 1), d->m_cmds, d->m_irs, d->m_clipRect, img)) {
+            return false;
+        }
+        d->scale(img);
+
+        *image = img;
+        ++d->m_currentImage;
+        return true;
+    }
+
+    // the merged image can be read again after jumpToImage(0)
+    if (d->m_layerSequence && !dev->isSequential()) {
+        if (d->m_startPos < 0)
+            d->m_startPos = dev->pos();
+        else if (!dev->seek(d->m_startPos))
+            return false;
+    }
+
+    QDataStream s(dev);
     s.setByteOrder(QDataStream::BigEndian);
 
     auto&& header = d->m_header;
@@ -1423,19 +2185,67 @@ bool PSDHandler::read(QImage *image)
     }
 
     QImage img;
-    if (!LoadPSD(s, header, img)) {
+    if (!LoadPSD(s, header, img, d->m_clipRect, d->m_scaledSize)) {
         //         qDebug() << "Error loading PSD file.";
         return false;
     }
+    d->scale(img);
 
     *image = img;
+    if (d->m_layerSequence)
+        ++d->m_currentImage;
+    return true;
+}
+
+int PSDHandler::imageCount() const
+{
+    if (!d->m_layerSequence)
+        return QImageIOHandler::imageCount();
+    d->scanLayers(device());
+    return 1 + d->m_layers.size();
+}
+
+int PSDHandler::currentImageNumber() const
+{
+    return d->m_currentImage;
+}
+
+bool PSDHandler::jumpToImage(int imageNumber)
+{
+    if (!d->m_layerSequence)
+        return QImageIOHandler::jumpToImage(imageNumber);
+    if (imageNumber < 0 || imageNumber >= imageCount()) {
+        return false;
+    }
+    d->m_currentImage = imageNumber;
     return true;
 }
 
+bool PSDHandler::jumpToNextImage()
+{
+    if (!d->m_layerSequence)
+        return QImageIOHandler::jumpToNextImage();
+    return jumpToImage(d->m_currentImage + 1);
+}
+
+void PSDHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == QImageIOHandler::ClipRect) {
+        d->m_clipRect = value.toRect();
+    }
+    if (option == QImageIOHandler::ScaledSize) {
+        d->m_scaledSize = value.toSize();
+    }
+}
+
 bool PSDHandler::supportsOption(ImageOption option) const
 {
     if (option == QImageIOHandler::Size)
         return true;
+    if (option == QImageIOHandler::ClipRect)
+        return true;
+    if (option == QImageIOHandler::ScaledSize)
+        return true;
     return false;
 }
 
@@ -1445,7 +2255,10 @@ QVariant PSDHandler::option(ImageOption option) const
 
     if (option == QImageIOHandler::Size) {
         auto&& header = d->m_header;
-        if (IsValid(header)) {
+        if (d->m_currentImage > 0 && d->m_currentImage <= d->m_layers.size()) {
+            v = QVariant::fromValue(d->m_layers.at(d->m_currentImage - 1).rect.size());
+        }
+        else if (IsValid(header)) {
             v = QVariant::fromValue(QSize(header.width, header.height));
         }
         else if (auto dev = device()) {
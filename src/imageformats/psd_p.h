@@ -20,6 +20,12 @@ public:
     bool canRead() const override;
     bool read(QImage *image) override;
 
+    int imageCount() const override;
+    int currentImageNumber() const override;
+    bool jumpToImage(int imageNumber) override;
+    bool jumpToNextImage() override;
+
+    void setOption(QImageIOHandler::ImageOption option, const QVariant &value) override;
     bool supportsOption(QImageIOHandler::ImageOption option) const override;
     QVariant option(QImageIOHandler::ImageOption option) const override;
 
@@ -12,6 +12,17 @@
 #include <QImage>
 #include <QLoggingCategory>
 
+#include <algorithm>
+#include <cstring>
+
+/* *** PXR_READ_BAND_SIZE ***
+ * Size in bytes of the bands of rows read at once from the device when the
+ * image rows are padded.
+ */
+#ifndef PXR_READ_BAND_SIZE
+#define PXR_READ_BAND_SIZE (256 * 1024)
+#endif
+
 Q_DECLARE_LOGGING_CATEGORY(LOG_PXRPLUGIN)
 Q_LOGGING_CATEGORY(LOG_PXRPLUGIN, "kf.imageformats.plugins.pxr", QtWarningMsg)
 
@@ -200,12 +211,28 @@ bool PXRHandler::read(QImage *image)
     }
 
     auto size = std::min(img.bytesPerLine(), header.strideSize());
-    for (auto y = 0, h = img.height(); y < h; ++y) {
-        auto line = reinterpret_cast<char*>(img.scanLine(y));
-        if (d->read(line, size) != size) {
-            qCWarning(LOG_PXRPLUGIN) << "PXRHandler::read() error while reading image scanline";
+    if (size == img.bytesPerLine()) {
+        // the file rows have the same layout of the image ones: read all in one go
+        auto bytes = size * img.height();
+        if (d->read(reinterpret_cast<char*>(img.bits()), bytes) != bytes) {
+            qCWarning(LOG_PXRPLUGIN) << "PXRHandler::read() error while reading image data";
             return false;
         }
+    } else {
+        // read bands of rows and spread them on the padded image rows
+        auto stride = header.strideSize();
+        auto rows = std::clamp(qsizetype(PXR_READ_BAND_SIZE / stride), qsizetype(1), qsizetype(img.height()));
+        QByteArray band(stride * rows, char());
+        for (auto y = 0, h = img.height(); y < h; y += rows) {
+            auto n = std::min(qsizetype(h - y), rows);
+            if (d->read(band.data(), stride * n) != stride * n) {
+                qCWarning(LOG_PXRPLUGIN) << "PXRHandler::read() error while reading image scanline";
+                return false;
+            }
+            for (auto i = 0; i < n; ++i) {
+                std::memcpy(img.scanLine(y + i), band.constData() + stride * i, size);
+            }
+        }
     }
 
     *image = img;
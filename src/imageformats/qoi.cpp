@@ -7,13 +7,21 @@
 */
 
 #include "qoi_p.h"
+#include "devicedata_p.h"
 #include "scanlineconverter_p.h"
+#include "threadpool_p.h"
 #include "util_p.h"
 
+#include <QBuffer>
 #include <QColorSpace>
 #include <QFile>
 #include <QIODevice>
 #include <QImage>
+#include <QList>
+#include <QVarLengthArray>
+
+#include <algorithm>
+#include <cstring>
 
 namespace // Private
 {
@@ -30,6 +38,14 @@ namespace // Private
 #define QOI_HEADER_SIZE 14
 #define QOI_END_STREAM_PAD 8
 
+/* *** QOI_BAND_PIXELS ***
+ * The minimum number of pixels of a band encoded concurrently (the bands are made by whole lines).
+ * Images with less than two bands are encoded on the calling thread.
+ */
+#ifndef QOI_BAND_PIXELS
+#define QOI_BAND_PIXELS (256 * 1024)
+#endif
+
 struct QoiHeader {
     QoiHeader()
         : MagicNumber(0)
@@ -111,6 +127,77 @@ static QImage::Format imageFormat(const QoiHeader &head)
     return QImage::Format_Invalid;
 }
 
+/*!
+ * \brief LoadQOIFromMemory
+ * Decodes the whole chunk stream of \a size bytes in \a img (allocated, 32-bit and contiguous).
+ */
+static bool LoadQOIFromMemory(const quint8 *input, qint64 size, const QoiHeader &qoi, QImage &img)
+{
+    Px index[64] = {Px{0, 0, 0, 0}};
+    Px px = Px{0, 0, 0, 255};
+
+    if (size < QOI_END_STREAM_PAD) {
+        return false;
+    }
+
+    // NOTE: the longest chunk is 5 bytes, so the end stream padding ensures that reads are in bounds
+    const qint64 chunks_len = size - QOI_END_STREAM_PAD;
+    const qint64 pixels = qint64(qoi.Width) * qoi.Height;
+    QRgb *output = reinterpret_cast<QRgb *>(img.bits());
+    qint64 p = 0;
+    for (qint64 i = 0; i < pixels;) {
+        if (p >= chunks_len) {
+            return false;
+        }
+
+        const quint32 b1 = input[p++];
+        if (b1 == QOI_OP_RGB) {
+            px.r = input[p];
+            px.g = input[p + 1];
+            px.b = input[p + 2];
+            p += 3;
+        } else if (b1 == QOI_OP_RGBA) {
+            px.r = input[p];
+            px.g = input[p + 1];
+            px.b = input[p + 2];
+            px.a = input[p + 3];
+            p += 4;
+        } else {
+            switch (b1 & QOI_MASK_2) {
+            case QOI_OP_INDEX:
+                px = index[b1];
+                break;
+            case QOI_OP_DIFF:
+                px.r += ((b1 >> 4) & 0x03) - 2;
+                px.g += ((b1 >> 2) & 0x03) - 2;
+                px.b += (b1 & 0x03) - 2;
+                break;
+            case QOI_OP_LUMA: {
+                const quint32 b2 = input[p++];
+                const quint32 vg = (b1 & 0x3f) - 32;
+                px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                px.g += vg;
+                px.b += vg - 8 + (b2 & 0x0f);
+                break;
+            }
+            default: { // QOI_OP_RUN
+                // the run can continue on the next lines: the lines of the image are contiguous
+                const auto run = std::min(qint64(b1 & 0x3f) + 1, pixels - i);
+                index[QoiHash(px) & 0x3F] = px;
+                std::fill_n(output + i, run, qRgba(px.r, px.g, px.b, px.a));
+                i += run;
+                continue;
+            }
+            }
+        }
+        index[QoiHash(px) & 0x3F] = px;
+        output[i++] = qRgba(px.r, px.g, px.b, px.a);
+    }
+
+    // see LoadQOI()
+    return size - p >= QOI_END_STREAM_PAD && memcmp(input + p, "\x00\x00\x00\x00\x00\x00\x00\x01", QOI_END_STREAM_PAD) == 0;
+}
+
 static bool LoadQOI(QIODevice *device, const QoiHeader &qoi, QImage &img)
 {
     Px index[64] = {Px{0, 0, 0, 0}};
@@ -140,6 +227,16 @@ static bool LoadQOI(QIODevice *device, const QoiHeader &qoi, QImage &img)
         img.setColorSpace(QColorSpace(QColorSpace::SRgb));
     }
 
+    // Files and buffers are decoded from memory in one pass (the lines of 32-bit images are contiguous)
+    if (!device->isSequential() && (qobject_cast<QFile *>(device) || qobject_cast<QBuffer *>(device))
+        && img.bytesPerLine() == qsizetype(qoi.Width) * 4) {
+        DeviceData data;
+        if (!data.load(device)) {
+            return false;
+        }
+        return LoadQOIFromMemory(reinterpret_cast<const quint8 *>(data.data()), data.size(), qoi, img);
+    }
+
     // Handle the byte stream
     QByteArray ba;
     for (quint32 y = 0, run = 0; y < qoi.Height; ++y) {
@@ -202,8 +299,245 @@ static bool LoadQOI(QIODevice *device, const QoiHeader &qoi, QImage &img)
     return (ba.startsWith(QByteArray::fromRawData("\x00\x00\x00\x00\x00\x00\x00\x01", 8)));
 }
 
+/*!
+ * \brief AppendPixel
+ * Appends the chunk of a pixel not found in the index (QOI_OP_DIFF, QOI_OP_LUMA, QOI_OP_RGB or QOI_OP_RGBA).
+ */
+static void AppendPixel(QByteArray &ba, const Px &px, const Px &px_prev)
+{
+    if (px.a == px_prev.a) {
+        signed char vr = px.r - px_prev.r;
+        signed char vg = px.g - px_prev.g;
+        signed char vb = px.b - px_prev.b;
+
+        signed char vg_r = vr - vg;
+        signed char vg_b = vb - vg;
+
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+            ba.append(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+        } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+            ba.append(QOI_OP_LUMA | (vg + 32));
+            ba.append((vg_r + 8) << 4 | (vg_b + 8));
+        } else {
+            ba.append(char(QOI_OP_RGB));
+            ba.append(px.r);
+            ba.append(px.g);
+            ba.append(px.b);
+        }
+    } else {
+        ba.append(char(QOI_OP_RGBA));
+        ba.append(px.r);
+        ba.append(px.g);
+        ba.append(px.b);
+        ba.append(px.a);
+    }
+}
+
+static void AppendRun(QByteArray &ba, qint64 run)
+{
+    for (; run >= 62; run -= 62) {
+        ba.append(QOI_OP_RUN | 61);
+    }
+    if (run > 0) {
+        ba.append(QOI_OP_RUN | (run - 1));
+    }
+}
+
+/*!
+ * \brief The QoiBand class
+ * The chunks of a band of lines, encoded without knowing the encoder state at the start of the band.
+ *
+ * The previous pixel is known (it is the last pixel of the previous band), so the chunks only depend on
+ * the incoming state through:
+ * - the run in progress: the leading pixels equal to the previous one are not encoded (lead);
+ * - the index: only the first lookup of each slot can differ, the band stores it as a miss (touches).
+ * The stitch() function rewrites these chunks with the actual state, so that the stream is identical
+ * to the one of the serial encoder.
+ */
+struct QoiBand {
+    struct Touch {
+        qsizetype offset;
+        qsizetype size;
+        int slot;
+        Px px;
+    };
+
+    bool encode(const QImage &img, ScanLineConverter converter, qint32 y, qint32 lines)
+    {
+        const auto channels = converter.targetFormat() == QImage::Format_RGB888 ? 3 : 4;
+        const auto w = img.width() * channels;
+        Px px = Px{0, 0, 0, 255};
+        Px px_prev = px;
+        if (y > 0) {
+            auto pixels = converter.convertedScanLine(img, y - 1);
+            if (pixels == nullptr) {
+                return false;
+            }
+            px_prev.r = pixels[w - channels + 0];
+            px_prev.g = pixels[w - channels + 1];
+            px_prev.b = pixels[w - channels + 2];
+            if (channels == 4) {
+                px_prev.a = pixels[w - channels + 3];
+            }
+            px.a = px_prev.a;
+        }
+
+        data.reserve(qsizetype(lines) * w * 3 / 2);
+        auto leading = true;
+        auto run = 0;
+        for (auto last = y + lines; y < last; ++y) {
+            auto pixels = converter.convertedScanLine(img, y);
+            if (pixels == nullptr) {
+                return false;
+            }
+
+            for (auto px_pos = 0; px_pos < w; px_pos += channels) {
+                px.r = pixels[px_pos + 0];
+                px.g = pixels[px_pos + 1];
+                px.b = pixels[px_pos + 2];
+
+                if (channels == 4) {
+                    px.a = pixels[px_pos + 3];
+                }
+
+                if (px == px_prev) {
+                    if (leading) {
+                        ++lead;
+                    } else if (++run == 62) {
+                        data.append(QOI_OP_RUN | (run - 1));
+                        run = 0;
+                    }
+                } else {
+                    leading = false;
+                    if (run > 0) {
+                        data.append(QOI_OP_RUN | (run - 1));
+                        run = 0;
+                    }
+
+                    auto index_pos = QoiHash(px) & 0x3F;
+                    if (!touched[index_pos]) {
+                        touched[index_pos] = true;
+                        index[index_pos] = px;
+                        const auto offset = data.size();
+                        AppendPixel(data, px, px_prev);
+                        touches.append(Touch{offset, data.size() - offset, index_pos, px});
+                    } else if (index[index_pos] == px) {
+                        data.append(QOI_OP_INDEX | index_pos);
+                    } else {
+                        index[index_pos] = px;
+                        AppendPixel(data, px, px_prev);
+                    }
+                }
+                px_prev = px;
+            }
+        }
+        trailing = run;
+        return true;
+    }
+
+    /*!
+     * \brief stitch
+     * Appends the chunks to \a ba with the actual encoder state (\a index and the pending \a run), then
+     * updates the state.
+     */
+    void stitch(QByteArray &ba, Px *index_state, qint64 &run) const
+    {
+        run += lead;
+        if (data.isEmpty()) {
+            // all pixels equal to the previous one
+            return;
+        }
+        AppendRun(ba, run);
+
+        qsizetype pos = 0;
+        for (auto &&touch : touches) {
+            ba.append(data.constData() + pos, touch.offset - pos);
+            if (index_state[touch.slot] == touch.px) {
+                ba.append(QOI_OP_INDEX | touch.slot);
+            } else {
+                ba.append(data.constData() + touch.offset, touch.size);
+            }
+            pos = touch.offset + touch.size;
+        }
+        ba.append(data.constData() + pos, data.size() - pos);
+
+        for (auto i = 0; i < 64; ++i) {
+            if (touched[i]) {
+                index_state[i] = index[i];
+            }
+        }
+        run = trailing;
+    }
+
+    QByteArray data;
+    qint64 lead = 0;
+    qint64 trailing = 0;
+    QVarLengthArray<Touch, 64> touches;
+    Px index[64] = {Px{0, 0, 0, 0}};
+    bool touched[64] = {false};
+};
+
+/*!
+ * \brief SaveQOIConcurrently
+ * Encodes bands of lines concurrently and stitches them together: the stream is identical to the
+ * one of SaveQOI().
+ */
+static bool SaveQOIConcurrently(QIODevice *device, const QoiHeader &qoi, const QImage &img, int threads)
+{
+    ScanLineConverter converter(qoi.Channels == 3 ? QImage::Format_RGB888 : QImage::Format_RGBA8888);
+    converter.setTargetColorSpace(QColorSpace(qoi.Colorspace == 1 ? QColorSpace::SRgbLinear : QColorSpace::SRgb));
+
+    Px index[64] = {Px{0, 0, 0, 0}};
+    qint64 run = 0;
+
+    const qint32 bandLines = std::max(1, QOI_BAND_PIXELS / img.width());
+    const qint32 bands = (img.height() + bandLines - 1) / bandLines;
+    QList<QoiBand> batch(std::min(bands, threads * 2));
+    QByteArray ba;
+    for (qint32 first = 0; first < bands; first += batch.size()) {
+        const qint32 count = std::min(qsizetype(bands - first), batch.size());
+        QAtomicInt next = 0;
+        QAtomicInt failed = 0;
+        auto data = batch.data();
+        runConcurrently(std::min(threads, count), [&](int) {
+            for (int i; (i = next.fetchAndAddRelaxed(1)) < count;) {
+                const qint32 y = (first + i) * bandLines;
+                data[i] = QoiBand();
+                if (!data[i].encode(img, converter, y, std::min(bandLines, img.height() - y))) {
+                    failed.storeRelaxed(1);
+                }
+            }
+        });
+        if (failed.loadRelaxed()) {
+            return false;
+        }
+
+        for (qint32 i = 0; i < count; ++i) {
+            batch.at(i).stitch(ba, index, run);
+            batch[i] = QoiBand();
+        }
+        if (device->write(ba) != ba.size()) {
+            return false;
+        }
+        ba.clear();
+    }
+
+    // the pending run ends with the last pixel
+    AppendRun(ba, run);
+
+    // QOI end of stream
+    ba.append(QByteArray::fromRawData("\x00\x00\x00\x00\x00\x00\x00\x01", 8));
+    return device->write(ba) == ba.size();
+}
+
 static bool SaveQOI(QIODevice *device, const QoiHeader &qoi, const QImage &img)
 {
+    // large images are encoded by bands on the shared thread pool
+    const auto threads = maxThreadCount();
+    if (threads > 1 && qint64(img.width()) * img.height() >= qint64(QOI_BAND_PIXELS) * 2) {
+        return SaveQOIConcurrently(device, qoi, img, threads);
+    }
+
     Px index[64] = {Px{0, 0, 0, 0}};
     Px px = Px{0, 0, 0, 255};
     Px px_prev = px;
@@ -217,8 +551,11 @@ static bool SaveQOI(QIODevice *device, const QoiHeader &qoi, const QImage &img)
     ScanLineConverter converter(channels == 3 ? QImage::Format_RGB888 : QImage::Format_RGBA8888);
     converter.setTargetColorSpace(QColorSpace(qoi.Colorspace == 1 ? QColorSpace::SRgbLinear : QColorSpace::SRgb));
 
+    // the next lines are converted while the current ones are encoded
+    ScanLinePipeline pipeline(converter, img);
+
     for (auto h = img.height(), y = 0; y < h; ++y) {
-        auto pixels = converter.convertedScanLine(img, y);
+        auto pixels = pipeline.convertedScanLine(y);
         if (pixels == nullptr) {
             return false;
         }
@@ -252,33 +589,7 @@ static bool SaveQOI(QIODevice *device, const QoiHeader &qoi, const QImage &img)
                     ba.append(QOI_OP_INDEX | index_pos);
                 } else {
                     index[index_pos] = px;
-
-                    if (px.a == px_prev.a) {
-                        signed char vr = px.r - px_prev.r;
-                        signed char vg = px.g - px_prev.g;
-                        signed char vb = px.b - px_prev.b;
-
-                        signed char vg_r = vr - vg;
-                        signed char vg_b = vb - vg;
-
-                        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
-                            ba.append(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
-                        } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
-                            ba.append(QOI_OP_LUMA | (vg + 32));
-                            ba.append((vg_r + 8) << 4 | (vg_b + 8));
-                        } else {
-                            ba.append(char(QOI_OP_RGB));
-                            ba.append(px.r);
-                            ba.append(px.g);
-                            ba.append(px.b);
-                        }
-                    } else {
-                        ba.append(char(QOI_OP_RGBA));
-                        ba.append(px.r);
-                        ba.append(px.g);
-                        ba.append(px.b);
-                        ba.append(px.a);
-                    }
+                    AppendPixel(ba, px, px_prev);
                 }
             }
             px_prev = px;
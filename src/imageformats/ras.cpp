@@ -15,6 +15,9 @@
 #include <QDebug>
 #include <QImage>
 
+#include <cstring>
+#include <functional>
+
 namespace // Private.
 {
 // format info from http://www.fileformat.info/format/sunraster/egff.htm
@@ -119,12 +122,17 @@ public:
     {
     }
 
-    QByteArray readLine(qint64 size)
+    /*!
+     * \brief readLine
+     * Reads the next \a size bytes of image data in \a line.
+     * \return True on success, false if the data are truncated or corrupted.
+     */
+    bool readLine(char *line, qint64 size)
     {
         /* *** uncompressed
          */
         if (header.Type != RAS_TYPE_BYTE_ENCODED) {
-            return device->read(size);
+            return device->read(line, size) == size;
         }
 
         /* *** rle compressed
@@ -148,56 +156,83 @@ public:
          * unencoded pixel data and is written directly to the output stream.
          *
          * source: http://www.fileformat.info/format/sunraster/egff.htm
+         *
+         * The runs are not aligned to the scanlines: a run can continue on
+         * the next line.
          */
-        for (qsizetype psz = 0, ptr = 0; uncBuffer.size() < size;) {
-            rleBuffer.append(device->read(std::min(qint64(32768), size)));
-            qsizetype sz = rleBuffer.size();
-            if (psz == sz) {
-                break; // avoid infinite loop (data corrupted?!)
+        for (qint64 written = 0; written < size;) {
+            // remaining part of a run started on the previous line
+            if (runLength > 0) {
+                auto n = std::min(runLength, size - written);
+                std::memset(line + written, runValue, n);
+                runLength -= n;
+                written += n;
+                continue;
             }
-            auto data = reinterpret_cast<uchar *>(rleBuffer.data());
-            for (; ptr < sz;) {
-                auto flag = data[ptr++];
-                if (flag == 0x80) {
-                    if (ptr >= sz) {
-                        ptr -= 1;
-                        break;
-                    }
-                    auto cnt = data[ptr++];
-                    if (cnt == 0) {
-                        uncBuffer.append(char(0x80));
-                        continue;
-                    } else if (ptr >= sz) {
-                        ptr -= 2;
-                        break;
-                    }
-                    auto val = data[ptr++];
-                    uncBuffer.append(QByteArray(1 + cnt, char(val)));
-                } else {
-                    uncBuffer.append(char(flag));
-                }
+
+            if (pos >= buffer.size() && !fill()) {
+                return false; // something wrong
             }
-            if (ptr) { // remove consumed data
-                rleBuffer.remove(0, ptr);
-                ptr = 0;
+
+            // unencoded data are copied up to the next flag
+            auto begin = buffer.constData() + pos;
+            auto n = std::min(buffer.size() - pos, qsizetype(size - written));
+            if (auto flag = static_cast<const char *>(std::memchr(begin, 0x80, n))) {
+                n = flag - begin;
             }
-            psz = rleBuffer.size();
-        }
-        if (uncBuffer.size() < size) {
-            return QByteArray(); // something wrong
+            if (n > 0) {
+                std::memcpy(line + written, begin, n);
+                pos += n;
+                written += n;
+                continue;
+            }
+
+            // run packet
+            ++pos;
+            auto cnt = nextByte();
+            if (cnt < 0) {
+                return false;
+            }
+            if (cnt == 0) {
+                line[written++] = char(0x80);
+                continue;
+            }
+            auto val = nextByte();
+            if (val < 0) {
+                return false;
+            }
+            runLength = 1 + cnt;
+            runValue = char(val);
         }
-        auto line = uncBuffer.mid(0, size);
-        uncBuffer.remove(0, line.size()); // remove consumed data
-        return line;
+        return true;
     }
 
 private:
+    bool fill()
+    {
+        buffer.resize(32768);
+        auto read = device->read(buffer.data(), buffer.size());
+        buffer.resize(std::max(read, qint64(0)));
+        pos = 0;
+        return !buffer.isEmpty();
+    }
+
+    int nextByte()
+    {
+        if (pos >= buffer.size() && !fill()) {
+            return -1;
+        }
+        return quint8(buffer.at(pos++));
+    }
+
     QIODevice *device;
     RasHeader header;
 
-    // RLE decoding buffers
-    QByteArray rleBuffer;
-    QByteArray uncBuffer;
+    // RLE decoding buffer and state
+    QByteArray buffer;
+    qsizetype pos = 0;
+    qint64 runLength = 0;
+    char runValue = 0;
 };
 
 static bool LoadRAS(QDataStream &s, const RasHeader &ras, QImage &img)
@@ -219,22 +254,74 @@ static bool LoadRAS(QDataStream &s, const RasHeader &ras, QImage &img)
         return false;
     }
 
+    // Select the scanline converter
+    const auto width = ras.Width;
+    const auto bytesPerLine = std::min(img.bytesPerLine(), qsizetype(rasLineSize));
+    std::function<void(uchar *, const uchar *)> convert;
+    if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && (ras.Depth == 1 || ras.Depth == 8)) {
+        // Grayscale 1-bit / Grayscale 8-bit (never seen)
+        convert = [bytesPerLine](uchar *dst, const uchar *src) {
+            for (qsizetype i = 0; i < bytesPerLine; ++i) {
+                dst[i] = ~src[i];
+            }
+        };
+    } else if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_RGB && (ras.Depth == 1 || ras.Depth == 8)) {
+        // Image with palette
+        convert = [bytesPerLine](uchar *dst, const uchar *src) {
+            std::memcpy(dst, src, bytesPerLine);
+        };
+    } else if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 24 && (ras.Type == RAS_TYPE_STANDARD || ras.Type == RAS_TYPE_BYTE_ENCODED)) {
+        // BGR 24-bit
+        convert = [width](uchar *dst, const uchar *src) {
+            auto scanLine = reinterpret_cast<QRgb *>(dst);
+            for (quint32 x = 0; x < width; ++x, src += 3) {
+                scanLine[x] = qRgb(src[2], src[1], src[0]);
+            }
+        };
+    } else if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 24 && ras.Type == RAS_TYPE_RGB_FORMAT) {
+        // RGB 24-bit
+        convert = [width](uchar *dst, const uchar *src) {
+            auto scanLine = reinterpret_cast<QRgb *>(dst);
+            for (quint32 x = 0; x < width; ++x, src += 3) {
+                scanLine[x] = qRgb(src[0], src[1], src[2]);
+            }
+        };
+    } else if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 32 && (ras.Type == RAS_TYPE_STANDARD || ras.Type == RAS_TYPE_BYTE_ENCODED)) {
+        // BGR 32-bit (not tested: test case missing)
+        convert = [width](uchar *dst, const uchar *src) {
+            auto scanLine = reinterpret_cast<QRgb *>(dst);
+            for (quint32 x = 0; x < width; ++x, src += 4) {
+                scanLine[x] = qRgb(src[3], src[2], src[1]);
+            }
+        };
+    } else if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 32 && ras.Type == RAS_TYPE_RGB_FORMAT) {
+        // RGB 32-bit (tested: test case missing due to image too large)
+        convert = [width](uchar *dst, const uchar *src) {
+            auto scanLine = reinterpret_cast<QRgb *>(dst);
+            for (quint32 x = 0; x < width; ++x, src += 4) {
+                scanLine[x] = qRgb(src[1], src[2], src[3]);
+            }
+        };
+    } else {
+        qWarning() << "LoadRAS() unsupported format!"
+                   << "ColorMapType:" << ras.ColorMapType << "Type:" << ras.Type << "Depth:" << ras.Depth;
+        return false;
+    }
+
     // Read palette if needed.
     if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_RGB) {
         // max 256 rgb elements palette is supported
         if (ras.ColorMapLength > 768) {
             return false;
         }
-        QList<quint8> palette(ras.ColorMapLength);
-        for (quint32 i = 0; i < ras.ColorMapLength; ++i) {
-            s >> palette[i];
-            if (s.status() != QDataStream::Ok) {
-                return false;
-            }
+        QByteArray palette(ras.ColorMapLength, char());
+        if (s.readRawData(palette.data(), palette.size()) != palette.size()) {
+            return false;
         }
+        auto pal = reinterpret_cast<const uchar *>(palette.constData());
         QList<QRgb> colorTable;
         for (quint32 i = 0, n = ras.ColorMapLength / 3; i < n; ++i) {
-            colorTable << qRgb(palette.at(i), palette.at(i + n), palette.at(i + 2 * n));
+            colorTable << qRgb(pal[i], pal[i + n], pal[i + 2 * n]);
         }
         for (; colorTable.size() < 256;) {
             colorTable << qRgb(255, 255, 255);
@@ -243,93 +330,13 @@ static bool LoadRAS(QDataStream &s, const RasHeader &ras, QImage &img)
     }
 
     LineDecoder dec(s.device(), ras);
-    auto bytesPerLine = std::min(img.bytesPerLine(), qsizetype(rasLineSize));
+    QByteArray rasLine(rasLineSize, char());
     for (quint32 y = 0; y < ras.Height; ++y) {
-        auto rasLine = dec.readLine(rasLineSize);
-        if (rasLine.size() != rasLineSize) {
+        if (!dec.readLine(rasLine.data(), rasLineSize)) {
             qWarning() << "LoadRAS() unable to read line" << y << ": the seems corrupted!";
             return false;
         }
-
-        // Grayscale 1-bit / Grayscale 8-bit (never seen)
-        if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && (ras.Depth == 1 || ras.Depth == 8)) {
-            for (auto &&b : rasLine) {
-                b = ~b;
-            }
-            std::memcpy(img.scanLine(y), rasLine.constData(), bytesPerLine);
-            continue;
-        }
-
-        // Image with palette
-        if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_RGB && (ras.Depth == 1 || ras.Depth == 8)) {
-            std::memcpy(img.scanLine(y), rasLine.constData(), bytesPerLine);
-            continue;
-        }
-
-        // BGR 24-bit
-        if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 24 && (ras.Type == RAS_TYPE_STANDARD || ras.Type == RAS_TYPE_BYTE_ENCODED)) {
-            quint8 red;
-            quint8 green;
-            quint8 blue;
-            auto scanLine = reinterpret_cast<QRgb *>(img.scanLine(y));
-            for (quint32 x = 0; x < ras.Width; x++) {
-                red = rasLine.at(x * 3 + 2);
-                green = rasLine.at(x * 3 + 1);
-                blue = rasLine.at(x * 3);
-                *(scanLine + x) = qRgb(red, green, blue);
-            }
-            continue;
-        }
-
-        // RGB 24-bit
-        if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 24 && ras.Type == RAS_TYPE_RGB_FORMAT) {
-            quint8 red;
-            quint8 green;
-            quint8 blue;
-            auto scanLine = reinterpret_cast<QRgb *>(img.scanLine(y));
-            for (quint32 x = 0; x < ras.Width; x++) {
-                red = rasLine.at(x * 3);
-                green = rasLine.at(x * 3 + 1);
-                blue = rasLine.at(x * 3 + 2);
-                *(scanLine + x) = qRgb(red, green, blue);
-            }
-            continue;
-        }
-
-        // BGR 32-bit (not tested: test case missing)
-        if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 32 && (ras.Type == RAS_TYPE_STANDARD || ras.Type == RAS_TYPE_BYTE_ENCODED)) {
-            quint8 red;
-            quint8 green;
-            quint8 blue;
-            auto scanLine = reinterpret_cast<QRgb *>(img.scanLine(y));
-            for (quint32 x = 0; x < ras.Width; x++) {
-                red = rasLine.at(x * 4 + 3);
-                green = rasLine.at(x * 4 + 2);
-                blue = rasLine.at(x * 4 + 1);
-                *(scanLine + x) = qRgb(red, green, blue);
-            }
-
-            continue;
-        }
-
-        // RGB 32-bit (tested: test case missing due to image too large)
-        if (ras.ColorMapType == RAS_COLOR_MAP_TYPE_NONE && ras.Depth == 32 && ras.Type == RAS_TYPE_RGB_FORMAT) {
-            quint8 red;
-            quint8 green;
-            quint8 blue;
-            auto scanLine = reinterpret_cast<QRgb *>(img.scanLine(y));
-            for (quint32 x = 0; x < ras.Width; x++) {
-                red = rasLine.at(x * 4 + 1);
-                green = rasLine.at(x * 4 + 2);
-                blue = rasLine.at(x * 4 + 3);
-                *(scanLine + x) = qRgb(red, green, blue);
-            }
-            continue;
-        }
-
-        qWarning() << "LoadRAS() unsupported format!"
-                   << "ColorMapType:" << ras.ColorMapType << "Type:" << ras.Type << "Depth:" << ras.Depth;
-        return false;
+        convert(img.scanLine(y), reinterpret_cast<const uchar *>(rasLine.constData()));
     }
 
     return true;
@@ -12,9 +12,17 @@
 #include <QColorSpace>
 #include <QDateTime>
 #include <QDebug>
+#include <QFile>
 #include <QImage>
+#include <QList>
+#include <QPointer>
 #include <QSet>
 #include <QTimeZone>
+#include <QTransform>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 #if defined(Q_OS_WINDOWS) && !defined(NOMINMAX)
 #define NOMINMAX
@@ -94,16 +102,53 @@ inline int raw_scanf_one(const QByteArray &ba, const char *fmt, void *val)
 /**
  * @brief The LibRaw_QIODevice class
  * Implementation of the LibRaw stream interface over a QIODevice.
+ *
+ * LibRaw makes many small reads and seeks while parsing the file: they are served from memory.
+ * - local files are mapped in memory;
+ * - on other random access devices, the data is read in pages of RAW_PAGE_SIZE bytes kept in a
+ *   small LRU cache of RAW_PAGE_COUNT pages (large reads go directly to the device);
+ * - sequential devices are read directly.
  */
 class LibRaw_QIODevice : public LibRaw_abstract_datastream
 {
+    static constexpr qint64 RAW_PAGE_SIZE = 256 * 1024;
+    static constexpr int RAW_PAGE_COUNT = 8;
+
+    struct Page {
+        qint64 start = -1;
+        quint64 used = 0;
+        QByteArray data;
+    };
+
 public:
     explicit LibRaw_QIODevice(QIODevice *device)
     {
         m_device = device;
+        if (m_device == nullptr) {
+            return;
+        }
+        m_pos = m_device->pos();
+        m_size = m_device->size();
+        m_sequential = m_device->isSequential();
+        m_pages.reserve(RAW_PAGE_COUNT);
+        if (auto file = qobject_cast<QFile *>(m_device)) {
+            if (!m_sequential && m_size > 0) {
+                m_map = file->map(0, m_size);
+                if (m_map) {
+                    m_file = file;
+                }
+            }
+        }
     }
     virtual ~LibRaw_QIODevice() override
     {
+        if (m_map && m_file) {
+            m_file->unmap(m_map);
+        }
+        // leave the device where LibRaw stopped reading
+        if (m_device && !m_sequential && m_device->pos() != m_pos) {
+            m_device->seek(std::min(m_pos, m_size));
+        }
     }
     virtual int valid() override
     {
@@ -111,63 +156,126 @@ public:
     }
     virtual int read(void *ptr, size_t sz, size_t nmemb) override
     {
-        qint64 read = 0;
         if (sz == 0) {
             return 0;
         }
-        auto data = reinterpret_cast<char*>(ptr);
-        for (qint64 r = 0, size = sz * nmemb; read < size; read += r) {
-            if (m_device->atEnd()) {
-                break;
+        auto data = reinterpret_cast<char *>(ptr);
+        const auto size = qint64(sz * nmemb);
+        qint64 read = 0;
+        if (m_sequential) {
+            for (qint64 r = 0; read < size; read += r) {
+                if (m_device->atEnd()) {
+                    break;
+                }
+                r = m_device->read(data + read, size - read);
+                if (r < 1) {
+                    break;
+                }
             }
-            r = m_device->read(data + read, size - read);
-            if (r < 1) {
+            m_pos += read;
+            return read / sz;
+        }
+        if (m_map == nullptr && size >= RAW_PAGE_SIZE && m_pos < m_size) {
+            // large reads (e.g. the raw data): no need to cache them
+            if (Instrumentation::seek(m_device, m_pos)) {
+                for (qint64 r = 0; read < size; read += r) {
+                    r = m_device->read(data + read, size - read);
+                    if (r < 1) {
+                        break;
+                    }
+                }
+            }
+            m_pos += read;
+            return read / sz;
+        }
+        while (read < size) {
+            qint64 avail = 0;
+            auto src = span(&avail);
+            if (src == nullptr) {
                 break;
             }
+            const auto n = std::min(avail, size - read);
+            std::memcpy(data + read, src, n);
+            read += n;
+            m_pos += n;
         }
         return read / sz;
     }
     virtual int eof() override
     {
-        return m_device->atEnd() ? 1 : 0;
+        if (m_sequential) {
+            return m_device->atEnd() ? 1 : 0;
+        }
+        return m_pos >= m_size ? 1 : 0;
     }
     virtual int seek(INT64 o, int whence) override
     {
         auto pos = o;
-        auto size = m_device->size();
         if (whence == SEEK_CUR) {
-            pos = m_device->pos() + o;
+            pos = m_pos + o;
         }
         if (whence == SEEK_END) {
-            pos = size + o;
+            pos = m_size + o;
         }
-        if (pos < 0 || m_device->isSequential()) {
+        if (pos < 0 || m_sequential) {
             return -1;
         }
-        return m_device->seek(pos) ? 0 : -1;
+        m_pos = pos;
+        return 0;
     }
     virtual INT64 tell() override
     {
-        return m_device->pos();
+        return m_pos;
     }
     virtual INT64 size() override
     {
-        return m_device->size();
+        return m_sequential ? m_device->size() : m_size;
     }
     virtual char *gets(char *s, int sz) override
     {
-        if (m_device->readLine(s, sz) > 0) {
-            return s;
+        if (sz < 1) {
+            return nullptr;
         }
-        return nullptr;
+        if (m_sequential) {
+            auto r = m_device->readLine(s, sz);
+            if (r > 0) {
+                m_pos += r;
+                return s;
+            }
+            return nullptr;
+        }
+        // same as QIODevice::readLine(): up to sz - 1 chars, the new line included
+        qint64 read = 0;
+        while (read < sz - 1) {
+            qint64 avail = 0;
+            auto src = span(&avail);
+            if (src == nullptr) {
+                break;
+            }
+            auto n = std::min(avail, qint64(sz - 1 - read));
+            if (auto nl = static_cast<const char *>(std::memchr(src, '\n', n))) {
+                n = nl - src + 1;
+            }
+            std::memcpy(s + read, src, n);
+            read += n;
+            m_pos += n;
+            if (s[read - 1] == '\n') {
+                break;
+            }
+        }
+        s[read] = '\0';
+        return read > 0 ? s : nullptr;
     }
     virtual int scanf_one(const char *fmt, void *val) override
     {
         QByteArray ba;
-        for (int xcnt = 0; xcnt < 24 && !m_device->atEnd(); ++xcnt) {
-            char c;
-            if (!m_device->getChar(&c)) {
-                return EOF;
+        for (int xcnt = 0; xcnt < 24; ++xcnt) {
+            auto c = get_char();
+            if (c == EOF) {
+                if (xcnt == 0) {
+                    return EOF;
+                }
+                break;
             }
             if (ba.isEmpty() && (c == ' ' || c == '\t')) {
                 continue;
@@ -175,17 +283,27 @@ public:
             if (c == '\0' || c == ' ' || c == '\t' || c == '\n') {
                 break;
             }
-            ba.append(c);
+            ba.append(char(c));
         }
         return raw_scanf_one(ba, fmt, val);
     }
     virtual int get_char() override
     {
-        unsigned char c;
-        if (!m_device->getChar(reinterpret_cast<char *>(&c))) {
+        if (m_sequential) {
+            unsigned char c;
+            if (!m_device->getChar(reinterpret_cast<char *>(&c))) {
+                return EOF;
+            }
+            ++m_pos;
+            return int(c);
+        }
+        qint64 avail = 0;
+        auto src = span(&avail);
+        if (src == nullptr) {
             return EOF;
         }
-        return int(c);
+        ++m_pos;
+        return int(uchar(*src));
     }
 #if (LIBRAW_VERSION < LIBRAW_MAKE_VERSION(0, 21, 0)) || defined(LIBRAW_OLD_VIDEO_SUPPORT)
     virtual void *make_jas_stream() override
@@ -195,7 +313,84 @@ public:
 #endif
 
 private:
+    /*!
+     * \brief span
+     * \return The data at the current position (\a avail contiguous bytes) or nullptr at the end.
+     */
+    const char *span(qint64 *avail)
+    {
+        if (m_pos >= m_size) {
+            return nullptr;
+        }
+        if (m_map) {
+            *avail = m_size - m_pos;
+            return reinterpret_cast<const char *>(m_map) + m_pos;
+        }
+        auto page = fetchPage(m_pos - m_pos % RAW_PAGE_SIZE);
+        if (page == nullptr) {
+            return nullptr;
+        }
+        const auto offset = m_pos - page->start;
+        *avail = page->data.size() - offset;
+        if (*avail <= 0) {
+            return nullptr;
+        }
+        return page->data.constData() + offset;
+    }
+
+    /*!
+     * \brief fetchPage
+     * \return The page starting at \a start, read from the device if not cached.
+     */
+    const Page *fetchPage(qint64 start)
+    {
+        auto lru = m_pages.begin();
+        for (auto it = m_pages.begin(); it != m_pages.end(); ++it) {
+            if (it->start == start) {
+                it->used = ++m_clock;
+                return &(*it);
+            }
+            if (it->used < lru->used) {
+                lru = it;
+            }
+        }
+        if (m_pages.size() < RAW_PAGE_COUNT) {
+            m_pages.append(Page());
+            lru = m_pages.end() - 1;
+        }
+        lru->start = -1;
+        if (!Instrumentation::seek(m_device, start)) {
+            return nullptr;
+        }
+        lru->data.resize(std::min(RAW_PAGE_SIZE, m_size - start));
+        qint64 read = 0;
+        for (qint64 r = 0; read < lru->data.size(); read += r) {
+            r = m_device->read(lru->data.data() + read, lru->data.size() - read);
+            if (r < 1) {
+                break;
+            }
+        }
+        if (read < 1) {
+            return nullptr;
+        }
+        lru->data.truncate(read);
+        lru->start = start;
+        lru->used = ++m_clock;
+        return &(*lru);
+    }
+
     QIODevice *m_device;
+    bool m_sequential = false;
+    qint64 m_pos = 0;
+    qint64 m_size = 0;
+
+    // memory map of local files
+    QPointer<QFile> m_file;
+    uchar *m_map = nullptr;
+
+    // page cache of the other random access devices
+    QList<Page> m_pages;
+    quint64 m_clock = 0;
 };
 
 bool addTag(const QString &tag, QStringList &lines)
@@ -393,16 +588,23 @@ QString updateXmpPacket(const QString &xmpPacket, LibRaw *rawProcessor)
     return lines.join(QChar::fromLatin1('\n'));
 }
 
+/*!
+ * \brief rgbToRgbX
+ * Expands in place the first \a width RGB pixels of \a line to RGBX.
+ * \note The line must be big enough to hold the RGBX pixels.
+ */
 template<class T>
-inline void rgbToRgbX(uchar *target, const uchar *source, qint32 targetSize, qint32 sourceSize)
-{
-    auto s = reinterpret_cast<const T *>(source);
-    auto t = reinterpret_cast<T *>(target);
-    auto width = std::min(targetSize / 4, sourceSize / 3) / qint32(sizeof(T));
-    for (qint32 x = 0; x < width; ++x) {
-        t[x * 4 + 0] = s[x * 3 + 0];
-        t[x * 4 + 1] = s[x * 3 + 1];
-        t[x * 4 + 2] = s[x * 3 + 2];
+inline void rgbToRgbX(uchar *line, qint32 width)
+{
+    auto t = reinterpret_cast<T *>(line);
+    // backward: the RGBX pixel is beyond the RGB one
+    for (qint32 x = width - 1; x >= 0; --x) {
+        auto r = t[x * 3 + 0];
+        auto g = t[x * 3 + 1];
+        auto b = t[x * 3 + 2];
+        t[x * 4 + 0] = r;
+        t[x * 4 + 1] = g;
+        t[x * 4 + 2] = b;
         t[x * 4 + 3] = std::numeric_limits<T>::max();
     }
 }
@@ -581,6 +783,117 @@ void setParams(QImageIOHandler *handler, LibRaw *rawProcessor)
     params.use_fuji_rotate = T_SR(quality) ? 0 : 1;
 }
 
+/*!
+ * \brief setMetadata
+ * Sets the metadata read by \a rawProcessor in \a img.
+ */
+void setMetadata(LibRaw *rawProcessor, QImage &img)
+{
+    auto &&iparams = rawProcessor->imgdata.idata;
+
+    auto xmpPacket = QString();
+    if (auto xmpdata = iparams.xmpdata) {
+        if (auto xmplen = iparams.xmplen)
+            xmpPacket = QString::fromUtf8(xmpdata, xmplen);
+    }
+    // Add info from LibRAW structs (e.g. GPS position, info about lens, info about shot and flash, etc...)
+    img.setText(QStringLiteral(META_KEY_XMP_ADOBE), updateXmpPacket(xmpPacket, rawProcessor));
+
+    auto model = QString::fromUtf8(iparams.normalized_model);
+    if (!model.isEmpty()) {
+        img.setText(QStringLiteral(META_KEY_MODEL), model);
+    }
+    auto manufacturer = QString::fromUtf8(iparams.normalized_make);
+    if (!manufacturer.isEmpty()) {
+        img.setText(QStringLiteral(META_KEY_MANUFACTURER), manufacturer);
+    }
+    auto software = QString::fromUtf8(iparams.software);
+    if (!software.isEmpty()) {
+        img.setText(QStringLiteral(META_KEY_SOFTWARE), software);
+    }
+
+    auto &&iother = rawProcessor->imgdata.other;
+    auto description = QString::fromUtf8(iother.desc);
+    if (!description.isEmpty()) {
+        img.setText(QStringLiteral(META_KEY_DESCRIPTION), description);
+    }
+    auto artist = QString::fromUtf8(iother.artist);
+    if (!artist.isEmpty()) {
+        img.setText(QStringLiteral(META_KEY_AUTHOR), artist);
+    }
+}
+
+/*!
+ * \brief rawSize
+ * \return The size of the processed image (rotation included).
+ */
+QSize rawSize(LibRaw *rawProcessor)
+{
+    auto &&sizes = rawProcessor->imgdata.sizes;
+    // flip & 4: taken from LibRaw code
+    return (sizes.flip & 4) ? QSize(sizes.height, sizes.width) : QSize(sizes.width, sizes.height);
+}
+
+/*!
+ * \brief loadThumbnail
+ * Loads the thumbnail embedded in the RAW file if it is at least of \a size and it has
+ * the same aspect ratio of the RAW image.
+ * \return True on success, otherwise false.
+ */
+bool loadThumbnail(LibRaw *rawProcessor, const QSize &size, QImage &img)
+{
+    auto &&thumbnail = rawProcessor->imgdata.thumbnail;
+    auto &&sizes = rawProcessor->imgdata.sizes;
+    auto thumbSize = (sizes.flip & 4) ? QSize(thumbnail.theight, thumbnail.twidth) : QSize(thumbnail.twidth, thumbnail.theight);
+    auto fullSize = rawSize(rawProcessor);
+    if (thumbSize.isEmpty() || fullSize.isEmpty() || thumbSize.width() < size.width() || thumbSize.height() < size.height()) {
+        return false;
+    }
+    // some cameras embed thumbnails with black bars or a different crop
+    auto ratio = double(thumbSize.width()) / thumbSize.height();
+    auto fullRatio = double(fullSize.width()) / fullSize.height();
+    if (std::abs(ratio - fullRatio) > fullRatio * 0.01) {
+        return false;
+    }
+
+    if (rawProcessor->unpack_thumb() != LIBRAW_SUCCESS) {
+        return false;
+    }
+    int err = LIBRAW_SUCCESS;
+    pi_unique_ptr thumb(rawProcessor->dcraw_make_mem_thumb(&err), LibRaw::dcraw_clear_mem);
+    if (thumb == nullptr || err != LIBRAW_SUCCESS) {
+        return false;
+    }
+
+    if (thumb->type == LIBRAW_IMAGE_JPEG) {
+        img = QImage::fromData(thumb->data, int(thumb->data_size), "JPG");
+    } else if (thumb->type == LIBRAW_IMAGE_BITMAP && thumb->colors == 3 && thumb->bits == 8) {
+        img = imageAlloc(thumb->width, thumb->height, QImage::Format_RGB888);
+        if (!img.isNull()) {
+            auto rawBytesPerLine = qint32(thumb->width) * 3;
+            for (int y = 0, h = img.height(); y < h; ++y) {
+                memcpy(img.scanLine(y), thumb->data + rawBytesPerLine * y, std::min(qint32(img.bytesPerLine()), rawBytesPerLine));
+            }
+        }
+    }
+    if (img.isNull()) {
+        return false;
+    }
+
+    // the thumbnail is not rotated by LibRaw
+    if (sizes.flip == 3) {
+        img = img.transformed(QTransform().rotate(180));
+    } else if (sizes.flip == 5) {
+        img = img.transformed(QTransform().rotate(-90));
+    } else if (sizes.flip == 6) {
+        img = img.transformed(QTransform().rotate(90));
+    }
+    if (!img.colorSpace().isValid()) {
+        img.setColorSpace(QColorSpace(QColorSpace::SRgb));
+    }
+    return true;
+}
+
 bool LoadRAW(QImageIOHandler *handler, QImage &img)
 {
     std::unique_ptr<LibRaw> rawProcessor(new LibRaw);
@@ -589,6 +902,7 @@ bool LoadRAW(QImageIOHandler *handler, QImage &img)
     setParams(handler, rawProcessor.get());
 
     // *** Open the stream
+    InstrumentationPhase headerPhase(Instrumentation::Header);
     auto device = handler->device();
 #ifndef EXCLUDE_LibRaw_QIODevice
     LibRaw_QIODevice stream(device);
@@ -602,40 +916,60 @@ bool LoadRAW(QImageIOHandler *handler, QImage &img)
     }
 #endif
 
+    // *** Scaled images (e.g. file browsers): the embedded thumbnail or an half-size image are used when big enough
+    auto scaledSize = handler->option(QImageIOHandler::ScaledSize).toSize();
+    if (scaledSize.isValid() && !scaledSize.isEmpty()) {
+        if (loadThumbnail(rawProcessor.get(), scaledSize, img)) {
+            setMetadata(rawProcessor.get(), img);
+            img = img.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            return !img.isNull();
+        }
+        auto fullSize = rawSize(rawProcessor.get());
+        if (fullSize.width() / 2 >= scaledSize.width() && fullSize.height() / 2 >= scaledSize.height()) {
+            rawProcessor->imgdata.params.half_size = 1;
+        }
+    }
+
+    headerPhase.end();
+
     // *** Unpacking selected image
+    InstrumentationPhase decodePhase(Instrumentation::Decode);
     if (rawProcessor->unpack() != LIBRAW_SUCCESS) {
         return false;
     }
+    decodePhase.end();
 
     // *** Process selected image
+    InstrumentationPhase convertPhase(Instrumentation::Convert);
     if (rawProcessor->dcraw_process() != LIBRAW_SUCCESS) {
         return false;
     }
 
     // *** Convert to QImage
-    pi_unique_ptr processedImage(rawProcessor->dcraw_make_mem_image(), LibRaw::dcraw_clear_mem);
-    if (processedImage == nullptr) {
-        return false;
-    }
+    // NOTE: the processed image is copied directly into the QImage (no intermediate buffer)
+    int width = 0;
+    int height = 0;
+    int colors = 0;
+    int bits = 0;
+    rawProcessor->get_mem_image_format(&width, &height, &colors, &bits);
 
     // clang-format off
-    if ((processedImage->type != LIBRAW_IMAGE_BITMAP) ||
-        (processedImage->colors != 1 && processedImage->colors != 3 && processedImage->colors != 4) ||
-        (processedImage->bits != 8 && processedImage->bits != 16)) {
+    if ((colors != 1 && colors != 3 && colors != 4) ||
+        (bits != 8 && bits != 16)) {
         return false;
     }
     // clang-format on
 
     auto format = QImage::Format_Invalid;
-    switch (processedImage->colors) {
+    switch (colors) {
     case 1: // Gray images (tested with image attached on https://bugs.kde.org/show_bug.cgi?id=401371)
-        format = processedImage->bits == 8 ? QImage::Format_Grayscale8 : QImage::Format_Grayscale16;
+        format = bits == 8 ? QImage::Format_Grayscale8 : QImage::Format_Grayscale16;
         break;
     case 3: // Images with R G B components
-        format = processedImage->bits == 8 ? QImage::Format_RGB888 : QImage::Format_RGBX64;
+        format = bits == 8 ? QImage::Format_RGB888 : QImage::Format_RGBX64;
         break;
     case 4: // Images with R G B components + Alpha (never seen)
-        format = processedImage->bits == 8 ? QImage::Format_RGBA8888 : QImage::Format_RGBA64;
+        format = bits == 8 ? QImage::Format_RGBA8888 : QImage::Format_RGBA64;
         break;
     }
 
@@ -643,22 +977,25 @@ bool LoadRAW(QImageIOHandler *handler, QImage &img)
         return false;
     }
 
-    img = imageAlloc(processedImage->width, processedImage->height, format);
+    img = imageAlloc(width, height, format);
     if (img.isNull()) {
         return false;
     }
 
-    auto rawBytesPerLine = qint32(processedImage->width * processedImage->bits * processedImage->colors + 7) / 8;
-    auto lineSize = std::min(qint32(img.bytesPerLine()), rawBytesPerLine);
-    for (int y = 0, h = img.height(); y < h; ++y) {
-        auto scanline = img.scanLine(y);
-        if (format == QImage::Format_RGBX64)
-            rgbToRgbX<quint16>(scanline, processedImage->data + rawBytesPerLine * y, img.bytesPerLine(), rawBytesPerLine);
-        else
-            memcpy(scanline, processedImage->data + rawBytesPerLine * y, lineSize);
+    // 16-bit RGB lines are copied at the start of the RGBX64 lines and expanded in place
+    if (rawProcessor->copy_mem_image(img.bits(), int(img.bytesPerLine()), 0) != LIBRAW_SUCCESS) {
+        return false;
+    }
+    if (format == QImage::Format_RGBX64) {
+        for (int y = 0, h = img.height(); y < h; ++y) {
+            rgbToRgbX<quint16>(img.scanLine(y), width);
+        }
     }
 
+    convertPhase.end();
+
     // *** Set the color space
+    InstrumentationPhase metadataPhase(Instrumentation::Metadata);
     auto &&params = rawProcessor->imgdata.params;
     if (params.output_color == 0) {
         auto &&color = rawProcessor->imgdata.color;
@@ -666,7 +1003,7 @@ bool LoadRAW(QImageIOHandler *handler, QImage &img)
             img.setColorSpace(QColorSpace::fromIccProfile(QByteArray(profile, color.profile_length)));
         }
     }
-    if (processedImage->colors >= 3) {
+    if (colors >= 3) {
         if (params.output_color == 1) {
             img.setColorSpace(QColorSpace(QColorSpace::SRgb));
         }
@@ -682,40 +1019,52 @@ bool LoadRAW(QImageIOHandler *handler, QImage &img)
     }
 
     // *** Set the metadata
-    auto &&iparams = rawProcessor->imgdata.idata;
+    setMetadata(rawProcessor.get(), img);
+    metadataPhase.end();
 
-    auto xmpPacket = QString();
-    if (auto xmpdata = iparams.xmpdata) {
-        if (auto xmplen = iparams.xmplen)
-            xmpPacket = QString::fromUtf8(xmpdata, xmplen);
+    if (scaledSize.isValid() && !scaledSize.isEmpty() && img.size() != scaledSize) {
+        img = img.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
     }
-    // Add info from LibRAW structs (e.g. GPS position, info about lens, info about shot and flash, etc...)
-    img.setText(QStringLiteral(META_KEY_XMP_ADOBE), updateXmpPacket(xmpPacket, rawProcessor.get()));
 
-    auto model = QString::fromUtf8(iparams.normalized_model);
-    if (!model.isEmpty()) {
-        img.setText(QStringLiteral(META_KEY_MODEL), model);
-    }
-    auto manufacturer = QString::fromUtf8(iparams.normalized_make);
-    if (!manufacturer.isEmpty()) {
-        img.setText(QStringLiteral(META_KEY_MANUFACTURER), manufacturer);
-    }
-    auto software = QString::fromUtf8(iparams.software);
-    if (!software.isEmpty()) {
-        img.setText(QStringLiteral(META_KEY_SOFTWARE), software);
-    }
+    return !img.isNull();
+}
 
-    auto &&iother = rawProcessor->imgdata.other;
-    auto description = QString::fromUtf8(iother.desc);
-    if (!description.isEmpty()) {
-        img.setText(QStringLiteral(META_KEY_DESCRIPTION), description);
-    }
-    auto artist = QString::fromUtf8(iother.artist);
-    if (!artist.isEmpty()) {
-        img.setText(QStringLiteral(META_KEY_AUTHOR), artist);
-    }
+/*!
+ * \brief isPlausibleRaw
+ * Quick check of the signatures of the RAW containers, used before opening the device with LibRaw
+ * when the format is not known: most of the files are rejected after peeking a few bytes.
+ * \note The headerless RAW files (identified by LibRaw from the file size) are not detected: they
+ *       are read only when the format is set (e.g. from the file suffix).
+ */
+bool isPlausibleRaw(QIODevice *device)
+{
+    struct Signature {
+        qsizetype offset;
+        QByteArrayView bytes;
+    };
+    // clang-format off
+    static const Signature signatures[] = {
+        // TIFF based (DNG, NEF, CR2, ARW, PEF, SRW, 3FR, IIQ, MOS, ...) and their variants (ORF, RW2)
+        {0, QByteArrayView("II*\0", 4)}, {0, QByteArrayView("MM\0*", 4)},
+        {0, QByteArrayView("IIRO", 4)}, {0, QByteArrayView("IIRS", 4)}, {0, QByteArrayView("MMOR", 4)},
+        {0, QByteArrayView("IIU\0", 4)},
+        // CR3 (ISO base media file with the Canon brand)
+        {4, QByteArrayView("ftypcrx ", 8)},
+        // CRW (CIFF)
+        {6, QByteArrayView("HEAPCCDR", 8)},
+        // RAF, X3F, MRW, ARRI, Nokia, Kodak
+        {0, QByteArrayView("FUJIFILM", 8)}, {0, QByteArrayView("FOVb", 4)}, {0, QByteArrayView("\0MRM", 4)},
+        {0, QByteArrayView("ARRI", 4)}, {0, QByteArrayView("NOKIARAW", 8)}, {0, QByteArrayView("DSC-Image", 9)},
+    };
+    // clang-format on
 
-    return true;
+    const auto header = device->peek(16);
+    for (auto &&sig : signatures) {
+        if (QByteArrayView(header).sliced(std::min(sig.offset, header.size())).startsWith(sig.bytes)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 } // Private
@@ -740,6 +1089,7 @@ bool RAWHandler::canRead() const
 bool RAWHandler::read(QImage *image)
 {
     auto dev = device();
+    Instrumentation instrumentation("raw", dev);
 
     // set the image position after the first run.
     if (!dev->isSequential()) {
@@ -773,6 +1123,9 @@ void RAWHandler::setOption(ImageOption option, const QVariant &value)
             m_quality = q;
         }
     }
+    if (option == QImageIOHandler::ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
 }
 
 bool RAWHandler::supportsOption(ImageOption option) const
@@ -787,6 +1140,10 @@ bool RAWHandler::supportsOption(ImageOption option) const
         return true;
     }
 
+    if (option == QImageIOHandler::ScaledSize) {
+        return true;
+    }
+
     return false;
 }
 
@@ -821,6 +1178,10 @@ QVariant RAWHandler::option(ImageOption option) const
         v = m_quality;
     }
 
+    if (option == QImageIOHandler::ScaledSize) {
+        v = m_scaledSize;
+    }
+
     return v;
 }
 
@@ -908,7 +1269,7 @@ QImageIOPlugin::Capabilities RAWPlugin::capabilities(QIODevice *device, const QB
     }
 
     Capabilities cap;
-    if (device->isReadable() && RAWHandler::canRead(device)) {
+    if (device->isReadable() && isPlausibleRaw(device) && RAWHandler::canRead(device)) {
         cap |= CanRead;
     }
     return cap;
@@ -80,6 +80,13 @@ private:
      * The initial device position to allow multi image load (cache value).
      */
     qint64 m_startPos;
+
+    /*!
+     * \brief m_scaledSize
+     * Value set by QImageReader::setScaledSize(). When set, the embedded thumbnail (or an half-size
+     * image) is used if it is big enough.
+     */
+    QSize m_scaledSize;
 };
 
 class RAWPlugin : public QImageIOPlugin
@@ -20,55 +20,74 @@
  */
 
 #include "rgb_p.h"
+#include "threadpool_p.h"
 #include "util_p.h"
 
 #include <QList>
-#include <QMap>
+#include <QMultiHash>
 
 #include <QDebug>
 #include <QImage>
 
-class RLEData : public QList<uchar>
+#include <algorithm>
+
+class RLEData
 {
 public:
     RLEData()
     {
     }
-    RLEData(const uchar *d, uint l, uint o)
-        : _offset(o)
+    RLEData(const QByteArray &d, uint o)
+        : _data(d)
+        , _offset(o)
     {
-        for (uint i = 0; i < l; i++) {
-            append(d[i]);
-        }
     }
-    bool operator<(const RLEData &) const;
-    void write(QDataStream &s);
+    void write(QDataStream &s) const;
+    uint size() const
+    {
+        return _data.size();
+    }
     uint offset() const
     {
         return _offset;
     }
+    const QByteArray &data() const
+    {
+        return _data;
+    }
 
 private:
+    QByteArray _data;
     uint _offset;
 };
 
-class RLEMap : public QMap<RLEData, uint>
+/*!
+ * \brief The RLEMap class
+ * Stores the compressed rows once: identical rows share the same data in the file.
+ *
+ * The rows are found by hash (the content is compared only for rows with the same hash) and
+ * numbered in insertion order.
+ */
+class RLEMap
 {
 public:
     RLEMap()
-        : _counter(0)
-        , _offset(0)
+        : _offset(0)
     {
     }
-    uint insert(const uchar *d, uint l);
-    QList<const RLEData *> vector();
+    uint insert(const QByteArray &d, size_t hash);
+    const QList<RLEData> &vector() const
+    {
+        return _rows;
+    }
     void setBaseOffset(uint o)
     {
         _offset = o;
     }
 
 private:
-    uint _counter;
+    QMultiHash<size_t, uint> _index;
+    QList<RLEData> _rows;
     uint _offset;
 };
 
@@ -106,24 +125,28 @@ private:
     quint32 *_lengthtab;
     QByteArray _data;
     QByteArray::Iterator _pos;
+    bool _streaming;
+    qint64 _dataStart;
     RLEMap _rlemap;
-    QList<const RLEData *> _rlevector;
+    QList<RLEData> _rlevector;
     uint _numrows;
 
     bool readData(QImage &);
+    bool loadRow(uint row);
     bool getRow(uchar *dest);
 
     void writeHeader();
     void writeRle();
     void writeVerbatim(const QImage &);
     bool scanData(const QImage &);
-    uint compact(uchar *, uchar *);
-    uchar intensity(uchar);
+    uint compact(uchar *, const uchar *) const;
 };
 
 SGIImage::SGIImage(QIODevice *io)
     : _starttab(nullptr)
     , _lengthtab(nullptr)
+    , _streaming(false)
+    , _dataStart(0)
 {
     _dev = io;
     _stream.setDevice(_dev);
@@ -180,22 +203,57 @@ bool SGIImage::getRow(uchar *dest)
     return i == _xsize;
 }
 
+/*!
+ * \brief SGIImage::loadRow
+ * Prepares the decoding of the \a row (rows of all channels in file order).
+ *
+ * On random access devices only the data of the row is read (the image is decoded in file order, so
+ * uncompressed files are read sequentially), otherwise the data of the whole file is in _data.
+ */
+bool SGIImage::loadRow(uint row)
+{
+    if (!_streaming) {
+        if (_rle) {
+            _pos = _data.begin() + _starttab[row];
+        } else if (row == 0) {
+            _pos = _data.begin();
+        }
+        return true;
+    }
+
+    qint64 offset;
+    qint64 length;
+    if (_rle) {
+        offset = _dataStart + _starttab[row];
+        length = _lengthtab[row];
+    } else {
+        length = qint64(_xsize) * _bpc;
+        offset = _dataStart + row * length;
+    }
+    if (_dev->pos() != offset && !_dev->seek(offset)) {
+        return false;
+    }
+    _data.resize(length);
+    const auto read = _dev->read(_data.data(), length);
+    if (read < length) {
+        _data.resize(std::max(read, qint64(0)));
+    }
+    _pos = _data.begin();
+    return true;
+}
+
 bool SGIImage::readData(QImage &img)
 {
     QRgb *c;
-    quint32 *start = _starttab;
+    uint row = 0;
     QByteArray lguard(_xsize, 0);
     uchar *line = (uchar *)lguard.data();
     unsigned x;
     unsigned y;
 
-    if (!_rle) {
-        _pos = _data.begin();
-    }
-
     for (y = 0; y < _ysize; y++) {
-        if (_rle) {
-            _pos = _data.begin() + *start++;
+        if (!loadRow(row++)) {
+            return false;
         }
         if (!getRow(line)) {
             return false;
@@ -212,8 +270,8 @@ bool SGIImage::readData(QImage &img)
 
     if (_zsize != 2) {
         for (y = 0; y < _ysize; y++) {
-            if (_rle) {
-                _pos = _data.begin() + *start++;
+            if (!loadRow(row++)) {
+                return false;
             }
             if (!getRow(line)) {
                 return false;
@@ -225,8 +283,8 @@ bool SGIImage::readData(QImage &img)
         }
 
         for (y = 0; y < _ysize; y++) {
-            if (_rle) {
-                _pos = _data.begin() + *start++;
+            if (!loadRow(row++)) {
+                return false;
             }
             if (!getRow(line)) {
                 return false;
@@ -243,8 +301,8 @@ bool SGIImage::readData(QImage &img)
     }
 
     for (y = 0; y < _ysize; y++) {
-        if (_rle) {
-            _pos = _data.begin() + *start++;
+        if (!loadRow(row++)) {
+            return false;
         }
         if (!getRow(line)) {
             return false;
@@ -369,13 +427,22 @@ bool SGIImage::readImage(QImage &img)
         return false;
     }
 
-    _data = _dev->readAll();
+    // the rows are read on demand from random access devices (peak memory is the image)
+    qint64 dataSize;
+    _streaming = !_dev->isSequential();
+    if (_streaming) {
+        _dataStart = _dev->pos();
+        dataSize = _dev->size() - _dataStart;
+    } else {
+        _data = _dev->readAll();
+        dataSize = _data.size();
+    }
 
     // sanity check
     if (_rle) {
         for (uint o = 0; o < _numrows; o++) {
             // don't change to greater-or-equal!
-            if (_starttab[o] + _lengthtab[o] > (uint)_data.size()) {
+            if (qint64(_starttab[o]) + _lengthtab[o] > dataSize) {
                 //                 qDebug() << "image corrupt (sanity check failed)";
                 return false;
             }
@@ -392,67 +459,34 @@ bool SGIImage::readImage(QImage &img)
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void RLEData::write(QDataStream &s)
+void RLEData::write(QDataStream &s) const
 {
-    for (int i = 0; i < size(); i++) {
-        s << at(i);
-    }
+    s.writeRawData(_data.constData(), _data.size());
 }
 
-bool RLEData::operator<(const RLEData &b) const
+uint RLEMap::insert(const QByteArray &d, size_t hash)
 {
-    uchar ac;
-    uchar bc;
-    for (int i = 0; i < qMin(size(), b.size()); i++) {
-        ac = at(i);
-        bc = b[i];
-        if (ac != bc) {
-            return ac < bc;
+    const auto range = _index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (_rows.at(*it).data() == d) {
+            return *it;
         }
     }
-    return size() < b.size();
-}
-
-uint RLEMap::insert(const uchar *d, uint l)
-{
-    RLEData data = RLEData(d, l, _offset);
-    Iterator it = find(data);
-    if (it != end()) {
-        return it.value();
-    }
 
-    _offset += l;
-    return QMap<RLEData, uint>::insert(data, _counter++).value();
+    const uint index = _rows.size();
+    _rows.append(RLEData(d, _offset));
+    _index.insert(hash, index);
+    _offset += d.size();
+    return index;
 }
 
-QList<const RLEData *> RLEMap::vector()
-{
-    QList<const RLEData *> v(size());
-    for (Iterator it = begin(); it != end(); ++it) {
-        v.replace(it.value(), &it.key());
-    }
-
-    return v;
-}
-
-uchar SGIImage::intensity(uchar c)
-{
-    if (c < _pixmin) {
-        _pixmin = c;
-    }
-    if (c > _pixmax) {
-        _pixmax = c;
-    }
-    return c;
-}
-
-uint SGIImage::compact(uchar *d, uchar *s)
+uint SGIImage::compact(uchar *d, const uchar *s) const
 {
     uchar *dest = d;
-    uchar *src = s;
+    const uchar *src = s;
     uchar patt;
-    uchar *t;
-    uchar *end = s + _xsize;
+    const uchar *t;
+    const uchar *end = s + _xsize;
     int i;
     int n;
     while (src < end) {
@@ -491,85 +525,66 @@ uint SGIImage::compact(uchar *d, uchar *s)
 
 bool SGIImage::scanData(const QImage &img)
 {
-    quint32 *start = _starttab;
-    QByteArray lineguard(_xsize * 2, 0);
-    QByteArray bufguard(_xsize, 0);
-    uchar *line = (uchar *)lineguard.data();
-    uchar *buf = (uchar *)bufguard.data();
-    const QRgb *c;
-    unsigned x;
-    unsigned y;
-    uint len;
-
-    for (y = 0; y < _ysize; y++) {
-        const int yPos = _ysize - y - 1; // scanline doesn't do any sanity checking
-        if (yPos >= img.height()) {
-            qWarning() << "Failed to get scanline for" << yPos;
-            return false;
-        }
-
-        c = reinterpret_cast<const QRgb *>(img.scanLine(yPos));
-
-        for (x = 0; x < _xsize; x++) {
-            buf[x] = intensity(qRed(*c++));
-        }
-        len = compact(line, buf);
-        *start++ = _rlemap.insert(line, len);
-    }
-
-    if (_zsize == 1) {
-        return true;
+    if (img.height() < _ysize || img.width() < _xsize) {
+        qWarning() << "Failed to get the scanlines of the image";
+        return false;
     }
 
-    if (_zsize != 2) {
-        for (y = 0; y < _ysize; y++) {
-            const int yPos = _ysize - y - 1;
-            if (yPos >= img.height()) {
-                qWarning() << "Failed to get scanline for" << yPos;
-                return false;
+    // The rows are compressed concurrently: the rows of the channels are stored one after the other
+    // (red or grey, then green, blue and alpha).
+    QList<QByteArray> rows(_numrows);
+    QList<size_t> hashes(_numrows);
+    const int threads = std::max(1, maxThreadCount());
+    QList<quint32> pixmin(threads, _pixmin);
+    QList<quint32> pixmax(threads, _pixmax);
+    QAtomicInt next = 0;
+    runConcurrently(threads, [&, rows = rows.data(), hashes = hashes.data(), pixmin = pixmin.data(), pixmax = pixmax.data()](int thread) {
+        QByteArray lineguard(_xsize * 2 + 2, 0);
+        QByteArray bufguard(_xsize, 0);
+        uchar *line = (uchar *)lineguard.data();
+        uchar *buf = (uchar *)bufguard.data();
+        uchar cmin = 255;
+        uchar cmax = 0;
+        for (int row; (row = next.fetchAndAddRelaxed(1)) < int(_numrows);) {
+            const int z = row / _ysize;
+            const int yPos = _ysize - row % _ysize - 1;
+            const QRgb *c = reinterpret_cast<const QRgb *>(img.constScanLine(yPos));
+            if (_zsize > 2 && z < 3) {
+                const int shift = 16 - z * 8; // red, green, blue
+                for (unsigned x = 0; x < _xsize; x++) {
+                    buf[x] = uchar(c[x] >> shift);
+                }
+            } else if (z == 0) {
+                for (unsigned x = 0; x < _xsize; x++) {
+                    buf[x] = uchar(qRed(c[x]));
+                }
+            } else {
+                for (unsigned x = 0; x < _xsize; x++) {
+                    buf[x] = uchar(qAlpha(c[x]));
+                }
             }
-
-            c = reinterpret_cast<const QRgb *>(img.scanLine(yPos));
-            for (x = 0; x < _xsize; x++) {
-                buf[x] = intensity(qGreen(*c++));
+            for (unsigned x = 0; x < _xsize; x++) {
+                cmin = std::min(cmin, buf[x]);
+                cmax = std::max(cmax, buf[x]);
             }
-            len = compact(line, buf);
-            *start++ = _rlemap.insert(line, len);
+            const uint len = compact(line, buf);
+            rows[row] = QByteArray(reinterpret_cast<const char *>(line), len);
+            hashes[row] = qHash(rows[row]);
         }
+        pixmin[thread] = std::min(pixmin[thread], quint32(cmin));
+        pixmax[thread] = std::max(pixmax[thread], quint32(cmax));
+    });
 
-        for (y = 0; y < _ysize; y++) {
-            const int yPos = _ysize - y - 1;
-            if (yPos >= img.height()) {
-                qWarning() << "Failed to get scanline for" << yPos;
-                return false;
-            }
-
-            c = reinterpret_cast<const QRgb *>(img.scanLine(yPos));
-            for (x = 0; x < _xsize; x++) {
-                buf[x] = intensity(qBlue(*c++));
-            }
-            len = compact(line, buf);
-            *start++ = _rlemap.insert(line, len);
-        }
-
-        if (_zsize == 3) {
-            return true;
-        }
+    for (int i = 0; i < threads; ++i) {
+        _pixmin = std::min(_pixmin, pixmin.at(i));
+        _pixmax = std::max(_pixmax, pixmax.at(i));
     }
 
-    for (y = 0; y < _ysize; y++) {
-        const int yPos = _ysize - y - 1;
-        if (yPos >= img.height()) {
-            qWarning() << "Failed to get scanline for" << yPos;
-            return false;
-        }
-
-        c = reinterpret_cast<const QRgb *>(img.scanLine(yPos));
-        for (x = 0; x < _xsize; x++) {
-            buf[x] = intensity(qAlpha(*c++));
-        }
-        len = compact(line, buf);
-        *start++ = _rlemap.insert(line, len);
+    // stored in the order of the file
+    quint32 *start = _starttab;
+    for (uint row = 0; row < _numrows; ++row) {
+        *start++ = _rlemap.insert(rows.at(row), hashes.at(row));
+        rows[row].clear();
     }
 
     return true;
@@ -603,17 +618,17 @@ void SGIImage::writeRle()
 
     // write start table
     for (i = 0; i < _numrows; i++) {
-        _stream << quint32(_rlevector[_starttab[i]]->offset());
+        _stream << quint32(_rlevector.at(_starttab[i]).offset());
     }
 
     // write length table
     for (i = 0; i < _numrows; i++) {
-        _stream << quint32(_rlevector[_starttab[i]]->size());
+        _stream << quint32(_rlevector.at(_starttab[i]).size());
     }
 
     // write data
     for (i = 0; (int)i < _rlevector.size(); i++) {
-        const_cast<RLEData *>(_rlevector[i])->write(_stream);
+        _rlevector.at(i).write(_stream);
     }
 }
 
@@ -718,7 +733,7 @@ bool SGIImage::writeImage(const QImage &image)
     long verbatim_size = _numrows * _xsize;
     long rle_size = _numrows * 2 * sizeof(quint32);
     for (int i = 0; i < _rlevector.size(); i++) {
-        rle_size += _rlevector[i]->size();
+        rle_size += _rlevector.at(i).size();
     }
 
     if (verbatim_size <= rle_size) {
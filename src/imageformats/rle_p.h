@@ -11,6 +11,8 @@
 #include <QDataStream>
 #include <QDebug>
 
+#include <cstring>
+
 /**
  * The RLEVariant to use.
  *
@@ -149,6 +151,156 @@ static inline bool decodeRLEData(RLEVariant variant, QDataStream &stream, Item *
     return stream.status() == QDataStream::Ok;
 }
 
+/**
+ * Decodes data written in run-length encoding format from a memory buffer.
+ *
+ * This is the same as the QDataStream overload, but the data is read from
+ * @p input: the bounds of the buffer are checked.
+ *
+ * @param variant     The RLE variant to decode.
+ * @param input       The encoded data.
+ * @param ilen        The size of @p input in bytes.
+ * @param itemSize    The number of bytes read by @p readData.
+ * @param buf         The location to write the decoded data.
+ * @param length      The number of items to read.
+ * @param readData    A function that takes a pointer to @p itemSize bytes
+ *                    and returns a single value.
+ * @param updateItem  A function that takes an item from @p buf and the result
+ *                    of a readData call, and produces the item that should be
+ *                    written to @p buf.
+ *
+ * @returns The number of bytes of @p input used, or -1 on error.
+ */
+template<typename Item, typename Func1, typename Func2>
+static inline qint64 decodeRLEData(RLEVariant variant, const uchar *input, qint64 ilen, qint64 itemSize, Item *dest, quint32 length, Func1 readData, Func2 updateItem)
+{
+    qint64 ip = 0; // in input
+    unsigned offset = 0; // in dest
+    bool is_msb = true; // only used for 16-bit PackBits, data is big-endian
+    quint16 temp_data = 0;
+    auto store = [&](unsigned i, auto datum) {
+        if (variant == RLEVariant::PackBits16) {
+            if (is_msb) {
+                temp_data = datum << 8;
+                is_msb = false;
+            } else {
+                temp_data |= datum;
+                dest[i >> 1] = updateItem(dest[i >> 1], temp_data);
+                is_msb = true;
+            }
+        } else {
+            dest[i] = updateItem(dest[i], datum);
+        }
+    };
+    while (offset < length) {
+        unsigned remaining = length - offset;
+        if (ip >= ilen) {
+            qDebug() << "Unexpected end of RLE data";
+            return -1;
+        }
+        const quint8 count1 = input[ip++];
+
+        if (count1 >= 128u) {
+            unsigned length = 0;
+            if (variant == RLEVariant::PIC) {
+                if (count1 == 128u) {
+                    // If the value is exactly 128, it means that it is more than
+                    // 127 repetitions
+                    if (ip + 2 > ilen) {
+                        return -1;
+                    }
+                    length = (unsigned(input[ip]) << 8) | input[ip + 1];
+                    ip += 2;
+                } else {
+                    // 2 to 128 repetitions
+                    length = count1 - 127u;
+                }
+            } else {
+                if (count1 == 128u) {
+                    // Ignore value 128
+                    continue;
+                }
+                // 128 to 2 repetitions
+                length = 257u - count1;
+            }
+            if (length > remaining) {
+                qDebug() << "Row overrun:" << length << ">" << remaining;
+                return -1;
+            }
+            if (ip + itemSize > ilen) {
+                return -1;
+            }
+            auto datum = readData(input + ip);
+            ip += itemSize;
+            for (unsigned i = offset; i < offset + length; ++i) {
+                store(i, datum);
+            }
+            offset += length;
+        } else {
+            // No repetitions
+            unsigned length = count1 + 1u;
+            if (length > remaining) {
+                qDebug() << "Row overrun:" << length << ">" << remaining;
+                return -1;
+            }
+            if (ip + itemSize * length > ilen) {
+                return -1;
+            }
+            for (unsigned i = offset; i < offset + length; ++i, ip += itemSize) {
+                store(i, readData(input + ip));
+            }
+            offset += length;
+        }
+    }
+    return ip;
+}
+
+/**
+ * Decodes PackBits data from a memory buffer.
+ *
+ * Literal runs are copied and repetitions are filled with memset.
+ *
+ * @param input       The encoded data.
+ * @param ilen        The size of @p input in bytes.
+ * @param output      The location to write the decoded data.
+ * @param olen        The size of @p output in bytes.
+ *
+ * @returns The number of valid bytes written to @p output, or -1 if a literal
+ *          run is truncated. The decoding stops before a run that does not fit
+ *          in @p output.
+ */
+static inline qint64 decodePackBits(const char *input, qint64 ilen, char *output, qint64 olen)
+{
+    qint64 j = 0;
+    for (qint64 ip = 0, rr = 0, available = olen; j < olen && ip < ilen; available = olen - j) {
+        signed char n = static_cast<signed char>(input[ip++]);
+        if (n == -128) {
+            continue;
+        }
+
+        if (n >= 0) {
+            rr = qint64(n) + 1;
+            if (available < rr) {
+                break;
+            }
+            if (ip + rr > ilen) {
+                return -1;
+            }
+            memcpy(output + j, input + ip, size_t(rr));
+            ip += rr;
+        } else if (ip < ilen) {
+            rr = qint64(1 - n);
+            if (available < rr) {
+                break;
+            }
+            memset(output + j, input[ip++], size_t(rr));
+        }
+
+        j += rr;
+    }
+    return j;
+}
+
 /**
  * Encodes data in run-length encoding format.
  *
@@ -219,4 +371,92 @@ static inline void encodeRLEData(RLEVariant variant, QDataStream &stream, const
     }
 }
 
+/**
+ * The size of a buffer large enough for the output of encodeRLEData() when
+ * encoding @p length items of @p itemSize bytes each.
+ */
+static inline qint64 encodeRLEBound(qint64 length, qint64 itemSize)
+{
+    // each packet has at least one item and a header of one byte, except
+    // the long PIC repetitions (three bytes for more than 128 items)
+    return length * (itemSize + 1) + 3;
+}
+
+/**
+ * Encodes data in run-length encoding format into memory.
+ *
+ * This is the same as the stream version of encodeRLEData(), but the packets
+ * are written into @p output so that the caller can write them with a single
+ * call (e.g. one QDataStream::writeRawData() per row).
+ *
+ * @param variant     The RLE variant to encode in.
+ * @param output      The buffer to write the packets to: it must have at least
+ *                    encodeRLEBound() bytes.
+ * @param data        The data to be written.
+ * @param length      The number of items to write.
+ * @param itemsEqual  A function that takes two items and returns whether
+ *                    @p writeItem would write them identically.
+ * @param writeItem   A function that takes a pointer into the output buffer and
+ *                    an item, writes the item and returns the pointer past it.
+ *
+ * @returns A pointer past the last byte written.
+ */
+template<typename Item, typename Func1, typename Func2>
+static inline uchar *encodeRLEData(RLEVariant variant, uchar *output, const Item *data, unsigned length, Func1 itemsEqual, Func2 writeItem)
+{
+    unsigned offset = 0;
+    const unsigned maxEncodableChunk = (variant == RLEVariant::PIC) ? 65535u : 128;
+    while (offset < length) {
+        const Item *chunkStart = data + offset;
+        unsigned maxChunk = qMin(length - offset, maxEncodableChunk);
+
+        const Item *chunkEnd = chunkStart + 1;
+        quint16 chunkLength = 1;
+        while (chunkLength < maxChunk && itemsEqual(*chunkStart, *chunkEnd)) {
+            ++chunkEnd;
+            ++chunkLength;
+        }
+
+        if (chunkLength > 128) {
+            // Sequence of > 128 identical pixels
+            Q_ASSERT(variant == RLEVariant::PIC);
+            *output++ = 128;
+            *output++ = uchar(chunkLength >> 8);
+            *output++ = uchar(chunkLength);
+            output = writeItem(output, *chunkStart);
+        } else if (chunkLength > 1) {
+            // Sequence of <= 128 identical pixels
+            quint8 encodedLength;
+            if (variant == RLEVariant::PIC) {
+                encodedLength = quint8(chunkLength + 127);
+            } else if (variant == RLEVariant::PackBits) {
+                encodedLength = quint8(257 - chunkLength);
+            } else {
+                Q_ASSERT(false);
+                encodedLength = 0;
+            }
+            *output++ = encodedLength;
+            output = writeItem(output, *chunkStart);
+        } else {
+            // find a string of up to 128 values, each different from the one
+            // that follows it
+            if (maxChunk > 128) {
+                maxChunk = 128;
+            }
+            chunkLength = 1;
+            chunkEnd = chunkStart + 1;
+            while (chunkLength < maxChunk && (chunkLength + 1u == maxChunk || !itemsEqual(*chunkEnd, *(chunkEnd + 1)))) {
+                ++chunkEnd;
+                ++chunkLength;
+            }
+            *output++ = quint8(chunkLength - 1);
+            for (unsigned i = 0; i < chunkLength; ++i) {
+                output = writeItem(output, *(chunkStart + i));
+            }
+        }
+        offset += chunkLength;
+    }
+    return output;
+}
+
 #endif // KIMAGEFORMATS_RLE_P_H
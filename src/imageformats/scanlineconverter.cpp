@@ -5,6 +5,9 @@
 */
 
 #include "scanlineconverter_p.h"
+#include "threadpool_p.h"
+
+#include <algorithm>
 #include <cstring>
 
 ScanLineConverter::ScanLineConverter(const QImage::Format &targetFormat)
@@ -16,6 +19,12 @@ ScanLineConverter::ScanLineConverter(const ScanLineConverter &other)
     : _targetFormat(other._targetFormat)
     , _colorSpace(other._colorSpace)
     , _defaultColorSpace(other._defaultColorSpace)
+    , _cacheValid(other._cacheValid)
+    , _cacheKey(other._cacheKey)
+    , _cacheFormat(other._cacheFormat)
+    , _colorSpaceConversion(other._colorSpaceConversion)
+    , _sourceColorSpace(other._sourceColorSpace)
+    , _colorTransform(other._colorTransform)
 {
 }
 
@@ -24,6 +33,12 @@ ScanLineConverter &ScanLineConverter::operator=(const ScanLineConverter &other)
     _targetFormat = other._targetFormat;
     _colorSpace = other._colorSpace;
     _defaultColorSpace = other._defaultColorSpace;
+    _cacheValid = other._cacheValid;
+    _cacheKey = other._cacheKey;
+    _cacheFormat = other._cacheFormat;
+    _colorSpaceConversion = other._colorSpaceConversion;
+    _sourceColorSpace = other._sourceColorSpace;
+    _colorTransform = other._colorTransform;
     return (*this);
 }
 
@@ -35,6 +50,7 @@ QImage::Format ScanLineConverter::targetFormat() const
 void ScanLineConverter::setTargetColorSpace(const QColorSpace &colorSpace)
 {
     _colorSpace = colorSpace;
+    _cacheValid = false;
 }
 
 QColorSpace ScanLineConverter::targetColorSpace() const
@@ -45,6 +61,7 @@ QColorSpace ScanLineConverter::targetColorSpace() const
 void ScanLineConverter::setDefaultSourceColorSpace(const QColorSpace &colorSpace)
 {
     _defaultColorSpace = colorSpace;
+    _cacheValid = false;
 }
 
 QColorSpace ScanLineConverter::defaultSourceColorSpace() const
@@ -52,26 +69,54 @@ QColorSpace ScanLineConverter::defaultSourceColorSpace() const
     return _defaultColorSpace;
 }
 
-const uchar *ScanLineConverter::convertedScanLine(const QImage &image, qint32 y)
+void ScanLineConverter::prepare(const QImage &image)
 {
-    auto colorSpaceConversion = isColorSpaceConversionNeeded(image);
-    if (image.format() == _targetFormat && !colorSpaceConversion) {
-        return image.constScanLine(y);
+    // NOTE: QImage::setColorSpace() on an unshared image keeps the cache key: the color space
+    //       and the format are compared too (the comparison of shared color spaces is cheap)
+    auto sourceColorSpace = image.colorSpace();
+    if (!sourceColorSpace.isValid()) {
+        sourceColorSpace = _defaultColorSpace;
     }
-    if (image.width() != _tmpBuffer.width() || image.format() != _tmpBuffer.format()) {
-        _tmpBuffer = QImage(image.width(), 1, image.format());
-        _tmpBuffer.setColorTable(image.colorTable());
+    if (_cacheValid && _cacheKey == image.cacheKey() && _cacheFormat == image.format() && _sourceColorSpace == sourceColorSpace) {
+        return;
+    }
+    _cacheValid = true;
+    _cacheKey = image.cacheKey();
+    _cacheFormat = image.format();
+    _colorSpaceConversion = isColorSpaceConversionNeeded(image);
+    _sourceColorSpace = sourceColorSpace;
+    _colorTransform = QColorTransform();
+    if (_colorSpaceConversion) {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+        // conversions between different color models may change the format: they are done by convertToColorSpace()
+        if (_sourceColorSpace.colorModel() == _colorSpace.colorModel())
+#endif
+            _colorTransform = _sourceColorSpace.transformationToColorSpace(_colorSpace);
+    }
+}
+
+QImage ScanLineConverter::convertBlock(const QImage &image, qint32 y, qint32 lines)
+{
+    if (y < 0 || lines < 1 || qint64(y) + lines > image.height()) {
+        return QImage();
+    }
+    if (image.width() != _tmpBuffer.width() || lines != _tmpBuffer.height() || image.format() != _tmpBuffer.format()) {
+        _tmpBuffer = QImage(image.width(), lines, image.format());
     }
     if (_tmpBuffer.isNull()) {
-        return nullptr;
+        return QImage();
+    }
+    if (image.format() == QImage::Format_Indexed8 || image.depth() == 1) {
+        _tmpBuffer.setColorTable(image.colorTable());
+    }
+    const auto bpl = std::min(_tmpBuffer.bytesPerLine(), image.bytesPerLine());
+    auto bits = _tmpBuffer.bits();
+    for (qint32 n = 0; n < lines; ++n) {
+        std::memcpy(bits + n * _tmpBuffer.bytesPerLine(), image.constScanLine(y + n), bpl);
     }
-    std::memcpy(_tmpBuffer.bits(), image.constScanLine(y), std::min(_tmpBuffer.bytesPerLine(), image.bytesPerLine()));
     auto tmp = _tmpBuffer;
-    if (colorSpaceConversion) {
-        auto cs = image.colorSpace();
-        if (!cs.isValid()) {
-            cs = _defaultColorSpace;
-        }
+    if (_colorSpaceConversion) {
+        const auto &cs = _sourceColorSpace;
 #if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
         if (tmp.depth() < 8 && cs.colorModel() == QColorSpace::ColorModel::Gray) {
             tmp.convertTo(QImage::Format_Grayscale8);
@@ -84,8 +129,12 @@ const uchar *ScanLineConverter::convertedScanLine(const QImage &image, qint32 y)
             tmp.convertTo(tmp.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
         }
 #endif
-        tmp.setColorSpace(cs);
-        tmp.convertToColorSpace(_colorSpace);
+        if (_colorTransform.isIdentity()) {
+            tmp.setColorSpace(cs);
+            tmp.convertToColorSpace(_colorSpace);
+        } else {
+            tmp.applyColorTransform(_colorTransform);
+        }
     }
 
     /*
@@ -95,13 +144,49 @@ const uchar *ScanLineConverter::convertedScanLine(const QImage &image, qint32 y)
      */
     tmp.convertTo(_targetFormat);
     _convBuffer = tmp;
+    return _convBuffer;
+}
 
-    if (_convBuffer.isNull()) {
+const uchar *ScanLineConverter::convertedScanLine(const QImage &image, qint32 y)
+{
+    prepare(image);
+    if (image.format() == _targetFormat && !_colorSpaceConversion) {
+        return image.constScanLine(y);
+    }
+    if (convertBlock(image, y, 1).isNull()) {
         return nullptr;
     }
     return _convBuffer.constBits();
 }
 
+bool ScanLineConverter::convertScanLines(const QImage &image, qint32 y, qint32 lines, uchar *dest, qsizetype destBytesPerLine)
+{
+    const auto bpl = targetBytesPerLine(image.width());
+    if (dest == nullptr || destBytesPerLine < bpl || y < 0 || lines < 1 || qint64(y) + lines > image.height()) {
+        return false;
+    }
+    prepare(image);
+    if (image.format() == _targetFormat && !_colorSpaceConversion) {
+        for (qint32 n = 0; n < lines; ++n) {
+            std::memcpy(dest + n * destBytesPerLine, image.constScanLine(y + n), bpl);
+        }
+        return true;
+    }
+    auto block = convertBlock(image, y, lines);
+    if (block.isNull() || block.format() != _targetFormat) {
+        return false;
+    }
+    for (qint32 n = 0; n < lines; ++n) {
+        std::memcpy(dest + n * destBytesPerLine, block.constScanLine(n), bpl);
+    }
+    return true;
+}
+
+qsizetype ScanLineConverter::targetBytesPerLine(qint32 width) const
+{
+    return (qsizetype(width) * QImage::toPixelFormat(_targetFormat).bitsPerPixel() + 7) / 8;
+}
+
 qsizetype ScanLineConverter::bytesPerLine() const
 {
     if (_convBuffer.isNull()) {
@@ -137,3 +222,59 @@ bool ScanLineConverter::isColorSpaceConversionNeeded(const QImage &image, const
     }
     return true;
 }
+
+ScanLinePipeline::ScanLinePipeline(const ScanLineConverter &converter, const QImage &image, qint32 bandLines)
+    : _converter(converter)
+    , _image(image)
+    , _bandLines(std::max(1, bandLines))
+    , _bytesPerLine(converter.targetBytesPerLine(image.width()))
+{
+}
+
+ScanLinePipeline::~ScanLinePipeline()
+{
+    // the task converts into the buffers: it must end before them
+    _next.reset();
+}
+
+const uchar *ScanLinePipeline::convertedScanLine(qint32 y)
+{
+    if (y < 0 || y >= _image.height()) {
+        return nullptr;
+    }
+    const auto band = y / _bandLines;
+    if (band != _band) {
+        auto ready = false;
+        if (_next && band == _band + 1) {
+            _next->wait();
+            if (_nextConverted) {
+                std::swap(_buffers[0], _buffers[1]);
+                ready = true;
+            }
+        }
+        _next.reset();
+        _band = -1;
+        if (!ready && !convertBand(band, _buffers[0])) {
+            return nullptr;
+        }
+        _band = band;
+        if (qint64(band + 1) * _bandLines < _image.height()) {
+            _nextConverted = false;
+            _next = std::make_unique<BackgroundTask>([this, band]() {
+                _nextConverted = convertBand(band + 1, _buffers[1]);
+            });
+        }
+    }
+    return reinterpret_cast<const uchar *>(_buffers[0].constData()) + qsizetype(y - band * _bandLines) * _bytesPerLine;
+}
+
+bool ScanLinePipeline::convertBand(qint32 band, QByteArray &buffer)
+{
+    const auto y = band * _bandLines;
+    const auto lines = std::min(_bandLines, _image.height() - y);
+    buffer.resize(qsizetype(lines) * _bytesPerLine);
+    if (buffer.size() != qsizetype(lines) * _bytesPerLine) {
+        return false;
+    }
+    return _converter.convertScanLines(_image, y, lines, reinterpret_cast<uchar *>(buffer.data()), _bytesPerLine);
+}
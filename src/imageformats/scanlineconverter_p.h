@@ -8,8 +8,13 @@
 #define SCANLINECONVERTER_P_H
 
 #include <QColorSpace>
+#include <QColorTransform>
 #include <QImage>
 
+#include <memory>
+
+class BackgroundTask;
+
 /*!
  * \brief The scanlineFormatConversion class
  * A class to convert an image scan line. It introduces some overhead on small images
@@ -58,6 +63,24 @@ public:
      */
     const uchar *convertedScanLine(const QImage &image, qint32 y);
 
+    /*!
+     * \brief convertScanLines
+     * Convert the \a lines scan lines of \a image starting from line \a y and copy them to \a dest.
+     *
+     * The lines are converted as a single block: the color transform is created once per
+     * source image and the per-line setup of convertedScanLine() is avoided.
+     * \param dest The destination buffer: it must contain \a lines lines of \a destBytesPerLine bytes.
+     * \param destBytesPerLine The size of a destination line: it must be at least targetBytesPerLine().
+     * \return True on success, otherwise false.
+     */
+    bool convertScanLines(const QImage &image, qint32 y, qint32 lines, uchar *dest, qsizetype destBytesPerLine);
+
+    /*!
+     * \brief targetBytesPerLine
+     * \return The size of a converted line of \a width pixels, without padding.
+     */
+    qsizetype targetBytesPerLine(qint32 width) const;
+
     /*!
      * \brief bytesPerLine
      * \return The size of the last converted scanline.
@@ -84,6 +107,20 @@ public:
     }
 
 private:
+    /*!
+     * \brief prepare
+     * Updates the cached conversion data when \a image is not the image of the previous call, or
+     * its format or color space changed.
+     */
+    void prepare(const QImage &image);
+
+    /*!
+     * \brief convertBlock
+     * Converts \a lines lines of \a image starting from line \a y.
+     * \return The converted block (shared with _convBuffer) or a null image on error.
+     */
+    QImage convertBlock(const QImage &image, qint32 y, qint32 lines);
+
     // data
     QImage::Format _targetFormat;
     QColorSpace _colorSpace;
@@ -92,6 +129,54 @@ private:
     // internal buffers
     QImage _tmpBuffer;
     QImage _convBuffer;
+
+    // cached conversion data of the last source image
+    bool _cacheValid = false;
+    qint64 _cacheKey = 0;
+    QImage::Format _cacheFormat = QImage::Format_Invalid;
+    bool _colorSpaceConversion = false;
+    QColorSpace _sourceColorSpace;
+    QColorTransform _colorTransform;
+};
+
+/*!
+ * \brief The ScanLinePipeline class
+ * Converts the scan lines of an image ahead of the encoder.
+ *
+ * The lines are converted in bands of \a bandLines lines with ScanLineConverter::convertScanLines():
+ * while the encoder reads the lines of the current band, the next one is converted by a
+ * thread of the shared thread pool (double buffering). When no thread is available, the
+ * bands are converted on the calling thread.
+ * \note The lines should be read in increasing order: other orders work but the converted
+ * band ahead is discarded.
+ */
+class ScanLinePipeline
+{
+public:
+    ScanLinePipeline(const ScanLineConverter &converter, const QImage &image, qint32 bandLines = 32);
+    ScanLinePipeline(const ScanLinePipeline &other) = delete;
+    ScanLinePipeline &operator=(const ScanLinePipeline &other) = delete;
+    ~ScanLinePipeline();
+
+    /*!
+     * \brief convertedScanLine
+     * \return The converted scan line \a y (valid until the next call) or nullptr on error.
+     */
+    const uchar *convertedScanLine(qint32 y);
+
+private:
+    bool convertBand(qint32 band, QByteArray &buffer);
+
+    ScanLineConverter _converter;
+    const QImage _image;
+    const qint32 _bandLines;
+    const qsizetype _bytesPerLine;
+
+    // the current band is in _buffers[0], the next one is converted in _buffers[1]
+    qint32 _band = -1;
+    QByteArray _buffers[2];
+    std::unique_ptr<BackgroundTask> _next;
+    bool _nextConverted = false;
 };
 
 #endif // SCANLINECONVERTER_P_H
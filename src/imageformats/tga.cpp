@@ -14,17 +14,19 @@
  *     pixel formats 8, 16, 24 and 32.
  * writing:
  *     uncompressed true color tga files
+ *     run length encoded true color and grey tga files (CompressionRatio option greater than 0)
  */
 
 #include "tga_p.h"
 #include "util_p.h"
 
-#include <assert.h>
-
 #include <QDataStream>
 #include <QDebug>
 #include <QImage>
 
+#include <algorithm>
+#include <cstring>
+
 typedef quint32 uint;
 typedef quint16 ushort;
 typedef quint8 uchar;
@@ -218,6 +220,130 @@ static bool peekHeader(QIODevice *device, TgaHeader &header)
     return true;
 }
 
+/*!
+ * \brief convertLine
+ * Converts a line of \a width pixels of \a PixelSize bytes to the image format.
+ */
+template<uint PixelSize>
+static void convertLine(const uchar *src, QRgb *scanline, int width, const TgaHeaderInfo &info, const char *palette, int numAlphaBits)
+{
+    if (info.pal) {
+        // Paletted.
+        for (int x = 0; x < width; x++, src += PixelSize) {
+            const uchar idx = *src;
+            scanline[x] = qRgb(palette[3 * idx + 2], palette[3 * idx + 1], palette[3 * idx + 0]);
+        }
+    } else if (info.grey) {
+        // Greyscale.
+        for (int x = 0; x < width; x++, src += PixelSize) {
+            scanline[x] = qRgb(*src, *src, *src);
+        }
+    } else if constexpr (PixelSize == 2) {
+        // True Color.
+        for (int x = 0; x < width; x++, src += PixelSize) {
+            Color555 c;
+            memcpy(&c, src, sizeof(c));
+            scanline[x] = qRgb((c.r << 3) | (c.r >> 2), (c.g << 3) | (c.g >> 2), (c.b << 3) | (c.b >> 2));
+        }
+    } else if constexpr (PixelSize == 3) {
+        for (int x = 0; x < width; x++, src += PixelSize) {
+            scanline[x] = qRgb(src[2], src[1], src[0]);
+        }
+    } else if constexpr (PixelSize == 4) {
+        for (int x = 0; x < width; x++, src += PixelSize) {
+            // ### TODO: verify with images having really some alpha data
+            const uchar alpha = (src[3] << (8 - numAlphaBits));
+            scanline[x] = qRgba(src[2], src[1], src[0], alpha);
+        }
+    }
+}
+
+/*!
+ * \brief decodeImage
+ * Decodes the pixels line by line directly in the image: only one line of raw pixels is buffered.
+ * \note RLE packets can continue on the next line.
+ */
+template<uint PixelSize>
+static bool decodeImage(QDataStream &s, const TgaHeader &tga, const TgaHeaderInfo &info, const char *palette, QImage &img)
+{
+    const int numAlphaBits = tga.flags & 0xf;
+    const int width = tga.width;
+    QByteArray line(qsizetype(width) * PixelSize, char(0));
+    auto buffer = reinterpret_cast<uchar *>(line.data());
+
+    // RLE state
+    qint64 remaining = qint64(width) * tga.height;
+    uint count = 0;
+    bool repeat = false;
+    uchar pixel[PixelSize];
+
+    for (int i = 0; i < tga.height; ++i) {
+        if (info.rle) {
+            for (int x = 0; x < width;) {
+                if (count == 0) {
+                    if (s.atEnd()) {
+                        return false;
+                    }
+
+                    // Get packet header.
+                    uchar c;
+                    s >> c;
+
+                    count = (c & 0x7f) + 1;
+                    remaining -= count;
+                    if (remaining < 0) {
+                        return false;
+                    }
+
+                    repeat = (c & 0x80);
+                    if (repeat) {
+                        // RLE pixels.
+                        const int dataRead = s.readRawData(reinterpret_cast<char *>(pixel), PixelSize);
+                        if (dataRead < int(PixelSize)) {
+                            memset(&pixel[std::max(dataRead, 0)], 0, PixelSize - std::max(dataRead, 0));
+                        }
+                    }
+                }
+
+                const uint n = std::min(count, uint(width - x));
+                uchar *dst = buffer + x * PixelSize;
+                if (repeat) {
+                    for (uint j = 0; j < n; ++j, dst += PixelSize) {
+                        memcpy(dst, pixel, PixelSize);
+                    }
+                } else {
+                    // Raw pixels.
+                    const int size = n * PixelSize;
+                    const int dataRead = s.readRawData(reinterpret_cast<char *>(dst), size);
+                    if (dataRead < 0) {
+                        return false;
+                    }
+                    if (dataRead < size) {
+                        memset(&dst[dataRead], 0, size - dataRead);
+                    }
+                }
+                count -= n;
+                x += n;
+            }
+        } else {
+            // Read raw line.
+            const int dataRead = s.readRawData(line.data(), line.size());
+            if (dataRead < 0) {
+                return false;
+            }
+            if (dataRead < line.size()) {
+                memset(&buffer[dataRead], 0, line.size() - dataRead);
+            }
+        }
+
+        // Convert the line to internal format.
+        const int y = (tga.flags & TGA_ORIGIN_UPPER) ? i : tga.height - 1 - i;
+        convertLine<PixelSize>(buffer, reinterpret_cast<QRgb *>(img.scanLine(y)), width, info, palette, numAlphaBits);
+    }
+
+    return true;
+}
+
 static bool LoadTGA(QDataStream &s, const TgaHeader &tga, QImage &img)
 {
     img = imageAlloc(tga.width, tga.height, imageFormat(tga));
@@ -228,7 +354,6 @@ static bool LoadTGA(QDataStream &s, const TgaHeader &tga, QImage &img)
 
     TgaHeaderInfo info(tga);
 
-    const int numAlphaBits = tga.flags & 0xf;
     uint pixel_size = (tga.pixel_size / 8);
     qint64 size = qint64(tga.width) * qint64(tga.height) * pixel_size;
 
@@ -255,154 +380,49 @@ static bool LoadTGA(QDataStream &s, const TgaHeader &tga, QImage &img)
         }
     }
 
-    // Allocate image.
-    uchar *const image = reinterpret_cast<uchar *>(malloc(size));
-    if (!image) {
+    switch (pixel_size) {
+    case 1:
+        return decodeImage<1>(s, tga, info, palette, img);
+    case 2:
+        return decodeImage<2>(s, tga, info, palette, img);
+    case 3:
+        return decodeImage<3>(s, tga, info, palette, img);
+    case 4:
+        return decodeImage<4>(s, tga, info, palette, img);
+    default:
         return false;
     }
+}
 
-    bool valid = true;
-
-    if (info.rle) {
-        // Decode image.
-        char *dst = (char *)image;
-        char *imgEnd = dst + size;
-        qint64 num = size;
-
-        while (num > 0 && valid) {
-            if (s.atEnd()) {
-                valid = false;
-                break;
-            }
-
-            // Get packet header.
-            uchar c;
-            s >> c;
-
-            uint count = (c & 0x7f) + 1;
-            num -= count * pixel_size;
-            if (num < 0) {
-                valid = false;
-                break;
-            }
-
-            if (c & 0x80) {
-                // RLE pixels.
-                assert(pixel_size <= 8);
-                char pixel[8];
-                const int dataRead = s.readRawData(pixel, pixel_size);
-                if (dataRead < (int)pixel_size) {
-                    memset(&pixel[dataRead], 0, pixel_size - dataRead);
-                }
-                do {
-                    if (dst + pixel_size > imgEnd) {
-                        qWarning() << "Trying to write out of bounds!" << ptrdiff_t(dst) << (ptrdiff_t(imgEnd) - ptrdiff_t(pixel_size));
-                        valid = false;
-                        break;
-                    }
-
-                    memcpy(dst, pixel, pixel_size);
-                    dst += pixel_size;
-                } while (--count);
-            } else {
-                // Raw pixels.
-                count *= pixel_size;
-                const int dataRead = s.readRawData(dst, count);
-                if (dataRead < 0) {
-                    free(image);
-                    return false;
-                }
-
-                if ((uint)dataRead < count) {
-                    const size_t toCopy = count - dataRead;
-                    if (&dst[dataRead] + toCopy > imgEnd) {
-                        qWarning() << "Trying to write out of bounds!" << ptrdiff_t(image) << ptrdiff_t(&dst[dataRead]);
-                        ;
-                        valid = false;
-                        break;
-                    }
-
-                    memset(&dst[dataRead], 0, toCopy);
-                }
-                dst += count;
-            }
-        }
-    } else {
-        // Read raw image.
-        const int dataRead = s.readRawData((char *)image, size);
-        if (dataRead < 0) {
-            free(image);
-            return false;
-        }
-        if (dataRead < size) {
-            memset(&image[dataRead], 0, size - dataRead);
+/*!
+ * \brief appendRlePackets
+ * Appends the RLE packets of a line of \a width pixels of \a pixelSize bytes.
+ * \note As recommended by the specifications, the packets do not cross the end of the line.
+ */
+static void appendRlePackets(QByteArray &ba, const uchar *line, int width, int pixelSize)
+{
+    auto same = [line, pixelSize](int x0, int x1) {
+        return memcmp(line + x0 * pixelSize, line + x1 * pixelSize, pixelSize) == 0;
+    };
+    for (int x = 0; x < width;) {
+        int count = 1;
+        while (x + count < width && count < 128 && same(x, x + count)) {
+            ++count;
         }
-    }
-
-    if (!valid) {
-        free(image);
-        return false;
-    }
-
-    // Convert image to internal format.
-    int y_start;
-    int y_step;
-    int y_end;
-    if (tga.flags & TGA_ORIGIN_UPPER) {
-        y_start = 0;
-        y_step = 1;
-        y_end = tga.height;
-    } else {
-        y_start = tga.height - 1;
-        y_step = -1;
-        y_end = -1;
-    }
-
-    uchar *src = image;
-
-    for (int y = y_start; y != y_end; y += y_step) {
-        QRgb *scanline = (QRgb *)img.scanLine(y);
-
-        if (info.pal) {
-            // Paletted.
-            for (int x = 0; x < tga.width; x++) {
-                uchar idx = *src++;
-                scanline[x] = qRgb(palette[3 * idx + 2], palette[3 * idx + 1], palette[3 * idx + 0]);
-            }
-        } else if (info.grey) {
-            // Greyscale.
-            for (int x = 0; x < tga.width; x++) {
-                scanline[x] = qRgb(*src, *src, *src);
-                src++;
+        if (count < 2) {
+            // Raw pixels: up to the next repeated pixel.
+            while (x + count < width && count < 128 && !(x + count + 1 < width && same(x + count, x + count + 1))) {
+                ++count;
             }
+            ba.append(char(count - 1));
+            ba.append(reinterpret_cast<const char *>(line + x * pixelSize), count * pixelSize);
         } else {
-            // True Color.
-            if (tga.pixel_size == 16) {
-                for (int x = 0; x < tga.width; x++) {
-                    Color555 c = *reinterpret_cast<Color555 *>(src);
-                    scanline[x] = qRgb((c.r << 3) | (c.r >> 2), (c.g << 3) | (c.g >> 2), (c.b << 3) | (c.b >> 2));
-                    src += 2;
-                }
-            } else if (tga.pixel_size == 24) {
-                for (int x = 0; x < tga.width; x++) {
-                    scanline[x] = qRgb(src[2], src[1], src[0]);
-                    src += 3;
-                }
-            } else if (tga.pixel_size == 32) {
-                for (int x = 0; x < tga.width; x++) {
-                    // ### TODO: verify with images having really some alpha data
-                    const uchar alpha = (src[3] << (8 - numAlphaBits));
-                    scanline[x] = qRgba(src[2], src[1], src[0], alpha);
-                    src += 4;
-                }
-            }
+            // RLE pixels.
+            ba.append(char(0x80 | (count - 1)));
+            ba.append(reinterpret_cast<const char *>(line + x * pixelSize), pixelSize);
         }
+        x += count;
     }
-
-    // Free image.
-    free(image);
-
-    return true;
 }
 
 } // namespace
@@ -414,6 +434,9 @@ public:
     ~TGAHandlerPrivate() {}
 
     TgaHeader m_header;
+
+    // used for writing: RLE compression when positive (-1 or 0: uncompressed, the default)
+    qint32 m_compressionRatio = -1;
 };
 
 TGAHandler::TGAHandler()
@@ -474,48 +497,95 @@ bool TGAHandler::write(const QImage &image)
     QDataStream s(device());
     s.setByteOrder(QDataStream::LittleEndian);
 
+    // Grey images are written with 8 bits per pixel only when compressed to keep the default output unchanged.
+    const bool rle = d->m_compressionRatio > 0;
+    const bool grey = rle && image.isGrayscale() && !image.hasAlphaChannel();
+
     QImage img(image);
     const bool hasAlpha = img.hasAlphaChannel();
-    if (hasAlpha && img.format() != QImage::Format_ARGB32) {
+    if (grey) {
+        if (img.format() != QImage::Format_Grayscale8) {
+            img = img.convertToFormat(QImage::Format_Grayscale8);
+        }
+    } else if (hasAlpha && img.format() != QImage::Format_ARGB32) {
         img = img.convertToFormat(QImage::Format_ARGB32);
     } else if (!hasAlpha && img.format() != QImage::Format_RGB32) {
         img = img.convertToFormat(QImage::Format_RGB32);
     }
     if (img.isNull()) {
-        qDebug() << "TGAHandler::write: image conversion to 32 bits failed!";
+        qDebug() << "TGAHandler::write: image conversion failed!";
         return false;
     }
     static constexpr quint8 originTopLeft = TGA_ORIGIN_UPPER + TGA_ORIGIN_LEFT; // 0x20
     static constexpr quint8 alphaChannel8Bits = 0x08;
 
+    uchar magic[12];
+    memcpy(magic, targaMagic, sizeof(magic));
+    if (grey) {
+        magic[2] = TGA_TYPE_RLE_GREY;
+    } else if (rle) {
+        magic[2] = TGA_TYPE_RLE_RGB;
+    }
     for (int i = 0; i < 12; i++) {
-        s << targaMagic[i];
+        s << magic[i];
     }
 
     // write header
+    const int pixelSize = grey ? 1 : (hasAlpha ? 4 : 3);
     s << quint16(img.width()); // width
     s << quint16(img.height()); // height
-    s << quint8(hasAlpha ? 32 : 24); // depth (24 bit RGB + 8 bit alpha)
+    s << quint8(pixelSize * 8); // depth (8 bit grey, 24 bit RGB or 24 bit RGB + 8 bit alpha)
     s << quint8(hasAlpha ? originTopLeft + alphaChannel8Bits : originTopLeft);   // top left image (0x20) + 8 bit alpha (0x8)
 
+    // write the lines (BGR(A) pixels)
+    QByteArray line(qsizetype(img.width()) * pixelSize, char(0));
+    QByteArray packets;
+    auto dst = reinterpret_cast<uchar *>(line.data());
     for (int y = 0; y < img.height(); y++) {
-        auto ptr = reinterpret_cast<QRgb *>(img.scanLine(y));
-        for (int x = 0; x < img.width(); x++) {
-            auto color = *(ptr + x);
-            s << quint8(qBlue(color));
-            s << quint8(qGreen(color));
-            s << quint8(qRed(color));
-            if (hasAlpha) {
-                s << quint8(qAlpha(color));
+        if (grey) {
+            memcpy(dst, img.constScanLine(y), img.width());
+        } else {
+            auto ptr = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+            for (int x = 0; x < img.width(); x++) {
+                auto color = *(ptr + x);
+                auto px = dst + x * pixelSize;
+                px[0] = quint8(qBlue(color));
+                px[1] = quint8(qGreen(color));
+                px[2] = quint8(qRed(color));
+                if (hasAlpha) {
+                    px[3] = quint8(qAlpha(color));
+                }
             }
         }
+
+        if (rle) {
+            packets.clear();
+            appendRlePackets(packets, dst, img.width(), pixelSize);
+            s.writeRawData(packets.constData(), packets.size());
+        } else {
+            s.writeRawData(line.constData(), line.size());
+        }
     }
 
-    return true;
+    return s.status() == QDataStream::Ok;
+}
+
+void TGAHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == QImageIOHandler::CompressionRatio) {
+        auto ok = false;
+        auto cr = value.toInt(&ok);
+        if (ok) {
+            d->m_compressionRatio = cr;
+        }
+    }
 }
 
 bool TGAHandler::supportsOption(ImageOption option) const
 {
+    if (option == QImageIOHandler::CompressionRatio) {
+        return true;
+    }
     if (option == QImageIOHandler::Size) {
         return true;
     }
@@ -529,6 +599,10 @@ QVariant TGAHandler::option(ImageOption option) const
 {
     QVariant v;
 
+    if (option == QImageIOHandler::CompressionRatio) {
+        v = QVariant(d->m_compressionRatio);
+    }
+
     if (option == QImageIOHandler::Size) {
         auto&& header = d->m_header;
         if (IsSupported(header)) {
@@ -0,0 +1,198 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#ifndef THREADPOOL_P_H
+#define THREADPOOL_P_H
+
+#include "util_p.h"
+
+#include <QAtomicInt>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <functional>
+
+/*!
+ * \brief sharedThreadPool
+ * The thread pool used by the codecs to decode and encode concurrently.
+ *
+ * Its size is the thread budget of the process: KIMAGEFORMATS_MAX_THREADS if set, otherwise
+ * QThread::idealThreadCount(). Concurrent readers share the budget instead of creating their
+ * own threads, so many readers do not oversubscribe the CPU.
+ * \note Each plugin is a separate module: the pool is shared by the handlers of the plugin.
+ */
+inline QThreadPool *sharedThreadPool()
+{
+    class SharedThreadPool : public QThreadPool
+    {
+    public:
+        SharedThreadPool()
+        {
+            // NOTE: maxThreadCount() alone is QThreadPool::maxThreadCount()
+            setMaxThreadCount(std::max(1, ::maxThreadCount()));
+        }
+    };
+    static SharedThreadPool pool;
+    return &pool;
+}
+
+/*!
+ * \brief runConcurrently
+ * Runs \a worker on up to \a threads threads: the calling thread and the free threads of
+ * sharedThreadPool(). The worker receives the index of its thread, in [0, threads).
+ *
+ * The calling thread always runs a worker, so the work never waits for a free thread of the
+ * pool: the workers must share the work (e.g. with an atomic counter).
+ * \note When KIMAGEFORMATS_MAX_THREADS is 0, only the calling thread is used.
+ */
+inline void runConcurrently(int threads, const std::function<void(int)> &worker)
+{
+    QSemaphore done;
+    int started = 0;
+    if (maxThreadCount() > 0) {
+        QThreadPool *pool = sharedThreadPool();
+        threads = std::min(threads, pool->maxThreadCount());
+        for (; started < threads - 1; ++started) {
+            const int thread = started + 1;
+            if (!pool->tryStart([&worker, &done, thread]() {
+                    worker(thread);
+                    done.release();
+                })) {
+                break;
+            }
+        }
+    }
+    worker(0);
+    done.acquire(started);
+}
+
+/*!
+ * \brief The BackgroundTask class
+ * Runs a function on a thread of sharedThreadPool(). When no pool thread is available (or
+ * \a concurrent is false) the function is run by wait() on the calling thread.
+ */
+class BackgroundTask
+{
+public:
+    BackgroundTask(const std::function<void()> &func, bool concurrent = true)
+        : m_func(func)
+    {
+        if (concurrent && maxThreadCount() > 0 && sharedThreadPool()->tryStart([this]() {
+                m_func();
+                m_done.release();
+            })) {
+            m_started = true;
+        }
+    }
+    BackgroundTask(const BackgroundTask &other) = delete;
+    BackgroundTask &operator=(const BackgroundTask &other) = delete;
+
+    ~BackgroundTask()
+    {
+        // the task uses the caller's variables: it must end before them
+        if (m_started) {
+            m_done.acquire();
+        }
+    }
+
+    /*!
+     * \brief wait
+     * Waits for the end of the function (or runs it on the current thread).
+     */
+    void wait()
+    {
+        if (m_started) {
+            m_done.acquire();
+            m_started = false;
+        } else if (m_func) {
+            m_func();
+        }
+        m_func = nullptr;
+    }
+
+    /*!
+     * \brief isStarted
+     * \return True if the function was started on a thread of the pool and wait() was not called yet.
+     */
+    bool isStarted() const
+    {
+        return m_started;
+    }
+
+private:
+    std::function<void()> m_func;
+    QSemaphore m_done;
+    bool m_started = false;
+};
+
+/*!
+ * \brief The ThreadReservation class
+ * Reserves threads of the budget of sharedThreadPool() for the libraries that create their own
+ * threads (e.g. the AV1 codecs). The threads are released by the destructor.
+ *
+ * A reader alone gets the whole budget; concurrent readers get what the others left: reserve
+ * for each decode or encode call rather than for the life of the handler.
+ */
+class ThreadReservation
+{
+public:
+    ThreadReservation() = default;
+    ThreadReservation(const ThreadReservation &other) = delete;
+    ThreadReservation &operator=(const ThreadReservation &other) = delete;
+
+    ~ThreadReservation()
+    {
+        release();
+    }
+
+    /*!
+     * \brief reserve
+     * Reserves up to \a wanted threads, depending on the threads not yet reserved.
+     * \return The number of threads to use (at least 1: the calling thread).
+     */
+    int reserve(int wanted)
+    {
+        release();
+        const int budget = maxThreadCount();
+        auto &&used = reservedThreads();
+        for (auto current = used.loadRelaxed();;) {
+            const int count = std::clamp(budget - current, 1, std::max(1, wanted));
+            if (used.testAndSetOrdered(current, current + count, current)) {
+                m_count = count;
+                return count;
+            }
+        }
+    }
+
+    /*!
+     * \brief release
+     * Gives back the reserved threads.
+     */
+    void release()
+    {
+        if (m_count > 0) {
+            reservedThreads().fetchAndSubOrdered(m_count);
+            m_count = 0;
+        }
+    }
+
+    int count() const
+    {
+        return std::max(1, m_count);
+    }
+
+private:
+    static QAtomicInt &reservedThreads()
+    {
+        static QAtomicInt used = 0;
+        return used;
+    }
+
+    int m_count = 0;
+};
+
+#endif // THREADPOOL_P_H
@@ -9,9 +9,14 @@
 #define UTIL_P_H
 
 #include <limits>
+#include <utility>
 
+#include "instrumentation_p.h"
+
+#include <QColorSpace>
 #include <QImage>
 #include <QImageIOHandler>
+#include <QThread>
 
 // Image metadata keys to use in plugins (so they are consistent)
 #define META_KEY_ALTITUDE "Altitude"
@@ -44,6 +49,7 @@ inline QImage imageAlloc(const QSize &size, const QImage::Format &format)
     if (!QImageIOHandler::allocateImage(size, format, &img)) {
         img = QImage(); // paranoia
     }
+    Instrumentation::imageAllocated(img);
     return img;
 }
 
@@ -52,4 +58,39 @@ inline QImage imageAlloc(qint32 width, qint32 height, const QImage::Format &form
     return imageAlloc(QSize(width, height), format);
 }
 
+// Returns an image of the given size and format reusing the memory of "recycled" when it has the same
+// size and format and no other QImage shares it (e.g. a previous frame of an animation no longer used
+// by the caller). Otherwise the image is allocated with imageAlloc(). In both cases "recycled" is released.
+// NOTE: the pixels of a reused image are not cleared. Its color space, offset and resolution are reset;
+//       images with text metadata are not reused because QImage cannot remove the keys.
+inline QImage imageReuse(QImage &recycled, const QSize &size, const QImage::Format &format)
+{
+    QImage img = std::exchange(recycled, QImage());
+    if (!img.isNull() && img.isDetached() && img.size() == size && img.format() == format && img.textKeys().isEmpty()) {
+        static const QImage defaults(1, 1, QImage::Format_Mono);
+        img.setColorSpace(QColorSpace());
+        img.setOffset(QPoint());
+        img.setDotsPerMeterX(defaults.dotsPerMeterX());
+        img.setDotsPerMeterY(defaults.dotsPerMeterY());
+        return img;
+    }
+    img = QImage(); // the memory is released before the allocation
+    return imageAlloc(size, format);
+}
+
+inline QImage imageReuse(QImage &recycled, qint32 width, qint32 height, const QImage::Format &format)
+{
+    return imageReuse(recycled, QSize(width, height), format);
+}
+
+// The maximum number of threads a plugin can use to read or write an image. It can be set with the
+// KIMAGEFORMATS_MAX_THREADS environment variable (0 means that only the caller thread is used): useful
+// on servers that already process many images in parallel.
+inline int maxThreadCount(int defaultCount = QThread::idealThreadCount())
+{
+    bool ok = false;
+    auto count = qEnvironmentVariableIntValue("KIMAGEFORMATS_MAX_THREADS", &ok);
+    return ok ? qMax(0, count) : defaultCount;
+}
+
 #endif // UTIL_P_H
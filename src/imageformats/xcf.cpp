@@ -11,12 +11,14 @@
 
 #include <QColorSpace>
 #include <QDebug>
+#include <QFileDevice>
 #include <QIODevice>
 #include <QImage>
 #include <QImageReader>
 #include <QList>
 #include <QLoggingCategory>
 #include <QPainter>
+#include <QPointer>
 #include <QStack>
 #include <QtEndian>
 
@@ -38,6 +40,8 @@
 #include <qrgbafloat.h>
 #endif
 
+#include <algorithm>
+#include <memory>
 #include <stdlib.h>
 #include <string.h>
 
@@ -51,6 +55,26 @@ Q_LOGGING_CATEGORY(XCFPLUGIN, "kf.imageformats.plugins.xcf", QtWarningMsg)
 #define DISABLE_TILE_PROFILE_CONV // default uncommented (comment to use the conversion as intended by Martin)
 #define DISABLE_IMAGE_PROFILE_CONV // default uncommented (comment to use the conversion as intended by Martin)
 
+/* *** XCF_USE_PARALLEL_MERGE ***
+ * If defined, the tiles of the layers not drawn with QPainter are merged using the threads of
+ * the shared thread pool (see runConcurrently() and KIMAGEFORMATS_MAX_THREADS). The result is the
+ * same of the serial merge. It is faster on large images with many non-normal layers.
+ * NOTE: Indexed and bitmap images (less than 8 bits per pixel) are always merged serially.
+ */
+//#define XCF_USE_PARALLEL_MERGE // default commented -> you should define it in your cmake file
+
+/* *** XCF_DISABLE_ROW_MERGE ***
+ * If defined, the common blend modes of 8-bit RGBA layers are merged one pixel at a time like
+ * the other ones, instead of one row at a time (see rowMergeOperation()). The result is the same:
+ * it is only useful to compare the performance of the two paths.
+ */
+//#define XCF_DISABLE_ROW_MERGE // default commented
+
+#ifdef XCF_USE_PARALLEL_MERGE
+#include "threadpool_p.h"
+#include <QAtomicInteger>
+#endif
+
 const float INCHESPERMETER = (100.0f / 2.54f);
 
 namespace
@@ -292,7 +316,8 @@ public:
     Q_ENUM(GimpPrecision);
 
     XCFImageFormat();
-    bool readXCF(QIODevice *device, QImage *image);
+    ~XCFImageFormat();
+    bool readXCF(QIODevice *device, QImage *image, const QSize &scaledSize = QSize());
 
     /*!
      * Each GIMP image is composed of one or more layers. A layer can
@@ -315,12 +340,39 @@ public:
         uint nrows; //!< Number of rows of tiles (y direction)
         uint ncols; //!< Number of columns of tiles (x direction)
 
+        //! Tiles are shrunk by this (power of two) factor as soon as they are loaded. It is
+        //! greater than 1 only when a scaled image is requested (see QImageIOHandler::ScaledSize).
+        uint scale = 1;
+
         Tiles image_tiles; //!< The basic image
         //! For Grayscale and Indexed images, the alpha channel is stored
         //! separately (in this data structure, anyway).
         Tiles alpha_tiles;
         Tiles mask_tiles; //!< The layer mask (optional)
 
+        //! Empty tiles (one for each possible tile size) shared by the tiles
+        //! of a row until they are loaded (see composeTileRow()).
+        struct {
+            QImage image;
+            QImage alpha;
+            QImage mask;
+        } template_tiles[4];
+
+        //! Index in template_tiles of the tiles with the given size: only the
+        //! tiles on the right and bottom edges can be smaller than TILE_WIDTH x TILE_HEIGHT.
+        static int templateIndex(uint tile_width, uint tile_height)
+        {
+            return (tile_width == TILE_WIDTH ? 0 : 1) + (tile_height == TILE_HEIGHT ? 0 : 2);
+        }
+
+        //! The top level of a tile hierarchy: tiles are loaded one row at a time from it.
+        struct Level {
+            qint32 bpp = 0; //!< Bytes per pixel
+            QList<qint64> tileOffsets; //!< File positions of the tiles followed by the end one (empty if there are no tiles)
+        };
+        Level image_level; //!< Tiles of the basic image
+        Level mask_level; //!< Tiles of the layer mask (optional)
+
         //! Additional information about a layer mask.
         struct {
             quint32 opacity;
@@ -487,6 +539,7 @@ public:
         } header;
 
         XcfCompressionType compression = COMPRESS_RLE; //!< tile compression method (CompressionType)
+        uint scale = 1; //!< shrink factor applied to tiles and canvas (see Layer::scale)
         float x_resolution = -1; //!< x resolution in dots per inch
         float y_resolution = -1; //!< y resolution in dots per inch
         qint32 tattoo; //!< (unique identifier?)
@@ -516,6 +569,12 @@ public:
         {
             return XCFImageFormat::bytesPerChannel(header.precision);
         }
+
+        //! Size of the final QImage (the canvas shrunk by the scale factor).
+        QSize canvasSize() const
+        {
+            return QSize((header.width + scale - 1) / scale, (header.height + scale - 1) / scale);
+        }
     };
 
 private:
@@ -542,6 +601,15 @@ private:
 
     static constexpr RandomTable randomTable{};
 
+    //! When the image is read from a file, the file is mapped in memory and the
+    //! RLE tiles are decoded directly from it (see loadTileRLE()).
+    QPointer<QFileDevice> mapped_file;
+    const uchar *mapped_data = nullptr;
+    qint64 mapped_size = 0;
+
+    //! Buffer for the RLE tile data read from the device (when it is not mapped).
+    QByteArray tile_data;
+
     //! This table is used as a shared grayscale ramp to be set on grayscale
     //! images. This is because Qt does not differentiate between indexed and
     //! grayscale images.
@@ -557,27 +625,33 @@ private:
 
     //! Higher layers are merged into the final QImage by this routine.
     typedef bool (*PixelMergeOperation)(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
+    typedef bool (*RowMergeOperation)(const uchar *src, const uchar *mask, uchar *dst, int count, int opacity, bool affectsAlpha);
 
     static bool modeAffectsSourceAlpha(const quint32 type);
 
     bool loadImageProperties(QDataStream &xcf_io, XCFImage &image);
     bool loadProperty(QDataStream &xcf_io, PropType &type, QByteArray &bytes, quint32 &rawType);
-    bool loadLayer(QDataStream &xcf_io, XCFImage &xcf_image);
+    bool planLayers(QDataStream &xcf_io, const XCFImage &xcf_image, const QList<qint64> &layer_offsets, QList<bool> &skip);
+    bool loadLayer(QDataStream &xcf_io, XCFImage &xcf_image, bool skipPixels = false);
     bool loadLayerProperties(QDataStream &xcf_io, Layer &layer);
     bool composeTiles(XCFImage &xcf_image);
+    static void composeTileRow(Layer &layer, uint j);
+    static void releaseTileRow(Layer &layer, uint j);
     void setGrayPalette(QImage &image);
     void setPalette(XCFImage &xcf_image, QImage &image);
     void setImageParasites(const XCFImage &xcf_image, QImage &image);
     static bool assignImageBytes(Layer &layer, uint i, uint j, const GimpPrecision &precision);
-    bool loadHierarchy(QDataStream &xcf_io, Layer &layer, const GimpPrecision precision);
-    bool loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp, const GimpPrecision precision);
+    bool loadHierarchy(QDataStream &xcf_io, Layer &layer, Layer::Level &level, const GimpPrecision precision);
+    bool loadLevel(QDataStream &xcf_io, Layer &layer, Layer::Level &level, qint32 bpp);
+    bool loadLevelRow(QDataStream &xcf_io, Layer &layer, const Layer::Level &level, uint j, const GimpPrecision precision);
     static bool assignMaskBytes(Layer &layer, uint i, uint j, const GimpPrecision &precision);
     bool loadMask(QDataStream &xcf_io, Layer &layer, const GimpPrecision precision);
     bool loadChannelProperties(QDataStream &xcf_io, Layer &layer);
     bool initializeImage(XCFImage &xcf_image);
     bool loadTileRLE(QDataStream &xcf_io, uchar *tile, int size, int data_length, qint32 bpp, qint64 *bytesParsed);
+    static bool shrinkTiles(Layer &layer, uint i, uint j);
 
-    static void copyLayerToImage(XCFImage &xcf_image);
+    static void copyLayerToImage(XCFImage &xcf_image, uint j);
     static void copyRGBToRGB(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
     static void copyGrayToGray(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
     static void copyGrayToRGB(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
@@ -586,7 +660,9 @@ private:
     static void copyIndexedAToIndexed(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
     static void copyIndexedAToRGB(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
 
-    static void mergeLayerIntoImage(XCFImage &xcf_image);
+    static bool mergeLayerIntoImage(XCFImage &xcf_image, uint j);
+    static RowMergeOperation rowMergeOperation(const Layer &layer, PixelMergeOperation merge, const QImage &image);
+    static bool mergeTileIntoImage(Layer &layer, PixelMergeOperation merge, RowMergeOperation rowMerge, uint i, uint j, QImage &image, const QRect &rect);
     static bool mergeRGBToRGB(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
     static bool mergeGrayToGray(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
     static bool mergeGrayAToGray(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
@@ -743,6 +819,13 @@ XCFImageFormat::XCFImageFormat()
     static_assert(sizeof(QRgb) == 4, "the code assumes sizeof(QRgb) == 4, if that's not your case, help us fix it :)");
 }
 
+XCFImageFormat::~XCFImageFormat()
+{
+    if (mapped_file && mapped_data) {
+        mapped_file->unmap(const_cast<uchar *>(mapped_data));
+    }
+}
+
 /*!
  * This initializes the tables used in the layer dissolving routines.
  */
@@ -852,15 +935,38 @@ bool XCFImageFormat::readXCFHeader(QDataStream &xcf_io, XCFImage::Header *header
     return true;
 }
 
-bool XCFImageFormat::readXCF(QIODevice *device, QImage *outImage)
+bool XCFImageFormat::readXCF(QIODevice *device, QImage *outImage, const QSize &scaledSize)
 {
     XCFImage xcf_image;
     QDataStream xcf_io(device);
 
+    InstrumentationPhase headerPhase(Instrumentation::Header);
     if (!readXCFHeader(xcf_io, &xcf_image.header)) {
         return false;
     }
 
+    // NOTE: the mapping fails (and the tiles are read from the device) if the file is not a regular one (e.g. a pipe).
+    if (auto file = qobject_cast<QFileDevice *>(device)) {
+        if (!mapped_data && file->size() > 0) {
+            mapped_data = file->map(0, file->size());
+            if (mapped_data) {
+                mapped_file = file;
+                mapped_size = file->size();
+            }
+        }
+    }
+
+    // When a scaled image is requested, tiles are shrunk by a power of two factor as soon as
+    // they are read: so the memory used scales with the requested size and not with the canvas one.
+    // The factor is limited to the tile size so that each tile is at least one pixel wide.
+    if (scaledSize.isValid() && !scaledSize.isEmpty()) {
+        const quint32 maxScale = std::min(xcf_image.header.width / scaledSize.width(), xcf_image.header.height / scaledSize.height());
+        while (xcf_image.scale * 2 <= maxScale && xcf_image.scale * 2 <= std::min(TILE_WIDTH, TILE_HEIGHT)) {
+            xcf_image.scale *= 2;
+        }
+        qCDebug(XCFPLUGIN) << "Using scale factor" << xcf_image.scale << "to get an image of" << scaledSize;
+    }
+
     if (!loadImageProperties(xcf_io, xcf_image)) {
         return false;
     }
@@ -896,13 +1002,20 @@ bool XCFImageFormat::readXCF(QIODevice *device, QImage *outImage)
     }
     qCDebug(XCFPLUGIN) << xcf_image.num_layers << "layers";
 
+    // Find the layers that do not contribute to the final image
+    QList<bool> skip_pixels;
+    if (!planLayers(xcf_io, xcf_image, layer_offsets, skip_pixels)) {
+        return false;
+    }
+    headerPhase.end();
+
     // Load each layer and add it to the image
     while (!layer_offsets.isEmpty()) {
         qint64 layer_offset = layer_offsets.pop();
 
-        xcf_io.device()->seek(layer_offset);
+        Instrumentation::seek(xcf_io.device(), layer_offset);
 
-        if (!loadLayer(xcf_io, xcf_image)) {
+        if (!loadLayer(xcf_io, xcf_image, skip_pixels.at(layer_offsets.size()))) {
             return false;
         }
     }
@@ -912,7 +1025,16 @@ bool XCFImageFormat::readXCF(QIODevice *device, QImage *outImage)
         return false;
     }
 
+    // The shrink factor is a power of two: the final adjustment is done here.
+    if (scaledSize.isValid() && !scaledSize.isEmpty() && xcf_image.image.size() != scaledSize) {
+        xcf_image.image = xcf_image.image.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        if (xcf_image.image.isNull()) {
+            return false;
+        }
+    }
+
     // The image was created: now I can set metadata and ICC color profile inside it.
+    InstrumentationPhase metadataPhase(Instrumentation::Metadata);
     setImageParasites(xcf_image, xcf_image.image);
 
     *outImage = xcf_image.image;
@@ -1113,15 +1235,104 @@ bool XCFImageFormat::loadProperty(QDataStream &xcf_io, PropType &type, QByteArra
     return true;
 }
 
+/*!
+ * Shrink a layer offset by the scale factor (floor division, offsets can be negative).
+ * \param offset the offset of the layer relative to the image.
+ * \param scale the scale factor.
+ * \return the offset in the shrunk image.
+ */
+static qint32 shrinkOffset(qint32 offset, uint scale)
+{
+    return offset < 0 ? -qint32((quint32(-qint64(offset)) + scale - 1) / scale) : qint32(quint32(offset) / scale);
+}
+
+/*!
+ * Read the headers of all layers and find the ones whose pixels do not change
+ * the final image, so that loadLayer() does not load them. They are:
+ * - layers with zero opacity or entirely outside the canvas;
+ * - layers under an opaque RGB layer, with normal mode and no mask, which covers all the canvas.
+ * The first visible layer is only skipped when covered (it is still used to initialize the image).
+ * \param xcf_io the image file data stream.
+ * \param xcf_image XCF image data.
+ * \param layer_offsets the file positions of the layers (top to bottom).
+ * \param skip returns, for each layer, true if its pixels have not to be loaded.
+ * \return true if there were no I/O errors.
+ */
+bool XCFImageFormat::planLayers(QDataStream &xcf_io, const XCFImage &xcf_image, const QList<qint64> &layer_offsets, QList<bool> &skip)
+{
+    struct LayerInfo {
+        bool visible = false;
+        bool empty = false; //!< does nothing to the image
+        bool covering = false; //!< hides all the layers under it
+        bool rgb = false;
+    };
+    QList<LayerInfo> infos(layer_offsets.size());
+    skip = QList<bool>(layer_offsets.size(), false);
+
+    const QSize canvas = xcf_image.canvasSize();
+    auto layer = std::make_unique<Layer>();
+    for (qsizetype k = layer_offsets.size() - 1; k >= 0; k--) { // same order of loading
+        Instrumentation::seek(xcf_io.device(), layer_offsets.at(k));
+
+        delete[] layer->name;
+        layer->name = nullptr;
+        xcf_io >> layer->width >> layer->height >> layer->type >> layer->name;
+        if (!loadLayerProperties(xcf_io, *layer)) {
+            return false;
+        }
+        readOffsetPtr(xcf_io); // hierarchy offset
+        const qint64 mask_offset = readOffsetPtr(xcf_io);
+
+        const QRect rect(shrinkOffset(layer->x_offset, xcf_image.scale),
+                         shrinkOffset(layer->y_offset, xcf_image.scale),
+                         (layer->width + xcf_image.scale - 1) / xcf_image.scale,
+                         (layer->height + xcf_image.scale - 1) / xcf_image.scale);
+
+        auto &&info = infos[k];
+        info.visible = layer->visible != 0;
+        info.empty = layer->opacity == 0 || !rect.intersects(QRect(QPoint(0, 0), canvas));
+        info.rgb = layer->type == RGB_GIMAGE || layer->type == RGBA_GIMAGE;
+        info.covering = layer->type == RGB_GIMAGE && layer->opacity == OPAQUE_OPACITY && mask_offset == 0
+            && (layer->mode == GIMP_LAYER_MODE_NORMAL || layer->mode == GIMP_LAYER_MODE_NORMAL_LEGACY) && rect.contains(QRect(QPoint(0, 0), canvas));
+    }
+
+    // the first visible layer (the layers are loaded bottom to top)
+    qsizetype first = layer_offsets.size() - 1;
+    for (; first >= 0 && !infos.at(first).visible; first--) { }
+    if (first < 0) {
+        return true; // no visible layers
+    }
+
+    for (qsizetype k = 0; k < first; k++) {
+        skip[k] = infos.at(k).visible && infos.at(k).empty;
+    }
+
+    // NOTE: the first layer determines the image format: covering layers are drawn with QPainter on the RGB ones only.
+    if (infos.at(first).rgb) {
+        for (qsizetype k = 0; k < first; k++) {
+            if (infos.at(k).visible && infos.at(k).covering) {
+                for (qsizetype h = k + 1; h <= first; h++) {
+                    skip[h] = infos.at(h).visible;
+                }
+                qCDebug(XCFPLUGIN) << "Layer" << k << "covers the" << first - k << "layers under it";
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
 /*!
  * Load a layer from the XCF file. The data stream must be positioned at
  * the beginning of the layer data.
  * \param xcf_io the image file data stream.
  * \param xcf_image contains the layer and the color table
  * (if the image is indexed).
+ * \param skipPixels if true, the pixels of the layer are not loaded (see planLayers()).
  * \return true if there were no I/O errors.
  */
-bool XCFImageFormat::loadLayer(QDataStream &xcf_io, XCFImage &xcf_image)
+bool XCFImageFormat::loadLayer(QDataStream &xcf_io, XCFImage &xcf_image, bool skipPixels)
 {
     Layer &layer(xcf_image.layer);
     delete[] layer.name;
@@ -1130,11 +1341,17 @@ bool XCFImageFormat::loadLayer(QDataStream &xcf_io, XCFImage &xcf_image)
 
     // Don't want to keep passing this around, dumb XCF format
     layer.compression = XcfCompressionType(xcf_image.compression);
+    layer.scale = xcf_image.scale;
 
     if (!loadLayerProperties(xcf_io, layer)) {
         return false;
     }
 
+    if (layer.scale > 1) {
+        layer.x_offset = shrinkOffset(layer.x_offset, layer.scale);
+        layer.y_offset = shrinkOffset(layer.y_offset, layer.scale);
+    }
+
     qCDebug(XCFPLUGIN) << "layer: \"" << layer.name << "\", size: " << layer.width << " x " << layer.height << ", type: " << layer.type
                        << ", mode: " << layer.mode << ", opacity: " << layer.opacity << ", visible: " << layer.visible << ", offset: " << layer.x_offset << ", "
                        << layer.y_offset << ", compression" << layer.compression;
@@ -1162,13 +1379,34 @@ bool XCFImageFormat::loadLayer(QDataStream &xcf_io, XCFImage &xcf_image)
         return false;
     }
 
-    // Allocate the individual tile QImages based on the size and type
-    // of this layer.
+    if (layer.mask_offset != 0) {
+        // 9 means its not on the file. Spec says "If the property does not appear for a layer which has a layer mask, it defaults to true (1).
+        if (layer.apply_mask == 9) {
+            layer.apply_mask = 1;
+        }
+    } else {
+        // Spec says "Robust readers should force this to false if the layer has no layer mask."
+        layer.apply_mask = 0;
+    }
+
+    // The layer does not change the final image (see planLayers()), but the first
+    // visible one is still used to initialize it.
+    if (skipPixels) {
+        if (!xcf_image.initialized) {
+            if (!initializeImage(xcf_image)) {
+                return false;
+            }
+            xcf_image.initialized = true;
+        }
+        return true;
+    }
+
+    // Prepare the tile matrices based on the size and type of this layer.
 
     if (!composeTiles(xcf_image)) {
         return false;
     }
-    xcf_io.device()->seek(layer.hierarchy_offset);
+    Instrumentation::seek(xcf_io.device(), layer.hierarchy_offset);
 
     // As tiles are loaded, they are copied into the layers tiles by
     // this routine. (loadMask(), below, uses a slightly different
@@ -1176,43 +1414,67 @@ bool XCFImageFormat::loadLayer(QDataStream &xcf_io, XCFImage &xcf_image)
 
     layer.assignBytes = assignImageBytes;
 
-    if (!loadHierarchy(xcf_io, layer, xcf_image.header.precision)) {
+    if (!loadHierarchy(xcf_io, layer, layer.image_level, xcf_image.header.precision)) {
         return false;
     }
 
     if (layer.mask_offset != 0) {
-        // 9 means its not on the file. Spec says "If the property does not appear for a layer which has a layer mask, it defaults to true (1).
-        if (layer.apply_mask == 9) {
-            layer.apply_mask = 1;
-        }
-
-        xcf_io.device()->seek(layer.mask_offset);
+        Instrumentation::seek(xcf_io.device(), layer.mask_offset);
 
         if (!loadMask(xcf_io, layer, xcf_image.header.precision)) {
             return false;
         }
     } else {
-        // Spec says "Robust readers should force this to false if the layer has no layer mask."
-        layer.apply_mask = 0;
+        layer.mask_level = Layer::Level();
     }
 
     // Now we should have enough information to initialize the final
     // QImage. The first visible layer determines the attributes
     // of the QImage.
 
-    if (!xcf_image.initialized) {
+    const bool copy = !xcf_image.initialized;
+    if (copy) {
         if (!initializeImage(xcf_image)) {
             return false;
         }
-        copyLayerToImage(xcf_image);
         xcf_image.initialized = true;
-    } else {
-        const QColorSpace colorspaceBefore = xcf_image.image.colorSpace();
-        mergeLayerIntoImage(xcf_image);
-        if (xcf_image.image.colorSpace() != colorspaceBefore) {
-            qCDebug(XCFPLUGIN) << "Converting color space back to" << colorspaceBefore << "after layer composition";
-            xcf_image.image.convertToColorSpace(colorspaceBefore);
+    }
+
+    // The layer is loaded and composited one row of tiles at a time: this way
+    // only the final image and a row of tiles are in memory.
+
+    const QColorSpace colorspaceBefore = xcf_image.image.colorSpace();
+    for (uint j = 0; j < layer.nrows; j++) {
+        composeTileRow(layer, j);
+
+        InstrumentationPhase decodePhase(Instrumentation::Decode);
+        layer.assignBytes = assignImageBytes;
+        if (!loadLevelRow(xcf_io, layer, layer.image_level, j, xcf_image.header.precision)) {
+            return false;
+        }
+
+        if (layer.mask_offset != 0) {
+            layer.assignBytes = assignMaskBytes;
+            if (!loadLevelRow(xcf_io, layer, layer.mask_level, j, xcf_image.header.precision)) {
+                return false;
+            }
         }
+        decodePhase.end();
+
+        InstrumentationPhase compositePhase(Instrumentation::Composite);
+        if (copy) {
+            copyLayerToImage(xcf_image, j);
+        } else if (!mergeLayerIntoImage(xcf_image, j)) {
+            releaseTileRow(layer, j);
+            break;
+        }
+
+        releaseTileRow(layer, j);
+    }
+
+    if (!copy && xcf_image.image.colorSpace() != colorspaceBefore) {
+        qCDebug(XCFPLUGIN) << "Converting color space back to" << colorspaceBefore << "after layer composition";
+        xcf_image.image.convertToColorSpace(colorspaceBefore);
     }
 
     return true;
@@ -1341,8 +1603,9 @@ bool XCFImageFormat::loadLayerProperties(QDataStream &xcf_io, Layer &layer)
 }
 
 /*!
- * Compute the number of tiles in the current layer and allocate
- * QImage structures for each of them.
+ * Compute the number of tiles in the current layer and prepare the
+ * tile matrices. The tiles are not allocated here (see composeTileRow()):
+ * only one empty tile for each possible tile size is created.
  * \param xcf_image contains the current layer.
  */
 bool XCFImageFormat::composeTiles(XCFImage &xcf_image)
@@ -1382,110 +1645,121 @@ bool XCFImageFormat::composeTiles(XCFImage &xcf_image)
 
 #ifndef XCF_QT5_SUPPORT
     // Qt 6 image allocation limit calculation: we have to check the limit here because the image is splitted in
-    // tiles of 64x64 pixels. The required memory to build the image is at least doubled because tiles are loaded
-    // and then the final image is created by copying the tiles inside it.
-    // NOTE: on Windows to open a 10GiB image the plugin uses 28GiB of RAM
+    // tiles of 64x64 pixels. The final image is allocated with imageAlloc() (so it is checked by Qt) and the layer
+    // is composited one row of tiles at a time: so only a row of tiles is added to the required memory.
     qint64 channels = 1 + (layer.type == RGB_GIMAGE ? 2 : 0) + (layer.type == RGBA_GIMAGE ? 3 : 0);
-    if (qint64(layer.width) * qint64(layer.height) * channels * 2ll / 1024ll / 1024ll > QImageReader::allocationLimit()) {
+    if (qint64(layer.width) * qint64(TILE_HEIGHT) * channels * 2ll / 1024ll / 1024ll > QImageReader::allocationLimit()) {
         qCDebug(XCFPLUGIN) << "Rejecting image as it exceeds the current allocation limit of" << QImageReader::allocationLimit() << "megabytes";
         return false;
     }
 #endif
 
-    layer.image_tiles.resize(layer.nrows);
+    const bool hasAlphaTiles = layer.type == GRAYA_GIMAGE || layer.type == INDEXEDA_GIMAGE;
 
-    if (layer.type == GRAYA_GIMAGE || layer.type == INDEXEDA_GIMAGE) {
-        layer.alpha_tiles.resize(layer.nrows);
-    }
-
-    if (layer.mask_offset != 0) {
-        layer.mask_tiles.resize(layer.nrows);
-    }
+    layer.image_tiles.resize(layer.nrows);
+    layer.alpha_tiles.resize(hasAlphaTiles ? layer.nrows : 0);
+    layer.mask_tiles.resize(layer.mask_offset != 0 ? layer.nrows : 0);
 
     for (uint j = 0; j < layer.nrows; j++) {
-        layer.image_tiles[j].resize(layer.ncols);
+        layer.image_tiles[j] = QList<QImage>(layer.ncols);
 
-        if (layer.type == GRAYA_GIMAGE || layer.type == INDEXEDA_GIMAGE) {
-            layer.alpha_tiles[j].resize(layer.ncols);
+        if (hasAlphaTiles) {
+            layer.alpha_tiles[j] = QList<QImage>(layer.ncols);
         }
 
         if (layer.mask_offset != 0) {
-            layer.mask_tiles[j].resize(layer.ncols);
+            layer.mask_tiles[j] = QList<QImage>(layer.ncols);
         }
     }
 
     const QImage::Format format = layer.qimageFormat(xcf_image.header.precision);
 
-    for (uint j = 0; j < layer.nrows; j++) {
-        for (uint i = 0; i < layer.ncols; i++) {
+    for (auto &&tiles : layer.template_tiles) {
+        tiles.image = QImage();
+        tiles.alpha = QImage();
+        tiles.mask = QImage();
+    }
+
+    // The tiles on the right and bottom edges can be smaller than TILE_WIDTH x TILE_HEIGHT.
+    for (uint j : {0u, layer.nrows - 1}) {
+        for (uint i : {0u, layer.ncols - 1}) {
+            if (j >= layer.nrows || i >= layer.ncols) {
+                continue;
+            }
+
             uint tile_width = (i + 1) * TILE_WIDTH <= layer.width ? TILE_WIDTH : layer.width - i * TILE_WIDTH;
 
             uint tile_height = (j + 1) * TILE_HEIGHT <= layer.height ? TILE_HEIGHT : layer.height - j * TILE_HEIGHT;
 
+            auto &&tiles = layer.template_tiles[Layer::templateIndex(tile_width, tile_height)];
+            if (!tiles.image.isNull()) {
+                continue;
+            }
+
             // Try to create the most appropriate QImage (each GIMP layer
             // type is treated slightly differently)
 
             switch (layer.type) {
             case RGB_GIMAGE:
             case RGBA_GIMAGE:
-                layer.image_tiles[j][i] = QImage(tile_width, tile_height, format);
-                if (layer.image_tiles[j][i].isNull()) {
+                tiles.image = QImage(tile_width, tile_height, format);
+                if (tiles.image.isNull()) {
                     return false;
                 }
-                layer.image_tiles[j][i].setColorCount(0);
+                tiles.image.setColorCount(0);
                 break;
 
             case GRAY_GIMAGE:
-                layer.image_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                if (layer.image_tiles[j][i].isNull()) {
+                tiles.image = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                if (tiles.image.isNull()) {
                     return false;
                 }
-                layer.image_tiles[j][i].setColorCount(256);
-                setGrayPalette(layer.image_tiles[j][i]);
+                tiles.image.setColorCount(256);
+                setGrayPalette(tiles.image);
                 break;
 
             case GRAYA_GIMAGE:
-                layer.image_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                layer.image_tiles[j][i].setColorCount(256);
-                if (layer.image_tiles[j][i].isNull()) {
+                tiles.image = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                tiles.image.setColorCount(256);
+                if (tiles.image.isNull()) {
                     return false;
                 }
-                setGrayPalette(layer.image_tiles[j][i]);
+                setGrayPalette(tiles.image);
 
-                layer.alpha_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                if (layer.alpha_tiles[j][i].isNull()) {
+                tiles.alpha = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                if (tiles.alpha.isNull()) {
                     return false;
                 }
-                layer.alpha_tiles[j][i].setColorCount(256);
-                setGrayPalette(layer.alpha_tiles[j][i]);
+                tiles.alpha.setColorCount(256);
+                setGrayPalette(tiles.alpha);
                 break;
 
             case INDEXED_GIMAGE:
-                layer.image_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                layer.image_tiles[j][i].setColorCount(xcf_image.num_colors);
-                if (layer.image_tiles[j][i].isNull()) {
+                tiles.image = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                tiles.image.setColorCount(xcf_image.num_colors);
+                if (tiles.image.isNull()) {
                     return false;
                 }
-                setPalette(xcf_image, layer.image_tiles[j][i]);
+                setPalette(xcf_image, tiles.image);
                 break;
 
             case INDEXEDA_GIMAGE:
-                layer.image_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                if (layer.image_tiles[j][i].isNull()) {
+                tiles.image = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                if (tiles.image.isNull()) {
                     return false;
                 }
-                layer.image_tiles[j][i].setColorCount(xcf_image.num_colors);
-                setPalette(xcf_image, layer.image_tiles[j][i]);
+                tiles.image.setColorCount(xcf_image.num_colors);
+                setPalette(xcf_image, tiles.image);
 
-                layer.alpha_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                if (layer.alpha_tiles[j][i].isNull()) {
+                tiles.alpha = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                if (tiles.alpha.isNull()) {
                     return false;
                 }
-                layer.alpha_tiles[j][i].setColorCount(256);
-                setGrayPalette(layer.alpha_tiles[j][i]);
+                tiles.alpha.setColorCount(256);
+                setGrayPalette(tiles.alpha);
             }
-            if (layer.type != GRAYA_GIMAGE && layer.image_tiles[j][i].format() != format) {
-                qCWarning(XCFPLUGIN) << "Selected wrong tile format" << layer.image_tiles[j][i].format() << "expected" << format;
+            if (layer.type != GRAYA_GIMAGE && tiles.image.format() != format) {
+                qCWarning(XCFPLUGIN) << "Selected wrong tile format" << tiles.image.format() << "expected" << format;
                 return false;
             }
 
@@ -1497,7 +1771,7 @@ bool XCFImageFormat::composeTiles(XCFImage &xcf_image)
             case XCFImageFormat::GIMP_PRECISION_U8_LINEAR:
             case XCFImageFormat::GIMP_PRECISION_U16_LINEAR:
             case XCFImageFormat::GIMP_PRECISION_U32_LINEAR:
-                layer.image_tiles[j][i].setColorSpace(QColorSpace::SRgbLinear);
+                tiles.image.setColorSpace(QColorSpace::SRgbLinear);
                 break;
             case XCFImageFormat::GIMP_PRECISION_HALF_NON_LINEAR:
             case XCFImageFormat::GIMP_PRECISION_FLOAT_NON_LINEAR:
@@ -1505,7 +1779,7 @@ bool XCFImageFormat::composeTiles(XCFImage &xcf_image)
             case XCFImageFormat::GIMP_PRECISION_U8_NON_LINEAR:
             case XCFImageFormat::GIMP_PRECISION_U16_NON_LINEAR:
             case XCFImageFormat::GIMP_PRECISION_U32_NON_LINEAR:
-                layer.image_tiles[j][i].setColorSpace(QColorSpace::SRgb);
+                tiles.image.setColorSpace(QColorSpace::SRgb);
                 break;
             case XCFImageFormat::GIMP_PRECISION_HALF_PERCEPTUAL:
             case XCFImageFormat::GIMP_PRECISION_FLOAT_PERCEPTUAL:
@@ -1513,23 +1787,64 @@ bool XCFImageFormat::composeTiles(XCFImage &xcf_image)
             case XCFImageFormat::GIMP_PRECISION_U8_PERCEPTUAL:
             case XCFImageFormat::GIMP_PRECISION_U16_PERCEPTUAL:
             case XCFImageFormat::GIMP_PRECISION_U32_PERCEPTUAL:
-                layer.image_tiles[j][i].setColorSpace(QColorSpace::SRgb);
+                tiles.image.setColorSpace(QColorSpace::SRgb);
                 break;
             }
 #endif
             if (layer.mask_offset != 0) {
-                layer.mask_tiles[j][i] = QImage(tile_width, tile_height, QImage::Format_Indexed8);
-                layer.mask_tiles[j][i].setColorCount(256);
-                if (layer.mask_tiles[j][i].isNull()) {
+                tiles.mask = QImage(tile_width, tile_height, QImage::Format_Indexed8);
+                tiles.mask.setColorCount(256);
+                if (tiles.mask.isNull()) {
                     return false;
                 }
-                setGrayPalette(layer.mask_tiles[j][i]);
+                setGrayPalette(tiles.mask);
             }
         }
     }
     return true;
 }
 
+/*!
+ * Allocate the tiles of a row of the current layer. The tiles initially
+ * share the data of the empty tiles created by composeTiles(): they are
+ * detached when the tile data is copied into them by assignBytes().
+ * \param layer the current layer.
+ * \param j row index of the tiles.
+ */
+void XCFImageFormat::composeTileRow(Layer &layer, uint j)
+{
+    for (uint i = 0; i < layer.ncols; i++) {
+        uint tile_width = (i + 1) * TILE_WIDTH <= layer.width ? TILE_WIDTH : layer.width - i * TILE_WIDTH;
+
+        uint tile_height = (j + 1) * TILE_HEIGHT <= layer.height ? TILE_HEIGHT : layer.height - j * TILE_HEIGHT;
+
+        const auto &tiles = layer.template_tiles[Layer::templateIndex(tile_width, tile_height)];
+        layer.image_tiles[j][i] = tiles.image;
+        if (!layer.alpha_tiles.isEmpty()) {
+            layer.alpha_tiles[j][i] = tiles.alpha;
+        }
+        if (!layer.mask_tiles.isEmpty()) {
+            layer.mask_tiles[j][i] = tiles.mask;
+        }
+    }
+}
+
+/*!
+ * Release the tiles of a row of the current layer.
+ * \param layer the current layer.
+ * \param j row index of the tiles.
+ */
+void XCFImageFormat::releaseTileRow(Layer &layer, uint j)
+{
+    layer.image_tiles[j].fill(QImage());
+    if (!layer.alpha_tiles.isEmpty()) {
+        layer.alpha_tiles[j].fill(QImage());
+    }
+    if (!layer.mask_tiles.isEmpty()) {
+        layer.mask_tiles[j].fill(QImage());
+    }
+}
+
 /*!
  * Apply a grayscale palette to the QImage. Note that Qt does not distinguish
  * between grayscale and indexed images. A grayscale image is just
@@ -1848,9 +2163,10 @@ bool XCFImageFormat::assignImageBytes(Layer &layer, uint i, uint j, const GimpPr
  * is used.
  * \param xcf_io the data stream connected to the XCF image.
  * \param layer the layer to collect the image.
+ * \param level returns with the tiles of the top level.
  * \return true if there were no I/O errors.
  */
-bool XCFImageFormat::loadHierarchy(QDataStream &xcf_io, Layer &layer, const GimpPrecision precision)
+bool XCFImageFormat::loadHierarchy(QDataStream &xcf_io, Layer &layer, Layer::Level &level, const GimpPrecision precision)
 {
     qint32 width;
     qint32 height;
@@ -1941,34 +2257,42 @@ bool XCFImageFormat::loadHierarchy(QDataStream &xcf_io, Layer &layer, const Gimp
 
     qint64 saved_pos = xcf_io.device()->pos();
 
-    xcf_io.device()->seek(offset);
-    if (!loadLevel(xcf_io, layer, bpp, precision)) {
+    Instrumentation::seek(xcf_io.device(), offset);
+    if (!loadLevel(xcf_io, layer, level, bpp)) {
         return false;
     }
 
-    xcf_io.device()->seek(saved_pos);
+    Instrumentation::seek(xcf_io.device(), saved_pos);
     return true;
 }
 
+/*!
+ * Convert the big endian floating point samples of a tile to big endian 16-bit samples.
+ * The computation is done in single precision (enough for 16-bit samples) so that the
+ * loop can be vectorized.
+ */
 template<typename SourceFormat>
 static bool convertFloatTo16Bit(uchar *output, quint64 outputSize, uchar *input)
 {
-    SourceFormat *source = (SourceFormat *)(input);
+    const SourceFormat *source = reinterpret_cast<const SourceFormat *>(input);
+    quint16 *target = reinterpret_cast<quint16 *>(output);
     for (quint64 offset = 0; offset < outputSize; offset++) {
-        ((uint16_t *)output)[offset] = qToBigEndian(quint16(qBound(0., qFromBigEndian<SourceFormat>(source[offset]) * 65535. + 0.5, 65535.)));
+        const float value = float(qFromBigEndian<SourceFormat>(source[offset]));
+        target[offset] = qToBigEndian(quint16(qBound(0.f, value * 65535.f + 0.5f, 65535.f)));
     }
     return true;
 }
 
 /*!
  * Load one level of the image hierarchy (but only the top level is ever used).
+ * Only the positions of the tiles are read here: the tiles are loaded by loadLevelRow().
  * \param xcf_io the data stream connected to the XCF image.
  * \param layer the layer to collect the image.
+ * \param level returns with the positions of the tiles.
  * \param bpp the number of bytes in a pixel.
  * \return true if there were no I/O errors.
- * \sa loadTileRLE().
  */
-bool XCFImageFormat::loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp, const GimpPrecision precision)
+bool XCFImageFormat::loadLevel(QDataStream &xcf_io, Layer &layer, Layer::Level &level, qint32 bpp)
 {
     qint32 width;
     qint32 height;
@@ -1976,6 +2300,9 @@ bool XCFImageFormat::loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp, co
     xcf_io >> width >> height;
     qint64 offset = readOffsetPtr(xcf_io);
 
+    level.bpp = bpp;
+    level.tileOffsets.clear();
+
     if (offset < 0) {
         qCDebug(XCFPLUGIN) << "XCF: negative level offset";
         return false;
@@ -1984,12 +2311,54 @@ bool XCFImageFormat::loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp, co
     if (offset == 0) {
         // offset 0 with rowsxcols != 0 is probably an error since it means we have tiles
         // without data but just clear the bits for now instead of returning false
-        for (uint j = 0; j < layer.nrows; j++) {
-            for (uint i = 0; i < layer.ncols; i++) {
-                layer.image_tiles[j][i].fill(Qt::transparent);
-                if (layer.type == GRAYA_GIMAGE || layer.type == INDEXEDA_GIMAGE) {
-                    layer.alpha_tiles[j][i].fill(Qt::transparent);
-                }
+        return true;
+    }
+
+    const qint64 tiles = qint64(layer.nrows) * layer.ncols;
+    level.tileOffsets.reserve(tiles + 1);
+    level.tileOffsets.append(offset);
+    for (qint64 k = 1; k <= tiles; k++) {
+        if (offset == 0) {
+            qCDebug(XCFPLUGIN) << "XCF: incorrect number of tiles in layer " << layer.name;
+            return false;
+        }
+
+        offset = readOffsetPtr(xcf_io);
+
+        if (offset < 0) {
+            qCDebug(XCFPLUGIN) << "XCF: negative level offset";
+            return false;
+        }
+
+        level.tileOffsets.append(offset);
+    }
+
+    return true;
+}
+
+/*!
+ * Load a row of tiles of a level of the image hierarchy.
+ * \param xcf_io the data stream connected to the XCF image.
+ * \param layer the layer to collect the image.
+ * \param level the positions of the tiles (see loadLevel()).
+ * \param j row index of the tiles.
+ * \return true if there were no I/O errors.
+ * \sa loadTileRLE().
+ */
+bool XCFImageFormat::loadLevelRow(QDataStream &xcf_io, Layer &layer, const Layer::Level &level, uint j, const GimpPrecision precision)
+{
+    const qint32 bpp = level.bpp;
+
+    if (level.tileOffsets.isEmpty()) {
+        // offset 0 with rowsxcols != 0 is probably an error since it means we have tiles
+        // without data but just clear the bits for now instead of returning false
+        for (uint i = 0; i < layer.ncols; i++) {
+            layer.image_tiles[j][i].fill(Qt::transparent);
+            if (layer.type == GRAYA_GIMAGE || layer.type == INDEXEDA_GIMAGE) {
+                layer.alpha_tiles[j][i].fill(Qt::transparent);
+            }
+            if (!shrinkTiles(layer, i, j)) {
+                return false;
             }
         }
         return true;
@@ -2023,143 +2392,222 @@ bool XCFImageFormat::loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp, co
     if (needConvert) {
         buffer.resize(blockSize * (bpp == 2 ? 2 : 1));
     }
-    for (uint j = 0; j < layer.nrows; j++) {
-        for (uint i = 0; i < layer.ncols; i++) {
-            if (offset == 0) {
-                qCDebug(XCFPLUGIN) << "XCF: incorrect number of tiles in layer " << layer.name;
-                return false;
-            }
+    for (uint i = 0; i < layer.ncols; i++) {
+        const qsizetype k = qsizetype(j) * layer.ncols + i;
+        const qint64 offset = level.tileOffsets.at(k);
+        qint64 offset2 = level.tileOffsets.at(k + 1);
+
+        // Evidently, RLE can occasionally expand a tile instead of compressing it!
+        if (offset2 == 0) {
+            offset2 = offset + blockSize;
+        }
 
-            qint64 saved_pos = xcf_io.device()->pos();
-            qint64 offset2 = readOffsetPtr(xcf_io);
+        Instrumentation::seek(xcf_io.device(), offset);
+        qint64 bytesParsed = 0;
 
-            if (offset2 < 0) {
-                qCDebug(XCFPLUGIN) << "XCF: negative level offset";
+        switch (layer.compression) {
+        case COMPRESS_NONE: {
+            if (xcf_io.version() > 11 || size_t(bpp) > sizeof(QRgba64)) {
+                qCDebug(XCFPLUGIN) << "Component reading not supported yet";
                 return false;
             }
-
-            // Evidently, RLE can occasionally expand a tile instead of compressing it!
-            if (offset2 == 0) {
-                offset2 = offset + blockSize;
+            const int data_size = bpp * TILE_WIDTH * TILE_HEIGHT;
+            if (data_size > int(blockSize)) {
+                qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << sizeof(layer.tile) << "but need" << data_size;
+                return false;
             }
-
-            xcf_io.device()->seek(offset);
-            qint64 bytesParsed = 0;
-
-            switch (layer.compression) {
-            case COMPRESS_NONE: {
-                if (xcf_io.version() > 11 || size_t(bpp) > sizeof(QRgba64)) {
-                    qCDebug(XCFPLUGIN) << "Component reading not supported yet";
+            int dataRead = xcf_io.readRawData(reinterpret_cast<char *>(layer.tile), data_size);
+            if (dataRead < data_size) {
+                qCDebug(XCFPLUGIN) << "short read, expected" << data_size << "got" << dataRead;
+                return false;
+            }
+            bytesParsed = dataRead;
+            break;
+        }
+        case COMPRESS_RLE: {
+            // NOTE: image tiles may be already shrunk when reading the mask
+            const int tile_width = (i + 1) * TILE_WIDTH <= layer.width ? TILE_WIDTH : layer.width - i * TILE_WIDTH;
+            const int tile_height = (j + 1) * TILE_HEIGHT <= layer.height ? TILE_HEIGHT : layer.height - j * TILE_HEIGHT;
+            int size = tile_width * tile_height;
+            const uint data_size = size * bpp;
+            if (needConvert) {
+                if (data_size >= unsigned(buffer.size())) {
+                    qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << buffer.size() << "but need" << data_size;
                     return false;
                 }
-                const int data_size = bpp * TILE_WIDTH * TILE_HEIGHT;
-                if (data_size > int(blockSize)) {
+            } else {
+                if (data_size > sizeof(layer.tile)) {
                     qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << sizeof(layer.tile) << "but need" << data_size;
                     return false;
                 }
-                int dataRead = xcf_io.readRawData(reinterpret_cast<char *>(layer.tile), data_size);
-                if (dataRead < data_size) {
-                    qCDebug(XCFPLUGIN) << "short read, expected" << data_size << "got" << dataRead;
+                if (blockSize > sizeof(layer.tile)) {
+                    qCWarning(XCFPLUGIN) << "Too small tiles" << sizeof(layer.tile) << "this image requires" << blockSize << sizeof(QRgba64) << bpp;
                     return false;
                 }
-                bytesParsed = dataRead;
-                break;
             }
-            case COMPRESS_RLE: {
-                int size = layer.image_tiles[j][i].width() * layer.image_tiles[j][i].height();
-                const uint data_size = size * bpp;
-                if (needConvert) {
-                    if (data_size >= unsigned(buffer.size())) {
-                        qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << buffer.size() << "but need" << data_size;
-                        return false;
-                    }
-                } else {
-                    if (data_size > sizeof(layer.tile)) {
-                        qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << sizeof(layer.tile) << "but need" << data_size;
-                        return false;
-                    }
-                    if (blockSize > sizeof(layer.tile)) {
-                        qCWarning(XCFPLUGIN) << "Too small tiles" << sizeof(layer.tile) << "this image requires" << blockSize << sizeof(QRgba64) << bpp;
-                        return false;
-                    }
-                }
-                if (!loadTileRLE(xcf_io, needConvert ? buffer.data() : layer.tile, size, offset2 - offset, bpp, &bytesParsed)) {
-                    qCDebug(XCFPLUGIN) << "Failed to read RLE";
-                    return false;
-                }
-                break;
+            if (!loadTileRLE(xcf_io, needConvert ? buffer.data() : layer.tile, size, offset2 - offset, bpp, &bytesParsed)) {
+                qCDebug(XCFPLUGIN) << "Failed to read RLE";
+                return false;
             }
-            default:
-                qCDebug(XCFPLUGIN) << "Unhandled compression" << layer.compression;
+            break;
+        }
+        default:
+            qCDebug(XCFPLUGIN) << "Unhandled compression" << layer.compression;
+            return false;
+        }
+
+        if (needConvert) {
+            if (bytesParsed > buffer.size()) {
+                qCDebug(XCFPLUGIN) << "Invalid number of bytes parsed" << bytesParsed << buffer.size();
                 return false;
             }
 
-            if (needConvert) {
-                if (bytesParsed > buffer.size()) {
-                    qCDebug(XCFPLUGIN) << "Invalid number of bytes parsed" << bytesParsed << buffer.size();
-                    return false;
-                }
+            // only the samples decoded in the tile are converted (edge tiles are smaller)
+            auto samples = [&buffer, bytesParsed](quint64 sampleSize) {
+                return std::min(quint64(buffer.size()) / sampleSize, (quint64(bytesParsed) + sampleSize - 1) / sampleSize);
+            };
 
-                switch (precision) {
-                case GIMP_PRECISION_U32_LINEAR:
-                case GIMP_PRECISION_U32_NON_LINEAR:
-                case GIMP_PRECISION_U32_PERCEPTUAL: {
-                    quint32 *source = (quint32 *)(buffer.data());
-                    for (quint64 offset = 0, len = buffer.size() / sizeof(quint32); offset < len; ++offset) {
-                        ((quint16 *)layer.tile)[offset] = qToBigEndian<quint16>(qFromBigEndian(source[offset]) / 65537);
-                    }
-                    break;
+            switch (precision) {
+            case GIMP_PRECISION_U32_LINEAR:
+            case GIMP_PRECISION_U32_NON_LINEAR:
+            case GIMP_PRECISION_U32_PERCEPTUAL: {
+                quint32 *source = (quint32 *)(buffer.data());
+                for (quint64 offset = 0, len = samples(sizeof(quint32)); offset < len; ++offset) {
+                    ((quint16 *)layer.tile)[offset] = qToBigEndian<quint16>(qFromBigEndian(source[offset]) / 65537);
                 }
+                break;
+            }
 #ifndef USE_FLOAT_IMAGES
-                case GIMP_PRECISION_HALF_LINEAR:
-                case GIMP_PRECISION_HALF_NON_LINEAR:
-                case GIMP_PRECISION_HALF_PERCEPTUAL:
-                    convertFloatTo16Bit<qfloat16>(layer.tile, buffer.size() / sizeof(qfloat16), buffer.data());
-                    break;
-                case GIMP_PRECISION_FLOAT_LINEAR:
-                case GIMP_PRECISION_FLOAT_NON_LINEAR:
-                case GIMP_PRECISION_FLOAT_PERCEPTUAL:
-                    convertFloatTo16Bit<float>(layer.tile, buffer.size() / sizeof(float), buffer.data());
-                    break;
-                case GIMP_PRECISION_DOUBLE_LINEAR:
-                case GIMP_PRECISION_DOUBLE_NON_LINEAR:
-                case GIMP_PRECISION_DOUBLE_PERCEPTUAL:
-                    convertFloatTo16Bit<double>(layer.tile, buffer.size() / sizeof(double), buffer.data());
-                    break;
+            case GIMP_PRECISION_HALF_LINEAR:
+            case GIMP_PRECISION_HALF_NON_LINEAR:
+            case GIMP_PRECISION_HALF_PERCEPTUAL:
+                convertFloatTo16Bit<qfloat16>(layer.tile, samples(sizeof(qfloat16)), buffer.data());
+                break;
+            case GIMP_PRECISION_FLOAT_LINEAR:
+            case GIMP_PRECISION_FLOAT_NON_LINEAR:
+            case GIMP_PRECISION_FLOAT_PERCEPTUAL:
+                convertFloatTo16Bit<float>(layer.tile, samples(sizeof(float)), buffer.data());
+                break;
+            case GIMP_PRECISION_DOUBLE_LINEAR:
+            case GIMP_PRECISION_DOUBLE_NON_LINEAR:
+            case GIMP_PRECISION_DOUBLE_PERCEPTUAL:
+                convertFloatTo16Bit<double>(layer.tile, samples(sizeof(double)), buffer.data());
+                break;
 #else
-                case GIMP_PRECISION_DOUBLE_LINEAR:
-                case GIMP_PRECISION_DOUBLE_NON_LINEAR:
-                case GIMP_PRECISION_DOUBLE_PERCEPTUAL: {
-                    double *source = (double *)(buffer.data());
-                    for (quint64 offset = 0, len = buffer.size() / sizeof(double); offset < len; ++offset) {
-                        ((float *)layer.tile)[offset] = qToBigEndian<float>(float(qFromBigEndian(source[offset])));
-                    }
-                    break;
-                }
-#endif
-                default:
-                    qCWarning(XCFPLUGIN) << "Unsupported precision" << precision;
-                    return false;
+            case GIMP_PRECISION_DOUBLE_LINEAR:
+            case GIMP_PRECISION_DOUBLE_NON_LINEAR:
+            case GIMP_PRECISION_DOUBLE_PERCEPTUAL: {
+                double *source = (double *)(buffer.data());
+                for (quint64 offset = 0, len = samples(sizeof(double)); offset < len; ++offset) {
+                    ((float *)layer.tile)[offset] = qToBigEndian<float>(float(qFromBigEndian(source[offset])));
                 }
+                break;
             }
-
-            // The bytes in the layer tile are juggled differently depending on
-            // the target QImage. The caller has set layer.assignBytes to the
-            // appropriate routine.
-            if (!layer.assignBytes(layer, i, j, precision)) {
+#endif
+            default:
+                qCWarning(XCFPLUGIN) << "Unsupported precision" << precision;
                 return false;
             }
+        }
 
-            xcf_io.device()->seek(saved_pos);
-            offset = readOffsetPtr(xcf_io);
+        // The bytes in the layer tile are juggled differently depending on
+        // the target QImage. The caller has set layer.assignBytes to the
+        // appropriate routine.
+        if (!layer.assignBytes(layer, i, j, precision)) {
+            return false;
+        }
 
-            if (offset < 0) {
-                qCDebug(XCFPLUGIN) << "XCF: negative level offset";
-                return false;
+        if (!shrinkTiles(layer, i, j)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * Shrink an Indexed8 tile by an integer factor.
+ * \param tile the tile to shrink.
+ * \param scale the shrink factor.
+ * \param average if true, the indexes are averaged (gray levels and alpha), otherwise the nearest is used (palette).
+ * \return the shrunk tile (null on error).
+ */
+static QImage shrinkIndexedTile(const QImage &tile, uint scale, bool average)
+{
+    const int width = (tile.width() + scale - 1) / scale;
+    const int height = (tile.height() + scale - 1) / scale;
+    QImage img(width, height, QImage::Format_Indexed8);
+    if (img.isNull()) {
+        return img;
+    }
+    img.setColorTable(tile.colorTable());
+    for (int y = 0; y < height; y++) {
+        uchar *dst = img.scanLine(y);
+        const int y0 = y * scale;
+        const int y1 = std::min(y0 + int(scale), tile.height());
+        for (int x = 0; x < width; x++) {
+            const int x0 = x * scale;
+            if (!average) {
+                dst[x] = tile.constScanLine(y0)[x0];
+                continue;
             }
+            const int x1 = std::min(x0 + int(scale), tile.width());
+            uint sum = 0;
+            for (int yy = y0; yy < y1; yy++) {
+                const uchar *src = tile.constScanLine(yy);
+                for (int xx = x0; xx < x1; xx++) {
+                    sum += src[xx];
+                }
+            }
+            const uint count = (y1 - y0) * (x1 - x0);
+            dst[x] = uchar((sum + count / 2) / count);
+        }
+    }
+    return img;
+}
+
+/*!
+ * When a scaled image is requested, shrink the tiles just loaded by the layer scale factor.
+ * The image and alpha tiles are shrunk when the image is read, the mask tiles when the mask is read.
+ * \param layer layer containing the tile matrices.
+ * \param i column index of current tile.
+ * \param j row index of current tile.
+ * \return true on success.
+ */
+bool XCFImageFormat::shrinkTiles(Layer &layer, uint i, uint j)
+{
+    if (layer.scale < 2) {
+        return true;
+    }
+
+    if (layer.assignBytes == assignMaskBytes) {
+        QImage &mask = layer.mask_tiles[j][i];
+        mask = shrinkIndexedTile(mask, layer.scale, true);
+        return !mask.isNull();
+    }
+
+    QImage &image = layer.image_tiles[j][i];
+    if (image.format() == QImage::Format_Indexed8) {
+        image = shrinkIndexedTile(image, layer.scale, layer.type == GRAY_GIMAGE || layer.type == GRAYA_GIMAGE);
+    } else {
+        const QImage::Format format = image.format();
+        const QSize size((image.width() + layer.scale - 1) / layer.scale, (image.height() + layer.scale - 1) / layer.scale);
+        image = image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        if (image.format() != format) {
+            image.convertTo(format);
         }
     }
+    if (image.isNull()) {
+        return false;
+    }
 
+    if (layer.type == GRAYA_GIMAGE || layer.type == INDEXEDA_GIMAGE) {
+        QImage &alpha = layer.alpha_tiles[j][i];
+        alpha = shrinkIndexedTile(alpha, layer.scale, true);
+        if (alpha.isNull()) {
+            return false;
+        }
+    }
     return true;
 }
 
@@ -2190,10 +2638,10 @@ bool XCFImageFormat::loadMask(QDataStream &xcf_io, Layer &layer, const GimpPreci
         return false;
     }
 
-    xcf_io.device()->seek(hierarchy_offset);
+    Instrumentation::seek(xcf_io.device(), hierarchy_offset);
     layer.assignBytes = assignMaskBytes;
 
-    if (!loadHierarchy(xcf_io, layer, precision)) {
+    if (!loadHierarchy(xcf_io, layer, layer.mask_level, precision)) {
         return false;
     }
 
@@ -2227,9 +2675,9 @@ bool XCFImageFormat::loadTileRLE(QDataStream &xcf_io, uchar *tile, int image_siz
 {
     uchar *data = tile;
 
-    uchar *xcfdata;
-    uchar *xcfodata;
-    uchar *xcfdatalimit;
+    const uchar *xcfdata;
+    const uchar *xcfodata;
+    const uchar *xcfdatalimit;
 
     int step = sizeof(QRgb);
     switch (bpp) {
@@ -2257,23 +2705,31 @@ bool XCFImageFormat::loadTileRLE(QDataStream &xcf_io, uchar *tile, int image_siz
         return false;
     }
 
-    xcfdata = xcfodata = new uchar[data_length];
+    const qint64 pos = xcf_io.device()->pos();
+    if (data_length > 0 && mapped_data && pos >= 0 && pos + data_length <= mapped_size) {
+        // decode directly from the mapped file
+        xcfdata = xcfodata = mapped_data + pos;
+        Instrumentation::seek(xcf_io.device(), pos + data_length);
+    } else {
+        tile_data.resize(data_length);
+        uchar *buffer = reinterpret_cast<uchar *>(tile_data.data());
 
-    const int dataRead = xcf_io.readRawData((char *)xcfdata, data_length);
-    if (dataRead <= 0) {
-        delete[] xcfodata;
-        qCDebug(XCFPLUGIN) << "XCF: read failure on tile" << dataRead;
-        return false;
-    }
+        const int dataRead = xcf_io.readRawData(reinterpret_cast<char *>(buffer), data_length);
+        if (dataRead <= 0) {
+            qCDebug(XCFPLUGIN) << "XCF: read failure on tile" << dataRead;
+            return false;
+        }
 
-    if (dataRead < data_length) {
-        memset(&xcfdata[dataRead], 0, data_length - dataRead);
-    }
+        if (dataRead < data_length) {
+            memset(&buffer[dataRead], 0, data_length - dataRead);
+        }
 
-    if (!xcf_io.device()->isOpen()) {
-        delete[] xcfodata;
-        qCDebug(XCFPLUGIN) << "XCF: read failure on tile";
-        return false;
+        if (!xcf_io.device()->isOpen()) {
+            qCDebug(XCFPLUGIN) << "XCF: read failure on tile";
+            return false;
+        }
+
+        xcfdata = xcfodata = buffer;
     }
 
     xcfdatalimit = &xcfodata[data_length - 1];
@@ -2356,13 +2812,11 @@ bool XCFImageFormat::loadTileRLE(QDataStream &xcf_io, uchar *tile, int image_siz
     }
     *bytesParsed = qintptr(data - tile);
 
-    delete[] xcfodata;
     return true;
 
 bogus_rle:
 
     qCDebug(XCFPLUGIN) << "The run length encoding could not be decoded properly";
-    delete[] xcfodata;
     return false;
 }
 
@@ -2478,7 +2932,7 @@ bool XCFImageFormat::assignMaskBytes(Layer &layer, uint i, uint j, const GimpPre
             if (precision < GimpPrecision::GIMP_PRECISION_HALF_LINEAR) {
                 for (int x = 0; x < width; x++) {
                     *dataPtr++ = qFromBigEndian<quint16>(*(const quint16 *)tile) / 257;
-                    tile += sizeof(quint16); // was converted to 16 bits in loadLevel()
+                    tile += sizeof(quint16); // was converted to 16 bits in loadLevelRow()
                 }
             } else {
                 for (int x = 0; x < width; x++) {
@@ -2504,12 +2958,12 @@ bool XCFImageFormat::assignMaskBytes(Layer &layer, uint i, uint j, const GimpPre
         if (bpc == 2) {
             for (int x = 0; x < width; x++) {
                 *dataPtr++ = qFromBigEndian<quint16>(*(const quint16 *)tile) / 257;
-                tile += sizeof(QRgb); // yeah! see loadTileRLE() / loadLevel()
+                tile += sizeof(QRgb); // yeah! see loadTileRLE() / loadLevelRow()
             }
         } else if (bpc == 4) {
             for (int x = 0; x < width; x++) {
                 *dataPtr++ = qFromBigEndian<quint16>(*(const quint16 *)tile) / 257;
-                tile += sizeof(quint16); // was converted to 16 bits in loadLevel()
+                tile += sizeof(quint16); // was converted to 16 bits in loadLevelRow()
             }
         }
 #endif
@@ -2557,11 +3011,12 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
     // (Aliases to make the code look a little better.)
     Layer &layer(xcf_image.layer);
     QImage &image(xcf_image.image);
+    const QSize size = xcf_image.canvasSize();
 
     switch (layer.type) {
     case GRAY_GIMAGE:
         if (layer.opacity == OPAQUE_OPACITY) {
-            image = imageAlloc(xcf_image.header.width, xcf_image.header.height, QImage::Format_Indexed8);
+            image = imageAlloc(size, QImage::Format_Indexed8);
             image.setColorCount(256);
             if (image.isNull()) {
                 return false;
@@ -2574,7 +3029,7 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
     case GRAYA_GIMAGE:
     case RGB_GIMAGE:
     case RGBA_GIMAGE:
-        image = imageAlloc(xcf_image.header.width, xcf_image.header.height, xcf_image.qimageFormat());
+        image = imageAlloc(size, xcf_image.qimageFormat());
         if (image.isNull()) {
             return false;
         }
@@ -2599,7 +3054,7 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
         // or two-color palette. Have to ask about this...
 
         if (xcf_image.num_colors <= 2) {
-            image = imageAlloc(xcf_image.header.width, xcf_image.header.height, QImage::Format_MonoLSB);
+            image = imageAlloc(size, QImage::Format_MonoLSB);
             image.setColorCount(xcf_image.num_colors);
             if (image.isNull()) {
                 return false;
@@ -2607,7 +3062,7 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
             image.fill(0);
             setPalette(xcf_image, image);
         } else if (xcf_image.num_colors <= 256) {
-            image = imageAlloc(xcf_image.header.width, xcf_image.header.height, QImage::Format_Indexed8);
+            image = imageAlloc(size, QImage::Format_Indexed8);
             image.setColorCount(xcf_image.num_colors);
             if (image.isNull()) {
                 return false;
@@ -2625,7 +3080,7 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
             xcf_image.palette[1] = xcf_image.palette[0];
             xcf_image.palette[0] = qRgba(255, 255, 255, 0);
 
-            image = imageAlloc(xcf_image.header.width, xcf_image.header.height, QImage::Format_MonoLSB);
+            image = imageAlloc(size, QImage::Format_MonoLSB);
             image.setColorCount(xcf_image.num_colors);
             if (image.isNull()) {
                 return false;
@@ -2641,7 +3096,7 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
             }
 
             xcf_image.palette[0] = qRgba(255, 255, 255, 0);
-            image = imageAlloc(xcf_image.header.width, xcf_image.header.height, QImage::Format_Indexed8);
+            image = imageAlloc(size, QImage::Format_Indexed8);
             image.setColorCount(xcf_image.num_colors);
             if (image.isNull()) {
                 return false;
@@ -2652,7 +3107,7 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
             // No room for a transparent color, so this has to be promoted to
             // true color. (There is no equivalent PNG representation output
             // from The GIMP as of v1.2.)
-            image = imageAlloc(xcf_image.header.width, xcf_image.header.height, QImage::Format_ARGB32);
+            image = imageAlloc(size, QImage::Format_ARGB32);
             if (image.isNull()) {
                 return false;
             }
@@ -2712,11 +3167,12 @@ bool XCFImageFormat::initializeImage(XCFImage &xcf_image)
 }
 
 /*!
- * Copy a layer into an image, taking account of the manifold modes. The
- * contents of the image are replaced.
+ * Copy a row of tiles of a layer into an image, taking account of the
+ * manifold modes. The contents of the image are replaced.
  * \param xcf_image contains the layer and image to be replaced.
+ * \param j row index of the tiles.
  */
-void XCFImageFormat::copyLayerToImage(XCFImage &xcf_image)
+void XCFImageFormat::copyLayerToImage(XCFImage &xcf_image, uint j)
 {
     Layer &layer(xcf_image.layer);
     QImage &image(xcf_image.image);
@@ -2754,54 +3210,52 @@ void XCFImageFormat::copyLayerToImage(XCFImage &xcf_image)
 
     // For each tile...
 
-    for (uint j = 0; j < layer.nrows; j++) {
-        qint32 y = qint32(j * TILE_HEIGHT);
-
-        for (uint i = 0; i < layer.ncols; i++) {
-            qint32 x = qint32(i * TILE_WIDTH);
+    qint32 y = qint32(j * (TILE_HEIGHT / layer.scale));
 
-            // This seems the best place to apply the dissolve because it
-            // depends on the global position of each tile's
-            // pixels. Apparently it's the only mode which can apply to a
-            // single layer.
+    for (uint i = 0; i < layer.ncols; i++) {
+        qint32 x = qint32(i * (TILE_WIDTH / layer.scale));
 
-            if (layer.mode == GIMP_LAYER_MODE_DISSOLVE) {
-                if (!random_table_initialized) {
-                    initializeRandomTable();
-                    random_table_initialized = true;
-                }
-                if (layer.type == RGBA_GIMAGE) {
-                    dissolveRGBPixels(layer.image_tiles[j][i], x, y);
-                }
+        // This seems the best place to apply the dissolve because it
+        // depends on the global position of each tile's
+        // pixels. Apparently it's the only mode which can apply to a
+        // single layer.
 
-                else if (layer.type == GRAYA_GIMAGE) {
-                    dissolveAlphaPixels(layer.alpha_tiles[j][i], x, y);
-                }
+        if (layer.mode == GIMP_LAYER_MODE_DISSOLVE) {
+            if (!random_table_initialized) {
+                initializeRandomTable();
+                random_table_initialized = true;
+            }
+            if (layer.type == RGBA_GIMAGE) {
+                dissolveRGBPixels(layer.image_tiles[j][i], x, y);
             }
 
-            // Shortcut for common case
-            if (copy == copyRGBToRGB && layer.apply_mask != 1) {
-                QPainter painter(&image);
-                painter.setOpacity(layer.opacity / 255.0);
-                painter.setCompositionMode(QPainter::CompositionMode_Source);
-                if (x + layer.x_offset < MAX_IMAGE_WIDTH &&
-                    y + layer.y_offset < MAX_IMAGE_HEIGHT) {
-                    painter.drawImage(x + layer.x_offset, y + layer.y_offset, layer.image_tiles[j][i]);
-                }
-                continue;
+            else if (layer.type == GRAYA_GIMAGE) {
+                dissolveAlphaPixels(layer.alpha_tiles[j][i], x, y);
             }
+        }
 
-            for (int l = 0; l < layer.image_tiles[j][i].height(); l++) {
-                for (int k = 0; k < layer.image_tiles[j][i].width(); k++) {
-                    int m = x + k + layer.x_offset;
-                    int n = y + l + layer.y_offset;
+        // Shortcut for common case
+        if (copy == copyRGBToRGB && layer.apply_mask != 1) {
+            QPainter painter(&image);
+            painter.setOpacity(layer.opacity / 255.0);
+            painter.setCompositionMode(QPainter::CompositionMode_Source);
+            if (x + layer.x_offset < MAX_IMAGE_WIDTH &&
+                y + layer.y_offset < MAX_IMAGE_HEIGHT) {
+                painter.drawImage(x + layer.x_offset, y + layer.y_offset, layer.image_tiles[j][i]);
+            }
+            continue;
+        }
 
-                    if (m < 0 || m >= image.width() || n < 0 || n >= image.height()) {
-                        continue;
-                    }
+        for (int l = 0; l < layer.image_tiles[j][i].height(); l++) {
+            for (int k = 0; k < layer.image_tiles[j][i].width(); k++) {
+                int m = x + k + layer.x_offset;
+                int n = y + l + layer.y_offset;
 
-                    (*copy)(layer, i, j, k, l, image, m, n);
+                if (m < 0 || m >= image.width() || n < 0 || n >= image.height()) {
+                    continue;
                 }
+
+                (*copy)(layer, i, j, k, l, image, m, n);
             }
         }
     }
@@ -3003,10 +3457,12 @@ void XCFImageFormat::copyIndexedAToRGB(const Layer &layer, uint i, uint j, int k
 }
 
 /*!
- * Merge a layer into an image, taking account of the manifold modes.
+ * Merge a row of tiles of a layer into an image, taking account of the manifold modes.
  * \param xcf_image contains the layer and image to merge.
+ * \param j row index of the tiles.
+ * \return false if the merge of the layer must be stopped.
  */
-void XCFImageFormat::mergeLayerIntoImage(XCFImage &xcf_image)
+bool XCFImageFormat::mergeLayerIntoImage(XCFImage &xcf_image, uint j)
 {
     Layer &layer(xcf_image.layer);
     QImage &image(xcf_image.image);
@@ -3014,29 +3470,32 @@ void XCFImageFormat::mergeLayerIntoImage(XCFImage &xcf_image)
     PixelMergeOperation merge = nullptr;
 
     if (!layer.opacity) {
-        return; // don't bother doing anything
+        return true; // don't bother doing anything
     }
 
-    if (layer.blendSpace == XCFImageFormat::AutoColorSpace) {
-        qCDebug(XCFPLUGIN) << "Auto blend space, defaulting to RgbLinearSpace (same as Gimp when writing this)";
-        layer.blendSpace = XCFImageFormat::RgbLinearSpace;
-    }
+    // The layer settings are checked only once (the layer is merged one row of tiles at a time)
+    if (j == 0) {
+        if (layer.blendSpace == XCFImageFormat::AutoColorSpace) {
+            qCDebug(XCFPLUGIN) << "Auto blend space, defaulting to RgbLinearSpace (same as Gimp when writing this)";
+            layer.blendSpace = XCFImageFormat::RgbLinearSpace;
+        }
 
-    if (layer.blendSpace != XCFImageFormat::RgbLinearSpace) {
-        qCDebug(XCFPLUGIN) << "Unimplemented blend color space" << layer.blendSpace;
-    }
-    qCDebug(XCFPLUGIN) << "Blend color space" << layer.blendSpace;
+        if (layer.blendSpace != XCFImageFormat::RgbLinearSpace) {
+            qCDebug(XCFPLUGIN) << "Unimplemented blend color space" << layer.blendSpace;
+        }
+        qCDebug(XCFPLUGIN) << "Blend color space" << layer.blendSpace;
 
-    if (layer.compositeSpace == XCFImageFormat::AutoColorSpace) {
-        qCDebug(XCFPLUGIN) << "Auto composite space, defaulting to RgbLinearSpace (same as Gimp when writing this)";
-        layer.compositeSpace = XCFImageFormat::RgbLinearSpace;
-    }
+        if (layer.compositeSpace == XCFImageFormat::AutoColorSpace) {
+            qCDebug(XCFPLUGIN) << "Auto composite space, defaulting to RgbLinearSpace (same as Gimp when writing this)";
+            layer.compositeSpace = XCFImageFormat::RgbLinearSpace;
+        }
 
-    if (layer.compositeSpace != XCFImageFormat::RgbLinearSpace) {
-        qCDebug(XCFPLUGIN) << "Unimplemented composite color space" << layer.compositeSpace;
-    }
-    if (layer.compositeMode != XCFImageFormat::CompositeUnion) {
-        qCDebug(XCFPLUGIN) << "Unhandled composite mode" << layer.compositeMode;
+        if (layer.compositeSpace != XCFImageFormat::RgbLinearSpace) {
+            qCDebug(XCFPLUGIN) << "Unimplemented composite color space" << layer.compositeSpace;
+        }
+        if (layer.compositeMode != XCFImageFormat::CompositeUnion) {
+            qCDebug(XCFPLUGIN) << "Unhandled composite mode" << layer.compositeMode;
+        }
     }
 
     switch (layer.type) {
@@ -3070,7 +3529,7 @@ void XCFImageFormat::mergeLayerIntoImage(XCFImage &xcf_image)
     }
 
     if (!merge) {
-        return;
+        return true;
     }
 
     if (merge == mergeRGBToRGB && layer.apply_mask != 1) {
@@ -3178,23 +3637,23 @@ void XCFImageFormat::mergeLayerIntoImage(XCFImage &xcf_image)
             QPainter painter(&image);
             painter.setOpacity(layer.opacity / 255.0);
             painter.setCompositionMode(QPainter::CompositionMode(painterMode));
-            qCDebug(XCFPLUGIN) << "Using QPainter for mode" << layer.mode;
+            if (j == 0) {
+                qCDebug(XCFPLUGIN) << "Using QPainter for mode" << layer.mode;
+            }
 
-            for (uint j = 0; j < layer.nrows; j++) {
-                qint32 y = qint32(j * TILE_HEIGHT);
+            qint32 y = qint32(j * (TILE_HEIGHT / layer.scale));
 
-                for (uint i = 0; i < layer.ncols; i++) {
-                    qint32 x = qint32(i * TILE_WIDTH);
+            for (uint i = 0; i < layer.ncols; i++) {
+                qint32 x = qint32(i * (TILE_WIDTH / layer.scale));
 
-                    QImage &tile = layer.image_tiles[j][i];
-                    if (x + layer.x_offset < MAX_IMAGE_WIDTH &&
-                        y + layer.y_offset < MAX_IMAGE_HEIGHT) {
-                        painter.drawImage(x + layer.x_offset, y + layer.y_offset, tile);
-                    }
+                QImage &tile = layer.image_tiles[j][i];
+                if (x + layer.x_offset < MAX_IMAGE_WIDTH &&
+                    y + layer.y_offset < MAX_IMAGE_HEIGHT) {
+                    painter.drawImage(x + layer.x_offset, y + layer.y_offset, tile);
                 }
             }
 
-            return;
+            return true;
         }
     }
 
@@ -3209,69 +3668,322 @@ void XCFImageFormat::mergeLayerIntoImage(XCFImage &xcf_image)
     }
 #endif
 
-    for (uint j = 0; j < layer.nrows; j++) {
-        qint32 y = qint32(j * TILE_HEIGHT);
+    // Shortcut for common case
+    if (merge == mergeRGBToRGB && layer.apply_mask != 1 && layer.mode == GIMP_LAYER_MODE_NORMAL_LEGACY) {
+        QPainter painter(&image);
+        painter.setOpacity(layer.opacity / 255.0);
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+
+        qint32 y = qint32(j * (TILE_HEIGHT / layer.scale));
 
         for (uint i = 0; i < layer.ncols; i++) {
-            qint32 x = qint32(i * TILE_WIDTH);
+            qint32 x = qint32(i * (TILE_WIDTH / layer.scale));
 
-            // This seems the best place to apply the dissolve because it
-            // depends on the global position of each tile's
-            // pixels. Apparently it's the only mode which can apply to a
-            // single layer.
+            if (x + layer.x_offset < MAX_IMAGE_WIDTH &&
+                y + layer.y_offset < MAX_IMAGE_HEIGHT) {
+                painter.drawImage(x + layer.x_offset, y + layer.y_offset, layer.image_tiles[j][i]);
+            }
+        }
+        return true;
+    }
 
-            if (layer.mode == GIMP_LAYER_MODE_DISSOLVE) {
-                if (!random_table_initialized) {
-                    initializeRandomTable();
-                    random_table_initialized = true;
-                }
-                if (layer.type == RGBA_GIMAGE) {
-                    dissolveRGBPixels(layer.image_tiles[j][i], x, y);
-                }
+    if (layer.mode == GIMP_LAYER_MODE_DISSOLVE && !random_table_initialized) {
+        initializeRandomTable();
+        random_table_initialized = true;
+    }
 
-                else if (layer.type == GRAYA_GIMAGE) {
-                    dissolveAlphaPixels(layer.alpha_tiles[j][i], x, y);
+    // The merge function is selected here, once for all pixels of the row (when possible).
+    const RowMergeOperation rowMerge = rowMergeOperation(layer, merge, image);
+
+#ifdef XCF_USE_PARALLEL_MERGE
+    // Tiles cover different pixels of the image and the dissolve is seeded by the
+    // tile position: so the tiles of the row can be merged concurrently. The pixels of
+    // the copies are written back by bytes: images of less than 8 bits are merged serially.
+    const int bpp = image.depth() / 8;
+    if (layer.ncols > 1 && bpp > 0 && maxThreadCount() > 1) {
+        // Each tile is merged into a copy of the pixels it covers: the copies are written back
+        // in tile order, up to the first tile where the merge stops (as the serial merge does).
+        struct TileMerge {
+            QRect rect;
+            QImage image;
+            bool ok = true;
+        };
+        QList<TileMerge> tiles(layer.ncols);
+        qint32 y = qint32(j * (TILE_HEIGHT / layer.scale));
+        for (uint i = 0; i < layer.ncols; i++) {
+            qint32 x = qint32(i * (TILE_WIDTH / layer.scale));
+            const QImage &tile = layer.image_tiles[j][i];
+            tiles[i].rect = QRect(x + layer.x_offset, y + layer.y_offset, tile.width(), tile.height()).intersected(image.rect());
+        }
+
+        QAtomicInteger<uint> nextTile = 0;
+        runConcurrently(int(layer.ncols), [&](int) {
+            for (uint i = nextTile.fetchAndAddRelaxed(1); i < layer.ncols; i = nextTile.fetchAndAddRelaxed(1)) {
+                auto &&t = tiles[i];
+                if (t.rect.isEmpty()) {
+                    continue;
                 }
+                t.image = image.copy(t.rect);
+                t.ok = !t.image.isNull() && mergeTileIntoImage(layer, merge, rowMerge, i, j, t.image, t.rect);
             }
+        });
 
-            // Shortcut for common case
-            if (merge == mergeRGBToRGB && layer.apply_mask != 1 && layer.mode == GIMP_LAYER_MODE_NORMAL_LEGACY) {
-                QPainter painter(&image);
-                painter.setOpacity(layer.opacity / 255.0);
-                painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-                if (x + layer.x_offset < MAX_IMAGE_WIDTH &&
-                    y + layer.y_offset < MAX_IMAGE_HEIGHT) {
-                    painter.drawImage(x + layer.x_offset, y + layer.y_offset, layer.image_tiles[j][i]);
+        for (auto &&t : tiles) {
+            if (t.image.isNull()) {
+                if (!t.ok) {
+                    return false;
                 }
                 continue;
             }
-
-#ifndef DISABLE_TILE_PROFILE_CONV // not sure about that: left as old plugin
-            QImage &tile = layer.image_tiles[j][i];
-            if (layer.compositeSpace == XCFImageFormat::RgbPerceptualSpace && tile.colorSpace() != QColorSpace::SRgb) {
-                tile.convertToColorSpace(QColorSpace::SRgb);
+            for (int l = 0; l < t.image.height(); l++) {
+                memcpy(image.scanLine(t.rect.top() + l) + t.rect.left() * bpp, t.image.constScanLine(l), t.image.width() * bpp);
             }
-            if (layer.compositeSpace == XCFImageFormat::RgbLinearSpace && tile.colorSpace() != QColorSpace::SRgbLinear) {
-                tile.convertToColorSpace(QColorSpace::SRgbLinear);
+            if (!t.ok) {
+                return false;
             }
+        }
+        return true;
+    }
+#endif
+
+    for (uint i = 0; i < layer.ncols; i++) {
+        if (!mergeTileIntoImage(layer, merge, rowMerge, i, j, image, image.rect())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+namespace
+{
+/*!
+ * Blend modes merged one row at a time by mergeRGBA8888Row().
+ */
+enum class RowBlendMode {
+    Normal,
+    Multiply,
+    Screen,
+    Overlay,
+    Difference,
+    Addition,
+    Subtract,
+    DarkenOnly,
+    LightenOnly
+};
+
+/*!
+ * Blend a color component of the layer with the one of the image (same formulas of mergeRGBToRGB()).
+ */
+template<RowBlendMode Mode>
+inline uchar blendComponent(uchar src, uchar dst)
+{
+    if constexpr (Mode == RowBlendMode::Multiply) {
+        return INT_MULT(src, dst);
+    } else if constexpr (Mode == RowBlendMode::Screen) {
+        return 255 - INT_MULT(255 - dst, 255 - src);
+    } else if constexpr (Mode == RowBlendMode::Overlay) {
+        return INT_MULT(dst, dst + INT_MULT(2 * src, 255 - dst));
+    } else if constexpr (Mode == RowBlendMode::Difference) {
+        return dst > src ? dst - src : src - dst;
+    } else if constexpr (Mode == RowBlendMode::Addition) {
+        return qMin(dst + src, 255);
+    } else if constexpr (Mode == RowBlendMode::Subtract) {
+        return dst > src ? dst - src : 0;
+    } else if constexpr (Mode == RowBlendMode::DarkenOnly) {
+        return dst < src ? dst : src;
+    } else if constexpr (Mode == RowBlendMode::LightenOnly) {
+        return dst < src ? src : dst;
+    } else {
+        return src;
+    }
+}
+
+/*!
+ * Merge a row of RGBA8888 pixels of a layer into a row of a RGBA8888 image. The result is the one of
+ * calling mergeRGBToRGB() on each pixel but the loop does not go through QImage::pixel()/setPixel()
+ * and has no mode switch, so the compiler is free to unroll and vectorize it.
+ * \param src the layer pixels.
+ * \param mask the layer mask values (nullptr if the mask is not applied).
+ * \param dst the image pixels.
+ * \param count the number of pixels.
+ * \param opacity the layer opacity.
+ * \param affectsAlpha true if the mode changes the image alpha.
+ * \return false if the merge stopped on a transparent layer pixel (as mergeRGBToRGB() does).
+ */
+template<RowBlendMode Mode>
+bool mergeRGBA8888Row(const uchar *src, const uchar *mask, uchar *dst, int count, int opacity, bool affectsAlpha)
+{
+    for (int x = 0; x < count; x++, src += 4, dst += 4) {
+        uchar src_a = src[3];
+        if (!src_a) {
+            return false; // nothing to merge
+        }
+
+        const uchar dst_a = dst[3];
+        uchar src_r = blendComponent<Mode>(src[0], dst[0]);
+        uchar src_g = blendComponent<Mode>(src[1], dst[1]);
+        uchar src_b = blendComponent<Mode>(src[2], dst[2]);
+        if constexpr (Mode != RowBlendMode::Normal) {
+            src_a = qMin(src_a, dst_a);
+        }
+
+        src_a = INT_MULT(src_a, opacity);
+        if (mask) {
+            src_a = INT_MULT(src_a, mask[x]);
+        }
+
+        uchar new_a = dst_a + INT_MULT(OPAQUE_OPACITY - dst_a, src_a);
+
+        const float src_ratio = new_a == 0 ? 1.0 : (float)src_a / new_a;
+        float dst_ratio = 1.0 - src_ratio;
+
+        dst[0] = (uchar)(src_ratio * src_r + dst_ratio * dst[0] + EPSILON);
+        dst[1] = (uchar)(src_ratio * src_g + dst_ratio * dst[1] + EPSILON);
+        dst[2] = (uchar)(src_ratio * src_b + dst_ratio * dst[2] + EPSILON);
+
+        if (affectsAlpha) {
+            dst[3] = new_a;
+        }
+    }
+    return true;
+}
+} // namespace
+
+/*!
+ * Select the row merge function of a layer, if any. Row merges are only used for
+ * the most common modes of RGBA8888 tiles merged into RGBA8888 images.
+ * \param layer source layer.
+ * \param merge the pixel merge operation of the layer.
+ * \param image destination image.
+ * \return the row merge function or nullptr if the layer must be merged one pixel at a time.
+ */
+XCFImageFormat::RowMergeOperation XCFImageFormat::rowMergeOperation(const Layer &layer, PixelMergeOperation merge, const QImage &image)
+{
+#ifdef XCF_DISABLE_ROW_MERGE
+    Q_UNUSED(layer)
+    Q_UNUSED(merge)
+    Q_UNUSED(image)
+    return nullptr;
+#else
+    if (merge != mergeRGBToRGB || image.format() != QImage::Format_RGBA8888) {
+        return nullptr;
+    }
+
+    switch (layer.mode) {
+    case GIMP_LAYER_MODE_NORMAL:
+    case GIMP_LAYER_MODE_NORMAL_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Normal>;
+    case GIMP_LAYER_MODE_MULTIPLY:
+    case GIMP_LAYER_MODE_MULTIPLY_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Multiply>;
+    case GIMP_LAYER_MODE_SCREEN:
+    case GIMP_LAYER_MODE_SCREEN_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Screen>;
+    case GIMP_LAYER_MODE_OVERLAY:
+    case GIMP_LAYER_MODE_OVERLAY_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Overlay>;
+    case GIMP_LAYER_MODE_DIFFERENCE:
+    case GIMP_LAYER_MODE_DIFFERENCE_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Difference>;
+    case GIMP_LAYER_MODE_ADDITION:
+    case GIMP_LAYER_MODE_ADDITION_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Addition>;
+    case GIMP_LAYER_MODE_SUBTRACT:
+    case GIMP_LAYER_MODE_SUBTRACT_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::Subtract>;
+    case GIMP_LAYER_MODE_DARKEN_ONLY:
+    case GIMP_LAYER_MODE_DARKEN_ONLY_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::DarkenOnly>;
+    case GIMP_LAYER_MODE_LIGHTEN_ONLY:
+    case GIMP_LAYER_MODE_LIGHTEN_ONLY_LEGACY:
+        return mergeRGBA8888Row<RowBlendMode::LightenOnly>;
+    default:
+        break;
+    }
+    return nullptr;
 #endif
+}
+
+/*!
+ * Merge a tile of a layer into an image, taking account of the manifold modes.
+ * \param layer source layer.
+ * \param merge the pixel merge operation of the layer.
+ * \param rowMerge the row merge operation of the layer (can be nullptr).
+ * \param i x tile index.
+ * \param j y tile index.
+ * \param image destination image.
+ * \param rect the area of the final image covered by the destination image.
+ * \return false if the merge of the layer must be stopped.
+ */
+bool XCFImageFormat::mergeTileIntoImage(Layer &layer, PixelMergeOperation merge, RowMergeOperation rowMerge, uint i, uint j, QImage &image, const QRect &rect)
+{
+    qint32 y = qint32(j * (TILE_HEIGHT / layer.scale));
+    qint32 x = qint32(i * (TILE_WIDTH / layer.scale));
 
-            for (int l = 0; l < layer.image_tiles[j][i].height(); l++) {
-                for (int k = 0; k < layer.image_tiles[j][i].width(); k++) {
-                    int m = x + k + layer.x_offset;
-                    int n = y + l + layer.y_offset;
+    // This seems the best place to apply the dissolve because it
+    // depends on the global position of each tile's
+    // pixels. Apparently it's the only mode which can apply to a
+    // single layer.
 
-                    if (m < 0 || m >= image.width() || n < 0 || n >= image.height()) {
-                        continue;
-                    }
+    if (layer.mode == GIMP_LAYER_MODE_DISSOLVE) {
+        if (layer.type == RGBA_GIMAGE) {
+            dissolveRGBPixels(layer.image_tiles[j][i], x, y);
+        }
 
-                    if (!(*merge)(layer, i, j, k, l, image, m, n)) {
-                        return;
-                    }
-                }
+        else if (layer.type == GRAYA_GIMAGE) {
+            dissolveAlphaPixels(layer.alpha_tiles[j][i], x, y);
+        }
+    }
+
+#ifndef DISABLE_TILE_PROFILE_CONV // not sure about that: left as old plugin
+    QImage &tile = layer.image_tiles[j][i];
+    if (layer.compositeSpace == XCFImageFormat::RgbPerceptualSpace && tile.colorSpace() != QColorSpace::SRgb) {
+        tile.convertToColorSpace(QColorSpace::SRgb);
+    }
+    if (layer.compositeSpace == XCFImageFormat::RgbLinearSpace && tile.colorSpace() != QColorSpace::SRgbLinear) {
+        tile.convertToColorSpace(QColorSpace::SRgbLinear);
+    }
+#endif
+
+    const QImage &src = layer.image_tiles[j][i];
+    if (rowMerge && src.format() == QImage::Format_RGBA8888) {
+        const QImage *mask = nullptr;
+        if (layer.apply_mask == 1 && layer.mask_tiles.size() > (int)j && layer.mask_tiles[j].size() > (int)i) {
+            mask = &layer.mask_tiles[j][i];
+        }
+        const bool affectsAlpha = modeAffectsSourceAlpha(layer.mode);
+
+        // clip the tile to the destination area
+        const QRect area = QRect(x + layer.x_offset, y + layer.y_offset, src.width(), src.height()).intersected(rect);
+        const int k = area.left() - x - layer.x_offset;
+        for (int n = area.top(); n <= area.bottom(); n++) {
+            const int l = n - y - layer.y_offset;
+            const uchar *maskLine = mask ? mask->constScanLine(l) + k : nullptr;
+            uchar *dst = image.scanLine(n - rect.top()) + (area.left() - rect.left()) * 4;
+            if (!rowMerge(src.constScanLine(l) + k * 4, maskLine, dst, area.width(), layer.opacity, affectsAlpha)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    for (int l = 0; l < layer.image_tiles[j][i].height(); l++) {
+        for (int k = 0; k < layer.image_tiles[j][i].width(); k++) {
+            int m = x + k + layer.x_offset;
+            int n = y + l + layer.y_offset;
+
+            if (!rect.contains(m, n)) {
+                continue;
+            }
+
+            if (!(*merge)(layer, i, j, k, l, image, m - rect.left(), n - rect.top())) {
+                return false;
             }
         }
     }
+
+    return true;
 }
 
 /*!
@@ -4148,9 +4860,12 @@ bool XCFHandler::canRead() const
 
 bool XCFHandler::read(QImage *image)
 {
+    Instrumentation instrumentation("xcf", device());
     XCFImageFormat xcfif;
-    auto ok = xcfif.readXCF(device(), image);
-    m_imageSize = image->size();
+    auto ok = xcfif.readXCF(device(), image, m_scaledSize);
+    if (!m_scaledSize.isValid()) {
+        m_imageSize = image->size();
+    }
     return ok;
 }
 
@@ -4163,13 +4878,26 @@ bool XCFHandler::supportsOption(ImageOption option) const
 {
     if (option == QImageIOHandler::Size)
         return true;
+    if (option == QImageIOHandler::ScaledSize)
+        return true;
     return false;
 }
 
+void XCFHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == QImageIOHandler::ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
+}
+
 QVariant XCFHandler::option(ImageOption option) const
 {
     QVariant v;
 
+    if (option == QImageIOHandler::ScaledSize) {
+        v = m_scaledSize;
+    }
+
     if (option == QImageIOHandler::Size) {
         if (!m_imageSize.isEmpty()) {
             return m_imageSize;
@@ -22,6 +22,7 @@ public:
 
     bool supportsOption(QImageIOHandler::ImageOption option) const override;
     QVariant option(QImageIOHandler::ImageOption option) const override;
+    void setOption(QImageIOHandler::ImageOption option, const QVariant &value) override;
 
     static bool canRead(QIODevice *device);
 
@@ -31,6 +32,12 @@ private:
      * Image size cache used by option()
      */
     QSize m_imageSize;
+
+    /*!
+     * \brief m_scaledSize
+     * Size of the image to return (invalid to read the image at full size)
+     */
+    QSize m_scaledSize;
 };
 
 class XCFPlugin : public QImageIOPlugin
@@ -0,0 +1,120 @@
+/*
+    This file is part of the KDE project
+    SPDX-FileCopyrightText: 2013 Boudewijn Rempt <boud@valdyas.org>
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#include "zipimagehandler_p.h"
+
+#include <kzip.h>
+
+#include <QIODevice>
+#include <QImage>
+#include <QImageReader>
+
+ZipImageHandler::ZipImageHandler(const QString &imageName, const QString &previewName)
+    : m_imageName(imageName)
+    , m_previewName(previewName)
+{
+}
+
+ZipImageHandler::~ZipImageHandler()
+{
+}
+
+const KZipFileEntry *ZipImageHandler::fileEntry(const QString &name) const
+{
+    if (m_zip.isNull()) {
+        m_zip.reset(new KZip(device()));
+        if (!m_zip->open(QIODevice::ReadOnly)) {
+            return nullptr;
+        }
+    }
+    if (!m_zip->isOpen()) {
+        return nullptr;
+    }
+
+    const KArchiveEntry *entry = m_zip->directory()->entry(name);
+    if (!entry || !entry->isFile()) {
+        return nullptr;
+    }
+    return static_cast<const KZipFileEntry *>(entry);
+}
+
+QSize ZipImageHandler::entrySize(const KZipFileEntry *entry)
+{
+    // the device is destroyed before returning: the next entry device can seek the archive
+    QScopedPointer<QIODevice> dev(entry->createDevice());
+    if (!dev) {
+        return QSize();
+    }
+    return QImageReader(dev.data(), "png").size();
+}
+
+QSize ZipImageHandler::imageSize() const
+{
+    if (!m_imageSize.isValid()) {
+        if (auto entry = fileEntry(m_imageName)) {
+            m_imageSize = entrySize(entry);
+        }
+    }
+    return m_imageSize;
+}
+
+bool ZipImageHandler::read(QImage *image)
+{
+    const KZipFileEntry *entry = fileEntry(m_imageName);
+    if (!entry) {
+        return false;
+    }
+
+    // a small image is requested: the preview is decoded if it is big enough
+    if (m_scaledSize.isValid() && !m_scaledSize.isEmpty()) {
+        if (auto preview = fileEntry(m_previewName)) {
+            const QSize previewSize = entrySize(preview);
+            const QSize size = imageSize();
+            if (previewSize.width() >= m_scaledSize.width() && previewSize.height() >= m_scaledSize.height() && !size.isEmpty() && !previewSize.isEmpty()
+                && qAbs(qreal(previewSize.width()) / previewSize.height() - qreal(size.width()) / size.height()) < 0.01) {
+                entry = preview;
+            }
+        }
+    }
+
+    // the PNG is decoded while it is extracted
+    QScopedPointer<QIODevice> dev(entry->createDevice());
+    if (!dev) {
+        return false;
+    }
+    QImageReader reader(dev.data(), "png");
+    if (m_scaledSize.isValid() && !m_scaledSize.isEmpty()) {
+        reader.setScaledSize(m_scaledSize);
+    }
+    return reader.read(image);
+}
+
+QVariant ZipImageHandler::option(ImageOption option) const
+{
+    if (option == ScaledSize) {
+        return m_scaledSize;
+    }
+    if (option == Size) {
+        auto size = imageSize();
+        if (size.isValid()) {
+            return size;
+        }
+    }
+    return QVariant();
+}
+
+void ZipImageHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
+}
+
+bool ZipImageHandler::supportsOption(ImageOption option) const
+{
+    return option == Size || option == ScaledSize;
+}
@@ -0,0 +1,77 @@
+/*
+    This file is part of the KDE project
+    SPDX-FileCopyrightText: 2013 Boudewijn Rempt <boud@valdyas.org>
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#ifndef KIMG_ZIPIMAGEHANDLER_P_H
+#define KIMG_ZIPIMAGEHANDLER_P_H
+
+#include <QImageIOHandler>
+#include <QScopedPointer>
+#include <QSize>
+
+class KZip;
+class KZipFileEntry;
+
+/*!
+ * \brief The ZipImageHandler class
+ * Base class of the handlers of the ZIP archives (Krita and OpenRaster) that contain the merged
+ * image and a small preview of it as PNG files.
+ */
+class ZipImageHandler : public QImageIOHandler
+{
+public:
+    /*!
+     * \param imageName The path of the merged image in the archive.
+     * \param previewName The path of the preview in the archive.
+     */
+    ZipImageHandler(const QString &imageName, const QString &previewName);
+    ~ZipImageHandler() override;
+
+    bool read(QImage *image) override;
+
+    QVariant option(ImageOption option) const override;
+    void setOption(ImageOption option, const QVariant &value) override;
+    bool supportsOption(ImageOption option) const override;
+
+private:
+    const KZipFileEntry *fileEntry(const QString &name) const;
+
+    /*!
+     * \brief entrySize
+     * \return The size of the PNG image \a entry.
+     * \note The entry devices read from the archive device: only one of them must exist at a time.
+     */
+    static QSize entrySize(const KZipFileEntry *entry);
+
+    /*!
+     * \brief imageSize
+     * \return The size of the merged image (it is read once).
+     */
+    QSize imageSize() const;
+
+    QString m_imageName;
+    QString m_previewName;
+
+    /*!
+     * \brief m_zip
+     * The archive: it is opened once, on the first request.
+     */
+    mutable QScopedPointer<KZip> m_zip;
+
+    /*!
+     * \brief m_imageSize
+     * Size of the merged image cache used by option() and read()
+     */
+    mutable QSize m_imageSize;
+
+    /*!
+     * \brief m_scaledSize
+     * Value set by QImageReader::setScaledSize(): the preview is used when it is big enough.
+     */
+    QSize m_scaledSize;
+};
+
+#endif // KIMG_ZIPIMAGEHANDLER_P_H
@@ -6,13 +6,145 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+
+#include <QAtomicInt>
 #include <QCommandLineOption>
 #include <QCommandLineParser>
 #include <QCoreApplication>
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
 #include <QImageReader>
 #include <QImageWriter>
+#include <QMutex>
 #include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+
+struct Conversion {
+    QString in;
+    QString out;
+};
+
+/*!
+ * \brief readBatchFile
+ * Reads the conversions of a batch file: one "input<TAB>output" pair per line
+ * (empty lines and lines starting with '#' are ignored).
+ */
+static bool readBatchFile(const QString &fileName, QList<Conversion> &conversions)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        QTextStream(stdout) << "Could not open batch file: " << file.errorString() << '\n';
+        return false;
+    }
+    QTextStream in(&file);
+    for (int lineNumber = 1; !in.atEnd(); ++lineNumber) {
+        const QString line = in.readLine();
+        if (line.trimmed().isEmpty() || line.startsWith(QLatin1Char('#'))) {
+            continue;
+        }
+        const QStringList pair = line.split(QLatin1Char('\t'));
+        if (pair.size() != 2 || pair.at(0).isEmpty() || pair.at(1).isEmpty()) {
+            QTextStream(stdout) << fileName << ':' << lineNumber << ": expected \"input<TAB>output\"\n";
+            return false;
+        }
+        conversions.append({pair.at(0), pair.at(1)});
+    }
+    return true;
+}
+
+/*!
+ * \brief directoryConversions
+ * Lists the conversions of the files of \a inDir to \a outformat in \a outDir.
+ */
+static bool directoryConversions(const QString &inDir, const QString &outDir, const QString &outformat, QList<Conversion> &conversions)
+{
+    if (outformat.isEmpty()) {
+        QTextStream(stdout) << "The output format is required to convert a directory\n";
+        return false;
+    }
+    if (!QDir().mkpath(outDir)) {
+        QTextStream(stdout) << "Could not create the output directory: " << outDir << '\n';
+        return false;
+    }
+    const QDir out(outDir);
+    const auto entries = QDir(inDir).entryInfoList(QDir::Files | QDir::Readable, QDir::Name);
+    for (const QFileInfo &fi : entries) {
+        conversions.append({fi.filePath(), out.filePath(fi.completeBaseName() + QLatin1Char('.') + outformat)});
+    }
+    return true;
+}
+
+/*!
+ * \brief runBatch
+ * Runs the conversions on \a jobs threads: each conversion uses its own QImageReader and
+ * QImageWriter (it is also a load test of the thread safety of the plugins).
+ * \return The number of failed conversions.
+ */
+static int runBatch(const QList<Conversion> &conversions, const QByteArray &informat, const QByteArray &outformat, int jobs)
+{
+    QMutex outputMutex;
+    QAtomicInt failures = 0;
+    QAtomicInteger<qint64> totalPixels = 0;
+    QAtomicInteger<qint64> totalBytes = 0;
+
+    auto print = [&outputMutex](const QString &text) {
+        QMutexLocker locker(&outputMutex);
+        QTextStream(stdout) << text << Qt::endl;
+    };
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+
+    QElapsedTimer total;
+    total.start();
+    for (const Conversion &conversion : conversions) {
+        pool.start([&, conversion]() {
+            QElapsedTimer timer;
+            timer.start();
+
+            QImageReader reader(conversion.in, informat);
+            const QImage img = reader.read();
+            if (img.isNull()) {
+                ++failures;
+                print(QStringLiteral("%1: could not read image: %2").arg(conversion.in, reader.errorString()));
+                return;
+            }
+
+            QImageWriter writer(conversion.out, outformat);
+            if (!writer.write(img)) {
+                ++failures;
+                print(QStringLiteral("%1: could not write image: %2").arg(conversion.out, writer.errorString()));
+                return;
+            }
+
+            const qint64 pixels = qint64(img.width()) * img.height();
+            const qint64 bytes = QFileInfo(conversion.in).size();
+            totalPixels += pixels;
+            totalBytes += bytes;
+            const double seconds = std::max(timer.nsecsElapsed() / 1e9, 1e-9);
+            print(QStringLiteral("%1 -> %2: %3x%4, %5 ms, %6 MP/s, %7 MB/s")
+                      .arg(conversion.in, conversion.out)
+                      .arg(img.width())
+                      .arg(img.height())
+                      .arg(seconds * 1000, 0, 'f', 1)
+                      .arg(pixels / seconds / 1e6, 0, 'f', 2)
+                      .arg(bytes / seconds / 1e6, 0, 'f', 2));
+        });
+    }
+    pool.waitForDone();
+
+    const double seconds = std::max(total.nsecsElapsed() / 1e9, 1e-9);
+    QTextStream(stdout) << "Total: " << conversions.size() << " files, " << failures.loadRelaxed() << " failed, " << jobs << " threads, "
+                        << QString::number(seconds, 'f', 3) << " s, " << QString::number(conversions.size() / seconds, 'f', 2) << " files/s, "
+                        << QString::number(totalPixels.loadRelaxed() / seconds / 1e6, 'f', 2) << " MP/s, "
+                        << QString::number(totalBytes.loadRelaxed() / seconds / 1e6, 'f', 2) << " MB/s\n";
+    return failures.loadRelaxed();
+}
 
 int main(int argc, char **argv)
 {
@@ -25,8 +157,8 @@ int main(int argc, char **argv)
     parser.setApplicationDescription(QStringLiteral("Converts images from one format to another"));
     parser.addHelpOption();
     parser.addVersionOption();
-    parser.addPositionalArgument(QStringLiteral("in"), QStringLiteral("input image file"));
-    parser.addPositionalArgument(QStringLiteral("out"), QStringLiteral("output image file"));
+    parser.addPositionalArgument(QStringLiteral("in"), QStringLiteral("input image file (or directory, with -o)"));
+    parser.addPositionalArgument(QStringLiteral("out"), QStringLiteral("output image file (or directory, with -o)"));
     QCommandLineOption informat(QStringList() << QStringLiteral("i") << QStringLiteral("informat"),
                                 QStringLiteral("Image format for input file"),
                                 QStringLiteral("format"));
@@ -41,6 +173,15 @@ int main(int argc, char **argv)
     QCommandLineOption listmimes(QStringList() << QStringLiteral("m") << QStringLiteral("listmime"), QStringLiteral("List supported image mime formats"));
     parser.addOption(listmimes);
 
+    QCommandLineOption batch(QStringList() << QStringLiteral("b") << QStringLiteral("batch"),
+                             QStringLiteral("Convert the files listed in a batch file (one \"input<TAB>output\" pair per line)"),
+                             QStringLiteral("file"));
+    parser.addOption(batch);
+    QCommandLineOption jobs(QStringList() << QStringLiteral("j") << QStringLiteral("jobs"),
+                            QStringLiteral("Number of concurrent conversions in batch mode (default: the number of cores)"),
+                            QStringLiteral("count"));
+    parser.addOption(jobs);
+
     parser.process(app);
 
     const QStringList files = parser.positionalArguments();
@@ -75,6 +216,34 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    // batch mode: a list of files or a directory
+    const bool isDirectory = files.count() == 2 && QFileInfo(files.at(0)).isDir();
+    if (parser.isSet(batch) || isDirectory) {
+        QList<Conversion> conversions;
+        if (parser.isSet(batch)) {
+            if (!files.isEmpty()) {
+                QTextStream(stdout) << "No files must be provided with a batch file\n";
+                parser.showHelp(1);
+            }
+            if (!readBatchFile(parser.value(batch), conversions)) {
+                return 1;
+            }
+        } else if (!directoryConversions(files.at(0), files.at(1), parser.value(outformat), conversions)) {
+            return 1;
+        }
+
+        int threads = QThread::idealThreadCount();
+        if (parser.isSet(jobs)) {
+            bool ok = false;
+            threads = parser.value(jobs).toInt(&ok);
+            if (!ok || threads < 1) {
+                QTextStream(stdout) << "Error: the number of jobs must be a positive number\n";
+                return 1;
+            }
+        }
+        return runBatch(conversions, parser.value(informat).toLatin1(), parser.value(outformat).toLatin1(), threads) > 0 ? 3 : 0;
+    }
+
     if (files.count() != 2) {
         QTextStream(stdout) << "Must provide exactly two files\n";
         parser.showHelp(1);